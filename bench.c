@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "vendor/lodepng/lodepng.h"
+#include "canny_internal.h"
+#include <omp.h>
+#include <time.h>
+#include <stdbool.h>
+#include <glob.h>
+
+// Per-stage benchmark of the float pipeline.
+// Every stage runs on the output of the previous one, so the inputs look like they do in a real run, and is timed
+// on its own over warm-up and measured repetitions for every thread count.
+
+#ifndef CANNY_RESOURCES_DIR
+#define CANNY_RESOURCES_DIR "resources"
+#endif
+
+#define DEFAULT_WARMUP 2
+#define DEFAULT_REPETITIONS 10
+#define DEFAULT_MIN_SIDE 256
+#define DEFAULT_MAX_SIDE 16384
+// ingest needs the RGB bytes, the horizontal pass and its output, the later stages three planes with the gradient
+// taking two
+#define FLOATS_PER_PIXEL 4
+
+typedef enum {
+    STAGE_INGEST_GAUSSIAN,
+    STAGE_SOBEL,
+    STAGE_THINNING,
+    STAGE_DOUBLE_THRESHOLD,
+    STAGE_HYSTERESIS,
+    STAGE_COUNT,
+} bench_stage;
+
+static const char *stage_names[STAGE_COUNT] = {
+        "ingest_gaussian", "sobel", "thinning", "double_threshold", "hysteresis"
+};
+
+typedef struct {
+    int warmup;
+    int repetitions;
+    float sigma;
+    int *threads;
+    int thread_count;
+    const char *label;
+} bench_options;
+
+typedef struct {
+    const char *input;
+    uint32_t width;
+    uint32_t height;
+    int threads;
+    bench_stage stage;
+    double median;
+    double p95;
+} bench_result;
+
+typedef struct {
+    bench_result *results;
+    size_t count;
+    size_t capacity;
+} bench_results;
+
+// the buffers of one input, see FLOATS_PER_PIXEL
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint8_t *rgb;
+    float *x;
+    float *y;
+    float *z; // two planes
+    float *kernel;
+    int kernel_radius;
+    float *line_buffers;
+    gradient_stats *stats; // one per thread, thinning fills them for the double threshold
+    int stats_count;       // how many of them thinning filled, the threads it last ran with
+} bench_buffers;
+
+static void run_stage(bench_buffers *buffers, bench_stage stage) {
+    uint32_t width = buffers->width;
+    uint32_t height = buffers->height;
+    switch (stage) {
+        case STAGE_INGEST_GAUSSIAN:
+            ingest_gaussian_filter_into(buffers->rgb, (size_t) width * 3, 3, buffers->z, buffers->y, width, height,
+                                        buffers->kernel, buffers->kernel_radius, buffers->line_buffers,
+                                        CANNY_BORDER_WRAP);
+            break;
+        case STAGE_SOBEL:
+            apply_sobel_filter_into(buffers->y, buffers->z, width, height, CANNY_BORDER_WRAP);
+            break;
+        case STAGE_THINNING:
+            apply_edge_thinning_into(buffers->z, buffers->x, width, height, buffers->stats, CANNY_BORDER_WRAP);
+            buffers->stats_count = omp_get_max_threads();
+            break;
+        case STAGE_DOUBLE_THRESHOLD: {
+            float high_threshold, low_threshold;
+            gradient_stats_thresholds(buffers->stats, buffers->stats_count, false, CANNY_THRESHOLD_RATIO, 0.0f,
+                                      &high_threshold, &low_threshold);
+            apply_double_threshold_into(buffers->x, buffers->y, width, height, high_threshold, low_threshold);
+            break;
+        }
+        case STAGE_HYSTERESIS:
+            apply_edge_histeresis_into(buffers->y, buffers->z, (uint32_t *) (buffers->z + (size_t) width * height),
+                                       width, height, CANNY_BORDER_WRAP);
+            break;
+        case STAGE_COUNT:
+            break;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank percentile of sorted values
+static double percentile(const double *sorted, int count, double p) {
+    int rank = (int) (p / 100.0 * count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void add_result(bench_results *results, bench_result result) {
+    if (results->count == results->capacity) {
+        results->capacity = results->capacity == 0 ? 64 : results->capacity * 2;
+        results->results = realloc(results->results, results->capacity * sizeof(bench_result));
+    }
+    results->results[results->count++] = result;
+}
+
+// The stages run in pipeline order so every one of them reads what the previous one produced.
+// The RGB input is only needed by ingest and is freed before the last plane is allocated.
+static void bench_input(const char *input, bench_buffers *buffers, const bench_options *options,
+                        bench_results *results) {
+    size_t pixels = (size_t) buffers->width * buffers->height;
+    double *times = malloc(options->repetitions * sizeof(double));
+    int max_threads = omp_get_max_threads();
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        for (int t = 0; t < options->thread_count; t++) {
+            omp_set_num_threads(options->threads[t]);
+            for (int i = 0; i < options->warmup; i++) {
+                run_stage(buffers, stage);
+            }
+            for (int i = 0; i < options->repetitions; i++) {
+                struct timespec start, end;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                run_stage(buffers, stage);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                times[i] = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+            }
+
+            qsort(times, options->repetitions, sizeof(double), compare_doubles);
+            bench_result result = {
+                    .input = input, .width = buffers->width, .height = buffers->height,
+                    .threads = options->threads[t], .stage = stage,
+                    .median = percentile(times, options->repetitions, 50.0),
+                    .p95 = percentile(times, options->repetitions, 95.0),
+            };
+            add_result(results, result);
+            printf("%-24s %6u x %-6u %3d threads  %-16s median %9.3f ms  p95 %9.3f ms  %9.2f MP/s\n",
+                   input, buffers->width, buffers->height, result.threads, stage_names[stage],
+                   1000.0 * result.median, 1000.0 * result.p95, (double) pixels / result.median / 1e6);
+        }
+        omp_set_num_threads(max_threads);
+
+        if (stage == STAGE_INGEST_GAUSSIAN) {
+            free(buffers->rgb);
+            buffers->rgb = nullptr;
+            buffers->x = malloc(pixels * sizeof(float));
+            if (buffers->x == nullptr) {
+                printf("%s: %u x %u does not fit in memory, stopped after ingest\n", input, buffers->width,
+                       buffers->height);
+                break;
+            }
+        }
+    }
+    free(times);
+}
+
+// takes ownership of rgb, 3 bytes per pixel
+static void bench_image(const char *input, uint8_t *rgb, uint32_t width, uint32_t height, const bench_options *options,
+                        bench_results *results) {
+    size_t pixels = (size_t) width * height;
+    bench_buffers buffers = {.width = width, .height = height, .rgb = rgb};
+    buffers.y = malloc(pixels * sizeof(float));
+    buffers.z = malloc(2 * pixels * sizeof(float));
+    buffers.kernel = create_gaussian_kernel(options->sigma, &buffers.kernel_radius);
+    int max_threads = 0;
+    for (int t = 0; t < options->thread_count; t++) {
+        if (options->threads[t] > max_threads) max_threads = options->threads[t];
+    }
+    buffers.line_buffers = malloc((size_t) max_threads * (width + 2 * buffers.kernel_radius) * sizeof(float));
+    buffers.stats = malloc((size_t) max_threads * sizeof(gradient_stats));
+
+    if (buffers.y == nullptr || buffers.z == nullptr) {
+        printf("%s: %u x %u does not fit in memory, skipped\n", input, width, height);
+    } else {
+        bench_input(input, &buffers, options, results);
+    }
+
+    free(buffers.rgb);
+    free(buffers.x);
+    free(buffers.y);
+    free(buffers.z);
+    free(buffers.kernel);
+    free(buffers.line_buffers);
+    free(buffers.stats);
+}
+
+static uint8_t *load_png(const char *path, uint32_t *width, uint32_t *height) {
+    uint8_t *image;
+    unsigned error = lodepng_decode24_file(&image, width, height, path);
+    if (error) {
+        printf("%s: error %u: %s\n", path, error, lodepng_error_text(error));
+        return nullptr;
+    }
+    return image;
+}
+
+// Concentric rings over a diagonal gradient with a little noise: plenty of edges in every direction,
+// weak ones included, so thinning and hysteresis do real work. The same side always gives the same image.
+static uint8_t *synthetic_image(uint32_t side) {
+    uint8_t *rgb = malloc((size_t) side * side * 3);
+    if (rgb == nullptr) return nullptr;
+
+#pragma omp parallel for default(none) shared(rgb, side)
+    for (uint32_t y = 0; y < side; y++) {
+        uint32_t state = y * 2654435761u + 1;
+        for (uint32_t x = 0; x < side; x++) {
+            state = state * 1664525u + 1013904223u;
+            int dx = (int) (x % 256) - 128;
+            int dy = (int) (y % 256) - 128;
+            float ring = ((dx * dx + dy * dy) / 600) % 2 == 0 ? 160.0f : 60.0f;
+            float gradient = 64.0f * (float) (x + y) / (float) (2 * side);
+            float noise = (float) (state >> 28);
+            uint8_t *pixel = rgb + ((size_t) y * side + x) * 3;
+            pixel[0] = (uint8_t) (ring + gradient + noise);
+            pixel[1] = (uint8_t) (ring * 0.8f + noise);
+            pixel[2] = (uint8_t) (255.0f - ring - gradient);
+        }
+    }
+    return rgb;
+}
+
+static void write_csv(const char *path, const bench_results *results, const bench_options *options) {
+    FILE *file = fopen(path, "w");
+    if (file == nullptr) {
+        printf("Cannot open %s\n", path);
+        return;
+    }
+    fprintf(file, "label,input,width,height,threads,stage,repetitions,median_ms,p95_ms,mp_per_s\n");
+    for (size_t i = 0; i < results->count; i++) {
+        const bench_result *result = &results->results[i];
+        fprintf(file, "%s,%s,%u,%u,%d,%s,%d,%.6f,%.6f,%.3f\n", options->label, result->input, result->width,
+                result->height, result->threads, stage_names[result->stage], options->repetitions,
+                1000.0 * result->median, 1000.0 * result->p95,
+                (double) result->width * result->height / result->median / 1e6);
+    }
+    fclose(file);
+}
+
+static void write_json(const char *path, const bench_results *results, const bench_options *options) {
+    FILE *file = fopen(path, "w");
+    if (file == nullptr) {
+        printf("Cannot open %s\n", path);
+        return;
+    }
+    fprintf(file, "{\n  \"label\": \"%s\",\n  \"sigma\": %g,\n  \"warmup\": %d,\n  \"repetitions\": %d,\n"
+                  "  \"results\": [\n", options->label, options->sigma, options->warmup, options->repetitions);
+    for (size_t i = 0; i < results->count; i++) {
+        const bench_result *result = &results->results[i];
+        fprintf(file, "    {\"input\": \"%s\", \"width\": %u, \"height\": %u, \"threads\": %d, \"stage\": \"%s\", "
+                      "\"median_ms\": %.6f, \"p95_ms\": %.6f, \"mp_per_s\": %.3f}%s\n",
+                result->input, result->width, result->height, result->threads, stage_names[result->stage],
+                1000.0 * result->median, 1000.0 * result->p95,
+                (double) result->width * result->height / result->median / 1e6,
+                i + 1 < results->count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+// "1,2,4", or powers of two up to the OpenMP default plus the default itself
+static int parse_threads(const char *text, int **threads) {
+    int count = 0;
+    int capacity = 16;
+    *threads = malloc(capacity * sizeof(int));
+
+    if (text == nullptr) {
+        int max_threads = omp_get_max_threads();
+        for (int t = 1; t < max_threads; t *= 2) {
+            (*threads)[count++] = t;
+        }
+        (*threads)[count++] = max_threads;
+        return count;
+    }
+
+    while (*text != '\0') {
+        char *end;
+        long t = strtol(text, &end, 10);
+        if (end == text || t < 1) return 0;
+        if (count == capacity) {
+            capacity *= 2;
+            *threads = realloc(*threads, capacity * sizeof(int));
+        }
+        (*threads)[count++] = (int) t;
+        text = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-w warmup] [-r repetitions] [-s sigma] [-T threads,...] [-n min_side] [-m max_side] [-P]\n"
+           "          [-l label] [-c results.csv] [-j results.json] [image.png ...]\n", program);
+    printf("Benchmarks every stage on the given images, or on %s/*.png, and on synthetic squares\n"
+           "from min_side to max_side doubling each time (default %d to %d, -m 0 skips them).\n"
+           "-P skips the images, sizes that do not fit in memory are skipped.\n",
+           CANNY_RESOURCES_DIR, DEFAULT_MIN_SIDE, DEFAULT_MAX_SIDE);
+}
+
+int main(int argc, char **argv) {
+    bench_options options = {
+            .warmup = DEFAULT_WARMUP, .repetitions = DEFAULT_REPETITIONS, .sigma = 1.0f, .label = "canny"
+    };
+    const char *thread_list = nullptr;
+    const char *csv_path = nullptr;
+    const char *json_path = nullptr;
+    uint32_t min_side = DEFAULT_MIN_SIDE;
+    uint32_t max_side = DEFAULT_MAX_SIDE;
+    bool images = true;
+    // the stage loops run with schedule(runtime), which the library points at a static or a tuned schedule
+    omp_set_schedule(omp_sched_static, 0);
+
+    int option;
+    while ((option = getopt(argc, argv, "w:r:s:T:n:m:Pl:c:j:")) != -1) {
+        switch (option) {
+            case 'w':
+                options.warmup = atoi(optarg);
+                break;
+            case 'r':
+                options.repetitions = atoi(optarg);
+                break;
+            case 's':
+                options.sigma = strtof(optarg, nullptr);
+                break;
+            case 'T':
+                thread_list = optarg;
+                break;
+            case 'n':
+                min_side = (uint32_t) strtoul(optarg, nullptr, 10);
+                break;
+            case 'm':
+                max_side = (uint32_t) strtoul(optarg, nullptr, 10);
+                break;
+            case 'P':
+                images = false;
+                break;
+            case 'l':
+                options.label = optarg;
+                break;
+            case 'c':
+                csv_path = optarg;
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    options.thread_count = parse_threads(thread_list, &options.threads);
+    if (options.warmup < 0 || options.repetitions < 1 || options.sigma <= 0.0f || options.thread_count == 0 ||
+        min_side == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    bench_results results = {0};
+
+    // the results point at the input names, so the matches live until the end
+    glob_t matches = {0};
+    if (images) {
+        if (optind < argc) {
+            for (int i = optind; i < argc; i++) {
+                glob(argv[i], i > optind ? GLOB_APPEND | GLOB_NOCHECK : GLOB_NOCHECK, nullptr, &matches);
+            }
+        } else {
+            glob(CANNY_RESOURCES_DIR "/*.png", 0, nullptr, &matches);
+        }
+
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            const char *path = matches.gl_pathv[i];
+            // the committed results next to the inputs
+            if (optind == argc && strstr(path, "_edges.png") != nullptr) continue;
+            const char *name = strrchr(path, '/');
+            uint32_t width, height;
+            uint8_t *rgb = load_png(path, &width, &height);
+            if (rgb != nullptr) bench_image(name != nullptr ? name + 1 : path, rgb, width, height, &options, &results);
+        }
+    }
+
+    // every side is a separate input name, kept alive for the report
+    static char side_names[32][32];
+    int side_index = 0;
+    for (uint32_t side = min_side; max_side != 0 && side <= max_side && side_index < 32; side *= 2, side_index++) {
+        size_t bytes = (size_t) side * side * FLOATS_PER_PIXEL * sizeof(float);
+        size_t memory = (size_t) sysconf(_SC_PHYS_PAGES) * (size_t) sysconf(_SC_PAGE_SIZE);
+        snprintf(side_names[side_index], sizeof(side_names[side_index]), "synthetic_%u", side);
+        if (bytes > memory / 4 * 3) {
+            printf("%s: needs %zu MiB of %zu MiB memory, skipped\n", side_names[side_index], bytes >> 20, memory >> 20);
+            continue;
+        }
+
+        uint8_t *rgb = synthetic_image(side);
+        if (rgb == nullptr) {
+            printf("%s: does not fit in memory, skipped\n", side_names[side_index]);
+            continue;
+        }
+        bench_image(side_names[side_index], rgb, side, side, &options, &results);
+    }
+
+    if (csv_path != nullptr) write_csv(csv_path, &results, &options);
+    if (json_path != nullptr) write_json(json_path, &results, &options);
+
+    globfree(&matches);
+    free(results.results);
+    free(options.threads);
+    return 0;
+}
@@ -0,0 +1,2722 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include "vendor/lodepng/lodepng.h"
+#include "canny.h"
+#include "canny_internal.h"
+#include "simd.h"
+#include <math.h>
+#include <omp.h>
+#include <assert.h>
+#include <stdbool.h>
+
+// #define WRITE_INTERMEDIATE_IMAGES
+
+static uint32_t calculate_index_with_wrap_around(int x, int y, uint32_t width, uint32_t height) {
+    if (x < 0) x = (int) width + x;
+    if (y < 0) y = (int) height + y;
+    if (x >= (int) width) x = x - (int) width;
+    if (y >= (int) height) y = y - (int) height;
+    return y * width + x;
+}
+
+// Where every canny_border reads a coordinate that lies less than one image size outside [0, size).
+// CANNY_BORDER_CONSTANT has nothing to read there and returns -1, which the stencils read as zero.
+typedef int (*border_map)(int x, int size);
+
+static inline int border_wrap(int x, int size) {
+    return x < 0 ? x + size : x >= size ? x - size : x;
+}
+
+static inline int border_clamp(int x, int size) {
+    return x < 0 ? 0 : x >= size ? size - 1 : x;
+}
+
+// the edge pixel is repeated, -1 reads 0 like mirror_coordinate in compute.cl
+static inline int border_mirror(int x, int size) {
+    return x < 0 ? -x - 1 : x >= size ? 2 * size - x - 1 : x;
+}
+
+static inline int border_constant(int x, int size) {
+    return x < 0 || x >= size ? -1 : x;
+}
+
+// for the once per row work around the inner loops, the inner loops never see the mode
+static int border_coordinate(canny_border border, int x, int size) {
+    switch (border) {
+        case CANNY_BORDER_CLAMP:
+            return border_clamp(x, size);
+        case CANNY_BORDER_MIRROR:
+            return border_mirror(x, size);
+        case CANNY_BORDER_CONSTANT:
+            return border_constant(x, size);
+        case CANNY_BORDER_WRAP:
+            break;
+    }
+    return border_wrap(x, size);
+}
+
+// The border loops are written once as always inlined functions taking a border_map, and BORDER_VARIANTS
+// instantiates a wrapper for every mode, so the map is a constant in each of them. A stage picks its variant from
+// BORDER_TABLE once instead of branching on the mode for every tap.
+#define BORDER_INLINE static inline __attribute__((always_inline))
+#define BORDER_VARIANTS(DEFINE) DEFINE(wrap) DEFINE(clamp) DEFINE(mirror) DEFINE(constant)
+#define BORDER_TABLE(function) { \
+        [CANNY_BORDER_WRAP] = function##_wrap, [CANNY_BORDER_CLAMP] = function##_clamp, \
+        [CANNY_BORDER_MIRROR] = function##_mirror, [CANNY_BORDER_CONSTANT] = function##_constant}
+
+// Byte offsets of green and blue in an input pixel with 1, 3 or 4 channels. Grey input uses its one channel for all
+// three, which the luma weights (summing to 1) leave unchanged, and the alpha of RGBA input is ignored.
+#define GREEN_OFFSET(channels) ((channels) >= 3 ? 1 : 0)
+#define BLUE_OFFSET(channels) ((channels) >= 3 ? 2 : 0)
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+
+static uint8_t *float_array_to_uint8_array(const float *in, uint8_t *out, uint32_t width, uint32_t height) {
+    for (uint32_t i = 0; i < width * height; i++) {
+        out[i] = (uint8_t) (in[i] * 255.0f);
+    }
+    return out;
+}
+
+static void write_intermediate_image(const char *filename, const float *image, uint32_t width, uint32_t height) {
+    uint8_t *image_uint8 = malloc(width * height * sizeof(uint8_t));
+    image_uint8 = float_array_to_uint8_array(image, image_uint8, width, height);
+    unsigned error = lodepng_encode_file(filename, image_uint8, width, height, LCT_GREY, 8);
+    if (error) printf("error %u: %s\n", error, lodepng_error_text(error));
+    free(image_uint8);
+}
+
+#endif
+
+#define LOW_THRESHOLD_RATIO 0.027f
+#define HIGH_THRESHOLD_RATIO 0.064f
+#define WEAK_EDGE_PIXEL 0.33f
+#define STRONG_EDGE_PIXEL 1.0f
+// the low threshold of CANNY_THRESHOLD_PERCENTILE and CANNY_THRESHOLD_OTSU as a fraction of the high one
+#define AUTO_LOW_THRESHOLD_RATIO 0.4f
+// sobel over a [0, 1] image is at most 4 both ways
+#define GRADIENT_MAGNITUDE_LIMIT 5.656854f
+
+// 1D gaussian with a radius of 2 * sigma (5 taps for sigma = 1.0, 15 taps for sigma = 3.5)
+// Every tap integrates the gaussian over the pixel footprint instead of sampling it at the center,
+// so for sigma = 1.0 the outer product reproduces the classic 5x5 1/273 table to within ~3e-3 per tap
+static int gaussian_kernel_radius(float sigma) {
+    int radius = (int) ceilf(2.0f * sigma);
+    return radius < 1 ? 1 : radius;
+}
+
+float *create_gaussian_kernel(float sigma, int *kernel_radius) {
+    int radius = gaussian_kernel_radius(sigma);
+
+    float *kernel = malloc((2 * radius + 1) * sizeof(float));
+    float scale = 1.0f / (sigma * sqrtf(2.0f));
+    float sum = 0.0f;
+    for (int i = -radius; i <= radius; i++) {
+        kernel[i + radius] = 0.5f * (erff(((float) i + 0.5f) * scale) - erff(((float) i - 0.5f) * scale));
+        sum += kernel[i + radius];
+    }
+    for (int i = 0; i < 2 * radius + 1; i++) {
+        kernel[i] /= sum;
+    }
+
+    *kernel_radius = radius;
+    return kernel;
+}
+
+#define FIXED_KERNEL_BITS 8
+#define BLUR_FRACTION_BITS 3
+// with 3 fractional bits the blur stays below 2^11, so sobel fits an i16 and the magnitude (< 11541) fits 14 bits
+#define GRADIENT_MAGNITUDE_MASK 0x3fff
+#define GRADIENT_SECTOR_SHIFT 14
+// tan(22.5 deg) in Q16
+#define TAN_22_5_Q16 27146
+#define WEAK_EDGE_PIXEL_U8 84
+#define STRONG_EDGE_PIXEL_U8 255
+
+// rounds the float kernel to FIXED_KERNEL_BITS and pushes the rounding error into the center tap so the taps sum to 1.0
+static void create_fixed_gaussian_kernel(const float *kernel, int kernel_radius, uint16_t *fixed_kernel) {
+    int sum = 0;
+    for (int i = 0; i < 2 * kernel_radius + 1; i++) {
+        fixed_kernel[i] = (uint16_t) lrintf(kernel[i] * (float) (1 << FIXED_KERNEL_BITS));
+        sum += fixed_kernel[i];
+    }
+    fixed_kernel[kernel_radius] += (1 << FIXED_KERNEL_BITS) - sum;
+}
+
+static const float sobel_kernel_x[3][3] = {
+        {-1, 0, 1},
+        {-2, 0, 2},
+        {-1, 0, 1}
+};
+static const float sobel_kernel_y[3][3] = {
+        {1,  2,  1},
+        {0,  0,  0},
+        {-1, -2, -1}
+};
+
+
+void convert_to_grayscale_into(const float *image, float *new_image, uint32_t width, uint32_t height) {
+#pragma omp parallel for default(none) shared(image, new_image, width, height)
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        new_image[i] = 0.2126f * image[i * 3] + 0.7152f * image[i * 3 + 1] + 0.0722f * image[i * 3 + 2];
+    }
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+    write_intermediate_image("/tmp/test_after_grayscale.png", new_image, width, height);
+#endif
+}
+
+static inline float fused_grayscale(const uint8_t *pixel, uint32_t channels) {
+    return 0.2126f * ((float) pixel[0] / 255.0f) + 0.7152f * ((float) pixel[GREEN_OFFSET(channels)] / 255.0f) +
+           0.0722f * ((float) pixel[BLUE_OFFSET(channels)] / 255.0f);
+}
+
+// the same grey as convert_to_grayscale_into straight from the bytes,
+// a constant channels gives the compiler a fixed stride to vectorize the loop with
+static inline void grayscale_row_channels(const uint8_t *pixel, float *out_row, uint32_t width, uint32_t channels) {
+    for (uint32_t x = 0; x < width; x++, pixel += channels) {
+        out_row[x] = fused_grayscale(pixel, channels);
+    }
+}
+
+static void grayscale_row(const uint8_t *pixel, uint32_t channels, float *out_row, uint32_t width) {
+    switch (channels) {
+        case 1:
+            grayscale_row_channels(pixel, out_row, width, 1);
+            break;
+        case 3:
+            grayscale_row_channels(pixel, out_row, width, 3);
+            break;
+        default:
+            grayscale_row_channels(pixel, out_row, width, 4);
+            break;
+    }
+}
+
+float *convert_to_grayscale(float *image, uint32_t width, uint32_t height) {
+    float *new_image = malloc(width * height * sizeof(float));
+    convert_to_grayscale_into(image, new_image, width, height);
+    free(image);
+    return new_image;
+}
+
+// separable blur: a horizontal pass into horizontal_pass followed by a vertical pass into new_image,
+// so every pixel costs 2 * (2 * radius + 1) multiply-adds instead of (2 * radius + 1)^2.
+// new_image may alias image, line_buffers holds omp_get_max_threads() rows of width + 2 * kernel_radius floats.
+// Horizontal pass over one row that the caller put at line + kernel_radius.
+// The line is padded with the halo the border reads, which keeps the sliding window free of index checks.
+static void apply_gaussian_filter_line(float *line, float *out_row, uint32_t width,
+                                       const float *kernel, int kernel_radius, canny_border border) {
+    int kernel_size = 2 * kernel_radius + 1;
+    for (int x = -kernel_radius; x < 0; x++) {
+        int left = border_coordinate(border, x, (int) width);
+        int right = border_coordinate(border, (int) width - x - 1, (int) width);
+        line[x + kernel_radius] = left < 0 ? 0.0f : line[kernel_radius + left];
+        line[(int) width + kernel_radius - x - 1] = right < 0 ? 0.0f : line[kernel_radius + right];
+    }
+
+    for (uint32_t x = 0; x < width; x++) {
+        float new_pixel_value = 0.0f;
+        for (int i = 0; i < kernel_size; i++) {
+            new_pixel_value += line[x + i] * kernel[i];
+        }
+        out_row[x] = new_pixel_value;
+    }
+}
+
+// the vertical pass accumulates whole rows, so the border is resolved once per row instead of per tap
+static void apply_gaussian_filter_columns(const float *horizontal_pass, float *new_image, uint32_t width,
+                                          uint32_t height, const float *kernel, int kernel_radius,
+                                          canny_border border) {
+#pragma omp parallel for schedule(runtime) default(none) shared(new_image, horizontal_pass, width, height, kernel, kernel_radius, border)
+    for (int y = 0; y < (int) height; y++) {
+        float *out_row = new_image + (size_t) y * width;
+        memset(out_row, 0, width * sizeof(float));
+
+        for (int i = -kernel_radius; i <= kernel_radius; i++) {
+            int source = border_coordinate(border, y + i, (int) height);
+            if (source < 0) continue;
+            const float *in_row = horizontal_pass + (size_t) source * width;
+            float weight = kernel[i + kernel_radius];
+            for (uint32_t x = 0; x < width; x++) {
+                out_row[x] += in_row[x] * weight;
+            }
+        }
+    }
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+    write_intermediate_image("/tmp/test_after_gaussian_filter.png", new_image, width, height);
+#endif
+}
+
+void apply_gaussian_filter_into(const float *image, float *horizontal_pass, float *new_image,
+                                uint32_t width, uint32_t height,
+                                const float *kernel, int kernel_radius, float *line_buffers, canny_border border) {
+#pragma omp parallel default(none) shared(image, horizontal_pass, width, height, kernel, kernel_radius, line_buffers, border)
+    {
+        float *line = line_buffers + (size_t) omp_get_thread_num() * (width + 2 * kernel_radius);
+
+#pragma omp for schedule(runtime)
+        for (int y = 0; y < (int) height; y++) {
+            memcpy(line + kernel_radius, image + (size_t) y * width, width * sizeof(float));
+            apply_gaussian_filter_line(line, horizontal_pass + (size_t) y * width, width, kernel, kernel_radius,
+                                       border);
+        }
+    }
+
+    apply_gaussian_filter_columns(horizontal_pass, new_image, width, height, kernel, kernel_radius, border);
+}
+
+// Grayscale and blur in one go: every row is converted from channels bytes per pixel straight into the line buffer
+// of the horizontal pass, so neither an RGB float image nor a grey one is ever written.
+void ingest_gaussian_filter_into(const uint8_t *image, size_t stride, uint32_t channels, float *horizontal_pass,
+                                 float *new_image, uint32_t width, uint32_t height,
+                                 const float *kernel, int kernel_radius, float *line_buffers, canny_border border) {
+#pragma omp parallel default(none) shared(image, stride, channels, horizontal_pass, width, height, kernel, kernel_radius, line_buffers, border)
+    {
+        float *line = line_buffers + (size_t) omp_get_thread_num() * (width + 2 * kernel_radius);
+
+#pragma omp for schedule(runtime)
+        for (int y = 0; y < (int) height; y++) {
+            grayscale_row(image + (size_t) y * stride, channels, line + kernel_radius, width);
+            apply_gaussian_filter_line(line, horizontal_pass + (size_t) y * width, width, kernel, kernel_radius,
+                                       border);
+        }
+    }
+
+    apply_gaussian_filter_columns(horizontal_pass, new_image, width, height, kernel, kernel_radius, border);
+}
+
+float *apply_gaussian_filter(float *image, uint32_t width, uint32_t height, float sigma) {
+    float *horizontal_pass = malloc(width * height * sizeof(float));
+    int kernel_radius;
+    float *kernel = create_gaussian_kernel(sigma, &kernel_radius);
+    float *line_buffers = malloc(omp_get_max_threads() * (width + 2 * kernel_radius) * sizeof(float));
+
+    apply_gaussian_filter_into(image, horizontal_pass, image, width, height, kernel, kernel_radius, line_buffers,
+                               CANNY_BORDER_WRAP);
+
+    free(line_buffers);
+    free(kernel);
+    free(horizontal_pass);
+    return image;
+}
+
+// a pixel of a row the border picked, a missing row or a column of -1 is CANNY_BORDER_CONSTANT's zero
+static inline float border_row_pixel(const float *row, int column) {
+    return row == nullptr || column < 0 ? 0.0f : row[column];
+}
+
+// above, row and below are whole rows, the columns go through map
+BORDER_INLINE void apply_sobel_filter_pixel(const float *above, const float *row, const float *below, int x,
+                                            uint32_t width, float *magnitude, float *orientation, border_map map) {
+    const float *rows[3] = {above, row, below};
+    float sobel_x = 0.0f;
+    float sobel_y = 0.0f;
+
+    for (int i = -1; i <= 1; i++) {
+        for (int j = -1; j <= 1; j++) {
+            float value = border_row_pixel(rows[i + 1], map(x + j, (int) width));
+            sobel_x += value * sobel_kernel_x[i + 1][j + 1];
+            sobel_y += value * sobel_kernel_y[i + 1][j + 1];
+        }
+    }
+
+    magnitude[x] = sqrtf(sobel_x * sobel_x + sobel_y * sobel_y);
+    orientation[x] = quantize_orientation(sobel_x, sobel_y);
+}
+
+typedef void (*sobel_pixel_function)(const float *above, const float *row, const float *below, int x, uint32_t width,
+                                     float *magnitude, float *orientation);
+
+#define DEFINE_SOBEL_PIXEL(mode) \
+    static void apply_sobel_filter_pixel_##mode(const float *above, const float *row, const float *below, int x, \
+                                                uint32_t width, float *magnitude, float *orientation) { \
+        apply_sobel_filter_pixel(above, row, below, x, width, magnitude, orientation, border_##mode); \
+    }
+BORDER_VARIANTS(DEFINE_SOBEL_PIXEL)
+
+static const sobel_pixel_function sobel_pixel_functions[] = BORDER_TABLE(apply_sobel_filter_pixel);
+
+// Sobel over one whole row: the SIMD kernels take the interior, only the first and last column go through the border
+// pixel. A missing row, CANNY_BORDER_CONSTANT's zeros above the first or below the last row, is all border pixels.
+static void apply_sobel_filter_row(const float *above, const float *row, const float *below,
+                                   float *magnitude, float *orientation, uint32_t width, const simd_kernels *kernels,
+                                   sobel_pixel_function pixel) {
+    if (width < 3 || above == nullptr || below == nullptr) {
+        for (int x = 0; x < (int) width; x++) {
+            pixel(above, row, below, x, width, magnitude, orientation);
+        }
+        return;
+    }
+
+    pixel(above, row, below, 0, width, magnitude, orientation);
+    kernels->sobel_row(above + 1, row + 1, below + 1, magnitude + 1, orientation + 1, width - 2);
+    pixel(above, row, below, (int) width - 1, width, magnitude, orientation);
+}
+
+// the row border picks for y, nullptr for CANNY_BORDER_CONSTANT's zeros
+static const float *border_row(const float *image, int y, uint32_t width, uint32_t height, canny_border border) {
+    int source = border_coordinate(border, y, (int) height);
+    return source < 0 ? nullptr : image + (size_t) source * width;
+}
+
+// new_image holds two planes: the magnitude followed by the quantized orientation.
+void apply_sobel_filter_into(const float *image, float *new_image, uint32_t width, uint32_t height,
+                             canny_border border) {
+    const simd_kernels *kernels = get_simd_kernels();
+    sobel_pixel_function pixel = sobel_pixel_functions[border];
+
+#pragma omp parallel for schedule(runtime) default(none) shared(image, new_image, width, height, kernels, pixel, border)
+    for (int y = 0; y < (int) height; y++) {
+        apply_sobel_filter_row(border_row(image, y - 1, width, height, border), image + (size_t) y * width,
+                               border_row(image, y + 1, width, height, border),
+                               new_image + (size_t) y * width, new_image + (size_t) width * height + (size_t) y * width,
+                               width, kernels, pixel);
+    }
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+    write_intermediate_image("/tmp/test_after_sobel_intensity_filter.png", new_image, width, height);
+    write_intermediate_image("/tmp/test_after_sobel_orientation_filter.png", new_image + width * height, width, height);
+#endif
+}
+
+float *apply_sobel_filter(float *image, uint32_t width, uint32_t height) {
+    float *new_image = malloc(width * height * 2 * sizeof(float));
+    apply_sobel_filter_into(image, new_image, width, height, CANNY_BORDER_WRAP);
+    free(image);
+    return new_image;
+}
+
+float gradient_stats_bin_width(bool integer) {
+    return integer ? (float) ((GRADIENT_MAGNITUDE_MASK + 1) / GRADIENT_HISTOGRAM_BINS)
+                   : GRADIENT_MAGNITUDE_LIMIT / GRADIENT_HISTOGRAM_BINS;
+}
+
+static inline uint32_t gradient_stats_bin(float value) {
+    uint32_t bin = (uint32_t) (value * (GRADIENT_HISTOGRAM_BINS / GRADIENT_MAGNITUDE_LIMIT));
+    return bin < GRADIENT_HISTOGRAM_BINS ? bin : GRADIENT_HISTOGRAM_BINS - 1;
+}
+
+// the row was just written by thinning, so this does not go back to memory
+static void gradient_stats_add_row(gradient_stats *stats, const float *row, uint32_t width) {
+    float max = stats->max;
+    for (uint32_t x = 0; x < width; x++) {
+        float value = row[x];
+        if (value > max) max = value;
+        if (value > 0.0f) stats->histogram[gradient_stats_bin(value)]++;
+    }
+    stats->max = max;
+}
+
+// Takes a row out of the histogram again, the max stays. The counts are modulo 2^32, so stats that only collect a
+// difference may wrap around and still add up right.
+static void gradient_stats_remove_row(gradient_stats *stats, const float *row, uint32_t width) {
+    for (uint32_t x = 0; x < width; x++) {
+        if (row[x] > 0.0f) stats->histogram[gradient_stats_bin(row[x])]--;
+    }
+}
+
+static void gradient_stats_reset(gradient_stats *stats, int count) {
+    memset(stats, 0, (size_t) count * sizeof(gradient_stats));
+}
+
+// the first bin where at least percentile of the histogram lies at or below
+static uint32_t histogram_percentile(const uint64_t *histogram, uint64_t total, float percentile) {
+    uint64_t target = (uint64_t) ((double) percentile * (double) total);
+    uint64_t cumulative = 0;
+    for (uint32_t bin = 0; bin < GRADIENT_HISTOGRAM_BINS; bin++) {
+        cumulative += histogram[bin];
+        if (cumulative >= target) return bin;
+    }
+    return GRADIENT_HISTOGRAM_BINS - 1;
+}
+
+// the last bin of the lower class of the split with the largest between class variance
+static uint32_t histogram_otsu(const uint64_t *histogram, uint64_t total) {
+    double sum = 0.0;
+    for (uint32_t bin = 0; bin < GRADIENT_HISTOGRAM_BINS; bin++) {
+        sum += (double) bin * (double) histogram[bin];
+    }
+
+    double lower_sum = 0.0;
+    uint64_t lower_count = 0;
+    double best_variance = -1.0;
+    uint32_t best_bin = 0;
+    for (uint32_t bin = 0; bin < GRADIENT_HISTOGRAM_BINS; bin++) {
+        lower_count += histogram[bin];
+        lower_sum += (double) bin * (double) histogram[bin];
+        if (lower_count == 0) continue;
+        if (lower_count == total) break;
+
+        uint64_t upper_count = total - lower_count;
+        double difference = lower_sum / (double) lower_count - (sum - lower_sum) / (double) upper_count;
+        double variance = (double) lower_count * (double) upper_count * difference * difference;
+        if (variance > best_variance) {
+            best_variance = variance;
+            best_bin = bin;
+        }
+    }
+    return best_bin;
+}
+
+void gradient_stats_thresholds(const gradient_stats *stats, int count, bool integer, canny_threshold threshold,
+                               float percentile, float *high_threshold, float *low_threshold) {
+    float max = 0.0f;
+    for (int t = 0; t < count; t++) {
+        if (stats[t].max > max) max = stats[t].max;
+    }
+    if (threshold == CANNY_THRESHOLD_RATIO) {
+        *high_threshold = max * HIGH_THRESHOLD_RATIO;
+        *low_threshold = *high_threshold * LOW_THRESHOLD_RATIO;
+        return;
+    }
+
+    uint64_t histogram[GRADIENT_HISTOGRAM_BINS] = {0};
+    uint64_t total = 0;
+    for (int t = 0; t < count; t++) {
+        for (uint32_t bin = 0; bin < GRADIENT_HISTOGRAM_BINS; bin++) {
+            histogram[bin] += stats[t].histogram[bin];
+        }
+    }
+    for (uint32_t bin = 0; bin < GRADIENT_HISTOGRAM_BINS; bin++) {
+        total += histogram[bin];
+    }
+    // no edge candidates at all, nothing is above the maximum
+    if (total == 0) {
+        *high_threshold = max;
+        *low_threshold = max;
+        return;
+    }
+
+    uint32_t bin = threshold == CANNY_THRESHOLD_OTSU ? histogram_otsu(histogram, total)
+                                                     : histogram_percentile(histogram, total, percentile);
+    // everything above the bin is strong
+    *high_threshold = (float) (bin + 1) * gradient_stats_bin_width(integer);
+    *low_threshold = *high_threshold * AUTO_LOW_THRESHOLD_RATIO;
+}
+
+// above, row and below are whole rows of magnitudes, the columns go through map
+BORDER_INLINE void apply_edge_thinning_pixel(const float *above, const float *row, const float *below, float angle,
+                                             int x, uint32_t width, float *out, border_map map) {
+    float q = 255.0f;
+    float r = 255.0f;
+    int left = map(x - 1, (int) width);
+    int right = map(x + 1, (int) width);
+
+    // angle 0
+    if (angle >= 0 && angle < 22.5) {
+        q = border_row_pixel(row, right);
+        r = border_row_pixel(row, left);
+    } else if (angle >= 22.5 && angle < 67.5) { // angle 45
+        q = border_row_pixel(below, left);
+        r = border_row_pixel(above, right);
+    } else if (angle >= 67.5 && angle < 112.5) { // angle 90
+        q = border_row_pixel(below, x);
+        r = border_row_pixel(above, x);
+    } else if (angle >= 112.5 && angle < 157.5) { // angle 135
+        q = border_row_pixel(above, left);
+        r = border_row_pixel(below, right);
+    }
+
+    float intensity = row[x];
+    if (intensity >= q && intensity >= r) {
+        out[x] = intensity;
+    } else {
+        out[x] = 0.0f;
+    }
+}
+
+typedef void (*thinning_pixel_function)(const float *above, const float *row, const float *below, float angle, int x,
+                                        uint32_t width, float *out);
+
+#define DEFINE_THINNING_PIXEL(mode) \
+    static void apply_edge_thinning_pixel_##mode(const float *above, const float *row, const float *below, \
+                                                 float angle, int x, uint32_t width, float *out) { \
+        apply_edge_thinning_pixel(above, row, below, angle, x, width, out, border_##mode); \
+    }
+BORDER_VARIANTS(DEFINE_THINNING_PIXEL)
+
+static const thinning_pixel_function thinning_pixel_functions[] = BORDER_TABLE(apply_edge_thinning_pixel);
+
+// same split as apply_sobel_filter_row
+static void apply_edge_thinning_row(const float *above, const float *row, const float *below, const float *orientation,
+                                    float *out, uint32_t width, const simd_kernels *kernels,
+                                    thinning_pixel_function pixel) {
+    if (width < 3 || above == nullptr || below == nullptr) {
+        for (int x = 0; x < (int) width; x++) {
+            pixel(above, row, below, orientation[x], x, width, out);
+        }
+        return;
+    }
+
+    pixel(above, row, below, orientation[0], 0, width, out);
+    kernels->thinning_row(above + 1, row + 1, below + 1, orientation + 1, out + 1, width - 2);
+    pixel(above, row, below, orientation[width - 1], (int) width - 1, width, out);
+}
+
+void apply_edge_thinning_into(const float *image, float *new_image, uint32_t width, uint32_t height,
+                              gradient_stats *stats, canny_border border) {
+    const simd_kernels *kernels = get_simd_kernels();
+    thinning_pixel_function pixel = thinning_pixel_functions[border];
+    if (stats != nullptr) gradient_stats_reset(stats, omp_get_max_threads());
+
+#pragma omp parallel for schedule(runtime) default(none) shared(image, new_image, width, height, kernels, stats, pixel, border)
+    for (int y = 0; y < (int) height; y++) {
+        apply_edge_thinning_row(border_row(image, y - 1, width, height, border), image + (size_t) y * width,
+                                border_row(image, y + 1, width, height, border),
+                                image + (size_t) width * height + (size_t) y * width,
+                                new_image + (size_t) y * width, width, kernels, pixel);
+        if (stats != nullptr) {
+            gradient_stats_add_row(stats + omp_get_thread_num(), new_image + (size_t) y * width, width);
+        }
+    }
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+    write_intermediate_image("/tmp/test_after_edge_thinning.png", new_image, width, height);
+#endif
+}
+
+float *apply_edge_thinning(float *image, uint32_t width, uint32_t height) {
+    float *new_image = malloc(width * height * sizeof(float));
+    apply_edge_thinning_into(image, new_image, width, height, nullptr, CANNY_BORDER_WRAP);
+    free(image);
+    return new_image;
+}
+
+// per-thread scratch for one tile of the fused pipeline, every buffer covers the tile plus the halo its consumer needs
+typedef struct {
+    float *grayscale;   // tile + (2 + kernel radius) on every side
+    float *horizontal;  // tile + 2 columns, tile + (2 + kernel radius) rows
+    float *blurred;     // tile + 2 on every side
+    float *magnitude;   // tile + 1 on every side
+    float *orientation; // tile + 1 on every side
+} fused_tile_scratch;
+
+// number of floats one thread needs for the tile scratch
+size_t fused_tile_scratch_size(uint32_t tile_size, int kernel_radius) {
+    size_t span = tile_size + 2 * (2 + kernel_radius);
+    return span * span + (tile_size + 4) * span + (tile_size + 4) * (tile_size + 4) + 2 * (tile_size + 2) * (tile_size + 2);
+}
+
+static void fused_tile_scratch_init(fused_tile_scratch *scratch, float *block, uint32_t tile_size, int kernel_radius) {
+    size_t span = tile_size + 2 * (2 + kernel_radius);
+    scratch->grayscale = block;
+    scratch->horizontal = scratch->grayscale + span * span;
+    scratch->blurred = scratch->horizontal + (tile_size + 4) * span;
+    scratch->magnitude = scratch->blurred + (tile_size + 4) * (tile_size + 4);
+    scratch->orientation = scratch->magnitude + (tile_size + 2) * (tile_size + 2);
+}
+
+// the input of the tile scratch that starts at (origin_x, origin_y) in the image
+typedef struct {
+    const uint8_t *image;
+    size_t stride;
+    uint32_t channels;
+    uint32_t width;
+    uint32_t height;
+    int origin_x;
+    int origin_y;
+} fused_tile_source;
+
+// for tiles whose halo lies inside the image
+static inline int border_interior(int x, int size) {
+    return x;
+}
+
+// Fills the gray_width x gray_height grayscale tile, with both coordinates of every pixel going through map.
+// Only border_constant ever returns -1, the comparison against it folds away in every other variant.
+BORDER_INLINE void fused_gather(const fused_tile_source *source, float *grayscale, uint32_t gray_width,
+                                uint32_t gray_height, border_map map) {
+    bool constant = map == border_constant;
+    for (uint32_t ly = 0; ly < gray_height; ly++) {
+        int y = map(source->origin_y + (int) ly, (int) source->height);
+        float *gray_row = grayscale + ly * gray_width;
+        if (constant && y < 0) {
+            memset(gray_row, 0, gray_width * sizeof(float));
+            continue;
+        }
+        const uint8_t *image_row = source->image + (size_t) y * source->stride;
+        for (uint32_t lx = 0; lx < gray_width; lx++) {
+            int x = map(source->origin_x + (int) lx, (int) source->width);
+            gray_row[lx] = constant && x < 0 ? 0.0f : fused_grayscale(image_row + (size_t) x * source->channels,
+                                                                       source->channels);
+        }
+    }
+}
+
+// Replaces the entries of a stage's tile buffer that lie outside the image with the ones the unfused stage reads
+// there. The buffer starts at (origin_x, origin_y) and reaches at least as far into the image as past its edge,
+// so whatever the border reads is already in it. Not needed for wrap around, where the entries outside are computed
+// from the wrapped input and already are the ones on the opposite edge.
+BORDER_INLINE void fused_fix_halo(float *buffer, uint32_t buffer_width, uint32_t buffer_height, int origin_x,
+                                  int origin_y, uint32_t width, uint32_t height, border_map map) {
+    for (uint32_t ly = 0; ly < buffer_height; ly++) {
+        int y = origin_y + (int) ly;
+        bool row_outside = y < 0 || y >= (int) height;
+        int source_y = map(y, (int) height);
+        for (uint32_t lx = 0; lx < buffer_width; lx++) {
+            int x = origin_x + (int) lx;
+            if (!row_outside && x >= 0 && x < (int) width) continue;
+            int source_x = map(x, (int) width);
+            buffer[ly * buffer_width + lx] = source_y < 0 || source_x < 0
+                                             ? 0.0f
+                                             : buffer[(source_y - origin_y) * (int) buffer_width + source_x - origin_x];
+        }
+    }
+}
+
+typedef void (*fused_gather_function)(const fused_tile_source *source, float *grayscale, uint32_t gray_width,
+                                      uint32_t gray_height);
+typedef void (*fused_fix_halo_function)(float *buffer, uint32_t buffer_width, uint32_t buffer_height, int origin_x,
+                                        int origin_y, uint32_t width, uint32_t height);
+
+#define DEFINE_FUSED_BORDER(mode) \
+    static void fused_gather_##mode(const fused_tile_source *source, float *grayscale, uint32_t gray_width, \
+                                    uint32_t gray_height) { \
+        fused_gather(source, grayscale, gray_width, gray_height, border_##mode); \
+    } \
+    static void fused_fix_halo_##mode(float *buffer, uint32_t buffer_width, uint32_t buffer_height, int origin_x, \
+                                      int origin_y, uint32_t width, uint32_t height) { \
+        fused_fix_halo(buffer, buffer_width, buffer_height, origin_x, origin_y, width, height, border_##mode); \
+    }
+BORDER_VARIANTS(DEFINE_FUSED_BORDER)
+
+static void fused_gather_interior(const fused_tile_source *source, float *grayscale, uint32_t gray_width,
+                                  uint32_t gray_height) {
+    fused_gather(source, grayscale, gray_width, gray_height, border_interior);
+}
+
+static const fused_gather_function fused_gather_functions[] = BORDER_TABLE(fused_gather);
+static const fused_fix_halo_function fused_fix_halo_functions[] = {
+        [CANNY_BORDER_WRAP] = nullptr, [CANNY_BORDER_CLAMP] = fused_fix_halo_clamp,
+        [CANNY_BORDER_MIRROR] = fused_fix_halo_mirror, [CANNY_BORDER_CONSTANT] = fused_fix_halo_constant};
+
+// Runs grayscale -> blur -> sobel -> thinning for the tile at (tile_x, tile_y).
+// Tiles away from the edge gather their halo without any checks. The others fetch it through the border, and
+// entries of the blur and the magnitude that lie outside the image are replaced with what the unfused stages read
+// there. Every stage accumulates in the same order, so the result is identical to running the stages one after
+// another over the whole image.
+static void process_fused_tile(const uint8_t *image, size_t stride, uint32_t channels, float *out,
+                               uint32_t width, uint32_t height,
+                               const float *kernel, int kernel_radius,
+                               uint32_t tile_x, uint32_t tile_y, uint32_t tile_width, uint32_t tile_height,
+                               const simd_kernels *kernels, fused_tile_scratch *scratch, gradient_stats *stats,
+                               float *orientation, canny_border border) {
+    int halo = 2 + kernel_radius;
+    uint32_t gray_width = tile_width + 2 * halo;
+    uint32_t gray_height = tile_height + 2 * halo;
+    uint32_t blur_width = tile_width + 4;
+    uint32_t blur_height = tile_height + 4;
+    uint32_t sobel_width = tile_width + 2;
+    uint32_t sobel_height = tile_height + 2;
+    int kernel_size = 2 * kernel_radius + 1;
+    bool interior = tile_x >= (uint32_t) halo && tile_y >= (uint32_t) halo &&
+                    tile_x + tile_width + halo <= width && tile_y + tile_height + halo <= height;
+    fused_fix_halo_function fix_halo = interior ? nullptr : fused_fix_halo_functions[border];
+
+    fused_tile_source source = {image, stride, channels, width, height, (int) tile_x - halo, (int) tile_y - halo};
+    if (interior) {
+        fused_gather_interior(&source, scratch->grayscale, gray_width, gray_height);
+    } else {
+        fused_gather_functions[border](&source, scratch->grayscale, gray_width, gray_height);
+    }
+
+    for (uint32_t ly = 0; ly < gray_height; ly++) {
+        const float *gray_row = scratch->grayscale + ly * gray_width;
+        float *horizontal_row = scratch->horizontal + ly * blur_width;
+        for (uint32_t x = 0; x < blur_width; x++) {
+            float new_pixel_value = 0.0f;
+            for (int i = 0; i < kernel_size; i++) {
+                new_pixel_value += gray_row[x + i] * kernel[i];
+            }
+            horizontal_row[x] = new_pixel_value;
+        }
+    }
+
+    for (uint32_t y = 0; y < blur_height; y++) {
+        float *blurred_row = scratch->blurred + y * blur_width;
+        memset(blurred_row, 0, blur_width * sizeof(float));
+        for (int i = 0; i < kernel_size; i++) {
+            const float *horizontal_row = scratch->horizontal + (y + i) * blur_width;
+            for (uint32_t x = 0; x < blur_width; x++) {
+                blurred_row[x] += horizontal_row[x] * kernel[i];
+            }
+        }
+    }
+    if (fix_halo != nullptr) {
+        fix_halo(scratch->blurred, blur_width, blur_height, (int) tile_x - 2, (int) tile_y - 2, width, height);
+    }
+
+    for (uint32_t y = 0; y < sobel_height; y++) {
+        const float *blurred_row = scratch->blurred + (y + 1) * blur_width + 1;
+        kernels->sobel_row(blurred_row - blur_width, blurred_row, blurred_row + blur_width,
+                           scratch->magnitude + y * sobel_width, scratch->orientation + y * sobel_width, sobel_width);
+    }
+    if (fix_halo != nullptr) {
+        fix_halo(scratch->magnitude, sobel_width, sobel_height, (int) tile_x - 1, (int) tile_y - 1, width, height);
+    }
+
+    for (uint32_t y = 0; y < tile_height; y++) {
+        const float *magnitude_row = scratch->magnitude + (y + 1) * sobel_width + 1;
+        float *out_row = out + (size_t) (tile_y + y) * width + tile_x;
+        kernels->thinning_row(magnitude_row - sobel_width, magnitude_row, magnitude_row + sobel_width,
+                              scratch->orientation + (y + 1) * sobel_width + 1, out_row, tile_width);
+        if (stats != nullptr) gradient_stats_add_row(stats, out_row, tile_width);
+        if (orientation != nullptr) {
+            memcpy(orientation + (size_t) (tile_y + y) * width + tile_x, scratch->orientation + (y + 1) * sobel_width + 1,
+                   tile_width * sizeof(float));
+        }
+    }
+}
+
+// Fused grayscale -> gaussian -> sobel -> edge thinning over cache sized tiles.
+// Every tile runs all four stages while its data is hot, so only the input image
+// and the thinned magnitude ever touch main memory.
+// image has channels bytes per pixel and rows stride bytes apart, scratch holds omp_get_max_threads() blocks of
+// fused_tile_scratch_size(tile_size, kernel_radius) floats.
+void apply_fused_pipeline_into(const uint8_t *image, size_t stride, uint32_t channels, float *new_image,
+                               uint32_t width, uint32_t height,
+                               const float *kernel, int kernel_radius, uint32_t tile_size, float *scratch,
+                               gradient_stats *stats, float *orientation, canny_border border) {
+    size_t scratch_size = fused_tile_scratch_size(tile_size, kernel_radius);
+    const simd_kernels *kernels = get_simd_kernels();
+    if (stats != nullptr) gradient_stats_reset(stats, omp_get_max_threads());
+
+#pragma omp parallel default(none) shared(image, stride, channels, new_image, width, height, kernel, kernel_radius, tile_size, scratch, scratch_size, kernels, stats, orientation, border)
+#pragma omp single
+    for (uint32_t tile_y = 0; tile_y < height; tile_y += tile_size) {
+        for (uint32_t tile_x = 0; tile_x < width; tile_x += tile_size) {
+#pragma omp task default(none) firstprivate(tile_x, tile_y) shared(image, stride, channels, new_image, width, height, kernel, kernel_radius, tile_size, scratch, scratch_size, kernels, stats, orientation, border)
+            {
+                uint32_t tile_width = tile_x + tile_size > width ? width - tile_x : tile_size;
+                uint32_t tile_height = tile_y + tile_size > height ? height - tile_y : tile_size;
+                fused_tile_scratch tile_scratch;
+                fused_tile_scratch_init(&tile_scratch, scratch + omp_get_thread_num() * scratch_size,
+                                        tile_size, kernel_radius);
+                process_fused_tile(image, stride, channels, new_image, width, height, kernel, kernel_radius,
+                                   tile_x, tile_y, tile_width, tile_height, kernels, &tile_scratch,
+                                   stats != nullptr ? stats + omp_get_thread_num() : nullptr, orientation, border);
+            }
+        }
+    }
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+    write_intermediate_image("/tmp/test_after_fused_pipeline.png", new_image, width, height);
+#endif
+}
+
+float *apply_fused_pipeline(const uint8_t *image, uint32_t width, uint32_t height, float sigma, uint32_t tile_size) {
+    float *new_image = malloc(width * height * sizeof(float));
+    int kernel_radius;
+    float *kernel = create_gaussian_kernel(sigma, &kernel_radius);
+    float *scratch = malloc(omp_get_max_threads() * fused_tile_scratch_size(tile_size, kernel_radius) * sizeof(float));
+
+    apply_fused_pipeline_into(image, (size_t) width * 3, 3, new_image, width, height, kernel, kernel_radius, tile_size,
+                              scratch, nullptr, nullptr, CANNY_BORDER_WRAP);
+
+    free(scratch);
+    free(kernel);
+    return new_image;
+}
+
+void apply_double_threshold_into(const float *image, float *new_image, uint32_t width, uint32_t height,
+                                 float high_threshold, float low_threshold) {
+#pragma omp parallel for schedule(runtime) default(none) shared(image, new_image, width, height, high_threshold, low_threshold)
+    for (uint32_t i = 0; i < width * height; i++) {
+        if (image[i] > high_threshold) {
+            new_image[i] = STRONG_EDGE_PIXEL;
+        } else if (image[i] > low_threshold) {
+            new_image[i] = WEAK_EDGE_PIXEL;
+        } else {
+            new_image[i] = 0.0f;
+        }
+    }
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+    write_intermediate_image("/tmp/test_after_double_threshold.png", new_image, width, height);
+#endif
+}
+
+float *apply_double_threshold(float *image, uint32_t width, uint32_t height) {
+    float high = FLT_MIN;
+#pragma omp parallel for default(none) reduction(max:high) shared(image, width, height)
+    for (uint32_t i = 0; i < width * height; i++) {
+        if (image[i] > high) high = image[i];
+    }
+
+    float *new_image = malloc(width * height * sizeof(float));
+    apply_double_threshold_into(image, new_image, width, height, high * HIGH_THRESHOLD_RATIO,
+                                high * HIGH_THRESHOLD_RATIO * LOW_THRESHOLD_RATIO);
+    free(image);
+    return new_image;
+}
+
+// Hysteresis as connected components: a weak pixel survives if it is 8-connected (across the image edges for
+// CANNY_BORDER_WRAP, like every other stage) to any strong pixel, however long the chain. Components are found with
+// union-find where every label points towards the smallest index of its component:
+//  1. horizontal strips are labelled in parallel with a plain sequential union-find,
+//  2. the rows between strips and the wrapped seams are merged with lock-free unions,
+//  3. labels are flattened to their roots, roots of components holding a strong pixel get HYSTERESIS_STRONG_ROOT,
+//  4. every candidate pixel looks up its root.
+// That is four sweeps over the image no matter what the edges look like.
+#define HYSTERESIS_NO_LABEL UINT32_MAX
+#define HYSTERESIS_STRONG_ROOT 0x80000000u
+
+enum {
+    PIXEL_NONE, PIXEL_WEAK, PIXEL_STRONG
+};
+
+// exactly one of the float and u8 images is set, the branch is the same for the whole image
+static inline int histeresis_pixel_class(const float *image_float, const uint8_t *image_u8, size_t i) {
+    if (image_float != nullptr) {
+        if (image_float[i] == STRONG_EDGE_PIXEL) return PIXEL_STRONG;
+        return image_float[i] == WEAK_EDGE_PIXEL ? PIXEL_WEAK : PIXEL_NONE;
+    }
+    if (image_u8[i] == STRONG_EDGE_PIXEL_U8) return PIXEL_STRONG;
+    return image_u8[i] == WEAK_EDGE_PIXEL_U8 ? PIXEL_WEAK : PIXEL_NONE;
+}
+
+// whether the pixel with label belongs to a component with a strong pixel, once the roots are marked
+static inline bool histeresis_is_edge(const uint32_t *labels, uint32_t label) {
+    return label != HYSTERESIS_NO_LABEL && (labels[label & ~HYSTERESIS_STRONG_ROOT] & HYSTERESIS_STRONG_ROOT) != 0;
+}
+
+static inline uint32_t find_root(uint32_t *labels, uint32_t i) {
+    while (labels[i] != i) {
+        labels[i] = labels[labels[i]];
+        i = labels[i];
+    }
+    return i;
+}
+
+static inline void union_labels(uint32_t *labels, uint32_t a, uint32_t b) {
+    a = find_root(labels, a);
+    b = find_root(labels, b);
+    if (a < b) labels[b] = a;
+    else if (b < a) labels[a] = b;
+}
+
+static inline uint32_t find_root_atomic(uint32_t *labels, uint32_t i) {
+    uint32_t parent;
+    while ((parent = __atomic_load_n(&labels[i], __ATOMIC_RELAXED)) != i) {
+        i = parent;
+    }
+    return i;
+}
+
+// roots only ever get linked to a smaller root, so a failed exchange just means somebody else linked it first
+static void union_labels_atomic(uint32_t *labels, uint32_t a, uint32_t b) {
+    if (labels[a] == HYSTERESIS_NO_LABEL || labels[b] == HYSTERESIS_NO_LABEL) return;
+
+    while (true) {
+        a = find_root_atomic(labels, a);
+        b = find_root_atomic(labels, b);
+        if (a == b) return;
+
+        uint32_t high = a > b ? a : b;
+        uint32_t low = a > b ? b : a;
+        uint32_t expected = high;
+        if (__atomic_compare_exchange_n(&labels[high], &expected, low, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+// The edges go to new_image_float, which is packed, or if that is nullptr to the map or mask of output.
+// wrap_columns and wrap_rows make the first and the last column and row neighbours. Strips cut out of a larger
+// image never wrap their rows.
+static void connected_histeresis(const float *image_float, const uint8_t *image_u8,
+                                 float *new_image_float, const canny_output *output, uint32_t *labels, uint32_t width, uint32_t height, bool wrap_columns, bool wrap_rows) {
+    assert((size_t) width * height < HYSTERESIS_STRONG_ROOT);
+    int strips = omp_get_max_threads() * 4;
+    if (strips > (int) height) strips = (int) height;
+
+#pragma omp parallel default(none) shared(image_float, image_u8, new_image_float, output, labels, width, height, wrap_columns, wrap_rows, strips)
+    {
+#pragma omp for schedule(dynamic)
+        for (int strip = 0; strip < strips; strip++) {
+            uint32_t strip_begin = (uint32_t) ((uint64_t) height * strip / strips);
+            uint32_t strip_end = (uint32_t) ((uint64_t) height * (strip + 1) / strips);
+
+            for (uint32_t y = strip_begin; y < strip_end; y++) {
+                for (uint32_t x = 0; x < width; x++) {
+                    uint32_t i = y * width + x;
+                    if (histeresis_pixel_class(image_float, image_u8, i) == PIXEL_NONE) {
+                        labels[i] = HYSTERESIS_NO_LABEL;
+                        continue;
+                    }
+
+                    labels[i] = i;
+                    if (x > 0 && labels[i - 1] != HYSTERESIS_NO_LABEL) union_labels(labels, i, i - 1);
+                    if (y == strip_begin) continue;
+                    for (int dx = -1; dx <= 1; dx++) {
+                        if ((int) x + dx < 0 || x + dx >= width) continue;
+                        uint32_t neighbour = i - width + dx;
+                        if (labels[neighbour] != HYSTERESIS_NO_LABEL) union_labels(labels, i, neighbour);
+                    }
+                }
+            }
+        }
+
+        // rows where the strips meet, with the neighbours that lie inside the image
+#pragma omp for nowait
+        for (int strip = 1; strip < strips; strip++) {
+            uint32_t y = (uint32_t) ((uint64_t) height * strip / strips);
+            for (uint32_t x = 0; x < width; x++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if ((int) x + dx < 0 || x + dx >= width) continue;
+                    union_labels_atomic(labels, y * width + x, (y - 1) * width + x + dx);
+                }
+            }
+        }
+
+        // wrapped neighbours: the first column against the last one and the first row against the last one
+#pragma omp for nowait
+        for (int y = 0; y < (int) height; y++) {
+            if (!wrap_columns) continue;
+            for (int dy = -1; dy <= 1; dy++) {
+                if (!wrap_rows && (y + dy < 0 || y + dy >= (int) height)) continue;
+                union_labels_atomic(labels, calculate_index_with_wrap_around(0, y, width, height),
+                                    calculate_index_with_wrap_around(-1, y + dy, width, height));
+            }
+        }
+
+#pragma omp for
+        for (int x = 0; x < (int) width; x++) {
+            if (!wrap_rows) continue;
+            for (int dx = -1; dx <= 1; dx++) {
+                union_labels_atomic(labels, calculate_index_with_wrap_around(x, 0, width, height),
+                                    calculate_index_with_wrap_around(x + dx, -1, width, height));
+            }
+        }
+
+#pragma omp for
+        for (uint32_t i = 0; i < width * height; i++) {
+            if (labels[i] != HYSTERESIS_NO_LABEL) __atomic_store_n(&labels[i], find_root_atomic(labels, i), __ATOMIC_RELAXED);
+        }
+
+#pragma omp for
+        for (uint32_t i = 0; i < width * height; i++) {
+            if (histeresis_pixel_class(image_float, image_u8, i) == PIXEL_STRONG) {
+                __atomic_fetch_or(&labels[labels[i] & ~HYSTERESIS_STRONG_ROOT], HYSTERESIS_STRONG_ROOT, __ATOMIC_RELAXED);
+            }
+        }
+
+#pragma omp for
+        for (uint32_t y = 0; y < height; y++) {
+            const uint32_t *row = labels + (size_t) y * width;
+            if (new_image_float != nullptr) {
+                for (uint32_t x = 0; x < width; x++) {
+                    new_image_float[y * width + x] = histeresis_is_edge(labels, row[x]) ? STRONG_EDGE_PIXEL : 0.0f;
+                }
+            } else if (output->map != nullptr) {
+                uint8_t *map_row = output->map + y * output->stride;
+                for (uint32_t x = 0; x < width; x++) {
+                    map_row[x] = histeresis_is_edge(labels, row[x]) ? STRONG_EDGE_PIXEL_U8 : 0;
+                }
+            } else {
+                uint8_t *mask_row = output->mask + y * output->stride;
+                for (uint32_t x = 0; x < width; x += 8) {
+                    uint32_t bits = 0;
+                    for (uint32_t bit = 0; bit < 8 && x + bit < width; bit++) {
+                        if (histeresis_is_edge(labels, row[x + bit])) bits |= 0x80u >> bit;
+                    }
+                    mask_row[x / 8] = (uint8_t) bits;
+                }
+            }
+        }
+    }
+}
+
+// the gradient direction of pixel i, from the orientation plane of the float pipelines or the sector the integer
+// thinning keeps
+static inline uint8_t edge_direction(const float *orientation, const uint16_t *gradient, size_t i) {
+    if (orientation != nullptr) return (uint8_t) (orientation[i] / 45.0f);
+    return (uint8_t) (gradient[i] >> GRADIENT_SECTOR_SHIFT);
+}
+
+// Lists the edges of output->mask row by row. Every thread counts the edges in its rows, an exclusive prefix sum
+// over the counts tells each thread where its edges go, and the threads write them from there without ever
+// synchronising again. At one bit per pixel the counting pass costs little next to hysteresis.
+// offsets holds omp_get_max_threads() + 1 entries, directions need orientation or gradient.
+static void list_edges(canny_output *output, uint32_t width, uint32_t height, size_t *offsets,
+                       const float *orientation, const uint16_t *gradient) {
+    size_t row_bytes = (width + 7) / 8;
+
+#pragma omp parallel default(none) shared(output, width, height, offsets, orientation, gradient, row_bytes)
+    {
+        int thread = omp_get_thread_num();
+        size_t count = 0;
+#pragma omp for schedule(static)
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *mask_row = output->mask + y * output->stride;
+            for (size_t i = 0; i < row_bytes; i++) {
+                count += (size_t) __builtin_popcount(mask_row[i]);
+            }
+        }
+        offsets[thread + 1] = count;
+
+#pragma omp barrier
+#pragma omp single
+        {
+            offsets[0] = 0;
+            for (int t = 0; t < omp_get_num_threads(); t++) {
+                offsets[t + 1] += offsets[t];
+            }
+            output->count = offsets[omp_get_num_threads()];
+        }
+
+        // a static schedule over the same rows hands every thread the rows it counted
+        size_t next = offsets[thread];
+#pragma omp for schedule(static)
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *mask_row = output->mask + y * output->stride;
+            for (size_t i = 0; i < row_bytes; i++) {
+                // most significant bit first, which is left to right
+                for (uint32_t bits = mask_row[i]; bits != 0; next++) {
+                    uint32_t bit = (uint32_t) __builtin_clz(bits) - 24;
+                    bits &= ~(0x80u >> bit);
+                    if (next >= output->capacity) continue;
+
+                    uint32_t x = (uint32_t) i * 8 + bit;
+                    output->edges[next] = (canny_edge) {x, y};
+                    if (output->directions != nullptr) {
+                        output->directions[next] = edge_direction(orientation, gradient, (size_t) y * width + x);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void apply_edge_histeresis_into(const float *image, float *new_image, uint32_t *labels, uint32_t width, uint32_t height,
+                                canny_border border) {
+    bool wrap = border == CANNY_BORDER_WRAP;
+    connected_histeresis(image, nullptr, new_image, nullptr, labels, width, height, wrap, wrap);
+
+#ifdef WRITE_INTERMEDIATE_IMAGES
+    write_intermediate_image("/tmp/test_after_edge_histeresis.png", new_image, width, height);
+#endif
+}
+
+float *apply_edge_histeresis(float *image, uint32_t width, uint32_t height) {
+    float *new_image = malloc(width * height * sizeof(float));
+    uint32_t *labels = malloc(width * height * sizeof(uint32_t));
+    apply_edge_histeresis_into(image, new_image, labels, width, height, CANNY_BORDER_WRAP);
+    free(labels);
+    free(image);
+    return new_image;
+}
+
+void convert_to_grayscale_u8(const uint8_t *image, size_t stride, uint32_t channels, uint8_t *new_image,
+                             uint32_t width, uint32_t height) {
+    uint32_t green = GREEN_OFFSET(channels);
+    uint32_t blue = BLUE_OFFSET(channels);
+
+    // 0.2126, 0.7152 and 0.0722 in Q8
+#pragma omp parallel for schedule(runtime) default(none) shared(image, stride, channels, green, blue, new_image, width, height)
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *pixel = image + y * stride;
+        for (uint32_t x = 0; x < width; x++, pixel += channels) {
+            new_image[y * width + x] = (uint8_t) ((54 * pixel[0] + 183 * pixel[green] + 19 * pixel[blue] + 128) >> 8);
+        }
+    }
+}
+
+// the vertical blur of row y, which lies within kernel_radius of the first or last row
+BORDER_INLINE void apply_gaussian_filter_u16_border_row(const uint16_t *horizontal_pass, uint16_t *out_row, int y,
+                                                        uint32_t width, uint32_t height, const uint16_t *kernel,
+                                                        int kernel_radius, border_map map) {
+    const int shift = 2 * FIXED_KERNEL_BITS - BLUR_FRACTION_BITS;
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t new_pixel_value = 1 << (shift - 1);
+        for (int i = -kernel_radius; i <= kernel_radius; i++) {
+            int source = map(y + i, (int) height);
+            if (source >= 0) new_pixel_value += horizontal_pass[(size_t) source * width + x] * kernel[i + kernel_radius];
+        }
+        out_row[x] = (uint16_t) (new_pixel_value >> shift);
+    }
+}
+
+typedef void (*gaussian_u16_border_row_function)(const uint16_t *horizontal_pass, uint16_t *out_row, int y,
+                                                 uint32_t width, uint32_t height, const uint16_t *kernel,
+                                                 int kernel_radius);
+
+#define DEFINE_GAUSSIAN_U16_BORDER_ROW(mode) \
+    static void apply_gaussian_filter_u16_border_row_##mode(const uint16_t *horizontal_pass, uint16_t *out_row, \
+                                                            int y, uint32_t width, uint32_t height, \
+                                                            const uint16_t *kernel, int kernel_radius) { \
+        apply_gaussian_filter_u16_border_row(horizontal_pass, out_row, y, width, height, kernel, kernel_radius, \
+                                             border_##mode); \
+    }
+BORDER_VARIANTS(DEFINE_GAUSSIAN_U16_BORDER_ROW)
+
+static const gaussian_u16_border_row_function gaussian_u16_border_row_functions[] =
+        BORDER_TABLE(apply_gaussian_filter_u16_border_row);
+
+// same separable passes as apply_gaussian_filter_into, the horizontal pass keeps the full Q8 sum in a u16
+// and the vertical pass rounds down to BLUR_FRACTION_BITS
+void apply_gaussian_filter_u8(const uint8_t *image, uint16_t *horizontal_pass, uint16_t *new_image,
+                              uint32_t width, uint32_t height,
+                              const uint16_t *kernel, int kernel_radius, uint8_t *line_buffers, canny_border border) {
+    int kernel_size = 2 * kernel_radius + 1;
+    const int shift = 2 * FIXED_KERNEL_BITS - BLUR_FRACTION_BITS;
+    gaussian_u16_border_row_function border_row_blur = gaussian_u16_border_row_functions[border];
+
+#pragma omp parallel default(none) shared(image, horizontal_pass, width, height, kernel, kernel_radius, kernel_size, line_buffers, border)
+    {
+        uint8_t *line = line_buffers + (size_t) omp_get_thread_num() * (width + 2 * kernel_radius);
+
+#pragma omp for schedule(runtime)
+        for (int y = 0; y < (int) height; y++) {
+            const uint8_t *in_row = image + (size_t) y * width;
+            for (int x = -kernel_radius; x < 0; x++) {
+                int left = border_coordinate(border, x, (int) width);
+                int right = border_coordinate(border, (int) width - x - 1, (int) width);
+                line[x + kernel_radius] = left < 0 ? 0 : in_row[left];
+                line[(int) width + kernel_radius - x - 1] = right < 0 ? 0 : in_row[right];
+            }
+            memcpy(line + kernel_radius, in_row, width);
+
+            uint16_t *out_row = horizontal_pass + (size_t) y * width;
+            for (uint32_t x = 0; x < width; x++) {
+                uint32_t new_pixel_value = 0;
+                for (int i = 0; i < kernel_size; i++) {
+                    new_pixel_value += line[x + i] * kernel[i];
+                }
+                out_row[x] = (uint16_t) new_pixel_value;
+            }
+        }
+    }
+
+#pragma omp parallel for schedule(runtime) default(none) shared(new_image, horizontal_pass, width, height, kernel, kernel_radius, kernel_size, shift, border_row_blur)
+    for (int y = 0; y < (int) height; y++) {
+        uint16_t *out_row = new_image + (size_t) y * width;
+        if (y < kernel_radius || y + kernel_radius >= (int) height) {
+            border_row_blur(horizontal_pass, out_row, y, width, height, kernel, kernel_radius);
+            continue;
+        }
+
+        const uint16_t *in_rows = horizontal_pass + (size_t) (y - kernel_radius) * width;
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t new_pixel_value = 1 << (shift - 1);
+            for (int i = 0; i < kernel_size; i++) {
+                new_pixel_value += in_rows[(size_t) i * width + x] * kernel[i];
+            }
+            out_row[x] = (uint16_t) (new_pixel_value >> shift);
+        }
+    }
+}
+
+// Picks the sector that atan2 followed by rounding to 45 degrees would, by comparing |gx| and |gy| against tan(22.5):
+// 0 is horizontal, 1 is 45 degrees, 2 is vertical and 3 is 135 degrees
+static inline uint16_t gradient_sector(int sobel_x, int sobel_y) {
+    int abs_x = abs(sobel_x);
+    int abs_y = abs(sobel_y);
+    if (abs_y * 65536 < TAN_22_5_Q16 * abs_x) return 0;
+    if (abs_x * 65536 < TAN_22_5_Q16 * abs_y) return 2;
+    return (sobel_x > 0) == (sobel_y > 0) ? 1 : 3;
+}
+
+// the packed gradient of the 3x3 neighbourhood n, row by row
+static inline uint16_t sobel_gradient_u16(const int n[3][3]) {
+    int16_t sobel_x = (int16_t) (n[0][2] + 2 * n[1][2] + n[2][2] - n[0][0] - 2 * n[1][0] - n[2][0]);
+    int16_t sobel_y = (int16_t) (n[0][0] + 2 * n[0][1] + n[0][2] - n[2][0] - 2 * n[2][1] - n[2][2]);
+
+    uint16_t magnitude = (uint16_t) lrintf(sqrtf((float) (sobel_x * sobel_x + sobel_y * sobel_y)));
+    return magnitude | gradient_sector(sobel_x, sobel_y) << GRADIENT_SECTOR_SHIFT;
+}
+
+BORDER_INLINE void apply_sobel_filter_u16_pixel(const uint16_t *image, uint16_t *gradient, int x, int y,
+                                                uint32_t width, uint32_t height, border_map map) {
+    int n[3][3];
+    for (int i = -1; i <= 1; i++) {
+        int row = map(y + i, (int) height);
+        for (int j = -1; j <= 1; j++) {
+            int column = map(x + j, (int) width);
+            n[i + 1][j + 1] = row < 0 || column < 0 ? 0 : image[(size_t) row * width + column];
+        }
+    }
+    gradient[(size_t) y * width + x] = sobel_gradient_u16(n);
+}
+
+typedef void (*sobel_u16_pixel_function)(const uint16_t *image, uint16_t *gradient, int x, int y, uint32_t width,
+                                         uint32_t height);
+
+#define DEFINE_SOBEL_U16_PIXEL(mode) \
+    static void apply_sobel_filter_u16_pixel_##mode(const uint16_t *image, uint16_t *gradient, int x, int y, \
+                                                    uint32_t width, uint32_t height) { \
+        apply_sobel_filter_u16_pixel(image, gradient, x, y, width, height, border_##mode); \
+    }
+BORDER_VARIANTS(DEFINE_SOBEL_U16_PIXEL)
+
+static const sobel_u16_pixel_function sobel_u16_pixel_functions[] = BORDER_TABLE(apply_sobel_filter_u16_pixel);
+
+// the first and last row and column go through the border pixel, everything else reads its neighbours directly
+void apply_sobel_filter_u16(const uint16_t *image, uint16_t *gradient, uint32_t width, uint32_t height,
+                            canny_border border) {
+    sobel_u16_pixel_function pixel = sobel_u16_pixel_functions[border];
+
+#pragma omp parallel for schedule(runtime) default(none) shared(image, gradient, width, height, pixel)
+    for (int y = 0; y < (int) height; y++) {
+        if (y == 0 || y == (int) height - 1 || width < 3) {
+            for (int x = 0; x < (int) width; x++) {
+                pixel(image, gradient, x, y, width, height);
+            }
+            continue;
+        }
+
+        pixel(image, gradient, 0, y, width, height);
+        const uint16_t *row = image + (size_t) y * width;
+        const uint16_t *above = row - width;
+        const uint16_t *below = row + width;
+        for (uint32_t x = 1; x < width - 1; x++) {
+            const int n[3][3] = {
+                    {above[x - 1], above[x], above[x + 1]},
+                    {row[x - 1],   row[x],   row[x + 1]},
+                    {below[x - 1], below[x], below[x + 1]},
+            };
+            gradient[(size_t) y * width + x] = sobel_gradient_u16(n);
+        }
+        pixel(image, gradient, (int) width - 1, y, width, height);
+    }
+}
+
+// the row was just written by thinning, so this does not go back to memory
+static void gradient_stats_add_row_u16(gradient_stats *stats, const uint16_t *row, uint32_t width) {
+    uint16_t max = (uint16_t) stats->max;
+    for (uint32_t x = 0; x < width; x++) {
+        uint16_t value = row[x] & GRADIENT_MAGNITUDE_MASK;
+        if (value > max) max = value;
+        if (value > 0) stats->histogram[value / ((GRADIENT_MAGNITUDE_MASK + 1) / GRADIENT_HISTOGRAM_BINS)]++;
+    }
+    stats->max = (float) max;
+}
+
+// neighbour offsets along the gradient for every sector, in the same order as apply_edge_thinning_into
+static const int thinning_neighbours[4][2][2] = {
+        {{1,  0}, {-1, 0}},
+        {{-1, 1}, {1,  -1}},
+        {{0,  1}, {0,  -1}},
+        {{-1, -1}, {1, 1}}
+};
+
+// the pixel with its sector if it is a local maximum, otherwise 0
+static inline uint16_t thinned_magnitude(uint16_t pixel, uint16_t q, uint16_t r) {
+    uint16_t intensity = pixel & GRADIENT_MAGNITUDE_MASK;
+    q &= GRADIENT_MAGNITUDE_MASK;
+    r &= GRADIENT_MAGNITUDE_MASK;
+    return intensity >= q && intensity >= r ? pixel : 0;
+}
+
+BORDER_INLINE void apply_edge_thinning_u16_pixel(const uint16_t *gradient, uint16_t *new_image, int x, int y,
+                                                 uint32_t width, uint32_t height, border_map map) {
+    uint16_t pixel = gradient[(size_t) y * width + x];
+    const int (*offsets)[2] = thinning_neighbours[pixel >> GRADIENT_SECTOR_SHIFT];
+    uint16_t neighbours[2];
+    for (int n = 0; n < 2; n++) {
+        int column = map(x + offsets[n][0], (int) width);
+        int row = map(y + offsets[n][1], (int) height);
+        neighbours[n] = row < 0 || column < 0 ? 0 : gradient[(size_t) row * width + column];
+    }
+    new_image[(size_t) y * width + x] = thinned_magnitude(pixel, neighbours[0], neighbours[1]);
+}
+
+typedef void (*thinning_u16_pixel_function)(const uint16_t *gradient, uint16_t *new_image, int x, int y,
+                                            uint32_t width, uint32_t height);
+
+#define DEFINE_THINNING_U16_PIXEL(mode) \
+    static void apply_edge_thinning_u16_pixel_##mode(const uint16_t *gradient, uint16_t *new_image, int x, int y, \
+                                                     uint32_t width, uint32_t height) { \
+        apply_edge_thinning_u16_pixel(gradient, new_image, x, y, width, height, border_##mode); \
+    }
+BORDER_VARIANTS(DEFINE_THINNING_U16_PIXEL)
+
+static const thinning_u16_pixel_function thinning_u16_pixel_functions[] = BORDER_TABLE(apply_edge_thinning_u16_pixel);
+
+// same split as apply_sobel_filter_u16
+void apply_edge_thinning_u16(const uint16_t *gradient, uint16_t *new_image, uint32_t width, uint32_t height,
+                             gradient_stats *stats, canny_border border) {
+    thinning_u16_pixel_function border_pixel = thinning_u16_pixel_functions[border];
+    if (stats != nullptr) gradient_stats_reset(stats, omp_get_max_threads());
+
+#pragma omp parallel for schedule(runtime) default(none) shared(gradient, new_image, width, height, thinning_neighbours, stats, border_pixel)
+    for (int y = 0; y < (int) height; y++) {
+        if (y == 0 || y == (int) height - 1 || width < 3) {
+            for (int x = 0; x < (int) width; x++) {
+                border_pixel(gradient, new_image, x, y, width, height);
+            }
+        } else {
+            border_pixel(gradient, new_image, 0, y, width, height);
+            const uint16_t *row = gradient + (size_t) y * width;
+            uint16_t *out_row = new_image + (size_t) y * width;
+            for (int x = 1; x < (int) width - 1; x++) {
+                const int (*offsets)[2] = thinning_neighbours[row[x] >> GRADIENT_SECTOR_SHIFT];
+                out_row[x] = thinned_magnitude(row[x], row[x + offsets[0][1] * (int) width + offsets[0][0]],
+                                               row[x + offsets[1][1] * (int) width + offsets[1][0]]);
+            }
+            border_pixel(gradient, new_image, (int) width - 1, y, width, height);
+        }
+        if (stats != nullptr) gradient_stats_add_row_u16(stats + omp_get_thread_num(), new_image + y * width, width);
+    }
+}
+
+void apply_double_threshold_u16(const uint16_t *image, uint8_t *new_image, uint32_t width, uint32_t height,
+                                float high_threshold, float low_threshold) {
+#pragma omp parallel for schedule(runtime) default(none) shared(image, new_image, width, height, high_threshold, low_threshold)
+    for (uint32_t i = 0; i < width * height; i++) {
+        float magnitude = (float) (image[i] & GRADIENT_MAGNITUDE_MASK);
+        if (magnitude > high_threshold) {
+            new_image[i] = STRONG_EDGE_PIXEL_U8;
+        } else if (magnitude > low_threshold) {
+            new_image[i] = WEAK_EDGE_PIXEL_U8;
+        } else {
+            new_image[i] = 0;
+        }
+    }
+}
+
+void apply_edge_histeresis_u8(const uint8_t *image, uint8_t *new_image, size_t out_stride, uint32_t *labels,
+                              uint32_t width, uint32_t height, canny_border border) {
+    bool wrap = border == CANNY_BORDER_WRAP;
+    canny_output output = {.map = new_image, .stride = out_stride};
+    connected_histeresis(nullptr, image, nullptr, &output, labels, width, height, wrap, wrap);
+}
+
+#define WORKSPACE_ALIGNMENT 64
+
+static void *workspace_alloc(canny_workspace *workspace, size_t bytes) {
+    bytes = (bytes + WORKSPACE_ALIGNMENT - 1) / WORKSPACE_ALIGNMENT * WORKSPACE_ALIGNMENT;
+    void *buffer = aligned_alloc(WORKSPACE_ALIGNMENT, bytes);
+    assert(buffer != nullptr);
+    workspace->bytes += bytes;
+    if (workspace->bytes > workspace->peak_bytes) workspace->peak_bytes = workspace->bytes;
+    return buffer;
+}
+
+static void workspace_free(canny_workspace *workspace, void *buffer, size_t bytes) {
+    if (buffer == nullptr) return;
+    workspace->bytes -= (bytes + WORKSPACE_ALIGNMENT - 1) / WORKSPACE_ALIGNMENT * WORKSPACE_ALIGNMENT;
+    free(buffer);
+}
+
+canny_workspace *canny_workspace_create(uint32_t max_width, uint32_t max_height) {
+    canny_workspace *workspace = calloc(1, sizeof(canny_workspace));
+    workspace->max_width = max_width;
+    workspace->max_height = max_height;
+    workspace->ping = workspace_alloc(workspace, (size_t) max_width * max_height * sizeof(float));
+    // the slack keeps the aligned hysteresis labels of the integer pipeline inside pong even for tiny images
+    workspace->pong = workspace_alloc(workspace, (size_t) max_width * max_height * 2 * sizeof(float) + WORKSPACE_ALIGNMENT);
+    return workspace;
+}
+
+void canny_workspace_destroy(canny_workspace *workspace) {
+    profiler_destroy(workspace->profiler);
+    free(workspace->ping);
+    free(workspace->pong);
+    free(workspace->kernel);
+    free(workspace->fixed_kernel);
+    free(workspace->scratch);
+    free(workspace->stats);
+    free(workspace->mask);
+    free(workspace->edge_offsets);
+    free(workspace);
+}
+
+size_t canny_workspace_peak_bytes(const canny_workspace *workspace) {
+    return workspace->peak_bytes;
+}
+
+static void workspace_prepare_kernel(canny_workspace *workspace, float sigma) {
+    if (workspace->kernel != nullptr && workspace->kernel_sigma == sigma) return;
+
+    workspace_free(workspace, workspace->kernel, (2 * workspace->kernel_radius + 1) * sizeof(float));
+    workspace_free(workspace, workspace->fixed_kernel, (2 * workspace->kernel_radius + 1) * sizeof(uint16_t));
+    int kernel_radius;
+    float *kernel = create_gaussian_kernel(sigma, &kernel_radius);
+    workspace->kernel = workspace_alloc(workspace, (2 * kernel_radius + 1) * sizeof(float));
+    memcpy(workspace->kernel, kernel, (2 * kernel_radius + 1) * sizeof(float));
+    workspace->fixed_kernel = workspace_alloc(workspace, (2 * kernel_radius + 1) * sizeof(uint16_t));
+    create_fixed_gaussian_kernel(kernel, kernel_radius, workspace->fixed_kernel);
+    free(kernel);
+    workspace->kernel_sigma = sigma;
+    workspace->kernel_radius = kernel_radius;
+}
+
+// The caller's thread count and schedule, which a run puts back once its stages are done with their own
+typedef struct {
+    int threads;
+    omp_sched_t kind;
+    int chunk;
+} omp_settings;
+
+// Keeps the caller's settings and has the stages of the following run on workspace take those of tuning, if any.
+static omp_settings tuning_apply(canny_workspace *workspace, const tuning_bucket *tuning) {
+    omp_settings caller = {.threads = omp_get_max_threads()};
+    omp_get_schedule(&caller.kind, &caller.chunk);
+    workspace->tuning = tuning;
+    // a run inside a parallel region, like a small crop of canny_run_regions, keeps its single thread
+    if (tuning != nullptr && tuning->threads > 0 && !omp_in_parallel()) omp_set_num_threads(tuning->threads);
+    return caller;
+}
+
+static void tuning_restore(canny_workspace *workspace, omp_settings caller) {
+    workspace->tuning = nullptr;
+    omp_set_num_threads(caller.threads);
+    omp_set_schedule(caller.kind, caller.chunk);
+}
+
+// The stage loops run with schedule(runtime), which every stage points at its tuned schedule or a static one,
+// whatever OMP_SCHEDULE says.
+static void stage_begin(canny_workspace *workspace, const char *name) {
+    omp_sched_t kind = omp_sched_static;
+    int chunk = 0;
+    const tuning_bucket *tuning = workspace->tuning;
+    for (int s = 0; tuning != nullptr && s < tuning->schedule_count; s++) {
+        if (strcmp(tuning->schedules[s].stage, name) != 0) continue;
+        kind = (omp_sched_t) tuning->schedules[s].kind;
+        chunk = tuning->schedules[s].chunk;
+        break;
+    }
+    omp_set_schedule(kind, chunk);
+
+    if (workspace->profiler == nullptr) return;
+    workspace->stage_bytes = workspace->bytes;
+    profiler_begin(workspace->profiler, name);
+}
+
+// traffic is a rough estimate of the bytes the stage reads and writes, to tell bandwidth bound stages apart
+static void stage_end(canny_workspace *workspace, size_t traffic) {
+    if (workspace->profiler == nullptr) return;
+    size_t allocated = workspace->bytes > workspace->stage_bytes ? workspace->bytes - workspace->stage_bytes : 0;
+    profiler_end(workspace->profiler, traffic, allocated);
+}
+
+// grows the scratch to per_thread floats for every thread, it is never shrunk
+static float *workspace_prepare_scratch(canny_workspace *workspace, size_t per_thread) {
+    size_t size = per_thread * omp_get_max_threads();
+    if (size > workspace->scratch_size) {
+        workspace_free(workspace, workspace->scratch, workspace->scratch_size * sizeof(float));
+        workspace->scratch = workspace_alloc(workspace, size * sizeof(float));
+        workspace->scratch_size = size;
+    }
+    return workspace->scratch;
+}
+
+// one gradient_stats for every thread, it is never shrunk
+static gradient_stats *workspace_prepare_stats(canny_workspace *workspace) {
+    int count = omp_get_max_threads();
+    if (count > workspace->stats_count) {
+        workspace_free(workspace, workspace->stats, workspace->stats_count * sizeof(gradient_stats));
+        workspace->stats = workspace_alloc(workspace, count * sizeof(gradient_stats));
+        workspace->stats_count = count;
+    }
+    return workspace->stats;
+}
+
+// An edge list without a mask of the caller's is compacted from the workspace's own, which is never shrunk.
+// The list also needs the compaction offsets.
+static void workspace_prepare_output(canny_workspace *workspace, canny_output *output, uint32_t width,
+                                     uint32_t height) {
+    if (!output->list) return;
+    if (output->mask == nullptr) {
+        output->map = nullptr;
+        output->stride = (width + 7) / 8;
+        size_t size = output->stride * height;
+        if (size > workspace->mask_size) {
+            workspace_free(workspace, workspace->mask, workspace->mask_size);
+            workspace->mask = workspace_alloc(workspace, size);
+            workspace->mask_size = size;
+        }
+        output->mask = workspace->mask;
+    }
+
+    int count = omp_get_max_threads() + 1;
+    if (count > workspace->edge_offsets_count) {
+        workspace_free(workspace, workspace->edge_offsets, workspace->edge_offsets_count * sizeof(size_t));
+        workspace->edge_offsets = workspace_alloc(workspace, count * sizeof(size_t));
+        workspace->edge_offsets_count = count;
+    }
+}
+
+// Hysteresis over the threshold classes into output, then the edge list if output asks for one.
+// labels is scratch for width * height uint32_t, the directions of the list come from orientation or gradient.
+static void workspace_histeresis(canny_workspace *workspace, const float *classes_float, const uint8_t *classes_u8,
+                                 uint32_t *labels, uint32_t width, uint32_t height, canny_output *output,
+                                 const float *orientation, const uint16_t *gradient) {
+    size_t pixels = (size_t) width * height;
+    size_t class_size = classes_float != nullptr ? sizeof(float) : 1;
+    bool wrap = workspace->border == CANNY_BORDER_WRAP;
+    // hysteresis reads the classes and goes over the labels about three times
+    stage_begin(workspace, "hysteresis");
+    connected_histeresis(classes_float, classes_u8, nullptr, output, labels, width, height, wrap, wrap);
+    stage_end(workspace, pixels * (class_size + 3 * sizeof(uint32_t)) + (output->map != nullptr ? pixels : pixels / 8));
+
+    if (!output->list) return;
+    stage_begin(workspace, "edge_list");
+    list_edges(output, width, height, workspace->edge_offsets, orientation, gradient);
+    size_t listed = output->count < output->capacity ? output->count : output->capacity;
+    stage_end(workspace, 2 * pixels / 8 + listed * (sizeof(canny_edge) + (output->directions != nullptr ? 2 : 0)));
+}
+
+// the double threshold from the statistics thinning collected
+static void workspace_thresholds(const canny_workspace *workspace, bool integer, float *high_threshold,
+                                 float *low_threshold) {
+    gradient_stats_thresholds(workspace->stats, omp_get_max_threads(), integer, workspace->threshold,
+                              workspace->percentile, high_threshold, low_threshold);
+}
+
+void canny_workspace_run(canny_workspace *workspace, const uint8_t *image, size_t stride, uint32_t channels,
+                         uint32_t width, uint32_t height, float sigma, canny_output *output) {
+    assert(width <= workspace->max_width && height <= workspace->max_height);
+    size_t pixels = (size_t) width * height;
+    stage_begin(workspace, "setup");
+    workspace_prepare_kernel(workspace, sigma);
+    float *line_buffers = workspace_prepare_scratch(workspace, width + 2 * workspace->kernel_radius);
+    gradient_stats *stats = workspace_prepare_stats(workspace);
+    workspace_prepare_output(workspace, output, width, height);
+    stage_end(workspace, 0);
+
+    stage_begin(workspace, "ingest_gaussian");
+    ingest_gaussian_filter_into(image, stride, channels, workspace->pong, workspace->ping, width, height,
+                                workspace->kernel, workspace->kernel_radius, line_buffers, workspace->border);
+    stage_end(workspace, pixels * (channels + 3 * sizeof(float)));
+    stage_begin(workspace, "sobel");
+    apply_sobel_filter_into(workspace->ping, workspace->pong, width, height, workspace->border);
+    stage_end(workspace, pixels * 3 * sizeof(float));
+    stage_begin(workspace, "thinning");
+    apply_edge_thinning_into(workspace->pong, workspace->ping, width, height, stats, workspace->border);
+    stage_end(workspace, pixels * 3 * sizeof(float));
+    // thinning already found the thresholds, only the classification reads the image
+    stage_begin(workspace, "double_threshold");
+    float high_threshold, low_threshold;
+    workspace_thresholds(workspace, false, &high_threshold, &low_threshold);
+    apply_double_threshold_into(workspace->ping, workspace->pong, width, height, high_threshold, low_threshold);
+    stage_end(workspace, pixels * 2 * sizeof(float));
+    // the edge map goes straight into the caller's buffer, so there is no float result to convert afterwards.
+    // The labels take the place of the thinned magnitude, which leaves sobel's orientation plane for the edge list.
+    workspace_histeresis(workspace, workspace->pong, nullptr, (uint32_t *) workspace->ping, width, height, output,
+                         workspace->pong + pixels, nullptr);
+}
+
+void canny_workspace_run_fused(canny_workspace *workspace, const uint8_t *image, size_t stride, uint32_t channels,
+                               uint32_t width, uint32_t height, float sigma, uint32_t tile_size,
+                               canny_output *output) {
+    assert(width <= workspace->max_width && height <= workspace->max_height);
+    size_t pixels = (size_t) width * height;
+    stage_begin(workspace, "setup");
+    workspace_prepare_kernel(workspace, sigma);
+    float *scratch = workspace_prepare_scratch(workspace, fused_tile_scratch_size(tile_size, workspace->kernel_radius));
+    gradient_stats *stats = workspace_prepare_stats(workspace);
+    workspace_prepare_output(workspace, output, width, height);
+    stage_end(workspace, 0);
+
+    // everything in between stays in the tile scratch, except the orientation when the edge list wants directions
+    float *orientation = output->list && output->directions != nullptr ? workspace->pong + pixels : nullptr;
+    stage_begin(workspace, "fused_tiles");
+    apply_fused_pipeline_into(image, stride, channels, workspace->pong, width, height, workspace->kernel,
+                              workspace->kernel_radius, tile_size, scratch, stats, orientation, workspace->border);
+    stage_end(workspace, pixels * (channels + (orientation != nullptr ? 2 : 1) * sizeof(float)));
+    stage_begin(workspace, "double_threshold");
+    float high_threshold, low_threshold;
+    workspace_thresholds(workspace, false, &high_threshold, &low_threshold);
+    apply_double_threshold_into(workspace->pong, workspace->ping, width, height, high_threshold, low_threshold);
+    stage_end(workspace, pixels * 2 * sizeof(float));
+    // the labels take the place of the thinned magnitude
+    workspace_histeresis(workspace, workspace->ping, nullptr, (uint32_t *) workspace->pong, width, height, output,
+                         orientation, nullptr);
+}
+
+// the compact intermediates reuse the float ping-pong buffers, every stage fits in the smaller of the two
+void canny_workspace_run_integer(canny_workspace *workspace, const uint8_t *image, size_t stride, uint32_t channels,
+                                 uint32_t width, uint32_t height, float sigma, canny_output *output) {
+    assert(width <= workspace->max_width && height <= workspace->max_height);
+    size_t pixels = (size_t) width * height;
+    stage_begin(workspace, "setup");
+    workspace_prepare_kernel(workspace, sigma);
+    uint8_t *line_buffers = (uint8_t *) workspace_prepare_scratch(
+            workspace, (width + 2 * workspace->kernel_radius + sizeof(float) - 1) / sizeof(float));
+    gradient_stats *stats = workspace_prepare_stats(workspace);
+    workspace_prepare_output(workspace, output, width, height);
+    stage_end(workspace, 0);
+
+    uint8_t *ping = (uint8_t *) workspace->ping;
+    uint8_t *pong = (uint8_t *) workspace->pong;
+    stage_begin(workspace, "grayscale");
+    convert_to_grayscale_u8(image, stride, channels, ping, width, height);
+    stage_end(workspace, pixels * (channels + 1));
+    stage_begin(workspace, "gaussian");
+    apply_gaussian_filter_u8(ping, (uint16_t *) pong, (uint16_t *) ping, width, height,
+                             workspace->fixed_kernel, workspace->kernel_radius, line_buffers, workspace->border);
+    stage_end(workspace, pixels * (1 + 3 * sizeof(uint16_t)));
+    stage_begin(workspace, "sobel");
+    apply_sobel_filter_u16((uint16_t *) ping, (uint16_t *) pong, width, height, workspace->border);
+    stage_end(workspace, pixels * 2 * sizeof(uint16_t));
+    stage_begin(workspace, "thinning");
+    apply_edge_thinning_u16((uint16_t *) pong, (uint16_t *) ping, width, height, stats, workspace->border);
+    stage_end(workspace, pixels * 2 * sizeof(uint16_t));
+    stage_begin(workspace, "double_threshold");
+    float high_threshold, low_threshold;
+    workspace_thresholds(workspace, true, &high_threshold, &low_threshold);
+    apply_double_threshold_u16((uint16_t *) ping, pong, width, height, high_threshold, low_threshold);
+    stage_end(workspace, pixels * (sizeof(uint16_t) + 1));
+    // the labels go behind the threshold classes, rounded up to keep them aligned
+    uint32_t *labels = (uint32_t *) (pong + ((size_t) width * height + WORKSPACE_ALIGNMENT - 1) / WORKSPACE_ALIGNMENT * WORKSPACE_ALIGNMENT);
+    // the thinned magnitudes in ping still carry the sectors for the edge list
+    workspace_histeresis(workspace, nullptr, pong, labels, width, height, output, nullptr, (uint16_t *) ping);
+}
+
+// canny_run_regions runs crops of up to REGION_SLOT_SIZE both ways side by side, one per thread: they have too few
+// rows to keep every thread busy in each stage. Larger crops run one after another on the whole pool.
+#define REGION_SLOT_SIZE 256
+
+// the buffers one thread runs small crops with
+typedef struct {
+    canny_workspace *workspace;
+    uint8_t *map;       // the edges of the whole crop
+} region_slot;
+
+// Everything canny_run_incremental keeps of the previous frame, for frames of width x height
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    bool primed;        // holds a frame, the first one recomputes every tile
+    uint8_t *previous;  // the last frame, width * channels bytes per row
+    float *thinned;     // its thinned gradient
+    uint8_t *classes;   // its double threshold classes
+    uint8_t *map;       // its edges
+    uint8_t *marks;     // flood fill marks, all clear between runs
+    float *tile_max;    // the largest thinned gradient of every tile
+    uint8_t *tile_flags; // INCREMENTAL_TILE_DIRTY and INCREMENTAL_TILE_AFFECTED
+    uint32_t *affected; // the indices of the affected tiles
+    uint32_t *reach;    // 2 * reach_size tiles for tiles_within_reach
+    size_t reach_size;
+    gradient_stats stats; // of the whole thinned gradient, kept up to date tile by tile
+    float high_threshold;
+    float low_threshold;
+} incremental_state;
+
+struct canny_context {
+    canny_params params;
+    canny_workspace *workspace;
+    // canny_run_regions, all of it never shrunk
+    canny_rect *crops;
+    size_t *crop_of;    // the crop every rectangle went into
+    size_t regions_capacity;
+    uint8_t *region_map; // the edges of a large crop
+    size_t region_map_size;
+    region_slot *slots; // one per thread
+    int slot_count;
+    incremental_state *incremental; // nullptr until the first canny_run_incremental
+};
+
+canny_context *canny_context_create(uint32_t width_max, uint32_t height_max, const canny_params *params) {
+    if (params == nullptr || !(params->sigma > 0.0f)) return nullptr;
+    if (params->pipeline == CANNY_PIPELINE_FUSED && params->tile_size == 0) return nullptr;
+    if (params->channels != 1 && params->channels != 3 && params->channels != 4) return nullptr;
+    if (params->threshold != CANNY_THRESHOLD_RATIO && params->threshold != CANNY_THRESHOLD_PERCENTILE &&
+        params->threshold != CANNY_THRESHOLD_OTSU) return nullptr;
+    if (params->border != CANNY_BORDER_WRAP && params->border != CANNY_BORDER_CLAMP &&
+        params->border != CANNY_BORDER_MIRROR && params->border != CANNY_BORDER_CONSTANT) return nullptr;
+    if (params->threshold == CANNY_THRESHOLD_PERCENTILE && !(params->percentile > 0.0f && params->percentile < 1.0f)) {
+        return nullptr;
+    }
+    if (params->pipeline != CANNY_PIPELINE_FLOAT && params->pipeline != CANNY_PIPELINE_FUSED &&
+        params->pipeline != CANNY_PIPELINE_INTEGER) return nullptr;
+    // hysteresis labels are pixel indices with the top bit reserved
+    if (width_max == 0 || height_max == 0 || (uint64_t) width_max * height_max >= HYSTERESIS_STRONG_ROOT) return nullptr;
+
+    canny_context *context = calloc(1, sizeof(canny_context));
+    context->params = *params;
+    context->workspace = canny_workspace_create(width_max, height_max);
+    context->workspace->threshold = params->threshold;
+    context->workspace->percentile = params->percentile;
+    context->workspace->border = params->border;
+    if (params->profile) context->workspace->profiler = profiler_create();
+    return context;
+}
+
+static void incremental_free(canny_workspace *workspace, incremental_state *state, uint32_t channels);
+
+void canny_context_destroy(canny_context *context) {
+    if (context == nullptr) return;
+    if (context->incremental != nullptr) incremental_free(context->workspace, context->incremental, context->params.channels);
+    for (int t = 0; t < context->slot_count; t++) {
+        if (context->slots[t].workspace == nullptr) continue;
+        free(context->slots[t].map);
+        canny_workspace_destroy(context->slots[t].workspace);
+    }
+    free(context->slots);
+    free(context->crops);
+    free(context->crop_of);
+    free(context->region_map);
+    canny_workspace_destroy(context->workspace);
+    free(context);
+}
+
+// the checks every run makes on the image
+static canny_status check_image(const canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                                size_t in_stride) {
+    if (context == nullptr || in == nullptr || width == 0 || height == 0) return CANNY_ERROR_INVALID_ARGUMENT;
+    if (in_stride < (size_t) width * context->params.channels) return CANNY_ERROR_INVALID_ARGUMENT;
+    // the blur reaches at most one image size past the edge
+    int kernel_radius = gaussian_kernel_radius(context->params.sigma);
+    if (width <= (uint32_t) kernel_radius || height <= (uint32_t) kernel_radius) return CANNY_ERROR_INVALID_ARGUMENT;
+    if (width > context->workspace->max_width || height > context->workspace->max_height) return CANNY_ERROR_TOO_LARGE;
+    return CANNY_OK;
+}
+
+// The pipeline of params on workspace, with the tuned settings for its size. The caller's thread count and schedule
+// are put back afterwards.
+static void run_pipeline(const canny_params *params, canny_workspace *workspace, const uint8_t *in, uint32_t width,
+                         uint32_t height, size_t in_stride, canny_output *output) {
+    const tuning_bucket *tuning = tuning_find(params->tuning, params->pipeline, (uint64_t) width * height);
+    omp_settings caller = tuning_apply(workspace, tuning);
+
+    switch (params->pipeline) {
+        case CANNY_PIPELINE_FLOAT:
+            canny_workspace_run(workspace, in, in_stride, params->channels, width, height, params->sigma, output);
+            break;
+        case CANNY_PIPELINE_FUSED:
+            canny_workspace_run_fused(workspace, in, in_stride, params->channels, width, height, params->sigma,
+                                      tuning != nullptr && tuning->tile_size > 0 ? tuning->tile_size
+                                                                                 : params->tile_size, output);
+            break;
+        case CANNY_PIPELINE_INTEGER:
+            canny_workspace_run_integer(workspace, in, in_stride, params->channels, width, height, params->sigma,
+                                        output);
+            break;
+    }
+
+    tuning_restore(workspace, caller);
+}
+
+// canny_run, canny_run_packed and canny_run_edges once their output is checked
+static canny_status run(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height, size_t in_stride,
+                        canny_output *output) {
+    canny_status status = check_image(context, in, width, height, in_stride);
+    if (status != CANNY_OK) return status;
+
+    run_pipeline(&context->params, context->workspace, in, width, height, in_stride, output);
+    if (context->workspace->profiler != nullptr) profiler_count_run(context->workspace->profiler);
+    return output->count > output->capacity ? CANNY_ERROR_CAPACITY : CANNY_OK;
+}
+
+canny_status canny_run(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height, size_t in_stride,
+                       uint8_t *out, size_t out_stride) {
+    if (out == nullptr || out_stride < width) return CANNY_ERROR_INVALID_ARGUMENT;
+    canny_output output = {.map = out, .stride = out_stride};
+    return run(context, in, width, height, in_stride, &output);
+}
+
+canny_status canny_run_packed(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                              size_t in_stride, uint8_t *out, size_t out_stride) {
+    if (out == nullptr || out_stride < (width + (size_t) 7) / 8) return CANNY_ERROR_INVALID_ARGUMENT;
+    canny_output output = {.mask = out, .stride = out_stride};
+    return run(context, in, width, height, in_stride, &output);
+}
+
+canny_status canny_run_edges(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                             size_t in_stride, canny_edge *edges, uint8_t *directions, size_t capacity,
+                             size_t *count) {
+    if (count == nullptr || (edges == nullptr && capacity > 0)) return CANNY_ERROR_INVALID_ARGUMENT;
+    canny_output output = {.list = true, .edges = edges, .directions = directions, .capacity = capacity};
+    canny_status status = run(context, in, width, height, in_stride, &output);
+    *count = output.count;
+    return status;
+}
+
+static bool rects_overlap(canny_rect a, canny_rect b) {
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+static uint64_t rect_area(canny_rect rect) {
+    return (uint64_t) rect.width * rect.height;
+}
+
+static canny_rect rect_union(canny_rect a, canny_rect b) {
+    uint32_t x0 = a.x < b.x ? a.x : b.x;
+    uint32_t y0 = a.y < b.y ? a.y : b.y;
+    uint32_t x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    uint32_t y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (canny_rect) {.x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0};
+}
+
+// rect grown by halo on every side, clipped to the image
+static canny_rect rect_grow(canny_rect rect, uint32_t halo, uint32_t width, uint32_t height) {
+    uint32_t x0 = rect.x > halo ? rect.x - halo : 0;
+    uint32_t y0 = rect.y > halo ? rect.y - halo : 0;
+    uint32_t x1 = width - (rect.x + rect.width) > halo ? rect.x + rect.width + halo : width;
+    uint32_t y1 = height - (rect.y + rect.height) > halo ? rect.y + rect.height + halo : height;
+    return (canny_rect) {.x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0};
+}
+
+static bool crop_members_overlap(const canny_rect *rects, const size_t *crop_of, size_t count, size_t a, size_t b) {
+    for (size_t i = 0; i < count; i++) {
+        if (crop_of[i] != a) continue;
+        for (size_t j = 0; j < count; j++) {
+            if (crop_of[j] == b && rects_overlap(rects[i], rects[j])) return true;
+        }
+    }
+    return false;
+}
+
+// Every rectangle starts out with a crop of its own, grown by halo, then two crops merge into their bounding box
+// while their rectangles overlap, which would compute the shared pixels twice and write them from both crops, or
+// while the bounding box is no larger than the two crops together. Returns the number of crops, crop_of receives
+// the crop of every rectangle.
+static size_t merge_regions(const canny_rect *rects, size_t count, uint32_t halo, uint32_t width, uint32_t height,
+                            canny_rect *crops, size_t *crop_of) {
+    for (size_t i = 0; i < count; i++) {
+        crops[i] = rect_grow(rects[i], halo, width, height);
+        crop_of[i] = i;
+    }
+    // merged crops are left empty
+    for (bool merged = true; merged;) {
+        merged = false;
+        for (size_t a = 0; a < count; a++) {
+            for (size_t b = a + 1; b < count && crops[a].width > 0; b++) {
+                if (crops[b].width == 0) continue;
+                canny_rect both = rect_union(crops[a], crops[b]);
+                if (rect_area(both) > rect_area(crops[a]) + rect_area(crops[b]) &&
+                    !crop_members_overlap(rects, crop_of, count, a, b)) continue;
+                crops[a] = both;
+                crops[b].width = 0;
+                for (size_t i = 0; i < count; i++) {
+                    if (crop_of[i] == b) crop_of[i] = a;
+                }
+                merged = true;
+            }
+        }
+    }
+
+    size_t crop_count = 0;
+    for (size_t c = 0; c < count; c++) {
+        if (crops[c].width == 0) continue;
+        crops[crop_count] = crops[c];
+        for (size_t i = 0; i < count; i++) {
+            if (crop_of[i] == c) crop_of[i] = crop_count;
+        }
+        crop_count++;
+    }
+    return crop_count;
+}
+
+// Runs the pipeline over crop number index into map and copies the rectangles that went into it to out.
+static void run_crop(const canny_params *params, canny_workspace *workspace, uint8_t *map, const uint8_t *in,
+                     size_t in_stride, canny_rect crop, size_t index, const canny_rect *rects, const size_t *crop_of,
+                     size_t count, uint8_t *out, size_t out_stride) {
+    canny_output output = {.map = map, .stride = crop.width};
+    run_pipeline(params, workspace, in + crop.y * in_stride + (size_t) crop.x * params->channels, crop.width,
+                 crop.height, in_stride, &output);
+    for (size_t i = 0; i < count; i++) {
+        if (crop_of[i] != index) continue;
+        canny_rect rect = rects[i];
+        for (uint32_t y = 0; y < rect.height; y++) {
+            memcpy(out + (size_t) (rect.y + y) * out_stride + rect.x,
+                   map + (size_t) (rect.y - crop.y + y) * crop.width + (rect.x - crop.x), rect.width);
+        }
+    }
+}
+
+// The buffers canny_run_regions keeps between runs, the slots only for the thread count when they were made.
+static void prepare_regions(canny_context *context, size_t count, canny_border border) {
+    if (count > context->regions_capacity) {
+        free(context->crops);
+        free(context->crop_of);
+        context->crops = malloc(count * sizeof(canny_rect));
+        context->crop_of = malloc(count * sizeof(size_t));
+        context->regions_capacity = count;
+    }
+
+    int slot_count = omp_get_max_threads();
+    if (slot_count <= context->slot_count) return;
+    context->slots = realloc(context->slots, slot_count * sizeof(region_slot));
+    canny_workspace *workspace = context->workspace;
+    uint32_t slot_width = workspace->max_width < REGION_SLOT_SIZE ? workspace->max_width : REGION_SLOT_SIZE;
+    uint32_t slot_height = workspace->max_height < REGION_SLOT_SIZE ? workspace->max_height : REGION_SLOT_SIZE;
+    size_t pixels = (size_t) slot_width * slot_height;
+    for (int t = context->slot_count; t < slot_count; t++) {
+        region_slot *slot = &context->slots[t];
+        slot->workspace = canny_workspace_create(slot_width, slot_height);
+        slot->workspace->threshold = workspace->threshold;
+        slot->workspace->percentile = workspace->percentile;
+        slot->workspace->border = border;
+        slot->map = workspace_alloc(slot->workspace, pixels);
+    }
+    context->slot_count = slot_count;
+}
+
+canny_status canny_run_regions(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                               size_t in_stride, const canny_rect *rects, size_t count, uint8_t *out,
+                               size_t out_stride) {
+    canny_status status = check_image(context, in, width, height, in_stride);
+    if (status != CANNY_OK) return status;
+    if (out == nullptr || out_stride < width || (rects == nullptr && count > 0)) return CANNY_ERROR_INVALID_ARGUMENT;
+    for (size_t i = 0; i < count; i++) {
+        canny_rect rect = rects[i];
+        if (rect.width == 0 || rect.height == 0 || rect.x >= width || rect.y >= height ||
+            rect.width > width - rect.x || rect.height > height - rect.y) return CANNY_ERROR_INVALID_ARGUMENT;
+    }
+    if (count == 0) return CANNY_OK;
+
+    // a crop cannot reach the opposite edge of the image, so wrapping clamps instead
+    canny_border border = context->params.border == CANNY_BORDER_WRAP ? CANNY_BORDER_CLAMP : context->params.border;
+    prepare_regions(context, count, border);
+    // thinning reads the magnitude one pixel away, which sobel computes from the blur one pixel further out
+    uint32_t halo = (uint32_t) gaussian_kernel_radius(context->params.sigma) + 2;
+    canny_rect *crops = context->crops;
+    size_t *crop_of = context->crop_of;
+    size_t crop_count = merge_regions(rects, count, halo, width, height, crops, crop_of);
+
+    canny_workspace *workspace = context->workspace;
+    const canny_params *params = &context->params;
+    // the crops run with their own tuning, small_regions with the static schedule
+    omp_settings caller = tuning_apply(workspace, nullptr);
+    canny_border image_border = workspace->border;
+    workspace->border = border;
+    size_t small_count = 0;
+    for (size_t c = 0; c < crop_count; c++) {
+        canny_rect crop = crops[c];
+        if (crop.width <= REGION_SLOT_SIZE && crop.height <= REGION_SLOT_SIZE) {
+            small_count++;
+            continue;
+        }
+        if (rect_area(crop) > context->region_map_size) {
+            workspace_free(workspace, context->region_map, context->region_map_size);
+            context->region_map = workspace_alloc(workspace, rect_area(crop));
+            context->region_map_size = rect_area(crop);
+        }
+        run_crop(params, workspace, context->region_map, in, in_stride, crop, c, rects, crop_of, count, out,
+                 out_stride);
+    }
+    workspace->border = image_border;
+
+    if (small_count > 0) {
+        region_slot *slots = context->slots;
+        size_t pixels = 0;
+        for (size_t c = 0; c < crop_count; c++) {
+            if (crops[c].width <= REGION_SLOT_SIZE && crops[c].height <= REGION_SLOT_SIZE) pixels += rect_area(crops[c]);
+        }
+        stage_begin(workspace, "small_regions");
+#pragma omp parallel default(none) shared(params, slots, in, in_stride, crops, crop_count, rects, crop_of, count, out, out_stride)
+        {
+            // every small crop runs all its stages on the thread that took it
+            omp_set_num_threads(1);
+            region_slot *slot = &slots[omp_get_thread_num()];
+#pragma omp for schedule(dynamic)
+            for (size_t c = 0; c < crop_count; c++) {
+                if (crops[c].width > REGION_SLOT_SIZE || crops[c].height > REGION_SLOT_SIZE) continue;
+                run_crop(params, slot->workspace, slot->map, in, in_stride, crops[c], c, rects, crop_of, count, out,
+                         out_stride);
+            }
+        }
+        stage_end(workspace, pixels * (params->channels + 1));
+    }
+    tuning_restore(workspace, caller);
+    if (workspace->profiler != nullptr) profiler_count_run(workspace->profiler);
+    return CANNY_OK;
+}
+
+#define INCREMENTAL_TILE_DIRTY 1
+#define INCREMENTAL_TILE_AFFECTED 2
+#define INCREMENTAL_MARK_OLD 1
+#define INCREMENTAL_MARK_NEW 2
+
+static void incremental_free(canny_workspace *workspace, incremental_state *state, uint32_t channels) {
+    size_t pixels = (size_t) state->width * state->height;
+    size_t tiles = (size_t) state->tiles_x * state->tiles_y;
+    workspace_free(workspace, state->previous, pixels * channels);
+    workspace_free(workspace, state->thinned, pixels * sizeof(float));
+    workspace_free(workspace, state->classes, pixels);
+    workspace_free(workspace, state->map, pixels);
+    workspace_free(workspace, state->marks, pixels);
+    workspace_free(workspace, state->tile_max, tiles * sizeof(float));
+    workspace_free(workspace, state->tile_flags, tiles);
+    workspace_free(workspace, state->affected, tiles * sizeof(uint32_t));
+    workspace_free(workspace, state->reach, 2 * state->reach_size * sizeof(uint32_t));
+    free(state);
+}
+
+// the state for width x height frames in tiles of tile_size, which starts over whenever either changes
+static incremental_state *incremental_prepare(canny_context *context, uint32_t width, uint32_t height,
+                                              uint32_t tile_size, int halo) {
+    incremental_state *state = context->incremental;
+    if (state != nullptr && state->width == width && state->height == height && state->tile_size == tile_size) {
+        return state;
+    }
+
+    canny_workspace *workspace = context->workspace;
+    uint32_t channels = context->params.channels;
+    if (state != nullptr) incremental_free(workspace, state, channels);
+    state = calloc(1, sizeof(incremental_state));
+    state->width = width;
+    state->height = height;
+    state->tile_size = tile_size;
+    state->tiles_x = (width + tile_size - 1) / tile_size;
+    state->tiles_y = (height + tile_size - 1) / tile_size;
+    size_t pixels = (size_t) width * height;
+    size_t tiles = (size_t) state->tiles_x * state->tiles_y;
+    state->previous = workspace_alloc(workspace, pixels * channels);
+    // a zero gradient has nothing to take out of the histogram before the first frame goes in
+    state->thinned = workspace_alloc(workspace, pixels * sizeof(float));
+    memset(state->thinned, 0, pixels * sizeof(float));
+    state->classes = workspace_alloc(workspace, pixels);
+    state->map = workspace_alloc(workspace, pixels);
+    state->marks = workspace_alloc(workspace, pixels);
+    memset(state->marks, 0, pixels);
+    state->tile_max = workspace_alloc(workspace, tiles * sizeof(float));
+    state->tile_flags = workspace_alloc(workspace, tiles);
+    state->affected = workspace_alloc(workspace, tiles * sizeof(uint32_t));
+    state->reach_size = tile_size + 2 * (size_t) halo;
+    state->reach = workspace_alloc(workspace, 2 * state->reach_size * sizeof(uint32_t));
+    context->incremental = state;
+    return state;
+}
+
+static void incremental_tile(const incremental_state *state, uint32_t tile, uint32_t *x, uint32_t *y,
+                             uint32_t *tile_width, uint32_t *tile_height) {
+    *x = tile % state->tiles_x * state->tile_size;
+    *y = tile / state->tiles_x * state->tile_size;
+    *tile_width = *x + state->tile_size > state->width ? state->width - *x : state->tile_size;
+    *tile_height = *y + state->tile_size > state->height ? state->height - *y : state->tile_size;
+}
+
+// Marks the tiles where in differs from the previous frame and copies them over it, every tile of the first frame
+// is dirty. Equal rows are only read, most of them stop at the first word.
+static void incremental_diff(incremental_state *state, const uint8_t *in, size_t in_stride, uint32_t channels) {
+    uint32_t tiles = state->tiles_x * state->tiles_y;
+#pragma omp parallel for schedule(dynamic) default(none) shared(state, in, in_stride, channels, tiles)
+    for (uint32_t t = 0; t < tiles; t++) {
+        uint32_t x, y, tile_width, tile_height;
+        incremental_tile(state, t, &x, &y, &tile_width, &tile_height);
+        size_t row_bytes = (size_t) tile_width * channels;
+        bool dirty = !state->primed;
+        for (uint32_t row = y; row < y + tile_height; row++) {
+            const uint8_t *in_row = in + row * in_stride + (size_t) x * channels;
+            uint8_t *previous_row = state->previous + ((size_t) row * state->width + x) * channels;
+            if (dirty || memcmp(in_row, previous_row, row_bytes) != 0) {
+                dirty = true;
+                memcpy(previous_row, in_row, row_bytes);
+            }
+        }
+        state->tile_flags[t] = dirty ? INCREMENTAL_TILE_DIRTY : 0;
+    }
+}
+
+// The tiles along one axis that hold a pixel within halo of [begin, end), wrapped around or clipped to the image.
+// Returns how many went into tiles, leaving out repeats in a row.
+static uint32_t tiles_within_reach(int begin, int end, int halo, uint32_t size, uint32_t tile_size, bool wrap,
+                                   uint32_t *tiles) {
+    uint32_t count = 0;
+    for (int p = begin - halo; p < end + halo; p++) {
+        int q = wrap ? ((p % (int) size) + (int) size) % (int) size : p;
+        if (q < 0 || q >= (int) size) continue;
+        uint32_t tile = (uint32_t) q / tile_size;
+        if (count == 0 || tiles[count - 1] != tile) tiles[count++] = tile;
+    }
+    return count;
+}
+
+// Marks and lists every tile with a pixel within halo of a dirty one: the stencils of blur, sobel and thinning carry
+// a change that far. Returns how many there are.
+static size_t incremental_affected(incremental_state *state, int halo, bool wrap) {
+    uint32_t tiles = state->tiles_x * state->tiles_y;
+    uint32_t *columns = state->reach;
+    uint32_t *rows = state->reach + state->reach_size;
+    for (uint32_t t = 0; t < tiles; t++) {
+        if (!(state->tile_flags[t] & INCREMENTAL_TILE_DIRTY)) continue;
+        uint32_t x, y, tile_width, tile_height;
+        incremental_tile(state, t, &x, &y, &tile_width, &tile_height);
+        uint32_t column_count = tiles_within_reach((int) x, (int) (x + tile_width), halo, state->width,
+                                                   state->tile_size, wrap, columns);
+        uint32_t row_count = tiles_within_reach((int) y, (int) (y + tile_height), halo, state->height,
+                                                state->tile_size, wrap, rows);
+        for (uint32_t r = 0; r < row_count; r++) {
+            for (uint32_t c = 0; c < column_count; c++) {
+                state->tile_flags[rows[r] * state->tiles_x + columns[c]] |= INCREMENTAL_TILE_AFFECTED;
+            }
+        }
+    }
+
+    size_t count = 0;
+    for (uint32_t t = 0; t < tiles; t++) {
+        if (state->tile_flags[t] & INCREMENTAL_TILE_AFFECTED) state->affected[count++] = t;
+    }
+    return count;
+}
+
+// Reruns grayscale -> thinning for the affected tiles like the fused pipeline does for all of them, which gives the
+// same gradient as a run over the whole frame. The statistics move along: the old gradient of a tile leaves the
+// histogram before the new one goes in, collected per thread in deltas, and the tile's maximum is kept for the max.
+static void incremental_thin(incremental_state *state, canny_workspace *workspace, const uint8_t *in,
+                             size_t in_stride, uint32_t channels, float *scratch, size_t scratch_size,
+                             gradient_stats *deltas, size_t count) {
+    const simd_kernels *kernels = get_simd_kernels();
+    gradient_stats_reset(deltas, omp_get_max_threads());
+
+#pragma omp parallel for schedule(dynamic) default(none) shared(state, workspace, in, in_stride, channels, scratch, scratch_size, deltas, count, kernels)
+    for (size_t i = 0; i < count; i++) {
+        uint32_t t = state->affected[i];
+        uint32_t x, y, tile_width, tile_height;
+        incremental_tile(state, t, &x, &y, &tile_width, &tile_height);
+        gradient_stats *delta = deltas + omp_get_thread_num();
+        for (uint32_t row = y; row < y + tile_height; row++) {
+            gradient_stats_remove_row(delta, state->thinned + (size_t) row * state->width + x, tile_width);
+        }
+
+        fused_tile_scratch tile_scratch;
+        fused_tile_scratch_init(&tile_scratch, scratch + omp_get_thread_num() * scratch_size, state->tile_size,
+                                workspace->kernel_radius);
+        process_fused_tile(in, in_stride, channels, state->thinned, state->width, state->height, workspace->kernel,
+                           workspace->kernel_radius, x, y, tile_width, tile_height, kernels, &tile_scratch, nullptr,
+                           nullptr, workspace->border);
+
+        // the max of a delta means nothing, it only collects the one of this tile
+        delta->max = 0.0f;
+        for (uint32_t row = y; row < y + tile_height; row++) {
+            gradient_stats_add_row(delta, state->thinned + (size_t) row * state->width + x, tile_width);
+        }
+        state->tile_max[t] = delta->max;
+    }
+
+    state->stats.max = 0.0f;
+    for (uint32_t t = 0; t < state->tiles_x * state->tiles_y; t++) {
+        if (state->tile_max[t] > state->stats.max) state->stats.max = state->tile_max[t];
+    }
+    for (int thread = 0; thread < omp_get_max_threads(); thread++) {
+        for (uint32_t bin = 0; bin < GRADIENT_HISTOGRAM_BINS; bin++) {
+            state->stats.histogram[bin] += deltas[thread].histogram[bin];
+        }
+    }
+}
+
+static inline uint8_t threshold_class_u8(float value, float high_threshold, float low_threshold) {
+    return value > high_threshold ? STRONG_EDGE_PIXEL_U8 : value > low_threshold ? WEAK_EDGE_PIXEL_U8 : 0;
+}
+
+// Breadth first over the candidates connected to list[begin, count), which are marked already, like hysteresis
+// connects them. Every candidate reached gets mark and goes on the list, strong, unless nullptr, is set if any of them
+// is strong.
+// Returns the new count.
+static size_t incremental_flood(incremental_state *state, uint32_t *list, size_t begin, size_t count, uint8_t mark,
+                                bool wrap, bool *strong) {
+    int width = (int) state->width;
+    int height = (int) state->height;
+    for (size_t head = begin; head < count; head++) {
+        uint32_t i = list[head];
+        if (strong != nullptr && state->classes[i] == STRONG_EDGE_PIXEL_U8) *strong = true;
+        int x = (int) (i % state->width);
+        int y = (int) (i / state->width);
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int nx = x + dx;
+                int ny = y + dy;
+                if (wrap) {
+                    nx = border_wrap(nx, width);
+                    ny = border_wrap(ny, height);
+                } else if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+                    continue;
+                }
+                uint32_t neighbour = (uint32_t) ny * state->width + (uint32_t) nx;
+                if (state->classes[neighbour] == 0 || (state->marks[neighbour] & mark)) continue;
+                state->marks[neighbour] |= mark;
+                list[count++] = neighbour;
+            }
+        }
+    }
+    return count;
+}
+
+// Starts a flood from pixel i unless it is no candidate or already reached, and writes the edges of its component.
+static size_t incremental_component(incremental_state *state, uint32_t i, uint32_t *list, size_t count, bool wrap) {
+    if (state->classes[i] == 0 || (state->marks[i] & INCREMENTAL_MARK_NEW)) return count;
+    size_t begin = count;
+    state->marks[i] |= INCREMENTAL_MARK_NEW;
+    list[count++] = i;
+    bool strong = false;
+    count = incremental_flood(state, list, begin, count, INCREMENTAL_MARK_NEW, wrap, &strong);
+    for (size_t k = begin; k < count; k++) {
+        state->map[list[k]] = strong ? STRONG_EDGE_PIXEL_U8 : 0;
+    }
+    return count;
+}
+
+// Hysteresis for the candidates whose component may have changed, the ones connected to an affected tile before or
+// after its classes changed: any other component kept all of its classes and so its edges. Both lists hold up to
+// width * height pixels. The floods are serial, they only cover the affected tiles and the edges through them.
+static void incremental_histeresis(incremental_state *state, size_t affected_count, float high_threshold,
+                                   float low_threshold, bool wrap, uint32_t *old_list, uint32_t *new_list) {
+    size_t old_count = 0;
+    for (size_t a = 0; a < affected_count; a++) {
+        uint32_t x, y, tile_width, tile_height;
+        incremental_tile(state, state->affected[a], &x, &y, &tile_width, &tile_height);
+        for (uint32_t row = y; row < y + tile_height; row++) {
+            for (uint32_t i = row * state->width + x; i < row * state->width + x + tile_width; i++) {
+                if (state->classes[i] == 0 || (state->marks[i] & INCREMENTAL_MARK_OLD)) continue;
+                state->marks[i] |= INCREMENTAL_MARK_OLD;
+                old_list[old_count++] = i;
+            }
+        }
+    }
+    old_count = incremental_flood(state, old_list, 0, old_count, INCREMENTAL_MARK_OLD, wrap, nullptr);
+
+    for (size_t a = 0; a < affected_count; a++) {
+        uint32_t x, y, tile_width, tile_height;
+        incremental_tile(state, state->affected[a], &x, &y, &tile_width, &tile_height);
+        for (uint32_t row = y; row < y + tile_height; row++) {
+            for (uint32_t i = row * state->width + x; i < row * state->width + x + tile_width; i++) {
+                state->classes[i] = threshold_class_u8(state->thinned[i], high_threshold, low_threshold);
+                state->map[i] = 0;
+            }
+        }
+    }
+
+    // every old candidate outside the affected tiles still is one and gets its edge from its new component
+    size_t new_count = 0;
+    for (size_t a = 0; a < affected_count; a++) {
+        uint32_t x, y, tile_width, tile_height;
+        incremental_tile(state, state->affected[a], &x, &y, &tile_width, &tile_height);
+        for (uint32_t row = y; row < y + tile_height; row++) {
+            for (uint32_t i = row * state->width + x; i < row * state->width + x + tile_width; i++) {
+                new_count = incremental_component(state, i, new_list, new_count, wrap);
+            }
+        }
+    }
+    for (size_t k = 0; k < old_count; k++) {
+        new_count = incremental_component(state, old_list[k], new_list, new_count, wrap);
+    }
+
+    for (size_t k = 0; k < old_count; k++) state->marks[old_list[k]] = 0;
+    for (size_t k = 0; k < new_count; k++) state->marks[new_list[k]] = 0;
+}
+
+canny_status canny_run_incremental(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                                   size_t in_stride, uint8_t *out, size_t out_stride, float *recomputed) {
+    canny_status status = check_image(context, in, width, height, in_stride);
+    if (status != CANNY_OK) return status;
+    if (out == nullptr || out_stride < width) return CANNY_ERROR_INVALID_ARGUMENT;
+    // the integer stages only run over whole images, there is nothing to rerun a tile with
+    if (context->params.pipeline == CANNY_PIPELINE_INTEGER) return CANNY_ERROR_INVALID_ARGUMENT;
+
+    canny_workspace *workspace = context->workspace;
+    const canny_params *params = &context->params;
+    uint32_t channels = params->channels;
+    size_t pixels = (size_t) width * height;
+    bool wrap = workspace->border == CANNY_BORDER_WRAP;
+    // the tuned settings for the size like run_pipeline takes them, before the scratch is made for the thread count
+    const tuning_bucket *tuning = tuning_find(params->tuning, params->pipeline, pixels);
+    omp_settings caller = tuning_apply(workspace, tuning);
+    stage_begin(workspace, "setup");
+    workspace_prepare_kernel(workspace, params->sigma);
+    // only the fused pipeline has to come with a tile size
+    uint32_t tile_size = tuning != nullptr && tuning->tile_size > 0 ? tuning->tile_size
+                         : params->tile_size != 0 ? params->tile_size : CANNY_DEFAULT_TILE_SIZE;
+    int halo = workspace->kernel_radius + 2;
+    size_t scratch_size = fused_tile_scratch_size(tile_size, workspace->kernel_radius);
+    float *scratch = workspace_prepare_scratch(workspace, scratch_size);
+    gradient_stats *deltas = workspace_prepare_stats(workspace);
+    incremental_state *state = incremental_prepare(context, width, height, tile_size, halo);
+    stage_end(workspace, 0);
+
+    stage_begin(workspace, "diff");
+    incremental_diff(state, in, in_stride, channels);
+    size_t affected_count = incremental_affected(state, halo, wrap);
+    stage_end(workspace, pixels * channels * 2);
+
+    size_t affected_pixels = 0;
+    for (size_t a = 0; a < affected_count; a++) {
+        uint32_t x, y, tile_width, tile_height;
+        incremental_tile(state, state->affected[a], &x, &y, &tile_width, &tile_height);
+        affected_pixels += (size_t) tile_width * tile_height;
+    }
+    stage_begin(workspace, "fused_tiles");
+    incremental_thin(state, workspace, in, in_stride, channels, scratch, scratch_size, deltas, affected_count);
+    stage_end(workspace, affected_pixels * (channels + 2 * sizeof(float)));
+
+    // A new threshold can flip candidates anywhere, and beyond half the tiles the floods cost more than
+    // hysteresis over the whole frame.
+    float high_threshold, low_threshold;
+    gradient_stats_thresholds(&state->stats, 1, false, workspace->threshold, workspace->percentile, &high_threshold,
+                              &low_threshold);
+    bool whole_frame = !state->primed || high_threshold != state->high_threshold ||
+                       low_threshold != state->low_threshold || affected_count * 2 > (size_t) state->tiles_x * state->tiles_y;
+    if (whole_frame) {
+        stage_begin(workspace, "double_threshold");
+        const float *thinned = state->thinned;
+        uint8_t *classes = state->classes;
+#pragma omp parallel for schedule(runtime) default(none) shared(thinned, classes, pixels, high_threshold, low_threshold)
+        for (size_t i = 0; i < pixels; i++) {
+            classes[i] = threshold_class_u8(thinned[i], high_threshold, low_threshold);
+        }
+        stage_end(workspace, pixels * (sizeof(float) + 1));
+        stage_begin(workspace, "hysteresis");
+        canny_output output = {.map = state->map, .stride = width};
+        connected_histeresis(nullptr, state->classes, nullptr, &output, (uint32_t *) workspace->ping, width, height,
+                             wrap, wrap);
+        stage_end(workspace, pixels * (2 + 3 * sizeof(uint32_t)));
+    } else if (affected_count > 0) {
+        stage_begin(workspace, "hysteresis");
+        incremental_histeresis(state, affected_count, high_threshold, low_threshold, wrap, (uint32_t *) workspace->ping,
+                               (uint32_t *) workspace->pong);
+        stage_end(workspace, affected_pixels * (sizeof(float) + 2));
+    }
+    state->primed = true;
+    state->high_threshold = high_threshold;
+    state->low_threshold = low_threshold;
+
+    stage_begin(workspace, "copy_through");
+    const uint8_t *map = state->map;
+#pragma omp parallel for schedule(runtime) default(none) shared(map, out, out_stride, width, height)
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(out + y * out_stride, map + (size_t) y * width, width);
+    }
+    stage_end(workspace, 2 * pixels);
+
+    tuning_restore(workspace, caller);
+    if (recomputed != nullptr) *recomputed = (float) affected_pixels / (float) pixels;
+    if (workspace->profiler != nullptr) profiler_count_run(workspace->profiler);
+    return CANNY_OK;
+}
+
+size_t canny_context_peak_bytes(const canny_context *context) {
+    size_t bytes = canny_workspace_peak_bytes(context->workspace);
+    for (int t = 0; t < context->slot_count; t++) {
+        bytes += canny_workspace_peak_bytes(context->slots[t].workspace);
+    }
+    return bytes;
+}
+
+bool canny_context_write_profile(const canny_context *context, FILE *file) {
+    if (context->workspace->profiler == nullptr) return false;
+    profiler_write_json(context->workspace->profiler, file);
+    return true;
+}
+
+const char *canny_status_text(canny_status status) {
+    switch (status) {
+        case CANNY_OK:
+            return "no error";
+        case CANNY_ERROR_INVALID_ARGUMENT:
+            return "invalid argument";
+        case CANNY_ERROR_TOO_LARGE:
+            return "image is larger than the context";
+        case CANNY_ERROR_IO:
+            return "stream read or write failed";
+        case CANNY_ERROR_CAPACITY:
+            return "more edges than fit";
+    }
+    return "unknown error";
+}
+
+// Streaming goes through the image in strips of STREAM_STRIP_ROWS rows and reads the input twice.
+// The threshold depends on the largest gradient of the whole image, which the first pass finds with
+// grayscale -> blur -> sobel alone: thinning always keeps the largest magnitude, so it cannot change the maximum.
+// The first pass also keeps the horizontal blur of the first and the last edge_rows rows, so in the second pass
+// the rows above the top and below the bottom wrap around exactly like they do in the in-memory stages.
+// Everything up to the double threshold is bit identical to the float pipeline, hysteresis runs over every strip
+// with STREAM_HYSTERESIS_MARGIN rows of context above and below it.
+#define STREAM_STRIP_ROWS 64
+#define STREAM_HYSTERESIS_MARGIN 32
+static_assert(STREAM_HYSTERESIS_MARGIN <= STREAM_STRIP_ROWS, "the margins come from the neighbouring strips");
+
+typedef struct {
+    const canny_stream_io *io;
+    uint32_t width;
+    uint32_t height;
+    float *kernel;
+    int kernel_radius;
+    const simd_kernels *kernels;
+    uint32_t edge_rows;  // 2 * kernel_radius + 4, enough for the strips next to the top and the bottom
+    uint32_t ring_rows;  // STREAM_STRIP_ROWS + 2 * kernel_radius + 4, every row one strip needs
+    float *head;         // horizontal blur of rows [0, edge_rows)
+    float *tail;         // horizontal blur of rows [height - edge_rows, height)
+    float *ring;         // horizontal blur of the rows in between, row y lives at y % ring_rows
+    uint32_t rows_read;
+    uint32_t channels;
+    uint8_t *input;      // STREAM_STRIP_ROWS rows of width * channels bytes
+    float *line_buffers; // per thread
+    float *blurred;      // STREAM_STRIP_ROWS + 4 rows
+    float *magnitude;    // STREAM_STRIP_ROWS + 2 rows
+    float *orientation;  // STREAM_STRIP_ROWS + 2 rows
+    float *thinned;      // STREAM_STRIP_ROWS rows
+    uint8_t *classes;    // the previous, the current and the next strip
+    uint8_t *edges;      // hysteresis of the current strip with its margins
+    uint32_t *labels;
+    size_t bytes;
+} canny_stream_state;
+
+static void *stream_alloc(canny_stream_state *stream, size_t bytes) {
+    void *buffer = calloc(1, bytes);
+    assert(buffer != nullptr);
+    stream->bytes += bytes;
+    return buffer;
+}
+
+// horizontal blur of row y, which may lie up to edge_rows outside of the image
+static float *stream_blur_row(const canny_stream_state *stream, int y) {
+    int height = (int) stream->height;
+    int edge_rows = (int) stream->edge_rows;
+    if (y < 0) y += height;
+    else if (y >= height) y -= height;
+
+    if (y < edge_rows) return stream->head + (size_t) y * stream->width;
+    if (y >= height - edge_rows) return stream->tail + (size_t) (y - (height - edge_rows)) * stream->width;
+    return stream->ring + (size_t) (y % stream->ring_rows) * stream->width;
+}
+
+// Reads rows until the ones before until are available, converts them to grayscale and blurs them horizontally.
+// The second pass reads the first and the last edge_rows rows again, but already has them.
+static bool stream_read_rows(canny_stream_state *stream, uint32_t until, bool first_pass) {
+    uint32_t width = stream->width;
+    uint32_t height = stream->height;
+    int kernel_radius = stream->kernel_radius;
+
+    while (stream->rows_read < until) {
+        uint32_t first = stream->rows_read;
+        uint32_t count = until - first < STREAM_STRIP_ROWS ? until - first : STREAM_STRIP_ROWS;
+        if (!stream->io->read_rows(stream->io->user, stream->input, count)) return false;
+
+#pragma omp parallel default(none) shared(stream, first, count, first_pass, width, height, kernel_radius)
+        {
+            float *line = stream->line_buffers + (size_t) omp_get_thread_num() * (width + 2 * kernel_radius);
+
+#pragma omp for
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t y = first + i;
+                if (!first_pass && (y < stream->edge_rows || y >= height - stream->edge_rows)) continue;
+
+                uint32_t channels = stream->channels;
+                const uint8_t *pixel = stream->input + (size_t) i * width * channels;
+                for (uint32_t x = 0; x < width; x++, pixel += channels) {
+                    line[x + kernel_radius] = 0.2126f * ((float) pixel[0] / 255.0f) +
+                                              0.7152f * ((float) pixel[GREEN_OFFSET(channels)] / 255.0f) +
+                                              0.0722f * ((float) pixel[BLUE_OFFSET(channels)] / 255.0f);
+                }
+                apply_gaussian_filter_line(line, stream_blur_row(stream, (int) y), width,
+                                           stream->kernel, kernel_radius, CANNY_BORDER_WRAP);
+            }
+        }
+        stream->rows_read += count;
+    }
+    return true;
+}
+
+// sobel of rows [y0, y1) into the first y1 - y0 rows of magnitude and orientation, needs blurred rows [y0 - 1, y1 + 1)
+static void stream_gradient(canny_stream_state *stream, int y0, int y1) {
+    uint32_t width = stream->width;
+    int kernel_radius = stream->kernel_radius;
+    int blurred_rows = y1 - y0 + 2;
+
+#pragma omp parallel for default(none) shared(stream, y0, blurred_rows, width, kernel_radius)
+    for (int i = 0; i < blurred_rows; i++) {
+        float *out_row = stream->blurred + (size_t) i * width;
+        memset(out_row, 0, width * sizeof(float));
+
+        for (int k = -kernel_radius; k <= kernel_radius; k++) {
+            const float *in_row = stream_blur_row(stream, y0 - 1 + i + k);
+            float weight = stream->kernel[k + kernel_radius];
+            for (uint32_t x = 0; x < width; x++) {
+                out_row[x] += in_row[x] * weight;
+            }
+        }
+    }
+
+#pragma omp parallel for default(none) shared(stream, y0, y1, width)
+    for (int i = 0; i < y1 - y0; i++) {
+        const float *blurred_row = stream->blurred + (size_t) (i + 1) * width;
+        apply_sobel_filter_row(blurred_row - width, blurred_row, blurred_row + width,
+                               stream->magnitude + (size_t) i * width, stream->orientation + (size_t) i * width,
+                               width, stream->kernels, apply_sobel_filter_pixel_wrap);
+    }
+}
+
+static void stream_shift_classes(canny_stream_state *stream) {
+    size_t strip_bytes = (size_t) STREAM_STRIP_ROWS * stream->width;
+    memmove(stream->classes, stream->classes + strip_bytes, 2 * strip_bytes);
+    memset(stream->classes + 2 * strip_bytes, 0, strip_bytes);
+}
+
+// Hysteresis over the strip in the middle third of the classes, then on to the next strip.
+// Rows outside of the image are left empty, so they never connect anything.
+static bool stream_emit_strip(canny_stream_state *stream, uint32_t rows) {
+    uint32_t width = stream->width;
+    uint32_t window_rows = STREAM_STRIP_ROWS + 2 * STREAM_HYSTERESIS_MARGIN;
+    const uint8_t *window = stream->classes + (size_t) (STREAM_STRIP_ROWS - STREAM_HYSTERESIS_MARGIN) * width;
+
+    canny_output output = {.map = stream->edges, .stride = width};
+    connected_histeresis(nullptr, window, nullptr, &output, stream->labels, width, window_rows, true, false);
+    if (!stream->io->write_rows(stream->io->user, stream->edges + (size_t) STREAM_HYSTERESIS_MARGIN * width, rows)) {
+        return false;
+    }
+    stream_shift_classes(stream);
+    return true;
+}
+
+static float stream_max_magnitude(canny_stream_state *stream, int y0, int y1, float high) {
+    stream_gradient(stream, y0, y1);
+
+    size_t count = (size_t) (y1 - y0) * stream->width;
+    const float *magnitude = stream->magnitude;
+#pragma omp parallel for default(none) reduction(max:high) shared(magnitude, count)
+    for (size_t i = 0; i < count; i++) {
+        if (magnitude[i] > high) high = magnitude[i];
+    }
+    return high;
+}
+
+// the largest gradient, the rows at the top need the bottom of the image so they come last
+static bool stream_first_pass(canny_stream_state *stream, float *high) {
+    int height = (int) stream->height;
+    int top_rows = stream->kernel_radius + 1;
+
+    *high = FLT_MIN;
+    for (int y0 = top_rows; y0 < height; y0 += STREAM_STRIP_ROWS) {
+        int y1 = y0 + STREAM_STRIP_ROWS < height ? y0 + STREAM_STRIP_ROWS : height;
+        int until = y1 + stream->kernel_radius + 1;
+        if (!stream_read_rows(stream, until < height ? until : height, true)) return false;
+        *high = stream_max_magnitude(stream, y0, y1, *high);
+    }
+    for (int y0 = 0; y0 < top_rows; y0 += STREAM_STRIP_ROWS) {
+        *high = stream_max_magnitude(stream, y0, y0 + STREAM_STRIP_ROWS < top_rows ? y0 + STREAM_STRIP_ROWS : top_rows,
+                                     *high);
+    }
+    return true;
+}
+
+// thinning, double threshold and hysteresis strip by strip, every strip is written once the next one is classified
+static bool stream_second_pass(canny_stream_state *stream, float high) {
+    uint32_t width = stream->width;
+    uint32_t height = stream->height;
+    float high_threshold = high * HIGH_THRESHOLD_RATIO;
+    float low_threshold = high_threshold * LOW_THRESHOLD_RATIO;
+
+    if (!stream->io->rewind(stream->io->user)) return false;
+    stream->rows_read = 0;
+
+    uint32_t previous_rows = 0;
+    for (uint32_t y0 = 0; y0 < height; y0 += STREAM_STRIP_ROWS) {
+        uint32_t y1 = y0 + STREAM_STRIP_ROWS < height ? y0 + STREAM_STRIP_ROWS : height;
+        uint32_t until = y1 + stream->kernel_radius + 2;
+        if (!stream_read_rows(stream, until < height ? until : height, false)) return false;
+        // the gradient of rows [y0 - 1, y1 + 1), so row y sits at y - y0 + 1
+        stream_gradient(stream, (int) y0 - 1, (int) y1 + 1);
+
+        uint8_t *classes = stream->classes + (size_t) 2 * STREAM_STRIP_ROWS * width;
+#pragma omp parallel for default(none) shared(stream, classes, y0, y1, width, high_threshold, low_threshold)
+        for (uint32_t i = 0; i < y1 - y0; i++) {
+            const float *magnitude_row = stream->magnitude + (size_t) (i + 1) * width;
+            float *thinned_row = stream->thinned + (size_t) i * width;
+            apply_edge_thinning_row(magnitude_row - width, magnitude_row, magnitude_row + width,
+                                    stream->orientation + (size_t) (i + 1) * width, thinned_row, width,
+                                    stream->kernels, apply_edge_thinning_pixel_wrap);
+
+            for (uint32_t x = 0; x < width; x++) {
+                if (thinned_row[x] > high_threshold) {
+                    classes[(size_t) i * width + x] = STRONG_EDGE_PIXEL_U8;
+                } else if (thinned_row[x] > low_threshold) {
+                    classes[(size_t) i * width + x] = WEAK_EDGE_PIXEL_U8;
+                } else {
+                    classes[(size_t) i * width + x] = 0;
+                }
+            }
+        }
+
+        if (previous_rows == 0) {
+            stream_shift_classes(stream);
+        } else if (!stream_emit_strip(stream, previous_rows)) {
+            return false;
+        }
+        previous_rows = y1 - y0;
+    }
+    return stream_emit_strip(stream, previous_rows);
+}
+
+// small images go through the regular pipeline, the strips would overlap the rows kept at the top and the bottom
+static canny_status stream_in_memory(uint32_t width, uint32_t height, const canny_params *params,
+                                     const canny_stream_io *io, size_t *bytes) {
+    canny_context *context = canny_context_create(width, height, params);
+    if (context == nullptr) return CANNY_ERROR_INVALID_ARGUMENT;
+
+    uint8_t *image = malloc((size_t) width * height * params->channels);
+    uint8_t *edges = malloc((size_t) width * height);
+    canny_status status = CANNY_ERROR_IO;
+    if (io->read_rows(io->user, image, height)) {
+        status = canny_run(context, image, width, height, (size_t) width * params->channels, edges, width);
+        if (status == CANNY_OK && !io->write_rows(io->user, edges, height)) status = CANNY_ERROR_IO;
+    }
+    if (bytes != nullptr) *bytes = canny_context_peak_bytes(context) + (size_t) width * height * 4;
+
+    free(edges);
+    free(image);
+    canny_context_destroy(context);
+    return status;
+}
+
+canny_status canny_stream(uint32_t width, uint32_t height, const canny_params *params, const canny_stream_io *io,
+                          size_t *bytes) {
+    if (params == nullptr || io == nullptr || width == 0 || height == 0 || !(params->sigma > 0.0f)) {
+        return CANNY_ERROR_INVALID_ARGUMENT;
+    }
+    if (params->pipeline == CANNY_PIPELINE_INTEGER || params->threshold != CANNY_THRESHOLD_RATIO ||
+        params->border != CANNY_BORDER_WRAP) {
+        return CANNY_ERROR_INVALID_ARGUMENT;
+    }
+    if (params->channels != 1 && params->channels != 3 && params->channels != 4) return CANNY_ERROR_INVALID_ARGUMENT;
+    if ((uint64_t) width * (STREAM_STRIP_ROWS + 2 * STREAM_HYSTERESIS_MARGIN) >= HYSTERESIS_STRONG_ROOT) {
+        return CANNY_ERROR_TOO_LARGE;
+    }
+
+    canny_stream_state stream = {
+            .io = io, .width = width, .height = height, .channels = params->channels, .kernels = get_simd_kernels()
+    };
+    stream.kernel = create_gaussian_kernel(params->sigma, &stream.kernel_radius);
+    stream.edge_rows = 2 * stream.kernel_radius + 4;
+    if (height < 2 * stream.edge_rows) {
+        free(stream.kernel);
+        return stream_in_memory(width, height, params, io, bytes);
+    }
+
+    stream.ring_rows = STREAM_STRIP_ROWS + 2 * stream.kernel_radius + 4;
+    size_t row_bytes = (size_t) width * sizeof(float);
+    stream.head = stream_alloc(&stream, stream.edge_rows * row_bytes);
+    stream.tail = stream_alloc(&stream, stream.edge_rows * row_bytes);
+    stream.ring = stream_alloc(&stream, stream.ring_rows * row_bytes);
+    stream.input = stream_alloc(&stream, (size_t) STREAM_STRIP_ROWS * width * params->channels);
+    stream.line_buffers = stream_alloc(&stream, omp_get_max_threads() * (width + 2 * stream.kernel_radius) * sizeof(float));
+    stream.blurred = stream_alloc(&stream, (STREAM_STRIP_ROWS + 4) * row_bytes);
+    stream.magnitude = stream_alloc(&stream, (STREAM_STRIP_ROWS + 2) * row_bytes);
+    stream.orientation = stream_alloc(&stream, (STREAM_STRIP_ROWS + 2) * row_bytes);
+    stream.thinned = stream_alloc(&stream, STREAM_STRIP_ROWS * row_bytes);
+    stream.classes = stream_alloc(&stream, (size_t) 3 * STREAM_STRIP_ROWS * width);
+    stream.edges = stream_alloc(&stream, (size_t) (STREAM_STRIP_ROWS + 2 * STREAM_HYSTERESIS_MARGIN) * width);
+    stream.labels = stream_alloc(&stream, (size_t) (STREAM_STRIP_ROWS + 2 * STREAM_HYSTERESIS_MARGIN) * width *
+                                          sizeof(uint32_t));
+    if (bytes != nullptr) *bytes = stream.bytes;
+
+    float high;
+    canny_status status = CANNY_ERROR_IO;
+    if (stream_first_pass(&stream, &high) && stream_second_pass(&stream, high)) status = CANNY_OK;
+
+    free(stream.kernel);
+    free(stream.head);
+    free(stream.tail);
+    free(stream.ring);
+    free(stream.input);
+    free(stream.line_buffers);
+    free(stream.blurred);
+    free(stream.magnitude);
+    free(stream.orientation);
+    free(stream.thinned);
+    free(stream.classes);
+    free(stream.edges);
+    free(stream.labels);
+    return status;
+}
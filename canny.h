@@ -0,0 +1,209 @@
+#ifndef EDGE_DETECTION_CANNY_H
+#define EDGE_DETECTION_CANNY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CANNY_DEFAULT_SIGMA 1.0f
+// 64x64 tiles keep the whole per-tile working set (~90 KiB for sigma = 1.0) inside a typical L2
+#define CANNY_DEFAULT_TILE_SIZE 64
+
+typedef enum {
+    CANNY_PIPELINE_FLOAT,   // one stage after another over float buffers
+    CANNY_PIPELINE_FUSED,   // grayscale -> thinning fused over cache sized tiles, then the float threshold stages
+    CANNY_PIPELINE_INTEGER, // compact fixed point intermediates, not bit identical to the float pipelines
+} canny_pipeline;
+
+// How the double threshold is chosen. Every mode works on the thinned gradient, whose maximum and histogram the
+// thinning stage collects on the side, so none of them reads the image again.
+typedef enum {
+    CANNY_THRESHOLD_RATIO,      // fixed fractions of the largest gradient
+    CANNY_THRESHOLD_PERCENTILE, // the strongest (1 - percentile) of the thinned edge candidates are strong edges
+    CANNY_THRESHOLD_OTSU,       // Otsu's split of the thinned edge candidates into strong and weak ones
+} canny_threshold;
+
+#define CANNY_DEFAULT_PERCENTILE 0.8f
+
+// What the blur, sobel and thinning stencils read past the edge of the image.
+typedef enum {
+    CANNY_BORDER_WRAP,     // the opposite edge, hysteresis also follows edges across it
+    CANNY_BORDER_CLAMP,    // the nearest edge pixel
+    CANNY_BORDER_MIRROR,   // the image mirrored at its edge, like the mirrored repeat sampler of compute.cl
+    CANNY_BORDER_CONSTANT, // zero
+} canny_border;
+
+// The settings canny_tune measured on this machine, see there.
+typedef struct canny_tuning canny_tuning;
+
+typedef struct {
+    float sigma;
+    canny_pipeline pipeline;
+    uint32_t tile_size; // only used by CANNY_PIPELINE_FUSED
+    uint32_t channels;  // bytes per input pixel: 1 (grey), 3 (RGB) or 4 (RGBA, the alpha is ignored)
+    bool profile;       // record every stage of every run, see canny_context_write_profile
+    canny_threshold threshold;
+    float percentile;   // only used by CANNY_THRESHOLD_PERCENTILE, between 0 and 1
+    canny_border border;
+    // nullptr runs every stage with a static schedule on all threads, otherwise it has to outlive the contexts
+    const canny_tuning *tuning;
+} canny_params;
+
+#define CANNY_DEFAULT_PARAMS ((canny_params) { \
+        .sigma = CANNY_DEFAULT_SIGMA, .pipeline = CANNY_PIPELINE_FLOAT, .tile_size = CANNY_DEFAULT_TILE_SIZE, \
+        .channels = 3, .threshold = CANNY_THRESHOLD_RATIO, .percentile = CANNY_DEFAULT_PERCENTILE, \
+        .border = CANNY_BORDER_WRAP})
+
+typedef enum {
+    CANNY_OK = 0,
+    CANNY_ERROR_INVALID_ARGUMENT,
+    CANNY_ERROR_TOO_LARGE, // the image is larger than the context was created for
+    CANNY_ERROR_IO,        // a canny_stream_io callback failed
+    CANNY_ERROR_CAPACITY,  // canny_run_edges found more edges than fit, the count tells how many
+} canny_status;
+
+// An edge pixel of canny_run_edges.
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+} canny_edge;
+
+// The gradient direction across an edge, rounded to 45 degrees like thinning does, with y pointing up.
+typedef enum {
+    CANNY_DIRECTION_0,   // along x, the edge runs vertically
+    CANNY_DIRECTION_45,  // towards the top right or the bottom left
+    CANNY_DIRECTION_90,  // along y, the edge runs horizontally
+    CANNY_DIRECTION_135, // towards the top left or the bottom right
+} canny_direction;
+
+// A rectangle of an image, x and y are its top left corner.
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} canny_rect;
+
+// Every buffer a run needs, sized for images up to width_max x height_max.
+// A context is not thread safe, use one per thread; the stages themselves run on the OpenMP thread pool.
+typedef struct canny_context canny_context;
+
+// returns nullptr if the parameters or the dimensions are invalid
+canny_context *canny_context_create(uint32_t width_max, uint32_t height_max, const canny_params *params);
+
+void canny_context_destroy(canny_context *context);
+
+// Detects the edges of a width x height image, which has to be larger than the blur radius (2 * sigma) both ways.
+// in is params->channels bytes per pixel with rows in_stride bytes apart, out gets 0 or 255 per pixel with rows
+// out_stride bytes apart. Both buffers belong to the caller and are used in place, nothing is allocated after the
+// first run with a given thread count.
+canny_status canny_run(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height, size_t in_stride,
+                       uint8_t *out, size_t out_stride);
+
+// Like canny_run, but out gets one bit per pixel, set for edges, with the leftmost pixel in the most significant bit
+// and rows out_stride >= (width + 7) / 8 bytes apart. That is the raster of a binary PBM (P4).
+canny_status canny_run_packed(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                              size_t in_stride, uint8_t *out, size_t out_stride);
+
+// Like canny_run, but lists the edge pixels row by row instead of writing a map. The first capacity of them go into
+// edges and, unless directions is nullptr, their canny_direction into directions. count receives the number of
+// edges, which is more than capacity when the run returns CANNY_ERROR_CAPACITY.
+canny_status canny_run_edges(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                             size_t in_stride, canny_edge *edges, uint8_t *directions, size_t capacity,
+                             size_t *count);
+
+// Like canny_run, but only writes the pixels inside count rectangles of out, at a cost that follows their area rather
+// than the image size. Every rectangle runs on a crop grown by the reach of the blur, sobel and thinning stencils, so
+// those stages match a whole image run inside it, while the threshold comes from the crop's gradients alone and
+// hysteresis only follows edges within the crop. Crops merge when their rectangles overlap or when their bounding box
+// is no larger than both together. Small crops run side by side, one per thread. At the edge of the image the crops
+// see params->border, except CANNY_BORDER_WRAP, which clamps since a crop cannot reach the opposite edge.
+canny_status canny_run_regions(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                               size_t in_stride, const canny_rect *rects, size_t count, uint8_t *out,
+                               size_t out_stride);
+
+// Like canny_run, for a sequence of frames that mostly stay the same, e.g. from a fixed camera. The context keeps the
+// previous frame with its thinned gradient and edges, compares every frame against it tile by tile (params->tile_size
+// or CANNY_DEFAULT_TILE_SIZE) and reruns grayscale -> thinning only for the tiles within reach of a change. Hysteresis
+// only follows the edges through those tiles, unless the threshold moved, and everything else is copied through.
+// The edges are identical to a canny_run of the same frame. Apart from comparing and copying the frame, the cost
+// follows the changed area and the edges connected to it. A frame of another size starts over. recomputed, unless
+// nullptr, receives the share of the frame whose tiles were recomputed.
+// Returns CANNY_ERROR_INVALID_ARGUMENT for CANNY_PIPELINE_INTEGER, whose stages only run over whole images.
+canny_status canny_run_incremental(canny_context *context, const uint8_t *in, uint32_t width, uint32_t height,
+                                   size_t in_stride, uint8_t *out, size_t out_stride, float *recomputed);
+
+// Tuning profiles hold, for every pipeline and a few image sizes, the thread count, the OpenMP schedule and chunk of
+// every stage loop and the tile size that ran fastest on this machine. A run with params->tuning takes the settings
+// measured at the size closest to its image, in pixels, and otherwise keeps params->tile_size and all threads.
+// The edges are the same with any of them.
+//
+// A profile is a text file with one setting per line:
+//     cpu <float|fused|integer> <pixels> threads <count>
+//     cpu <float|fused|integer> <pixels> tile <size>
+//     cpu <float|fused|integer> <pixels> schedule <stage> <static|dynamic|guided> <chunk>
+// Lines of other targets, like the OpenCL work-group sizes of the opencl tool, are kept as they are.
+canny_tuning *canny_tuning_create(void);
+
+// nullptr if path cannot be read, malformed cpu lines are skipped with a line on stderr
+canny_tuning *canny_tuning_load(const char *path);
+
+// replaces path as a whole, through a temporary file next to it
+bool canny_tuning_save(const canny_tuning *tuning, const char *path);
+
+void canny_tuning_destroy(canny_tuning *tuning);
+
+// The lines of other targets in the order they were read or added, nullptr past the last one.
+const char *canny_tuning_other_line(const canny_tuning *tuning, size_t index);
+
+// drops the lines of other targets that start with prefix, e.g. the ones of a device about to be measured again
+void canny_tuning_remove_other_lines(canny_tuning *tuning, const char *prefix);
+
+void canny_tuning_add_other_line(canny_tuning *tuning, const char *line);
+
+// Where profiles are kept unless told otherwise: $CANNY_TUNING, $XDG_CACHE_HOME/canny-edge-detection/tuning or
+// ~/.cache/canny-edge-detection/tuning, canny_tuning_save creates the directories.
+// Returns false if there is no such place or CANNY_TUNING is set but empty, which turns tuning off.
+bool canny_tuning_default_path(char *path, size_t size);
+
+// Measures params->pipeline on the width x height image in: first every thread count up to omp_get_max_threads(),
+// then the schedules of every stage, then for CANNY_PIPELINE_FUSED the tile size, each on the best of the ones before.
+// The fastest go into tuning for images of this size, replacing what it held for them. log, unless nullptr, gets a
+// line per candidate. Takes about a second for every megapixel on a single thread.
+canny_status canny_tune(canny_tuning *tuning, const canny_params *params, const uint8_t *in, uint32_t width,
+                        uint32_t height, size_t in_stride, FILE *log);
+
+// heap bytes held by the context at its largest so far
+size_t canny_context_peak_bytes(const canny_context *context);
+
+const char *canny_status_text(canny_status status);
+
+// Writes the per stage profile of all runs so far as JSON: wall time, busy and idle time of every OpenMP thread,
+// workspace bytes allocated, estimated bytes read and written, and the hardware counters the kernel permits.
+// Returns false if the context was created without params->profile.
+bool canny_context_write_profile(const canny_context *context, FILE *file);
+
+// Row callbacks for canny_stream, every one returns false on an I/O error.
+typedef struct {
+    void *user;
+    // reads the next count rows of width * params->channels bytes into rows
+    bool (*read_rows)(void *user, uint8_t *rows, uint32_t count);
+    // goes back to the first row, the input is read twice
+    bool (*rewind)(void *user);
+    // writes the next count rows of width bytes
+    bool (*write_rows)(void *user, const uint8_t *rows, uint32_t count);
+} canny_stream_io;
+
+// Detects the edges of an image that never has to fit in memory.
+// Rows are read in strips and every stage keeps only the rows its stencil needs, so memory is O(width) no matter
+// the height, and output rows are written as soon as they are final. The result matches the float and fused
+// pipelines except for hysteresis, which only follows an edge for a limited number of rows above and below every
+// strip and does not connect the last row to the first one. CANNY_PIPELINE_INTEGER is not supported, and neither
+// are thresholds other than CANNY_THRESHOLD_RATIO, the first pass only finds the largest gradient, or borders other
+// than CANNY_BORDER_WRAP.
+// bytes, if set, receives the size of all buffers the stream needed.
+canny_status canny_stream(uint32_t width, uint32_t height, const canny_params *params, const canny_stream_io *io,
+                          size_t *bytes);
+
+#endif //EDGE_DETECTION_CANNY_H
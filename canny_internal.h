@@ -0,0 +1,200 @@
+#ifndef EDGE_DETECTION_CANNY_INTERNAL_H
+#define EDGE_DETECTION_CANNY_INTERNAL_H
+
+// The individual stages and the workspace behind canny_context, for tools that drive the stages themselves.
+// Nothing in here is part of the public canny.h API.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "canny.h"
+#include "profile.h"
+
+#define GRADIENT_HISTOGRAM_BINS 4096
+
+// The largest thinned gradient and a histogram of the non-zero ones, which are the edge candidates.
+// Thinning fills one per OpenMP thread while the rows it wrote are still in cache, so choosing the double threshold
+// needs no pass of its own. Float magnitudes are binned over [0, 4 * sqrt(2)], the most a [0, 1] image can reach,
+// the 14 bit magnitudes of the integer pipeline by their top 12 bits.
+typedef struct {
+    float max;
+    uint32_t histogram[GRADIENT_HISTOGRAM_BINS];
+} gradient_stats;
+
+// the width of a histogram bin in float and in integer magnitudes
+float gradient_stats_bin_width(bool integer);
+
+// Merges count per thread stats into the high and low threshold threshold asks for.
+void gradient_stats_thresholds(const gradient_stats *stats, int count, bool integer, canny_threshold threshold,
+                               float percentile, float *high_threshold, float *low_threshold);
+
+// 2 * kernel_radius + 1 taps, the caller frees it
+float *create_gaussian_kernel(float sigma, int *kernel_radius);
+
+float *apply_gaussian_filter(float *image, uint32_t width, uint32_t height, float sigma);
+
+float *convert_to_grayscale(float *image, uint32_t width, uint32_t height);
+
+float *apply_sobel_filter(float *image, uint32_t width, uint32_t height);
+
+float *apply_edge_thinning(float *image, uint32_t width, uint32_t height);
+
+float *apply_double_threshold(float *image, uint32_t width, uint32_t height);
+
+float *apply_edge_histeresis(float *image, uint32_t width, uint32_t height);
+
+void convert_to_grayscale_into(const float *image, float *new_image, uint32_t width, uint32_t height);
+
+// Every stencil stage runs a branch-free loop over the pixels whose stencil stays inside the image, and a loop
+// specialised for border over the ones within reach of the edge.
+void apply_gaussian_filter_into(const float *image, float *horizontal_pass, float *new_image,
+                                uint32_t width, uint32_t height,
+                                const float *kernel, int kernel_radius, float *line_buffers, canny_border border);
+
+// convert_to_grayscale_into and apply_gaussian_filter_into of channels (1, 3 or 4) bytes per pixel in one pass
+void ingest_gaussian_filter_into(const uint8_t *image, size_t stride, uint32_t channels, float *horizontal_pass,
+                                 float *new_image, uint32_t width, uint32_t height,
+                                 const float *kernel, int kernel_radius, float *line_buffers, canny_border border);
+
+void apply_sobel_filter_into(const float *image, float *new_image, uint32_t width, uint32_t height,
+                             canny_border border);
+
+// stats, unless nullptr, holds omp_get_max_threads() entries and receives the statistics of new_image
+void apply_edge_thinning_into(const float *image, float *new_image, uint32_t width, uint32_t height,
+                              gradient_stats *stats, canny_border border);
+
+// strong above high_threshold, weak above low_threshold
+void apply_double_threshold_into(const float *image, float *new_image, uint32_t width, uint32_t height,
+                                 float high_threshold, float low_threshold);
+
+// labels is scratch for width * height uint32_t, edges are followed across the image edges for CANNY_BORDER_WRAP
+void apply_edge_histeresis_into(const float *image, float *new_image, uint32_t *labels, uint32_t width, uint32_t height,
+                                canny_border border);
+
+float *apply_fused_pipeline(const uint8_t *image, uint32_t width, uint32_t height, float sigma, uint32_t tile_size);
+
+// number of floats one thread needs for the tile scratch
+size_t fused_tile_scratch_size(uint32_t tile_size, int kernel_radius);
+
+// image has channels (1, 3 or 4) bytes per pixel and rows stride bytes apart, scratch holds omp_get_max_threads()
+// blocks of fused_tile_scratch_size(tile_size, kernel_radius) floats. stats is the same as for
+// apply_edge_thinning_into. orientation, unless nullptr, receives the orientation plane sobel would write.
+void apply_fused_pipeline_into(const uint8_t *image, size_t stride, uint32_t channels, float *new_image,
+                               uint32_t width, uint32_t height,
+                               const float *kernel, int kernel_radius, uint32_t tile_size, float *scratch,
+                               gradient_stats *stats, float *orientation, canny_border border);
+
+// Integer pipeline with compact intermediates: u8 grayscale, u16 blur with BLUR_FRACTION_BITS fractional bits,
+// and the gradient magnitude packed together with a 2-bit direction sector into a single u16 per pixel.
+// image has channels (1, 3 or 4) bytes per pixel and rows stride bytes apart
+void convert_to_grayscale_u8(const uint8_t *image, size_t stride, uint32_t channels, uint8_t *new_image,
+                             uint32_t width, uint32_t height);
+
+void apply_gaussian_filter_u8(const uint8_t *image, uint16_t *horizontal_pass, uint16_t *new_image,
+                              uint32_t width, uint32_t height,
+                              const uint16_t *kernel, int kernel_radius, uint8_t *line_buffers, canny_border border);
+
+void apply_sobel_filter_u16(const uint16_t *image, uint16_t *gradient, uint32_t width, uint32_t height,
+                            canny_border border);
+
+// the thinned magnitudes keep their sector, which the threshold ignores and the edge list reports
+void apply_edge_thinning_u16(const uint16_t *gradient, uint16_t *new_image, uint32_t width, uint32_t height,
+                             gradient_stats *stats, canny_border border);
+
+void apply_double_threshold_u16(const uint16_t *image, uint8_t *new_image, uint32_t width, uint32_t height,
+                                float high_threshold, float low_threshold);
+
+// new_image rows are out_stride bytes apart
+void apply_edge_histeresis_u8(const uint8_t *image, uint8_t *new_image, size_t out_stride, uint32_t *labels,
+                              uint32_t width, uint32_t height, canny_border border);
+
+#define TUNING_NAME_SIZE 24
+#define TUNING_MAX_SCHEDULES 8
+
+// the schedule of the loops of a stage, kind is an omp_sched_t and a chunk of 0 its default chunk
+typedef struct {
+    char stage[TUNING_NAME_SIZE];
+    int kind;
+    int chunk;
+} tuning_schedule;
+
+// what canny_tune measured for one pipeline at one image size
+typedef struct {
+    canny_pipeline pipeline;
+    uint64_t pixels;
+    int threads;        // 0 keeps omp_get_max_threads()
+    uint32_t tile_size; // 0 keeps params->tile_size
+    tuning_schedule schedules[TUNING_MAX_SCHEDULES];
+    int schedule_count;
+} tuning_bucket;
+
+struct canny_tuning {
+    tuning_bucket *buckets;
+    size_t count;
+    char **other_lines; // of other targets, written back unchanged
+    size_t other_count;
+};
+
+// the bucket of pipeline measured at the size closest to pixels, nullptr if there is none
+const tuning_bucket *tuning_find(const canny_tuning *tuning, canny_pipeline pipeline, uint64_t pixels);
+
+// Preallocated buffers for repeated runs on images up to max_width x max_height.
+// The stages ping-pong between two aligned buffers, so after the first run with a given sigma,
+// tile size and thread count no further heap allocations are made.
+typedef struct {
+    uint32_t max_width;
+    uint32_t max_height;
+    float *ping;           // max_width * max_height floats
+    float *pong;           // 2 * max_width * max_height floats, sobel writes magnitude and orientation planes
+    float *kernel;         // gaussian for kernel_sigma
+    uint16_t *fixed_kernel; // the same gaussian with FIXED_KERNEL_BITS fractional bits
+    float kernel_sigma;
+    int kernel_radius;
+    float *scratch;        // per-thread gaussian line buffers or fused tile scratch
+    size_t scratch_size;   // in floats
+    size_t bytes;
+    size_t peak_bytes;
+    canny_profiler *profiler; // nullptr unless profiling
+    const tuning_bucket *tuning; // the stage schedules of the current run, nullptr for static ones
+    size_t stage_bytes;       // bytes when the profiled stage began
+    gradient_stats *stats;    // one per thread, filled by thinning
+    int stats_count;
+    canny_threshold threshold; // CANNY_THRESHOLD_RATIO unless set after creation
+    float percentile;
+    canny_border border;       // CANNY_BORDER_WRAP unless set after creation
+    uint8_t *mask;             // the packed edges behind an edge list
+    size_t mask_size;
+    size_t *edge_offsets;      // omp_get_max_threads() + 1 entries for compacting the edge list
+    int edge_offsets_count;
+} canny_workspace;
+
+// Where a run puts the edges: a map or a mask, both rows stride bytes apart.
+typedef struct {
+    uint8_t *map;        // 0 or 255 per pixel
+    uint8_t *mask;       // one bit per pixel like canny_run_packed, if map is nullptr
+    size_t stride;
+    bool list;           // also list the edges in mask like canny_run_edges does
+    canny_edge *edges;
+    uint8_t *directions; // nullptr unless the list wants them
+    size_t capacity;
+    size_t count;        // receives the number of listed edges
+} canny_output;
+
+canny_workspace *canny_workspace_create(uint32_t max_width, uint32_t max_height);
+
+void canny_workspace_destroy(canny_workspace *workspace);
+
+size_t canny_workspace_peak_bytes(const canny_workspace *workspace);
+
+// The runs write the edges into output.
+// image is channels (1, 3 or 4) bytes per pixel with rows stride bytes apart
+void canny_workspace_run(canny_workspace *workspace, const uint8_t *image, size_t stride, uint32_t channels,
+                         uint32_t width, uint32_t height, float sigma, canny_output *output);
+
+void canny_workspace_run_fused(canny_workspace *workspace, const uint8_t *image, size_t stride, uint32_t channels,
+                               uint32_t width, uint32_t height, float sigma, uint32_t tile_size,
+                               canny_output *output);
+
+void canny_workspace_run_integer(canny_workspace *workspace, const uint8_t *image, size_t stride, uint32_t channels,
+                                 uint32_t width, uint32_t height, float sigma, canny_output *output);
+
+#endif //EDGE_DETECTION_CANNY_INTERNAL_H
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <omp.h>
+#include "canny_internal.h"
+
+// Checks the parallel union-find of hysteresis against a plain flood fill from every strong pixel on random maps:
+// sparse and percolating weak pixels, long winding chains that cross every strip, images thinner than the strips,
+// with and without wrapping, for the float and the u8 classes and for several thread counts, so the lock-free unions
+// between strips race each other. Exits with 1 on the first map where they disagree.
+
+#define TRIALS 300
+#define MAX_WIDTH 257
+#define MAX_HEIGHT 193
+
+static const int thread_counts[] = {1, 2, 4, 7};
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// 0 below the low threshold, 1 weak and 2 strong, see random_map
+static const float magnitudes_float[] = {0.0f, 0.5f, 1.0f};
+static const uint16_t magnitudes_u16[] = {0, 1500, 3000};
+#define HIGH_FLOAT 0.75f
+#define LOW_FLOAT 0.25f
+#define HIGH_U16 2000.0f
+#define LOW_U16 1000.0f
+
+// Noise of weak pixels at a density around where they start to percolate, a few strong ones, and random walks of
+// weak pixels that wind through many strips with a strong pixel at one end.
+static void random_map(uint8_t *classes, uint32_t width, uint32_t height, uint32_t *state) {
+    size_t pixels = (size_t) width * height;
+    uint32_t weak = 200 + next_random(state) % 500;  // per mille
+    uint32_t strong = 1 + next_random(state) % 20;   // per mille
+    for (size_t i = 0; i < pixels; i++) {
+        uint32_t r = next_random(state) % 1000;
+        classes[i] = r < strong ? 2 : r < strong + weak ? 1 : 0;
+    }
+
+    uint32_t walks = next_random(state) % 4;
+    for (uint32_t w = 0; w < walks; w++) {
+        int x = (int) (next_random(state) % width);
+        int y = (int) (next_random(state) % height);
+        classes[(size_t) y * width + x] = 2;
+        size_t length = next_random(state) % (pixels / 2 + 1);
+        for (size_t step = 0; step < length; step++) {
+            x = (x + (int) (next_random(state) % 3) - 1 + (int) width) % (int) width;
+            y = (y + (int) (next_random(state) % 3) - 1 + (int) height) % (int) height;
+            if (classes[(size_t) y * width + x] == 0) classes[(size_t) y * width + x] = 1;
+        }
+    }
+}
+
+// every weak or strong pixel 8-connected to a strong one, across the image edges with wrap
+static void flood_fill(const uint8_t *classes, bool *edges, uint32_t *queue, uint32_t width, uint32_t height,
+                       bool wrap) {
+    size_t pixels = (size_t) width * height;
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < pixels; i++) {
+        edges[i] = classes[i] == 2;
+        if (edges[i]) queue[tail++] = (uint32_t) i;
+    }
+    while (head < tail) {
+        int x = (int) (queue[head] % width);
+        int y = (int) (queue[head] / width);
+        head++;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int nx = x + dx, ny = y + dy;
+                if (wrap) {
+                    nx = (nx + (int) width) % (int) width;
+                    ny = (ny + (int) height) % (int) height;
+                } else if (nx < 0 || ny < 0 || nx >= (int) width || ny >= (int) height) {
+                    continue;
+                }
+                size_t n = (size_t) ny * width + (size_t) nx;
+                if (classes[n] == 0 || edges[n]) continue;
+                edges[n] = true;
+                queue[tail++] = (uint32_t) n;
+            }
+        }
+    }
+}
+
+int main(void) {
+    size_t max_pixels = (size_t) MAX_WIDTH * MAX_HEIGHT;
+    uint8_t *classes = malloc(max_pixels);
+    bool *expected = malloc(max_pixels * sizeof(bool));
+    uint32_t *queue = malloc(max_pixels * sizeof(uint32_t));
+    float *magnitude_float = malloc(max_pixels * sizeof(float));
+    float *classes_float = malloc(max_pixels * sizeof(float));
+    float *edges_float = malloc(max_pixels * sizeof(float));
+    uint16_t *magnitude_u16 = malloc(max_pixels * sizeof(uint16_t));
+    uint8_t *classes_u8 = malloc(max_pixels);
+    uint8_t *edges_u8 = malloc(max_pixels);
+    uint32_t *labels = malloc(max_pixels * sizeof(uint32_t));
+    int max_threads = omp_get_max_threads();
+    uint32_t state = 1;
+    int failures = 0;
+
+    for (int trial = 0; trial < TRIALS && failures == 0; trial++) {
+        // every tenth map is a row or a column, or fewer rows than there are strips
+        uint32_t width = trial % 10 == 1 ? 1 : 1 + next_random(&state) % MAX_WIDTH;
+        uint32_t height = trial % 10 == 2 ? 1 : trial % 10 == 3 ? 1 + next_random(&state) % 8
+                                                               : 1 + next_random(&state) % MAX_HEIGHT;
+        size_t pixels = (size_t) width * height;
+        random_map(classes, width, height, &state);
+        for (size_t i = 0; i < pixels; i++) {
+            magnitude_float[i] = magnitudes_float[classes[i]];
+            magnitude_u16[i] = magnitudes_u16[classes[i]];
+        }
+
+        for (int wrap = 0; wrap <= 1 && failures == 0; wrap++) {
+            canny_border border = wrap ? CANNY_BORDER_WRAP : CANNY_BORDER_CLAMP;
+            flood_fill(classes, expected, queue, width, height, wrap);
+
+            for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+                omp_set_num_threads(thread_counts[t]);
+                apply_double_threshold_into(magnitude_float, classes_float, width, height, HIGH_FLOAT, LOW_FLOAT);
+                apply_edge_histeresis_into(classes_float, edges_float, labels, width, height, border);
+                apply_double_threshold_u16(magnitude_u16, classes_u8, width, height, HIGH_U16, LOW_U16);
+                apply_edge_histeresis_u8(classes_u8, edges_u8, width, labels, width, height, border);
+
+                size_t float_differences = 0, u8_differences = 0;
+                for (size_t i = 0; i < pixels; i++) {
+                    if ((edges_float[i] != 0.0f) != expected[i]) float_differences++;
+                    if ((edges_u8[i] != 0) != expected[i]) u8_differences++;
+                }
+                if (float_differences > 0 || u8_differences > 0) {
+                    printf("map %d (%u x %u, %s, %d threads): %zu float and %zu u8 pixels differ from the flood fill\n",
+                           trial, width, height, wrap ? "wrap" : "clamp", thread_counts[t], float_differences,
+                           u8_differences);
+                    failures++;
+                }
+            }
+            omp_set_num_threads(max_threads);
+        }
+    }
+    if (failures == 0) {
+        printf("%d maps agree with the flood fill, with and without wrapping, on 1 to %d threads\n", TRIALS,
+               thread_counts[sizeof(thread_counts) / sizeof(thread_counts[0]) - 1]);
+    }
+
+    free(classes);
+    free(expected);
+    free(queue);
+    free(magnitude_float);
+    free(classes_float);
+    free(edges_float);
+    free(magnitude_u16);
+    free(classes_u8);
+    free(edges_u8);
+    free(labels);
+    return failures == 0 ? 0 : 1;
+}
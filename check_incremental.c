@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <omp.h>
+#include "canny.h"
+
+// Checks that canny_run_incremental gives the same edges as a canny_run on a fresh context, byte for byte, for a
+// sequence of perturbed frames of the float and fused pipelines with every border and threshold: changes at the image
+// edges and corners, inside a single tile, across several tiles, none at all and all over, and frames that change size
+// in between. The caller's OpenMP schedule has to survive every run, and the integer pipeline is turned down.
+// Exits with 1 on the first configuration that differs.
+
+#define FRAMES 24
+#define TILE_SIZE 32
+// the schedule main sets for the caller, which no stage of a run may leave behind
+#define CALLER_CHUNK 7
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+} frame_size;
+
+// the size every frame has, a few of them switch to another one and back
+static const frame_size frame_sizes[] = {{200, 150}, {173, 211}, {64, 64}};
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// Soft diagonal bands with a little noise and a black square on white, whose edge keeps the largest gradient of
+// every frame, so the ratio threshold stays put and the incremental runs only recompute the changed tiles.
+static void base_frame(uint8_t *image, uint32_t width, uint32_t height, uint32_t channels, uint32_t *state) {
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            bool square = x >= width / 3 && x < width / 2 && y >= height / 3 && y < height / 2;
+            uint8_t value = square ? 0 : (uint8_t) (96 + ((x + 2 * y) / 9 % 2) * 48 + next_random(state) % 8);
+            if (x > width - 8) value = 255;
+            for (uint32_t c = 0; c < channels; c++) {
+                image[((size_t) y * width + x) * channels + c] = value;
+            }
+        }
+    }
+}
+
+// Paints a rectangle of noise and bands, its placement cycles through the kinds of changes the check covers.
+static void perturb(uint8_t *image, uint32_t width, uint32_t height, uint32_t channels, int frame, uint32_t *state) {
+    uint32_t x, y, w, h;
+    switch (frame % 7) {
+        case 0: // the top left corner, next to the wrapped edges
+            x = 0, y = 0, w = 1 + next_random(state) % 12, h = 1 + next_random(state) % 12;
+            break;
+        case 1: // the right and the bottom edge, where the tiles are partial
+            w = 1 + next_random(state) % 20, h = 1 + next_random(state) % 20;
+            x = width - w, y = height - h;
+            break;
+        case 2: // a single pixel somewhere inside
+            w = 1, h = 1, x = next_random(state) % width, y = next_random(state) % height;
+            break;
+        case 3: // across several tiles
+            w = TILE_SIZE + next_random(state) % (2 * TILE_SIZE), h = TILE_SIZE + next_random(state) % TILE_SIZE;
+            x = next_random(state) % (width - w / 2), y = next_random(state) % (height - h / 2);
+            break;
+        case 4: // nothing changed
+            return;
+        case 5: // on a tile boundary, so the change and its halo fall into the tiles on both sides
+            w = 4, h = 4 + next_random(state) % 30, x = TILE_SIZE - 2, y = next_random(state) % (height - 1);
+            break;
+        default: // almost everything
+            x = 1, y = 1, w = width - 2, h = height - 2;
+            break;
+    }
+    if (x + w > width) w = width - x;
+    if (y + h > height) h = height - y;
+
+    uint8_t band = (uint8_t) (next_random(state) % 64);
+    for (uint32_t py = y; py < y + h; py++) {
+        for (uint32_t px = x; px < x + w; px++) {
+            uint8_t value = (uint8_t) (80 + band + ((px + py) / 5 % 2) * 40 + next_random(state) % 24);
+            for (uint32_t c = 0; c < channels; c++) {
+                image[((size_t) py * width + px) * channels + c] = value;
+            }
+        }
+    }
+}
+
+static const char *pipeline_names[] = {"float", "fused", "integer"};
+static const char *border_names[] = {"wrap", "clamp", "mirror", "constant"};
+static const char *threshold_names[] = {"ratio", "percentile", "otsu"};
+
+// the frames of one configuration through one incremental context, false if any of them differs
+static bool check_sequence(const canny_params *params, uint32_t seed) {
+    uint32_t channels = params->channels;
+    uint32_t max_width = 0, max_height = 0;
+    for (size_t s = 0; s < sizeof(frame_sizes) / sizeof(frame_sizes[0]); s++) {
+        if (frame_sizes[s].width > max_width) max_width = frame_sizes[s].width;
+        if (frame_sizes[s].height > max_height) max_height = frame_sizes[s].height;
+    }
+
+    canny_context *incremental = canny_context_create(max_width, max_height, params);
+    uint8_t *image = malloc((size_t) max_width * max_height * channels);
+    uint8_t *expected = malloc((size_t) max_width * max_height);
+    uint8_t *actual = malloc((size_t) max_width * max_height);
+    uint32_t state = seed;
+    uint32_t width = 0, height = 0;
+    int partial_frames = 0;
+    bool same = true;
+
+    for (int frame = 0; frame < FRAMES && same; frame++) {
+        // the size changes twice on the way and comes back
+        frame_size size = frame_sizes[frame == 9 ? 1 : frame == 10 ? 2 : 0];
+        if (size.width != width || size.height != height) {
+            width = size.width;
+            height = size.height;
+            base_frame(image, width, height, channels, &state);
+        } else {
+            perturb(image, width, height, channels, frame, &state);
+        }
+
+        canny_context *fresh = canny_context_create(width, height, params);
+        canny_status status = canny_run(fresh, image, width, height, (size_t) width * channels, expected, width);
+        canny_context_destroy(fresh);
+        float recomputed = 1.0f;
+        canny_status incremental_status = canny_run_incremental(incremental, image, width, height,
+                                                                (size_t) width * channels, actual, width, &recomputed);
+        if (status != CANNY_OK || incremental_status != CANNY_OK) {
+            printf("%s %s %s: frame %d failed: %s / %s\n", pipeline_names[params->pipeline],
+                   border_names[params->border], threshold_names[params->threshold], frame, canny_status_text(status),
+                   canny_status_text(incremental_status));
+            same = false;
+            break;
+        }
+        if (recomputed < 0.5f) partial_frames++;
+        omp_sched_t kind;
+        int chunk;
+        omp_get_schedule(&kind, &chunk);
+        if (kind != omp_sched_dynamic || chunk != CALLER_CHUNK) {
+            printf("%s %s %s: frame %d left the schedule at %d, %d\n", pipeline_names[params->pipeline],
+                   border_names[params->border], threshold_names[params->threshold], frame, (int) kind, chunk);
+            same = false;
+            break;
+        }
+
+        size_t differences = 0;
+        size_t first = 0;
+        for (size_t i = (size_t) width * height; i-- > 0;) {
+            if (expected[i] != actual[i]) {
+                differences++;
+                first = i;
+            }
+        }
+        if (differences > 0) {
+            printf("%s %s %s: frame %d (%u x %u, %.1f%% recomputed) differs in %zu pixels, the first at %zu, %zu\n",
+                   pipeline_names[params->pipeline], border_names[params->border],
+                   threshold_names[params->threshold], frame, width, height,
+                   100.0f * recomputed, differences, first % width, first / width);
+            same = false;
+        }
+    }
+    if (same) {
+        printf("%s %s %s: %d frames identical, %d of them recomputed partially\n", pipeline_names[params->pipeline],
+               border_names[params->border], threshold_names[params->threshold], FRAMES, partial_frames);
+    }
+    // a check that never leaves the whole frame path checks nothing incremental
+    if (same && partial_frames == 0) {
+        printf("%s %s %s: no frame was recomputed partially\n", pipeline_names[params->pipeline],
+               border_names[params->border], threshold_names[params->threshold]);
+        same = false;
+    }
+
+    canny_context_destroy(incremental);
+    free(image);
+    free(expected);
+    free(actual);
+    return same;
+}
+
+int main(void) {
+    bool same = true;
+    uint32_t seed = 1;
+    omp_set_schedule(omp_sched_dynamic, CALLER_CHUNK);
+    for (int pipeline = CANNY_PIPELINE_FLOAT; pipeline <= CANNY_PIPELINE_FUSED; pipeline++) {
+        for (int border = CANNY_BORDER_WRAP; border <= CANNY_BORDER_CONSTANT; border++) {
+            canny_params params = CANNY_DEFAULT_PARAMS;
+            params.pipeline = (canny_pipeline) pipeline;
+            params.border = (canny_border) border;
+            params.tile_size = TILE_SIZE;
+            // grey and RGBA take turns, both go through the same diff and ingest
+            params.channels = border % 2 == 0 ? 1 : 4;
+            same = check_sequence(&params, seed++) && same;
+        }
+        // the histogram thresholds move with every change, which takes the whole frame hysteresis but checks that
+        // the statistics follow the recomputed tiles
+        for (int threshold = CANNY_THRESHOLD_PERCENTILE; threshold <= CANNY_THRESHOLD_OTSU; threshold++) {
+            canny_params params = CANNY_DEFAULT_PARAMS;
+            params.pipeline = (canny_pipeline) pipeline;
+            params.threshold = (canny_threshold) threshold;
+            params.tile_size = TILE_SIZE;
+            same = check_sequence(&params, seed++) && same;
+        }
+    }
+
+    canny_params params = CANNY_DEFAULT_PARAMS;
+    params.pipeline = CANNY_PIPELINE_INTEGER;
+    canny_context *context = canny_context_create(64, 64, &params);
+    uint8_t *image = calloc(64 * 64, params.channels);
+    uint8_t *edges = malloc(64 * 64);
+    canny_status status = canny_run_incremental(context, image, 64, 64, 64 * params.channels, edges, 64, nullptr);
+    if (status != CANNY_ERROR_INVALID_ARGUMENT) {
+        printf("integer: canny_run_incremental gave %s\n", canny_status_text(status));
+        same = false;
+    }
+    canny_context_destroy(context);
+    free(image);
+    free(edges);
+    return same ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+# Checks of the opencl tool on whatever device it picks, e.g. the CPU of a PoCL runtime, run by ctest as
+#     cmake -DOPENCL=<opencl> -DSOURCE_DIR=<sources> -DWORK_DIR=<scratch> -DCHECK=<check> -P check_opencl.cmake
+# tiles: the fused kernel gives the same edges byte for byte whatever its work-group size, also sizes the image is not
+#        a multiple of, so the halo loads and the padded range neither lose nor add anything
+# slots: a list of images of changing sizes gives the same edges as every image on its own, with one slot and with
+#        several in flight, so the reductions and the buffers of a slot follow the image it holds
+# Prints "no OpenCL device" and passes when there is none, which ctest counts as skipped.
+
+set(KERNEL ${SOURCE_DIR}/compute.cl)
+set(WORK_DIR ${WORK_DIR}/${CHECK})
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+# a fresh program cache and no tuning profile, so nothing from earlier runs picks the work-group sizes
+set(ENV{CANNY_CL_CACHE_DIR} ${WORK_DIR}/cache)
+set(ENV{CANNY_TUNING} ${WORK_DIR}/tuning)
+
+# runs the opencl tool with the arguments, the check fails if it does
+function(run_opencl)
+    execute_process(COMMAND ${OPENCL} ${ARGN} RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+    if (NOT result EQUAL 0)
+        list(JOIN ARGN " " arguments)
+        message(FATAL_ERROR "opencl ${arguments} failed with ${result}:\n${output}")
+    endif ()
+endfunction()
+
+function(compare_edges expected actual)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${expected} ${actual} RESULT_VARIABLE different)
+    if (NOT different EQUAL 0)
+        message(FATAL_ERROR "${actual} differs from ${expected}")
+    endif ()
+endfunction()
+
+execute_process(COMMAND ${OPENCL} ${KERNEL} ${SOURCE_DIR}/resources/keyboard.png ${WORK_DIR}/probe.png
+                RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+if (NOT result EQUAL 0 AND NOT output MATCHES "Device: ")
+    message("no OpenCL device")
+    return()
+endif ()
+
+# 400 x 250 and 400 x 169, neither a multiple of the tile heights
+set(IMAGES tiger keyboard)
+
+if (CHECK STREQUAL "tiles")
+    foreach (image ${IMAGES})
+        set(input ${SOURCE_DIR}/resources/${image}.png)
+        run_opencl(-l 16x16 ${KERNEL} ${input} ${WORK_DIR}/${image}_16x16.png)
+        foreach (tile 8x8 7x13 32x4 1x1)
+            run_opencl(-l ${tile} ${KERNEL} ${input} ${WORK_DIR}/${image}_${tile}.png)
+            compare_edges(${WORK_DIR}/${image}_16x16.png ${WORK_DIR}/${image}_${tile}.png)
+        endforeach ()
+    endforeach ()
+elseif (CHECK STREQUAL "slots")
+    # 400 x 400 between the two, back to back and repeated
+    set(LIST tiger keyboard lenna keyboard keyboard tiger lenna tiger keyboard)
+    foreach (path fused unfused)
+        if (path STREQUAL "unfused")
+            set(options -u)
+        else ()
+            set(options)
+        endif ()
+        foreach (image ${IMAGES} lenna)
+            run_opencl(${options} ${KERNEL} ${SOURCE_DIR}/resources/${image}.png ${WORK_DIR}/${image}_${path}.png)
+        endforeach ()
+        foreach (slots 1 3 8)
+            set(list ${WORK_DIR}/${path}_${slots}.list)
+            file(WRITE ${list} "")
+            set(index 0)
+            foreach (image ${LIST})
+                math(EXPR index "${index} + 1")
+                file(APPEND ${list} "${SOURCE_DIR}/resources/${image}.png ${WORK_DIR}/${path}_${slots}_${index}.png\n")
+            endforeach ()
+            run_opencl(${options} -q ${slots} ${KERNEL} -p ${list})
+            set(index 0)
+            foreach (image ${LIST})
+                math(EXPR index "${index} + 1")
+                compare_edges(${WORK_DIR}/${image}_${path}.png ${WORK_DIR}/${path}_${slots}_${index}.png)
+            endforeach ()
+        endforeach ()
+    endforeach ()
+else ()
+    message(FATAL_ERROR "no check ${CHECK}")
+endif ()
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "vendor/lodepng/lodepng.h"
+#include "server.h"
+
+// Load generator for edge_detection -D: every connection sends the same image over and over, one request at a time,
+// and the latencies of all of them are reported next to the compute time the server measured, which tells the
+// time spent waiting and copying apart from canny_run itself.
+
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_REQUESTS 100
+#define DEFAULT_WARMUP 2
+
+typedef struct {
+    const char *socket_path;
+    const uint8_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    int requests;
+    int warmup;
+    bool shared;
+    const char *output_path; // the edges of the last request of the first connection
+} client_options;
+
+typedef struct {
+    const client_options *options;
+    int index;
+    double *latencies;
+    double *queued;
+    double *computed;
+    bool failed;
+} client_connection;
+
+#define TIME_IN_SECONDS(start, end) ((double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1000000000)
+
+static bool read_fully(int fd, void *data, size_t size) {
+    uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t count = recv(fd, bytes, size, 0);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+// sends the request with shared_fd attached unless it is -1
+static bool send_request(int fd, const server_request *request, int shared_fd) {
+    if (shared_fd < 0) return write_fully(fd, request, sizeof(server_request));
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec vector = {.iov_base = (void *) request, .iov_len = sizeof(server_request)};
+    struct msghdr message = {
+            .msg_iov = &vector, .msg_iovlen = 1, .msg_control = control.space, .msg_controllen = sizeof(control.space)
+    };
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &shared_fd, sizeof(int));
+    ssize_t count;
+    do {
+        count = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) return false;
+    return write_fully(fd, (const uint8_t *) request + count, sizeof(server_request) - (size_t) count);
+}
+
+static bool write_pgm(const char *path, const uint8_t *edges, uint32_t width, uint32_t height) {
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr) return false;
+    fprintf(file, "P5\n%u %u\n255\n", width, height);
+    bool written = fwrite(edges, 1, (size_t) width * height, file) == (size_t) width * height;
+    return fclose(file) == 0 && written;
+}
+
+static void *run_connection(void *argument) {
+    client_connection *connection = argument;
+    const client_options *options = connection->options;
+    size_t in_size = (size_t) options->width * options->height * options->channels;
+    size_t out_size = (size_t) options->width * options->height;
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, options->socket_path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (const struct sockaddr *) &address, sizeof(address)) != 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", options->socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        connection->failed = true;
+        return nullptr;
+    }
+
+    // the pixels followed by the edges, the pixels are only written once
+    int shared_fd = -1;
+    uint8_t *shared = nullptr;
+    uint8_t *edges = nullptr;
+    if (options->shared) {
+        // sealed against shrinking, which the server insists on before it maps it
+        shared_fd = memfd_create("canny_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (shared_fd < 0 || ftruncate(shared_fd, (off_t) (in_size + out_size)) != 0 ||
+            fcntl(shared_fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0 ||
+            (shared = mmap(nullptr, in_size + out_size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0)) == MAP_FAILED) {
+            fprintf(stderr, "Cannot create the shared memory: %s\n", strerror(errno));
+            if (shared_fd >= 0) close(shared_fd);
+            close(fd);
+            connection->failed = true;
+            return nullptr;
+        }
+        memcpy(shared, options->pixels, in_size);
+        edges = shared + in_size;
+    } else {
+        edges = malloc(out_size);
+    }
+
+    server_request request = {
+            .magic = SERVER_MAGIC, .flags = options->shared ? SERVER_REQUEST_SHARED | SERVER_REQUEST_ATTACH : 0,
+            .width = options->width, .height = options->height, .channels = options->channels,
+            .output_offset = options->shared ? in_size : 0
+    };
+    for (int i = 0; i < options->warmup + options->requests; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        server_response response;
+        bool exchanged = send_request(fd, &request, i == 0 ? shared_fd : -1) &&
+                         (options->shared || write_fully(fd, options->pixels, in_size)) &&
+                         read_fully(fd, &response, sizeof(server_response));
+        if (exchanged && response.status == CANNY_OK && !options->shared) exchanged = read_fully(fd, edges, out_size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (!exchanged || response.magic != SERVER_MAGIC || response.status != CANNY_OK) {
+            if (!exchanged) {
+                fprintf(stderr, "Connection %d lost the server\n", connection->index);
+            } else {
+                fprintf(stderr, "Connection %d: %s\n", connection->index, response.status == SERVER_STATUS_BAD_REQUEST ?
+                        "bad request" : canny_status_text((canny_status) response.status));
+            }
+            connection->failed = true;
+            break;
+        }
+        request.flags &= ~SERVER_REQUEST_ATTACH;
+        if (i < options->warmup) continue;
+        int measured = i - options->warmup;
+        connection->latencies[measured] = TIME_IN_SECONDS(start, end);
+        connection->queued[measured] = (double) response.queued_ns / 1e9;
+        connection->computed[measured] = (double) response.compute_ns / 1e9;
+    }
+
+    if (!connection->failed && connection->index == 0 && options->output_path != nullptr &&
+        !write_pgm(options->output_path, edges, options->width, options->height)) {
+        fprintf(stderr, "Cannot write %s\n", options->output_path);
+        connection->failed = true;
+    }
+
+    if (options->shared) {
+        munmap(shared, in_size + out_size);
+        close(shared_fd);
+    } else {
+        free(edges);
+    }
+    close(fd);
+    return nullptr;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank percentiles of values, which get sorted
+static void print_latencies(const char *name, double *values, size_t count) {
+    if (count == 0) return;
+    qsort(values, count, sizeof(double), compare_doubles);
+    const double percentiles[] = {50.0, 90.0, 99.0};
+    printf("%-11s (ms):", name);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        size_t rank = (size_t) (percentiles[i] / 100.0 * (double) count + 0.999999);
+        printf(" p%.0f %.3f", percentiles[i], 1000.0 * values[rank > 0 ? rank - 1 : 0]);
+    }
+    printf(" max %.3f\n", 1000.0 * values[count - 1]);
+}
+
+// <width>x<height>[x<channels>] of random pixels
+static uint8_t *random_image(const char *text, uint32_t *width, uint32_t *height, uint32_t *channels) {
+    int length = 0;
+    *channels = 3;
+    int fields = sscanf(text, "%ux%u%n", width, height, &length);
+    if (fields == 2 && text[length] == 'x') {
+        int more = 0;
+        if (sscanf(text + length, "x%u%n", channels, &more) != 1) return nullptr;
+        length += more;
+    }
+    if (fields != 2 || text[length] != '\0' || *width == 0 || *height == 0) return nullptr;
+    if (*channels != 1 && *channels != 3 && *channels != 4) return nullptr;
+
+    size_t size = (size_t) *width * *height * *channels;
+    uint8_t *pixels = malloc(size);
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        pixels[i] = (uint8_t) state;
+    }
+    return pixels;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-k connections] [-n requests] [-w warmup] [-m] [-o edges.pgm] socket <image.png|-R WxHxC>\n",
+           program);
+    printf("-k concurrent connections, %d by default\n", DEFAULT_CONNECTIONS);
+    printf("-n measured requests per connection, %d by default, after -w unmeasured ones, %d by default\n",
+           DEFAULT_REQUESTS, DEFAULT_WARMUP);
+    printf("-m passes the image in shared memory instead of over the socket\n");
+    printf("-R sends random pixels of that size instead of an image\n");
+    printf("-o writes the edges of the last response\n");
+}
+
+int main(int argc, char **argv) {
+    client_options options = {.requests = DEFAULT_REQUESTS, .warmup = DEFAULT_WARMUP};
+    int connections = DEFAULT_CONNECTIONS;
+    uint8_t *pixels = nullptr;
+
+    int option;
+    while ((option = getopt(argc, argv, "k:n:w:mo:R:")) != -1) {
+        switch (option) {
+            case 'k':
+                connections = atoi(optarg);
+                break;
+            case 'n':
+                options.requests = atoi(optarg);
+                break;
+            case 'w':
+                options.warmup = atoi(optarg);
+                break;
+            case 'm':
+                options.shared = true;
+                break;
+            case 'o':
+                options.output_path = optarg;
+                break;
+            case 'R':
+                free(pixels);
+                pixels = random_image(optarg, &options.width, &options.height, &options.channels);
+                if (pixels == nullptr) {
+                    printf("Size has to be <width>x<height>[x<channels>] with 1, 3 or 4 channels\n");
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                free(pixels);
+                return 1;
+        }
+    }
+    if (connections < 1 || options.requests < 1 || options.warmup < 0 ||
+        argc - optind != (pixels == nullptr ? 2 : 1)) {
+        print_usage(argv[0]);
+        free(pixels);
+        return 1;
+    }
+    options.socket_path = argv[optind];
+    if (pixels == nullptr) {
+        unsigned error = lodepng_decode24_file(&pixels, &options.width, &options.height, argv[optind + 1]);
+        if (error) {
+            printf("error %u: %s\n", error, lodepng_error_text(error));
+            return 1;
+        }
+        options.channels = 3;
+    }
+    options.pixels = pixels;
+
+    size_t measured = (size_t) connections * options.requests;
+    double *latencies = malloc(measured * sizeof(double));
+    double *queued = malloc(measured * sizeof(double));
+    double *computed = malloc(measured * sizeof(double));
+    client_connection *clients = calloc(connections, sizeof(client_connection));
+    pthread_t *threads = malloc(connections * sizeof(pthread_t));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < connections; i++) {
+        size_t offset = (size_t) i * options.requests;
+        clients[i] = (client_connection) {
+                .options = &options, .index = i, .latencies = latencies + offset, .queued = queued + offset,
+                .computed = computed + offset
+        };
+        pthread_create(&threads[i], nullptr, run_connection, &clients[i]);
+    }
+    bool failed = false;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], nullptr);
+        failed |= clients[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!failed) {
+        // the warm-up requests are in the wall time too
+        double seconds = TIME_IN_SECONDS(start, end);
+        size_t total = (size_t) connections * (options.warmup + options.requests);
+        printf("%zu requests of %u x %u x %u %s over %d connections in %.3f seconds, %.1f requests/s\n", total,
+               options.width, options.height, options.channels, options.shared ? "in shared memory" : "inline",
+               connections, seconds, (double) total / seconds);
+        print_latencies("End to end", latencies, measured);
+        print_latencies("Queued", queued, measured);
+        print_latencies("Compute", computed, measured);
+    }
+
+    free(threads);
+    free(clients);
+    free(latencies);
+    free(queued);
+    free(computed);
+    free(pixels);
+    return failed ? 1 : 0;
+}
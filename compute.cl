@@ -1,10 +1,66 @@
+// Mirrored repeat is only defined with normalized coordinates, so every kernel clamps and the ones reading further
+// than one pixel out mirror their coordinates themselves, one pixel out the two are the same.
 constant sampler_t
-sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_MIRRORED_REPEAT | CLK_FILTER_NEAREST;
+sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 
 #define GTE_WITH_EPSILON(a, b) (a >= b - 0.0001f)
 #define LT_WITH_EPSILON(a, b) (a < b + 0.0001f)
 #define IN_RANGE_WITH_EPSILON(a, b, c) (GTE_WITH_EPSILON(a, b) && LT_WITH_EPSILON(a, c))
 
+#define GAUSSIAN_RADIUS 2
+
+constant float gaussianTable[25] = {
+        1/273.0f, 4/273.0f, 7/273.0f, 4/273.0f, 1/273.0f,
+        4/273.0f, 16/273.0f, 26/273.0f, 16/273.0f, 4/273.0f,
+        7/273.0f, 26/273.0f, 41/273.0f, 26/273.0f, 7/273.0f,
+        4/273.0f, 16/273.0f, 26/273.0f, 16/273.0f, 4/273.0f,
+        1/273.0f, 4/273.0f, 7/273.0f, 4/273.0f, 1/273.0f
+};
+
+constant float sobelKernelX[3][3] = {
+        {-1.0f, 0.0f, 1.0f},
+        {-2.0f, 0.0f, 2.0f},
+        {-1.0f, 0.0f, 1.0f}
+};
+constant float sobelKernelY[3][3] = {
+        {1.0f,  2.0f,  1.0f},
+        {0.0f,  0.0f,  0.0f},
+        {-1.0f, -2.0f, -1.0f}
+};
+
+// the pixel x mirrors past the edges, pixel -1 being pixel 0
+int mirror_coordinate(int x, int size) {
+    if (x < 0) x = -x - 1;
+    if (x >= size) x = 2 * size - x - 1;
+    return clamp(x, 0, size - 1);
+}
+
+// the gradient direction rounded to 22.5 degrees and folded into [0, 180)
+float quantize_orientation(float sobelX, float sobelY) {
+    float orientation = atan2(sobelY, sobelX);
+    orientation = orientation * (180.0f / M_PI);
+    orientation = round(orientation / 22.5f) * 22.5f;
+    orientation = fmod(orientation + 180.0f, 180.0f);
+    if (orientation < 0.0f) {
+        orientation += 180.0f;
+    }
+    return orientation;
+}
+
+// the offset of the neighbour in the gradient direction, the other one is the opposite
+int2 thinning_neighbour(float angle) {
+    if (IN_RANGE_WITH_EPSILON(angle, 0.0f, 22.5f)) {
+        return (int2)(1, 0);
+    } else if (IN_RANGE_WITH_EPSILON(angle, 22.5f, 67.5f)) {
+        return (int2)(-1, 1);
+    } else if (IN_RANGE_WITH_EPSILON(angle, 67.5f, 112.5f)) {
+        return (int2)(0, 1);
+    } else if (IN_RANGE_WITH_EPSILON(angle, 112.5f, 157.5f)) {
+        return (int2)(-1, -1);
+    }
+    return (int2)(1, 0);
+}
+
 __kernel void grayscale_image(
         read_only image2d_t inputImage,
         write_only image2d_t outputImage
@@ -32,18 +88,11 @@ __kernel void gaussian_blur(
     }
 
     float newPixelValue = 0.0f;
-    const float gaussianTable[25] = {
-            1/273.0f, 4/273.0f, 7/273.0f, 4/273.0f, 1/273.0f,
-            4/273.0f, 16/273.0f, 26/273.0f, 16/273.0f, 4/273.0f,
-            7/273.0f, 26/273.0f, 41/273.0f, 26/273.0f, 7/273.0f,
-            4/273.0f, 16/273.0f, 26/273.0f, 16/273.0f, 4/273.0f,
-            1/273.0f, 4/273.0f, 7/273.0f, 4/273.0f, 1/273.0f
-    };
-
     for (int i = -2; i <= 2; i++) {
         for (int j = -2; j <= 2; j++) {
-            int2 neighborCoord = (int2)(coord.x + i, coord.y + j);
-            newPixelValue += read_imagef(inputImage, sampler, neighborCoord).x * gaussianTable[(i + 2) * 3 + (j + 2)];
+            int2 neighborCoord = (int2)(mirror_coordinate(coord.x + i, imageSize.x),
+                                        mirror_coordinate(coord.y + j, imageSize.y));
+            newPixelValue += read_imagef(inputImage, sampler, neighborCoord).x * gaussianTable[(i + 2) * 5 + (j + 2)];
         }
     }
 
@@ -62,42 +111,25 @@ __kernel void sobel_filter(
         return;
     }
 
-    const float sobelKernelX[3][3] = {
-            {-1.0f, 0.0f, 1.0f},
-            {-2.0f, 0.0f, 2.0f},
-            {-1.0f, 0.0f, 1.0f}
-    };
-    const float sobelKernelY[3][3] = {
-            {1.0f,  2.0f,  1.0f},
-            {0.0f,  0.0f,  0.0f},
-            {-1.0f, -2.0f, -1.0f}
-    };
-
     float sobelX = 0.0f;
     float sobelY = 0.0f;
     for (int i = -1; i <= 1; i++) {
         for (int j = -1; j <= 1; j++) {
             int2 neighborCoord = (int2)(coords.x + j, coords.y + i);
-            sobelX += read_imagef(inputImage, sampler, neighborCoord).x * sobelKernelX[i + 1][j + 1];
-            sobelY += read_imagef(inputImage, sampler, neighborCoord).x * sobelKernelY[i + 1][j + 1];
+            float neighbor = read_imagef(inputImage, sampler, neighborCoord).x;
+            sobelX += neighbor * sobelKernelX[i + 1][j + 1];
+            sobelY += neighbor * sobelKernelY[i + 1][j + 1];
         }
     }
 
     float sobelMagnitude = sqrt(sobelX * sobelX + sobelY * sobelY);
-
-    float orientation = atan2(sobelY, sobelX);
-    orientation = orientation * (180.0f / M_PI);
-    orientation = round(orientation / 22.5f) * 22.5f;
-    orientation = fmod(orientation + 180.0f, 180.0f);
-    if (orientation < 0.0f) {
-        orientation += 180.0f;
-    }
+    float orientation = quantize_orientation(sobelX, sobelY);
 
     intensityImage[coords.x + coords.y * get_global_size(0)] = sobelMagnitude;
     orientationImage[coords.x + coords.y * get_global_size(0)] = orientation;
 }
 
-#define CHECK_INDEX(index, imageWidth, imageHeight, fallback) ((index >= 0 && index < imageWidth * imageHeight) ? index : fallback)
+#define CHECK_INDEX(index, imageWidth, imageHeight, fallback) ((index) >= 0 && (index) < (imageWidth) * (imageHeight) ? (index) : (fallback))
 
 __kernel void edge_thinning(
         __global float *intensityImage,
@@ -106,30 +138,14 @@ __kernel void edge_thinning(
 ) {
     int2 coords = (int2)(get_global_id(0), get_global_id(1));
      
-    float q = 255.0f;
-    float r = 255.0f;
-
     int angleIndex = coords.x + coords.y * get_global_size(0);
     float angle = orientationImage[angleIndex];
 
-#define READ_ORIENTATION_WITH_FALLBACK(x, y) (intensityImage[CHECK_INDEX(x + y * get_global_size(0), get_global_size(0), get_global_size(1), angleIndex)])
+#define READ_ORIENTATION_WITH_FALLBACK(x, y) (intensityImage[CHECK_INDEX((x) + (y) * get_global_size(0), get_global_size(0), get_global_size(1), angleIndex)])
 
-    if (IN_RANGE_WITH_EPSILON(angle, 0.0f, 22.5f)) {
-        q = READ_ORIENTATION_WITH_FALLBACK(coords.x + 1, coords.y);
-        r = READ_ORIENTATION_WITH_FALLBACK(coords.x - 1, coords.y);
-    } else if (IN_RANGE_WITH_EPSILON(angle, 22.5f, 67.5f)) {
-        q = READ_ORIENTATION_WITH_FALLBACK(coords.x - 1, coords.y + 1);
-        r = READ_ORIENTATION_WITH_FALLBACK(coords.x + 1, coords.y - 1);
-    } else if (IN_RANGE_WITH_EPSILON(angle, 67.5f, 112.5f)) {
-        q = READ_ORIENTATION_WITH_FALLBACK(coords.x, coords.y + 1);
-        r = READ_ORIENTATION_WITH_FALLBACK(coords.x, coords.y - 1);
-    } else if (IN_RANGE_WITH_EPSILON(angle, 112.5f, 157.5f)) {
-        q = READ_ORIENTATION_WITH_FALLBACK(coords.x - 1, coords.y - 1);
-        r = READ_ORIENTATION_WITH_FALLBACK(coords.x + 1, coords.y + 1);
-    } else {
-        q = READ_ORIENTATION_WITH_FALLBACK(coords.x + 1, coords.y);
-        r = READ_ORIENTATION_WITH_FALLBACK(coords.x - 1, coords.y);
-    }
+    int2 neighbour = thinning_neighbour(angle);
+    float q = READ_ORIENTATION_WITH_FALLBACK(coords.x + neighbour.x, coords.y + neighbour.y);
+    float r = READ_ORIENTATION_WITH_FALLBACK(coords.x - neighbour.x, coords.y - neighbour.y);
 
     float intensity = intensityImage[coords.x + coords.y * get_global_size(0)];
     if (GTE_WITH_EPSILON(intensity, q) && GTE_WITH_EPSILON(intensity, r)) {
@@ -139,20 +155,107 @@ __kernel void edge_thinning(
     }
 }
 
+// Blur -> sobel -> edge thinning for one tile of get_local_size() pixels, with every intermediate in local memory.
+// The work-group loads the grayscale tile plus a FUSED_HALO pixel halo once and only writes the thinned magnitude,
+// the global size is the image size rounded up to the local size.
+// The local buffers hold (local + 2 * halo) pixels each way, the halos being FUSED_HALO, GAUSSIAN_RADIUS and 1.
+// Pixels outside the image mirror the ones inside, which the symmetric blur and sobel kernels carry over to every
+// intermediate. That only differs from the separate kernels in the outermost pixels, where edge_thinning wraps.
+#define FUSED_HALO (GAUSSIAN_RADIUS + 2)
+
+__kernel void fused_blur_sobel_thinning(
+        read_only image2d_t inputImage,
+        __global float *outputBuffer,
+        __local float *grayTile,
+        __local float *blurTile,
+        __local float *magnitudeTile,
+        __local float *orientationTile
+) {
+    int2 imageSize = (int2)(get_image_width(inputImage), get_image_height(inputImage));
+    int2 localSize = (int2)(get_local_size(0), get_local_size(1));
+    int2 localId = (int2)(get_local_id(0), get_local_id(1));
+    int2 tileOrigin = (int2)(get_group_id(0), get_group_id(1)) * localSize;
+    int localIndex = localId.y * localSize.x + localId.x;
+    int groupSize = localSize.x * localSize.y;
+
+    int grayWidth = localSize.x + 2 * FUSED_HALO;
+    int grayHeight = localSize.y + 2 * FUSED_HALO;
+    for (int i = localIndex; i < grayWidth * grayHeight; i += groupSize) {
+        int2 coords = (int2)(tileOrigin.x + i % grayWidth - FUSED_HALO, tileOrigin.y + i / grayWidth - FUSED_HALO);
+        coords = (int2)(mirror_coordinate(coords.x, imageSize.x), mirror_coordinate(coords.y, imageSize.y));
+        grayTile[i] = read_imagef(inputImage, sampler, coords).x;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // the blur tile starts GAUSSIAN_RADIUS pixels into the gray tile
+    int blurWidth = localSize.x + 2 * (FUSED_HALO - GAUSSIAN_RADIUS);
+    int blurHeight = localSize.y + 2 * (FUSED_HALO - GAUSSIAN_RADIUS);
+    for (int b = localIndex; b < blurWidth * blurHeight; b += groupSize) {
+        int x = b % blurWidth + GAUSSIAN_RADIUS;
+        int y = b / blurWidth + GAUSSIAN_RADIUS;
+        float newPixelValue = 0.0f;
+        for (int i = -2; i <= 2; i++) {
+            for (int j = -2; j <= 2; j++) {
+                newPixelValue += grayTile[(y + j) * grayWidth + x + i] * gaussianTable[(i + 2) * 5 + (j + 2)];
+            }
+        }
+        blurTile[b] = clamp(newPixelValue, 0.0f, 1.0f);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // and the gradient tile one pixel into the blur tile
+    int magnitudeWidth = localSize.x + 2;
+    int magnitudeHeight = localSize.y + 2;
+    for (int m = localIndex; m < magnitudeWidth * magnitudeHeight; m += groupSize) {
+        int x = m % magnitudeWidth + 1;
+        int y = m / magnitudeWidth + 1;
+        float sobelX = 0.0f;
+        float sobelY = 0.0f;
+        for (int i = -1; i <= 1; i++) {
+            for (int j = -1; j <= 1; j++) {
+                float neighbor = blurTile[(y + i) * blurWidth + x + j];
+                sobelX += neighbor * sobelKernelX[i + 1][j + 1];
+                sobelY += neighbor * sobelKernelY[i + 1][j + 1];
+            }
+        }
+        magnitudeTile[m] = sqrt(sobelX * sobelX + sobelY * sobelY);
+        orientationTile[m] = quantize_orientation(sobelX, sobelY);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int2 coords = tileOrigin + localId;
+    if (coords.x >= imageSize.x || coords.y >= imageSize.y) {
+        return;
+    }
+
+    int center = (localId.y + 1) * magnitudeWidth + localId.x + 1;
+    int2 neighbour = thinning_neighbour(orientationTile[center]);
+    float q = magnitudeTile[center + neighbour.y * magnitudeWidth + neighbour.x];
+    float r = magnitudeTile[center - neighbour.y * magnitudeWidth - neighbour.x];
+    float intensity = magnitudeTile[center];
+    outputBuffer[coords.x + coords.y * imageSize.x] =
+            GTE_WITH_EPSILON(intensity, q) && GTE_WITH_EPSILON(intensity, r) ? intensity : 0.0f;
+}
+
+// The largest intensity in two launches without leaving the device: the first one with any number of groups writes
+// the maximum of every group to result[get_group_id(0)], the second one with a single group reduces those to
+// result[0]. The local size has to be a power of two of at most MAX_REDUCTION_LOCAL_SIZE.
+#define MAX_REDUCTION_LOCAL_SIZE 256
+
 __kernel void find_max_intensity(
-        __global float *intensityBuffer,
+        __global const float *intensityBuffer,
         __global float *result,
         const int bufferSize
 ) {
     int globalIndex = get_global_id(0);
 
-    float localMax = intensityBuffer[globalIndex];
-
-    for (int i = globalIndex + get_global_size(0); i < bufferSize; i += get_global_size(0)) {
+    // every group gets at least one value, intensities are never negative
+    float localMax = 0.0f;
+    for (int i = globalIndex; i < bufferSize; i += get_global_size(0)) {
         localMax = max(localMax, intensityBuffer[i]);
     }
 
-    __local float localMaxBuffer[256];
+    __local float localMaxBuffer[MAX_REDUCTION_LOCAL_SIZE];
     localMaxBuffer[get_local_id(0)] = localMax;
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -178,7 +281,7 @@ __kernel void find_max_intensity(
 __kernel void double_thresholding(
         __global float *inputImage,
         write_only image2d_t outputImage,
-        const float maxIntensityValue
+        __global const float *maxIntensityValue
 ) {
     int2 coords = (int2)(get_global_id(0), get_global_id(1));
     int2 imageSize = (int2)(get_image_width(outputImage), get_image_height(outputImage));
@@ -186,7 +289,7 @@ __kernel void double_thresholding(
         return;
     }
 
-    float high_threshold = maxIntensityValue * HIGH_THRESHOLD_RATIO;
+    float high_threshold = maxIntensityValue[0] * HIGH_THRESHOLD_RATIO;
     float low_threshold = high_threshold * LOW_THRESHOLD_RATIO;
 
     float intensity = inputImage[coords.x + coords.y * get_global_size(0)];
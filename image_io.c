@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vendor/lodepng/lodepng.h"
+#include "image_io.h"
+
+image_format image_format_from_path(const char *path) {
+    const char *extension = strrchr(path, '.');
+    if (extension == nullptr || strchr(extension, '/') != nullptr) return IMAGE_FORMAT_RAW;
+    if (strcasecmp(extension, ".png") == 0) return IMAGE_FORMAT_PNG;
+    if (strcasecmp(extension, ".pgm") == 0 || strcasecmp(extension, ".ppm") == 0) return IMAGE_FORMAT_PNM;
+    if (strcasecmp(extension, ".pbm") == 0) return IMAGE_FORMAT_PBM;
+    if (strcasecmp(extension, ".edges") == 0) return IMAGE_FORMAT_EDGES;
+    return IMAGE_FORMAT_RAW;
+}
+
+const char *image_output_extension(image_format format) {
+    switch (format) {
+        case IMAGE_FORMAT_PNG:
+            return ".png";
+        case IMAGE_FORMAT_PNM:
+            return ".pgm";
+        case IMAGE_FORMAT_RAW:
+            return ".raw";
+        case IMAGE_FORMAT_PBM:
+            return ".pbm";
+        case IMAGE_FORMAT_EDGES:
+            return ".edges";
+    }
+    return "";
+}
+
+bool parse_raw_geometry(const char *text, raw_geometry *geometry) {
+    geometry->channels = 1;
+    int fields = sscanf(text, "%ux%ux%u", &geometry->width, &geometry->height, &geometry->channels);
+    return fields >= 2 && geometry->width > 0 && geometry->height > 0 &&
+           (geometry->channels == 1 || geometry->channels == 3 || geometry->channels == 4);
+}
+
+// the next whitespace separated header field, comments run from '#' to the end of the line
+static size_t pnm_next_field(const uint8_t *data, size_t size, size_t offset, uint32_t *value) {
+    while (offset < size) {
+        if (data[offset] == '#') {
+            while (offset < size && data[offset] != '\n') offset++;
+        } else if (data[offset] == ' ' || data[offset] == '\t' || data[offset] == '\r' || data[offset] == '\n') {
+            offset++;
+        } else {
+            break;
+        }
+    }
+
+    size_t start = offset;
+    uint64_t number = 0;
+    while (offset < size && data[offset] >= '0' && data[offset] <= '9' && number <= UINT32_MAX) {
+        number = number * 10 + (data[offset++] - '0');
+    }
+    if (offset == start || number > UINT32_MAX) return 0;
+    *value = (uint32_t) number;
+    return offset;
+}
+
+size_t pnm_parse_header(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height, uint32_t *channels) {
+    if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) return 0;
+    *channels = data[1] == '5' ? 1 : 3;
+
+    uint32_t max_value;
+    size_t offset = 2;
+    if ((offset = pnm_next_field(data, size, offset, width)) == 0) return 0;
+    if ((offset = pnm_next_field(data, size, offset, height)) == 0) return 0;
+    if ((offset = pnm_next_field(data, size, offset, &max_value)) == 0) return 0;
+    // exactly one whitespace byte separates the header from the pixels
+    if (offset >= size || max_value != 255 || *width == 0 || *height == 0) return 0;
+    return offset + 1;
+}
+
+static void *map_file(const char *path, bool output, size_t size, size_t *mapped_size) {
+    int fd = output ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    if (output) {
+        if (ftruncate(fd, (off_t) size) != 0) {
+            close(fd);
+            return nullptr;
+        }
+    } else {
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+        size = (size_t) status.st_size;
+    }
+
+    void *mapping = mmap(nullptr, size, output ? PROT_READ | PROT_WRITE : PROT_READ,
+                         output ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return nullptr;
+    // every stage touches the whole image, so start faulting it in right away
+    madvise(mapping, size, MADV_WILLNEED);
+    *mapped_size = size;
+    return mapping;
+}
+
+bool image_file_open(image_file *file, const char *path, const raw_geometry *raw) {
+    memset(file, 0, sizeof(image_file));
+    file->format = image_format_from_path(path);
+    file->path = path;
+
+    if (file->format == IMAGE_FORMAT_PNG) {
+        uint8_t *data = nullptr;
+        size_t size = 0;
+        unsigned error = lodepng_load_file(&data, &size, path);
+        if (error == 0 && png_decode_segmented(data, size, &file->pixels, &file->width, &file->height)) {
+            file->channels = 1;
+        } else if (error == 0) {
+            error = lodepng_decode_memory(&file->pixels, &file->width, &file->height, data, size, LCT_RGB, 8);
+            file->channels = 3;
+        }
+        free(data);
+        if (error) {
+            printf("%s: error %u: %s\n", path, error, lodepng_error_text(error));
+            return false;
+        }
+        file->stride = (size_t) file->width * file->channels;
+        return true;
+    }
+
+    if (file->format == IMAGE_FORMAT_RAW && raw == nullptr) {
+        printf("%s: raw input needs its width, height and channels\n", path);
+        return false;
+    }
+    if (file->format == IMAGE_FORMAT_PBM || file->format == IMAGE_FORMAT_EDGES) {
+        printf("%s: edge masks and lists are only written\n", path);
+        return false;
+    }
+
+    file->mapping = map_file(path, false, 0, &file->mapping_size);
+    if (file->mapping == nullptr) {
+        printf("%s: cannot map the file\n", path);
+        return false;
+    }
+
+    size_t offset = 0;
+    if (file->format == IMAGE_FORMAT_PNM) {
+        offset = pnm_parse_header(file->mapping, file->mapping_size, &file->width, &file->height, &file->channels);
+        if (offset == 0) {
+            printf("%s: not an 8-bit binary PGM or PPM\n", path);
+            image_file_close(file);
+            return false;
+        }
+    } else {
+        file->width = raw->width;
+        file->height = raw->height;
+        file->channels = raw->channels;
+    }
+
+    file->stride = (size_t) file->width * file->channels;
+    if (file->mapping_size - offset < file->stride * file->height) {
+        printf("%s: the file is shorter than a %u x %u image\n", path, file->width, file->height);
+        image_file_close(file);
+        return false;
+    }
+    file->pixels = (uint8_t *) file->mapping + offset;
+    return true;
+}
+
+bool image_file_create(image_file *file, const char *path, uint32_t width, uint32_t height) {
+    memset(file, 0, sizeof(image_file));
+    file->format = image_format_from_path(path);
+    file->path = path;
+    file->width = width;
+    file->height = height;
+    file->channels = 1;
+    file->stride = width;
+    file->output = true;
+    if (file->format == IMAGE_FORMAT_PNG) return true;
+    if (file->format == IMAGE_FORMAT_EDGES) {
+        printf("%s: edge lists are written with edge_list_write\n", path);
+        return false;
+    }
+
+    char header[64] = {0};
+    if (file->format == IMAGE_FORMAT_PNM) snprintf(header, sizeof(header), "P5\n%u %u\n255\n", width, height);
+    if (file->format == IMAGE_FORMAT_PBM) {
+        snprintf(header, sizeof(header), "P4\n%u %u\n", width, height);
+        file->stride = (width + 7) / 8;
+    }
+    size_t header_size = strlen(header);
+
+    file->mapping = map_file(path, true, header_size + file->stride * height, &file->mapping_size);
+    if (file->mapping == nullptr) {
+        printf("%s: cannot create the file\n", path);
+        return false;
+    }
+    memcpy(file->mapping, header, header_size);
+    file->pixels = (uint8_t *) file->mapping + header_size;
+    return true;
+}
+
+bool image_file_close(image_file *file) {
+    bool written = true;
+    if (file->mapping != nullptr) {
+        munmap(file->mapping, file->mapping_size);
+    } else if (file->format == IMAGE_FORMAT_PNG && file->output) {
+        unsigned error = file->pixels != nullptr
+                         ? png_encode_grey_file(file->path, file->pixels, file->width, file->height, file->compression)
+                         : 0;
+        if (error) {
+            printf("%s: error %u: %s\n", file->path, error, lodepng_error_text(error));
+            written = false;
+        }
+    } else if (file->format == IMAGE_FORMAT_PNG) {
+        free(file->pixels);
+    }
+
+    file->mapping = nullptr;
+    file->pixels = nullptr;
+    return written;
+}
+
+bool edge_list_write(const char *path, uint32_t width, uint32_t height, const canny_edge *edges,
+                     const uint8_t *directions, size_t count) {
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr) {
+        printf("%s: cannot create the file\n", path);
+        return false;
+    }
+    bool written = fprintf(file, "CE\n%u %u %zu %d\n", width, height, count, directions != nullptr) > 0 &&
+                   fwrite(edges, sizeof(canny_edge), count, file) == count &&
+                   (directions == nullptr || fwrite(directions, 1, count, file) == count);
+    written = fclose(file) == 0 && written;
+    if (!written) printf("%s: cannot write the edge list\n", path);
+    return written;
+}
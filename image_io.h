@@ -0,0 +1,72 @@
+#ifndef EDGE_DETECTION_IMAGE_IO_H
+#define EDGE_DETECTION_IMAGE_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "canny.h"
+#include "png_codec.h"
+
+typedef enum {
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_PNM, // binary PGM (P5) and PPM (P6) with 8 bits per sample
+    IMAGE_FORMAT_RAW, // headerless rows of width * channels bytes
+    IMAGE_FORMAT_PBM, // binary PBM (P4), only written, one bit per pixel from canny_run_packed
+    IMAGE_FORMAT_EDGES, // only written by edge_list_write
+} image_format;
+
+// picked by extension: .png, .pgm, .ppm, .pbm or .edges, anything else is raw
+image_format image_format_from_path(const char *path);
+
+// the extension an edge map of that format gets, edge maps are always grey so PNM output is PGM
+const char *image_output_extension(image_format format);
+
+// width, height and channels of raw input, which has no header to read them from
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+} raw_geometry;
+
+// "<width>x<height>x<channels>", channels defaults to 1
+bool parse_raw_geometry(const char *text, raw_geometry *geometry);
+
+// An image file and its pixels.
+// PNM and raw files are mapped and pixels points straight into the mapping, so nothing is copied or converted.
+// PNG input is decoded into a buffer that is freed on close, grey if png_decode_segmented can take it and RGB from
+// lodepng otherwise.
+typedef struct {
+    image_format format;
+    const char *path;
+    uint8_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    size_t stride;
+    bool output;
+    void *mapping;
+    size_t mapping_size;
+    png_compression compression; // PNG output only, PNG_COMPRESSION_BEST unless set after creation
+} image_file;
+
+// raw is only needed for IMAGE_FORMAT_RAW paths
+bool image_file_open(image_file *file, const char *path, const raw_geometry *raw);
+
+// A grey output image, or a PBM mask with rows of (width + 7) / 8 bytes. PNM, PBM and raw files are created at
+// their final size and mapped, so the pipeline writes into the file directly. A PNG has no fixed layout, pixels stays
+// nullptr for the caller to point at its own buffer, which image_file_close then encodes.
+bool image_file_create(image_file *file, const char *path, uint32_t width, uint32_t height);
+
+// writes PNG output and unmaps or frees everything, returns false if the output could not be written
+bool image_file_close(image_file *file);
+
+// Writes the list of canny_run_edges: a text header "CE\n<width> <height> <count> <has directions>\n", then count
+// canny_edge records and, if directions is not nullptr, count canny_direction bytes, all in host byte order.
+bool edge_list_write(const char *path, uint32_t width, uint32_t height, const canny_edge *edges,
+                     const uint8_t *directions, size_t count);
+
+// Parses a binary PGM or PPM header from the first size bytes of data.
+// Returns the offset of the pixel data, or 0 if it is not an 8-bit binary PGM/PPM.
+size_t pnm_parse_header(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height, uint32_t *channels);
+
+#endif //EDGE_DETECTION_IMAGE_IO_H
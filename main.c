@@ -1,336 +1,1193 @@
 #include <stdio.h>
-#include <malloc.h>
+#include <stdlib.h>
 #include <stdint.h>
-#include <float.h>
-#include "vendor/lodepng/lodepng.h"
-#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "canny.h"
+#include "image_io.h"
+#include "server.h"
+#include "simd.h"
 #include <omp.h>
 #include <time.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <glob.h>
 
-// #define WRITE_INTERMEDIATE_IMAGES
+typedef struct {
+    canny_params params;
+    const raw_geometry *raw; // geometry of raw inputs, nullptr if there are none
+    int codec_threads;       // decoder and encoder threads each
+    const char *output_dir;  // nullptr writes <input>_edges.<extension> next to every input
+    png_compression compression;
+} batch_options;
 
-static uint8_t *float_array_to_uint8_array(const float *in, uint8_t *out, uint32_t width, uint32_t height) {
-    for (uint32_t i = 0; i < width * height; i++) {
-        out[i] = (uint8_t) (in[i] * 255.0f);
-    }
-    return out;
-}
+#define DEFAULT_CODEC_THREADS 2
 
-static uint32_t calculate_index_with_wrap_around(int x, int y, uint32_t width, uint32_t height) {
-    if (x < 0) x = (int) width + x;
-    if (y < 0) y = (int) height + y;
-    if (x >= (int) width) x = x - (int) width;
-    if (y >= (int) height) y = y - (int) height;
-    return y * width + x;
-}
+// source is a directory of .png, .ppm and .pgm files, a glob pattern or a manifest with one path per line
+int run_batch(const char *source, const batch_options *options);
+
+// PGM, PPM or raw in and PGM or raw out, without ever holding the whole image
+int run_stream(const char *input_path, const char *output_path, const canny_params *params, const raw_geometry *raw);
 
-#ifdef WRITE_INTERMEDIATE_IMAGES
+// raw frames of the given geometry in, grey edge frames of width * height bytes out, "-" is stdin or stdout
+// profile_path is where the --profile report goes, nullptr for none, incremental only recomputes what changed
+int run_video(const char *input_path, const char *output_path, const canny_params *params, const raw_geometry *frame,
+              const char *profile_path, bool incremental);
 
-static void write_intermediate_image(const char *filename, const float *image, uint32_t width, uint32_t height) {
-    uint8_t *image_uint8 = malloc(width * height * sizeof(uint8_t));
-    image_uint8 = float_array_to_uint8_array(image, image_uint8, width, height);
-    unsigned error = lodepng_encode_file(filename, image_uint8, width, height, LCT_GREY, 8);
-    if (error) printf("error %u: %s\n", error, lodepng_error_text(error));
-    free(image_uint8);
+// measures every pipeline on input_path scaled to a few common sizes and adds what ran fastest to the profile at
+// tuning_path, keeping the sizes and targets it does not measure
+int run_tune(const char *input_path, const raw_geometry *raw, const canny_params *params, const char *tuning_path);
+
+// "-" writes to fallback
+static bool write_profile(const canny_context *context, const char *path, FILE *fallback) {
+    FILE *file = strcmp(path, "-") == 0 ? fallback : fopen(path, "w");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    canny_context_write_profile(context, file);
+    return file == fallback ? fflush(file) == 0 : fclose(file) == 0;
 }
 
-#endif
+// x,y,<width>x<height>
+static bool parse_region(const char *text, canny_rect *rect) {
+    int length = 0;
+    int fields = sscanf(text, "%u,%u,%ux%u%n", &rect->x, &rect->y, &rect->width, &rect->height, &length);
+    return fields == 4 && text[length] == '\0' && rect->width > 0 && rect->height > 0;
+}
 
-#define LOW_THRESHOLD_RATIO 0.027f
-#define HIGH_THRESHOLD_RATIO 0.064f
-#define WEAK_EDGE_PIXEL 0.33f
-#define STRONG_EDGE_PIXEL 1.0f
+static void print_usage(const char *program) {
+    printf("Usage: %s [-s sigma] [-f] [-t tile_size] [-i [-c]] [-T threshold] [-B border] [-r repetitions] [-R WxHxC] [-A x,y,WxH]... [-z level] [input_image_path] [output_image_path]\n",
+           program);
+    printf("       %s [-s sigma] [-f] [-t tile_size] [-i] [-T threshold] [-B border] [-R WxHxC] -b <directory|glob|manifest> [-o output_dir] [-j codec_threads] [-z level]\n",
+           program);
+    printf("       %s [-s sigma] [-R WxHxC] -S input output\n", program);
+    printf("       %s [-s sigma] [-f] [-t tile_size] [-i] [-T threshold] [-B border] -R WxHxC -V [-I] [input|-] [output|-]\n", program);
+    printf("       %s [-s sigma] [-f] [-t tile_size] [-i] [-T threshold] [-B border] -D socket\n", program);
+    printf("       %s [-s sigma] [-t tile_size] [-T threshold] [-B border] [-R WxHxC] --tune[=profile] [input_image_path]\n", program);
+    printf("Images are .png, binary .pgm/.ppm or headerless raw, which needs -R width x height x channels.\n");
+    printf("PGM, PPM and raw files are memory mapped and used in place.\n");
+    printf("A single image can also be written as a 1-bit .pbm mask or as an .edges list of the edge pixels with\n");
+    printf("   their gradient direction, see edge_list_write in image_io.h for the layout.\n");
+    printf("-V reads raw frames until the end of the input, e.g. from ffmpeg -f rawvideo, and writes grey edge frames.\n");
+    printf("   With -I only the tiles a frame changed and their surroundings are recomputed, the edges stay the same.\n");
+    printf("   -I does not go with -i, the integer pipeline only runs over whole frames.\n");
+    printf("-D serves edge maps on a Unix socket until SIGINT or SIGTERM, see server.h for the protocol and canny_client\n");
+    printf("   for a client that measures the latency under load.\n");
+    printf("-T ratio|otsu|<percentile> picks the double threshold: fixed ratios of the largest gradient (the default),\n");
+    printf("   Otsu's method, or e.g. -T 0.8 for the strongest 20%% of the thinned edge candidates. Not supported with -S.\n");
+    printf("-B wrap|clamp|mirror|constant picks what the filters read past the edge of the image: the opposite edge\n");
+    printf("   (the default), the edge pixel, the image mirrored at its edge, or black. -S only wraps around.\n");
+    printf("-A x,y,WxH only detects edges inside that rectangle of a single image, can be given several times. Every\n");
+    printf("   rectangle is thresholded on its own and the rest of the output stays black.\n");
+    printf("-z best|fast|stored picks how PNG output is compressed: as small as lodepng gets it (the default), or\n");
+    printf("   split over all threads with a quick greedy match finder or with none at all. Both of those write edge maps\n");
+    printf("   with 1 bit per pixel, and PNGs they wrote are read back in parallel.\n");
+    printf("--profile[=report.json] prints a JSON profile of every stage for single images and -V, to stderr for -V.\n");
+    printf("--tune measures which thread count, OpenMP schedule of every stage and tile size run every pipeline fastest\n");
+    printf("   on this machine, on the input scaled from VGA to 4K, and keeps them in $CANNY_TUNING or\n");
+    printf("   ~/.cache/canny-edge-detection/tuning unless a profile is given. Every later run picks them up, with the\n");
+    printf("   sizes closest to its image. CANNY_TUNING= (empty) runs untuned. See canny_tuning_create in canny.h.\n");
+}
 
-float *apply_gaussian_filter(float *image, uint32_t width, uint32_t height);
+int main(int argc, char **argv) {
+    uint32_t width, height;
 
-float *convert_to_grayscale(float *image, uint32_t width, uint32_t height);
+    char inputImagePath[1024] = {0};
+    char outputImagePath[1024] = {0};
+    float sigma = CANNY_DEFAULT_SIGMA;
+    bool fused = false;
+    bool integer = false;
+    bool compare = false;
+    uint32_t tile_size = CANNY_DEFAULT_TILE_SIZE;
+    int repetitions = 1;
+    const char *batch_source = nullptr;
+    const char *socket_path = nullptr;
+    const char *batch_output_dir = nullptr;
+    int codec_threads = DEFAULT_CODEC_THREADS;
+    bool stream = false;
+    bool video = false;
+    bool incremental = false;
+    raw_geometry raw_storage;
+    const raw_geometry *raw = nullptr;
+    const char *profile_path = nullptr;
+    bool tune = false;
+    const char *tune_path = nullptr;
+    canny_threshold threshold = CANNY_THRESHOLD_RATIO;
+    float percentile = CANNY_DEFAULT_PERCENTILE;
+    canny_border border = CANNY_BORDER_WRAP;
+    canny_rect *regions = nullptr;
+    size_t region_count = 0;
+    png_compression compression = PNG_COMPRESSION_BEST;
+    const struct option long_options[] = {
+            {"profile", optional_argument, nullptr, 'p'},
+            {"tune",    optional_argument, nullptr, 'u'},
+            {nullptr, 0,                   nullptr, 0},
+    };
 
-float *apply_sobel_filter(float *image, uint32_t width, uint32_t height);
+    int option;
+    while ((option = getopt_long(argc, argv, "s:ft:r:icb:o:j:SR:VIT:B:A:z:D:", long_options, nullptr)) != -1) {
+        switch (option) {
+            case 's':
+                sigma = strtof(optarg, nullptr);
+                if (sigma <= 0.0f) {
+                    printf("Gaussian sigma has to be positive\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                fused = true;
+                break;
+            case 'i':
+                integer = true;
+                break;
+            case 'c':
+                compare = true;
+                break;
+            case 't':
+                tile_size = (uint32_t) strtoul(optarg, nullptr, 10);
+                if (tile_size == 0) {
+                    printf("Tile size has to be positive\n");
+                    return 1;
+                }
+                break;
+            case 'r':
+                repetitions = atoi(optarg);
+                if (repetitions < 1) {
+                    printf("Repetitions have to be positive\n");
+                    return 1;
+                }
+                break;
+            case 'b':
+                batch_source = optarg;
+                break;
+            case 'o':
+                batch_output_dir = optarg;
+                break;
+            case 'j':
+                codec_threads = atoi(optarg);
+                if (codec_threads < 1) {
+                    printf("Codec threads have to be positive\n");
+                    return 1;
+                }
+                break;
+            case 'S':
+                stream = true;
+                break;
+            case 'V':
+                video = true;
+                break;
+            case 'I':
+                incremental = true;
+                break;
+            case 'T':
+                if (strcmp(optarg, "ratio") == 0) {
+                    threshold = CANNY_THRESHOLD_RATIO;
+                } else if (strcmp(optarg, "otsu") == 0) {
+                    threshold = CANNY_THRESHOLD_OTSU;
+                } else {
+                    threshold = CANNY_THRESHOLD_PERCENTILE;
+                    percentile = strtof(optarg, nullptr);
+                    if (!(percentile > 0.0f && percentile < 1.0f)) {
+                        printf("Threshold has to be ratio, otsu or a percentile between 0 and 1\n");
+                        return 1;
+                    }
+                }
+                break;
+            case 'B':
+                if (strcmp(optarg, "wrap") == 0) {
+                    border = CANNY_BORDER_WRAP;
+                } else if (strcmp(optarg, "clamp") == 0) {
+                    border = CANNY_BORDER_CLAMP;
+                } else if (strcmp(optarg, "mirror") == 0) {
+                    border = CANNY_BORDER_MIRROR;
+                } else if (strcmp(optarg, "constant") == 0) {
+                    border = CANNY_BORDER_CONSTANT;
+                } else {
+                    printf("Border has to be wrap, clamp, mirror or constant\n");
+                    return 1;
+                }
+                break;
+            case 'A':
+                regions = realloc(regions, (region_count + 1) * sizeof(canny_rect));
+                if (!parse_region(optarg, &regions[region_count++])) {
+                    printf("Region has to be <x>,<y>,<width>x<height>\n");
+                    free(regions);
+                    return 1;
+                }
+                break;
+            case 'z':
+                if (strcmp(optarg, "best") == 0) {
+                    compression = PNG_COMPRESSION_BEST;
+                } else if (strcmp(optarg, "fast") == 0) {
+                    compression = PNG_COMPRESSION_FAST;
+                } else if (strcmp(optarg, "stored") == 0) {
+                    compression = PNG_COMPRESSION_STORED;
+                } else {
+                    printf("PNG compression has to be best, fast or stored\n");
+                    return 1;
+                }
+                break;
+            case 'D':
+                socket_path = optarg;
+                break;
+            case 'p':
+                profile_path = optarg != nullptr ? optarg : "-";
+                break;
+            case 'u':
+                tune = true;
+                tune_path = optarg;
+                break;
+            case 'R':
+                if (!parse_raw_geometry(optarg, &raw_storage)) {
+                    printf("Raw geometry has to be <width>x<height>[x<channels>] with 1, 3 or 4 channels\n");
+                    return 1;
+                }
+                raw = &raw_storage;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
 
-float *apply_edge_thinning(float *image, uint32_t width, uint32_t height);
+    canny_params params = {
+            .sigma = sigma,
+            .pipeline = integer ? CANNY_PIPELINE_INTEGER : fused ? CANNY_PIPELINE_FUSED : CANNY_PIPELINE_FLOAT,
+            .tile_size = tile_size,
+            .channels = 3,
+            .profile = profile_path != nullptr,
+            .threshold = threshold,
+            .percentile = percentile,
+            .border = border
+    };
 
-float *apply_double_threshold(float *image, uint32_t width, uint32_t height);
+    if (regions != nullptr && (batch_source != nullptr || stream || video || socket_path != nullptr || tune)) {
+        printf("Regions are only supported for single images\n");
+        free(regions);
+        return 1;
+    }
 
-float *apply_edge_histeresis(float *image, uint32_t width, uint32_t height);
+    char tuning_path[1024] = {0};
+    if (tune_path != nullptr) {
+        snprintf(tuning_path, sizeof(tuning_path), "%s", tune_path);
+    } else {
+        canny_tuning_default_path(tuning_path, sizeof(tuning_path));
+    }
+    if (tune) {
+        if (argc - optind > 1 || batch_source != nullptr || socket_path != nullptr || stream || video) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (tuning_path[0] == '\0') {
+            printf("There is no place for the tuning profile, give one with --tune=<profile>\n");
+            return 1;
+        }
+        return run_tune(argc - optind == 1 ? argv[optind] : "lenna.png", raw, &params, tuning_path);
+    }
+    // every mode runs with what --tune measured, if it ever ran
+    canny_tuning *tuning = tuning_path[0] != '\0' ? canny_tuning_load(tuning_path) : nullptr;
+    params.tuning = tuning;
 
-// for sigma = 1.0
-#define GAUSSIAN_KERNEL_SIZE 5
-static const float gaussian_kernel[5][5] = {
-        {1.0f / 273.0f, 4.0f / 273.0f,  7.0f / 273.0f,  4.0f / 273.0f,  1.0f / 273.0f},
-        {4.0f / 273.0f, 16.0f / 273.0f, 26.0f / 273.0f, 16.0f / 273.0f, 4.0f / 273.0f},
-        {7.0f / 273.0f, 26.0f / 273.0f, 41.0f / 273.0f, 26.0f / 273.0f, 7.0f / 273.0f},
-        {4.0f / 273.0f, 16.0f / 273.0f, 26.0f / 273.0f, 16.0f / 273.0f, 4.0f / 273.0f},
-        {1.0f / 273.0f, 4.0f / 273.0f,  7.0f / 273.0f,  4.0f / 273.0f,  1.0f / 273.0f}
-};
+    if (socket_path != nullptr) {
+        if (argc - optind != 0 || batch_source != nullptr || stream || video) {
+            print_usage(argv[0]);
+            canny_tuning_destroy(tuning);
+            return 1;
+        }
+        // a profile of every request would only grow
+        params.profile = false;
+        int result = run_server(socket_path, &params);
+        canny_tuning_destroy(tuning);
+        return result;
+    }
 
-static const float sobel_kernel_x[3][3] = {
-        {-1, 0, 1},
-        {-2, 0, 2},
-        {-1, 0, 1}
-};
-static const float sobel_kernel_y[3][3] = {
-        {1,  2,  1},
-        {0,  0,  0},
-        {-1, -2, -1}
-};
+    if (batch_source != nullptr) {
+        batch_options options = {
+                .params = params, .raw = raw, .codec_threads = codec_threads, .output_dir = batch_output_dir,
+                .compression = compression
+        };
+        // the context is recreated whenever a larger image comes along, so there is no profile of the whole batch
+        options.params.profile = false;
+        int result = run_batch(batch_source, &options);
+        canny_tuning_destroy(tuning);
+        return result;
+    }
 
-int main(int argc, char **argv) {
-    uint32_t error;
-    uint8_t *image;
-    uint32_t width, height;
+    if (stream) {
+        int result = 1;
+        if (argc - optind != 2 || integer) {
+            print_usage(argv[0]);
+        } else {
+            result = run_stream(argv[optind], argv[optind + 1], &params, raw);
+        }
+        canny_tuning_destroy(tuning);
+        return result;
+    }
 
-    char inputImagePath[1024] = {0};
-    char outputImagePath[1024] = {0};
+    if (video) {
+        int result = 1;
+        if (argc - optind > 2 || raw == nullptr || (incremental && integer)) {
+            print_usage(argv[0]);
+        } else {
+            const char *input_path = argc - optind > 0 ? argv[optind] : "-";
+            const char *output_path = argc - optind > 1 ? argv[optind + 1] : "-";
+            result = run_video(input_path, output_path, &params, raw, profile_path, incremental);
+        }
+        canny_tuning_destroy(tuning);
+        return result;
+    }
 
-    switch (argc) {
-        case 1:
+    switch (argc - optind) {
+        case 0:
             strcpy(inputImagePath, "lenna.png");
             strcpy(outputImagePath, "/tmp/lena_out.png");
             break;
-        case 2:
-            assert(strstr(argv[1], ".png") != nullptr);
-            strcpy(inputImagePath, argv[1]);
+        case 1:
+            strcpy(inputImagePath, argv[optind]);
             strcpy(outputImagePath, "/tmp/lena_out.png");
             break;
-        case 3:
-            assert(strstr(argv[2], ".png") != nullptr);
-            assert(strstr(argv[3], ".png") != nullptr);
-            strcpy(inputImagePath, argv[1]);
-            strcpy(outputImagePath, argv[2]);
+        case 2:
+            strcpy(inputImagePath, argv[optind]);
+            strcpy(outputImagePath, argv[optind + 1]);
             break;
         default:
-            printf("Usage: %s [input_image_path] [output_image_path]\n", argv[0]);
+            print_usage(argv[0]);
             return 1;
     }
 
+    image_format output_format = image_format_from_path(outputImagePath);
+    if (regions != nullptr && (output_format == IMAGE_FORMAT_PBM || output_format == IMAGE_FORMAT_EDGES)) {
+        printf("Regions are only written as grey edge maps\n");
+        free(regions);
+        canny_tuning_destroy(tuning);
+        return 1;
+    }
+
     printf("Input image path: %s\n", inputImagePath);
     printf("Output image path: %s\n", outputImagePath);
     printf("Using %d threads\n", omp_get_max_threads());
+    if (tuning != nullptr) printf("Tuned by %s\n", tuning_path);
+    printf("Gaussian sigma: %.2f\n", sigma);
+    if (fused) printf("Fused pipeline with %ux%u tiles\n", tile_size, tile_size);
+    if (integer) printf("Integer pipeline\n");
+    else printf("SIMD kernels: %s\n", get_simd_kernels()->name);
 
-    error = lodepng_decode24_file(&image, &width, &height, inputImagePath);
-    if (error) printf("error %u: %s\n", error, lodepng_error_text(error));
-    printf("The loaded image has dimensions %u x %u\n", width, height);
+    image_file input;
+    if (!image_file_open(&input, inputImagePath, raw)) return 1;
+    width = input.width;
+    height = input.height;
+    params.channels = input.channels;
+    printf("The loaded image has dimensions %u x %u with %u channels\n", width, height, input.channels);
 
-    // turn the image into a float array as it's easier to work with
-    float *image_float = malloc(width * height * 3 * sizeof(float));
-    for (uint32_t i = 0; i < width * height * 3; i++) {
-        image_float[i] = (float) image[i] / 255.0f;
-    }
+    canny_context *context = canny_context_create(width, height, &params);
+    assert(context != nullptr);
 
-    struct timespec start;
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    // PGM, PBM and raw output is mapped, so the edges go straight into the file
+    bool list = output_format == IMAGE_FORMAT_EDGES;
+    image_file output = {0};
+    if (!list && !image_file_create(&output, outputImagePath, width, height)) {
+        canny_context_destroy(context);
+        canny_tuning_destroy(tuning);
+        image_file_close(&input);
+        return 1;
+    }
+    output.compression = compression;
+    uint8_t *edges_buffer = nullptr;
+    if (!list && output.pixels == nullptr) output.pixels = edges_buffer = malloc((size_t) width * height);
+    uint8_t *edges = output.pixels;
+    bool packed = output.format == IMAGE_FORMAT_PBM;
+    // regions leave everything outside them alone
+    for (uint32_t y = 0; regions != nullptr && y < height; y++) {
+        memset(edges + y * output.stride, 0, width);
+    }
 
-    image_float = convert_to_grayscale(image_float, width, height);
-    image_float = apply_gaussian_filter(image_float, width, height);
-    image_float = apply_sobel_filter(image_float, width, height);
-    image_float = apply_edge_thinning(image_float, width, height);
-    image_float = apply_double_threshold(image_float, width, height);
-    image_float = apply_edge_histeresis(image_float, width, height);
+    // room for an eighth of the pixels, grown to the reported count when an image has more
+    size_t edge_capacity = list ? (size_t) width * height / 8 + 1 : 0;
+    size_t edge_count = 0;
+    canny_edge *edge_list = list ? malloc(edge_capacity * sizeof(canny_edge)) : nullptr;
+    uint8_t *edge_directions = list ? malloc(edge_capacity) : nullptr;
 
-    struct timespec end;
-    clock_gettime(CLOCK_MONOTONIC, &end);
 #define TIME_IN_SECONDS(start, end) ((double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1000000000)
+    canny_status status = CANNY_OK;
+    for (int run = 0; run < repetitions && status == CANNY_OK; run++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-    printf("Time taken: %f seconds\n", TIME_IN_SECONDS(start, end));
+        if (regions != nullptr) {
+            status = canny_run_regions(context, input.pixels, width, height, input.stride, regions, region_count,
+                                       edges, output.stride);
+        } else if (list) {
+            status = canny_run_edges(context, input.pixels, width, height, input.stride, edge_list, edge_directions,
+                                     edge_capacity, &edge_count);
+            if (status == CANNY_ERROR_CAPACITY) {
+                edge_capacity = edge_count;
+                edge_list = realloc(edge_list, edge_capacity * sizeof(canny_edge));
+                edge_directions = realloc(edge_directions, edge_capacity);
+                status = canny_run_edges(context, input.pixels, width, height, input.stride, edge_list,
+                                         edge_directions, edge_capacity, &edge_count);
+            }
+        } else if (packed) {
+            status = canny_run_packed(context, input.pixels, width, height, input.stride, edges, output.stride);
+        } else {
+            status = canny_run(context, input.pixels, width, height, input.stride, edges, output.stride);
+        }
 
-    image = float_array_to_uint8_array(image_float, image, width, height);
-    error = lodepng_encode_file(outputImagePath, image, width, height, LCT_GREY, 8);
-    if (error) printf("error %u: %s\n", error, lodepng_error_text(error));
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (status == CANNY_OK) printf("Time taken: %f seconds\n", TIME_IN_SECONDS(start, end));
+    }
+    if (status != CANNY_OK) printf("error: %s\n", canny_status_text(status));
+    if (status == CANNY_OK && list) {
+        printf("Edges: %zu (%.2f%% of the pixels)\n", edge_count, 100.0 * (double) edge_count / width / height);
+    }
+    printf("Peak workspace size: %zu bytes\n", canny_context_peak_bytes(context));
+    bool profiled = profile_path == nullptr || write_profile(context, profile_path, stdout);
 
-    free(image_float);
-    free(image);
-    return 0;
+    if (status == CANNY_OK && integer && compare && !list && !packed && regions == nullptr) {
+        canny_params reference_params = params;
+        reference_params.pipeline = CANNY_PIPELINE_FLOAT;
+        reference_params.profile = false;
+        canny_context *reference_context = canny_context_create(width, height, &reference_params);
+        size_t pixels = (size_t) width * height;
+        uint8_t *reference = malloc(pixels);
+        canny_run(reference_context, input.pixels, width, height, input.stride, reference, width);
+        size_t differences = 0;
+        for (size_t i = 0; i < pixels; i++) {
+            if (reference[i] != edges[i]) differences++;
+        }
+        printf("Integer pipeline differs from the float pipeline in %zu of %zu pixels (%.4f%%)\n",
+               differences, pixels, 100.0 * (double) differences / (double) pixels);
+        free(reference);
+        canny_context_destroy(reference_context);
+    }
+
+    bool written = list ? status == CANNY_OK && edge_list_write(outputImagePath, width, height, edge_list,
+                                                                edge_directions, edge_count)
+                        : image_file_close(&output);
+    image_file_close(&input);
+    canny_context_destroy(context);
+    free(edges_buffer);
+    free(edge_list);
+    free(edge_directions);
+    free(regions);
+    canny_tuning_destroy(tuning);
+    return status == CANNY_OK && written && profiled ? 0 : 1;
+}
+
+// Batch mode runs decode, compute and encode as a pipeline over a fixed pool of slots:
+// free -> decoders -> decoded -> compute -> computed -> encoders -> free.
+// The pool size bounds the queues and the memory, and every slot keeps its buffers for the next image.
+#define BATCH_SLOTS 4
+
+typedef struct {
+    const char *input_path;
+    char output_path[1024];
+    image_file input;
+    // PGM and raw outputs are mapped by the decoder and computed into directly, PNG output goes through edges
+    image_file output;
+    uint8_t *edges;
+    size_t edges_capacity;
+} batch_slot;
+
+// a bounded queue of slots, shared by batch and video mode
+typedef struct {
+    void *slots[BATCH_SLOTS];
+    int head;
+    int count;
+    bool closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} batch_queue;
+
+static void batch_queue_init(batch_queue *queue) {
+    memset(queue, 0, sizeof(batch_queue));
+    pthread_mutex_init(&queue->mutex, nullptr);
+    pthread_cond_init(&queue->changed, nullptr);
 }
 
-float *convert_to_grayscale(float *image, uint32_t width, uint32_t height) {
-    float *new_image = malloc(width * height * sizeof(float));
-#pragma omp parallel default(none) shared(image, new_image, width, height)
-    for (uint32_t i = 0; i < width * height; i++) {
-        new_image[i] = 0.2126f * image[i * 3] + 0.7152f * image[i * 3 + 1] + 0.0722f * image[i * 3 + 2];
+static void batch_queue_destroy(batch_queue *queue) {
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->changed);
+}
+
+// never blocks, there are only BATCH_SLOTS slots in flight
+static void batch_queue_push(batch_queue *queue, void *slot) {
+    pthread_mutex_lock(&queue->mutex);
+    assert(queue->count < BATCH_SLOTS);
+    queue->slots[(queue->head + queue->count) % BATCH_SLOTS] = slot;
+    queue->count++;
+    pthread_cond_signal(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// returns nullptr once the queue is closed and drained
+static void *batch_queue_pop(batch_queue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->changed, &queue->mutex);
     }
 
-#ifdef WRITE_INTERMEDIATE_IMAGES
-    write_intermediate_image("/tmp/test_after_grayscale.png", new_image, width, height);
-#endif
+    void *slot = nullptr;
+    if (queue->count > 0) {
+        slot = queue->slots[queue->head];
+        queue->head = (queue->head + 1) % BATCH_SLOTS;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return slot;
+}
 
-    free(image);
-    return new_image;
+static void batch_queue_close(batch_queue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
 }
 
-float *apply_gaussian_filter(float *image, uint32_t width, uint32_t height) {
-    float *new_image = malloc(width * height * sizeof(float));
-    int kernel_radius = GAUSSIAN_KERNEL_SIZE / 2;
-
-#pragma omp parallel for default(none) shared(image, new_image, width, height, kernel_radius, gaussian_kernel) collapse(2)
-    for (int y = 0; y < (int) height; y++) {
-        for (int x = 0; x < (int) width; x++) {
-            float new_pixel_value = 0.0f;
-
-            for (int i = -kernel_radius; i <= kernel_radius; i++) {
-                for (int j = -kernel_radius; j <= kernel_radius; j++) {
-                    int current_x = x + j;
-                    int current_y = y + i;
-                    uint32_t pixel_index = calculate_index_with_wrap_around(current_x, current_y, width, height);
-                    new_pixel_value += image[pixel_index] * gaussian_kernel[i + kernel_radius][j + kernel_radius];
-                }
-            }
+typedef struct {
+    const batch_options *options;
+    char **paths;
+    size_t path_count;
+    size_t next_path;
+    int active_decoders;
+    size_t failures;
+    pthread_mutex_t mutex;
+    batch_queue free_slots;
+    batch_queue decoded;
+    batch_queue computed;
+} batch_pipeline;
+
+// the output keeps the format of the input, PPM becomes PGM
+static void batch_output_path(const batch_options *options, const char *input_path, char *output_path) {
+    const char *output_extension = image_output_extension(image_format_from_path(input_path));
+    const char *name = strrchr(input_path, '/');
+    name = name != nullptr ? name + 1 : input_path;
+    const char *extension = strrchr(name, '.');
+    int stem_length = extension != nullptr ? (int) (extension - input_path) : (int) strlen(input_path);
+
+    if (options->output_dir != nullptr) {
+        int name_length = stem_length - (int) (name - input_path);
+        snprintf(output_path, 1024, "%s/%.*s%s", options->output_dir, name_length, name, output_extension);
+        return;
+    }
+
+    snprintf(output_path, 1024, "%.*s_edges%s", stem_length, input_path, output_extension);
+}
 
-            uint32_t pixel_index = y * width + x;
-            new_image[pixel_index] = new_pixel_value;
+static void batch_failed(batch_pipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->failures++;
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+// the codec threads already work on several images at once, so each one decodes and encodes on its own
+static void *batch_decoder(void *argument) {
+    batch_pipeline *pipeline = argument;
+    omp_set_num_threads(1);
+
+    while (true) {
+        pthread_mutex_lock(&pipeline->mutex);
+        size_t index = pipeline->next_path++;
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (index >= pipeline->path_count) break;
+
+        batch_slot *slot = batch_queue_pop(&pipeline->free_slots);
+        slot->input_path = pipeline->paths[index];
+        batch_output_path(pipeline->options, slot->input_path, slot->output_path);
+
+        if (!image_file_open(&slot->input, slot->input_path, pipeline->options->raw)) {
+            batch_failed(pipeline);
+            batch_queue_push(&pipeline->free_slots, slot);
+            continue;
+        }
+        if (!image_file_create(&slot->output, slot->output_path, slot->input.width, slot->input.height)) {
+            image_file_close(&slot->input);
+            batch_failed(pipeline);
+            batch_queue_push(&pipeline->free_slots, slot);
+            continue;
         }
+        slot->output.compression = pipeline->options->compression;
+
+        batch_queue_push(&pipeline->decoded, slot);
     }
 
-#ifdef WRITE_INTERMEDIATE_IMAGES
-    write_intermediate_image("/tmp/test_after_gaussian_filter.png", new_image, width, height);
-#endif
+    pthread_mutex_lock(&pipeline->mutex);
+    bool last = --pipeline->active_decoders == 0;
+    pthread_mutex_unlock(&pipeline->mutex);
+    if (last) batch_queue_close(&pipeline->decoded);
+    return nullptr;
+}
+
+static void *batch_encoder(void *argument) {
+    batch_pipeline *pipeline = argument;
+    omp_set_num_threads(1);
 
-    free(image);
-    return new_image;
+    batch_slot *slot;
+    while ((slot = batch_queue_pop(&pipeline->computed)) != nullptr) {
+        // encodes PNG output, mapped outputs were written by compute and only need unmapping
+        if (!image_file_close(&slot->output)) batch_failed(pipeline);
+        batch_queue_push(&pipeline->free_slots, slot);
+    }
+    return nullptr;
 }
 
-float *apply_sobel_filter(float *image, uint32_t width, uint32_t height) {
-    float *new_image = malloc(width * height * 2 * sizeof(float));
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
 
-#pragma omp parallel for default(none) shared(image, new_image, width, height, sobel_kernel_x, sobel_kernel_y) collapse(2)
-    for (int y = 0; y < (int) height; y++) {
-        for (int x = 0; x < (int) width; x++) {
-            float sobel_x = 0.0f;
-            float sobel_y = 0.0f;
+static void add_batch_path(char ***paths, size_t *count, size_t *capacity, const char *path) {
+    if (*count == *capacity) {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        *paths = realloc(*paths, *capacity * sizeof(char *));
+    }
+    (*paths)[(*count)++] = strdup(path);
+}
 
-            for (int i = -1; i <= 1; i++) {
-                for (int j = -1; j <= 1; j++) {
-                    int current_x = x + j;
-                    int current_y = y + i;
+static char **collect_batch_paths(const char *source, size_t *count) {
+    char **paths = nullptr;
+    size_t capacity = 0;
+    *count = 0;
 
-                    uint32_t pixel_index = calculate_index_with_wrap_around(current_x, current_y, width, height);
-                    sobel_x += image[pixel_index] * sobel_kernel_x[i + 1][j + 1];
-                    sobel_y += image[pixel_index] * sobel_kernel_y[i + 1][j + 1];
-                }
+    DIR *directory = opendir(source);
+    if (directory != nullptr) {
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != nullptr) {
+            const char *extension = strrchr(entry->d_name, '.');
+            if (extension == nullptr) continue;
+            // raw files need -R for their geometry, PBM masks and edge lists are only ever outputs
+            image_format format = image_format_from_path(entry->d_name);
+            if (format == IMAGE_FORMAT_RAW || format == IMAGE_FORMAT_PBM || format == IMAGE_FORMAT_EDGES) continue;
+            // skip the results of a previous run without -o
+            size_t stem_length = extension - entry->d_name;
+            if (stem_length >= 6 && strncmp(extension - 6, "_edges", 6) == 0) continue;
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+            add_batch_path(&paths, count, &capacity, path);
+        }
+        closedir(directory);
+        qsort(paths, *count, sizeof(char *), compare_paths);
+        return paths;
+    }
+
+    if (strpbrk(source, "*?[") != nullptr) {
+        glob_t matches;
+        if (glob(source, 0, nullptr, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                add_batch_path(&paths, count, &capacity, matches.gl_pathv[i]);
             }
+        }
+        globfree(&matches);
+        return paths;
+    }
 
-            float magnitude = sqrtf(sobel_x * sobel_x + sobel_y * sobel_y);
-            float orientation = atan2f(sobel_y, sobel_x);
-            orientation = orientation * (180.0f / (float) M_PI); // convert to radians
-            float orientation_rounded = roundf(orientation / 45.0f) * 45.0f;
-            orientation_rounded = fmodf(orientation_rounded + 180.0f, 180.0f); // convert to 0-180
-            new_image[y * width + x] = magnitude;
-            new_image[width * height + y * width + x] = orientation_rounded;
+    FILE *manifest = fopen(source, "r");
+    if (manifest == nullptr) return nullptr;
+    char line[1024];
+    while (fgets(line, sizeof(line), manifest) != nullptr) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        add_batch_path(&paths, count, &capacity, line);
+    }
+    fclose(manifest);
+    return paths;
+}
+
+int run_batch(const char *source, const batch_options *options) {
+    batch_pipeline pipeline = {.options = options, .active_decoders = options->codec_threads};
+    pipeline.paths = collect_batch_paths(source, &pipeline.path_count);
+    if (pipeline.path_count == 0) {
+        printf("No input images found in %s\n", source);
+        free(pipeline.paths);
+        return 1;
+    }
+
+    printf("Batch of %zu images with %d decoder and %d encoder threads, %d compute threads\n",
+           pipeline.path_count, options->codec_threads, options->codec_threads, omp_get_max_threads());
+
+    pthread_mutex_init(&pipeline.mutex, nullptr);
+    batch_queue_init(&pipeline.free_slots);
+    batch_queue_init(&pipeline.decoded);
+    batch_queue_init(&pipeline.computed);
+
+    batch_slot slots[BATCH_SLOTS] = {0};
+    for (int i = 0; i < BATCH_SLOTS; i++) {
+        batch_queue_push(&pipeline.free_slots, &slots[i]);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t *codec_threads = malloc(2 * options->codec_threads * sizeof(pthread_t));
+    for (int i = 0; i < options->codec_threads; i++) {
+        pthread_create(&codec_threads[i], nullptr, batch_decoder, &pipeline);
+        pthread_create(&codec_threads[options->codec_threads + i], nullptr, batch_encoder, &pipeline);
+    }
+
+    // compute runs on this thread so the OpenMP pool stays warm between images
+    canny_context *context = nullptr;
+    canny_params params = options->params;
+    uint32_t max_width = 0;
+    uint32_t max_height = 0;
+    size_t images = 0;
+    double megapixels = 0.0;
+    double compute_seconds = 0.0;
+    batch_slot *slot;
+    while ((slot = batch_queue_pop(&pipeline.decoded)) != nullptr) {
+        uint32_t width = slot->input.width;
+        uint32_t height = slot->input.height;
+        if (context == nullptr || width > max_width || height > max_height || slot->input.channels != params.channels) {
+            if (width > max_width) max_width = width;
+            if (height > max_height) max_height = height;
+            params.channels = slot->input.channels;
+            canny_context_destroy(context);
+            context = canny_context_create(max_width, max_height, &params);
+            assert(context != nullptr);
         }
+        if (slot->output.pixels == nullptr) {
+            if ((size_t) width * height > slot->edges_capacity) {
+                free(slot->edges);
+                slot->edges = malloc((size_t) width * height);
+                slot->edges_capacity = (size_t) width * height;
+            }
+            slot->output.pixels = slot->edges;
+        }
+
+        struct timespec compute_start;
+        clock_gettime(CLOCK_MONOTONIC, &compute_start);
+        canny_status status = canny_run(context, slot->input.pixels, width, height, slot->input.stride,
+                                        slot->output.pixels, slot->output.stride);
+        struct timespec compute_end;
+        clock_gettime(CLOCK_MONOTONIC, &compute_end);
+        compute_seconds += TIME_IN_SECONDS(compute_start, compute_end);
+
+        // a decoded PNG is always a fresh lodepng allocation, so inputs are not kept around like the other buffers
+        image_file_close(&slot->input);
+
+        if (status != CANNY_OK) {
+            printf("%s: error: %s\n", slot->input_path, canny_status_text(status));
+            // a mapped output already has its final size, empty it rather than leave a blank edge map behind
+            bool mapped = slot->output.mapping != nullptr;
+            slot->output.pixels = nullptr;
+            image_file_close(&slot->output);
+            if (mapped) truncate(slot->output_path, 0);
+            batch_failed(&pipeline);
+            batch_queue_push(&pipeline.free_slots, slot);
+            continue;
+        }
+
+        images++;
+        megapixels += (double) width * height / 1e6;
+        batch_queue_push(&pipeline.computed, slot);
     }
+    batch_queue_close(&pipeline.computed);
 
-#ifdef WRITE_INTERMEDIATE_IMAGES
-    write_intermediate_image("/tmp/test_after_sobel_intensity_filter.png", new_image, width, height);
-    write_intermediate_image("/tmp/test_after_sobel_orientation_filter.png", new_image + width * height, width, height);
-#endif
+    for (int i = 0; i < 2 * options->codec_threads; i++) {
+        pthread_join(codec_threads[i], nullptr);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = TIME_IN_SECONDS(start, end);
+
+    printf("Processed %zu images (%.2f MP) in %.3f seconds, %zu failed\n", images, megapixels, seconds, pipeline.failures);
+    printf("Throughput: %.2f images/s, %.2f MP/s\n", (double) images / seconds, megapixels / seconds);
+    printf("Compute: %.3f seconds (%.1f%% of wall time)\n", compute_seconds, 100.0 * compute_seconds / seconds);
+    if (context != nullptr) {
+        printf("Peak workspace size: %zu bytes\n", canny_context_peak_bytes(context));
+        canny_context_destroy(context);
+    }
 
-    free(image);
-    return new_image;
+    for (int i = 0; i < BATCH_SLOTS; i++) {
+        free(slots[i].edges);
+    }
+    for (size_t i = 0; i < pipeline.path_count; i++) {
+        free(pipeline.paths[i]);
+    }
+    free(pipeline.paths);
+    free(codec_threads);
+    batch_queue_destroy(&pipeline.free_slots);
+    batch_queue_destroy(&pipeline.decoded);
+    batch_queue_destroy(&pipeline.computed);
+    pthread_mutex_destroy(&pipeline.mutex);
+    return pipeline.failures == 0 ? 0 : 1;
 }
 
-float *apply_edge_thinning(float *image, uint32_t width, uint32_t height) {
-    float *new_image = malloc(width * height * sizeof(float));
-
-#pragma omp parallel for default(none) shared(image, new_image, width, height) collapse(2)
-    for (int y = 0; y < (int) height; y++) {
-        for (int x = 0; x < (int) width; x++) {
-            float q = 255.0f;
-            float r = 255.0f;
-            uint32_t angle_index = width * height + y * width + x;
-            float angle = image[angle_index];
-
-            // angle 0
-            if (angle >= 0 && angle < 22.5) {
-                q = image[calculate_index_with_wrap_around(x + 1, y, width, height)];
-                r = image[calculate_index_with_wrap_around(x - 1, y, width, height)];
-            } else if (angle >= 22.5 && angle < 67.5) { // angle 45
-                q = image[calculate_index_with_wrap_around(x - 1, y + 1, width, height)];
-                r = image[calculate_index_with_wrap_around(x + 1, y - 1, width, height)];
-            } else if (angle >= 67.5 && angle < 112.5) { // angle 90
-                q = image[calculate_index_with_wrap_around(x, y + 1, width, height)];
-                r = image[calculate_index_with_wrap_around(x, y - 1, width, height)];
-            } else if (angle >= 112.5 && angle < 157.5) { // angle 135
-                q = image[calculate_index_with_wrap_around(x - 1, y - 1, width, height)];
-                r = image[calculate_index_with_wrap_around(x + 1, y + 1, width, height)];
-            }
+typedef struct {
+    FILE *input;
+    FILE *output;
+    long data_offset;
+    size_t input_row_size;
+    uint32_t width;
+} stream_files;
 
-            float intensity = image[y * width + x];
-            if (intensity >= q && intensity >= r) {
-                new_image[y * width + x] = intensity;
-            } else {
-                new_image[y * width + x] = 0.0f;
-            }
+static bool stream_files_read(void *user, uint8_t *rows, uint32_t count) {
+    stream_files *files = user;
+    return fread(rows, files->input_row_size, count, files->input) == count;
+}
+
+static bool stream_files_rewind(void *user) {
+    stream_files *files = user;
+    return fseek(files->input, files->data_offset, SEEK_SET) == 0;
+}
+
+static bool stream_files_write(void *user, const uint8_t *rows, uint32_t count) {
+    stream_files *files = user;
+    return fwrite(rows, files->width, count, files->output) == count;
+}
+
+// Streaming reads the input through stdio rather than mmap: mapping a file larger than memory works, but its pages
+// would stay resident until reclaimed, which is exactly what streaming is there to avoid.
+int run_stream(const char *input_path, const char *output_path, const canny_params *params, const raw_geometry *raw) {
+    image_format input_format = image_format_from_path(input_path);
+    image_format output_format = image_format_from_path(output_path);
+    if (input_format == IMAGE_FORMAT_PNG || output_format == IMAGE_FORMAT_PNG) {
+        printf("Streaming needs PGM, PPM or raw files, PNG cannot be read or written row by row\n");
+        return 1;
+    }
+    if (output_format == IMAGE_FORMAT_PBM || output_format == IMAGE_FORMAT_EDGES) {
+        printf("Streaming writes grey edge maps only, PBM masks and edge lists need a single image run\n");
+        return 1;
+    }
+    if (input_format == IMAGE_FORMAT_RAW && raw == nullptr) {
+        printf("%s: raw input needs its width, height and channels\n", input_path);
+        return 1;
+    }
+
+    stream_files files = {0};
+    files.input = fopen(input_path, "rb");
+    if (files.input == nullptr) {
+        printf("Cannot open %s\n", input_path);
+        return 1;
+    }
+
+    uint32_t height, channels;
+    if (input_format == IMAGE_FORMAT_PNM) {
+        uint8_t header[1024];
+        size_t header_size = fread(header, 1, sizeof(header), files.input);
+        files.data_offset = (long) pnm_parse_header(header, header_size, &files.width, &height, &channels);
+        if (files.data_offset == 0 || fseek(files.input, files.data_offset, SEEK_SET) != 0) {
+            printf("%s is not an 8-bit binary PGM or PPM\n", input_path);
+            fclose(files.input);
+            return 1;
         }
+    } else {
+        files.width = raw->width;
+        height = raw->height;
+        channels = raw->channels;
+    }
+    files.input_row_size = (size_t) files.width * channels;
+
+    files.output = fopen(output_path, "wb");
+    if (files.output == nullptr) {
+        printf("Cannot open %s\n", output_path);
+        fclose(files.input);
+        return 1;
+    }
+    if (output_format == IMAGE_FORMAT_PNM) fprintf(files.output, "P5\n%u %u\n255\n", files.width, height);
+
+    printf("Streaming %u x %u image from %s to %s with %d threads\n", files.width, height, input_path, output_path,
+           omp_get_max_threads());
+
+    canny_params stream_params = *params;
+    stream_params.channels = channels;
+    canny_stream_io io = {
+            .user = &files, .read_rows = stream_files_read, .rewind = stream_files_rewind, .write_rows = stream_files_write
+    };
+    size_t bytes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    canny_status status = canny_stream(files.width, height, &stream_params, &io, &bytes);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (fclose(files.output) != 0 && status == CANNY_OK) status = CANNY_ERROR_IO;
+    fclose(files.input);
+    if (status != CANNY_OK) {
+        printf("error: %s\n", canny_status_text(status));
+        return 1;
     }
 
-#ifdef WRITE_INTERMEDIATE_IMAGES
-    write_intermediate_image("/tmp/test_after_edge_thinning.png", new_image, width, height);
-#endif
+    printf("Time taken: %f seconds\n", TIME_IN_SECONDS(start, end));
+    printf("Stream buffers: %zu bytes (%.2f bytes per pixel)\n", bytes, (double) bytes / ((double) files.width * height));
+    return 0;
+}
+
+// Video mode runs reader -> compute -> writer over VIDEO_FRAMES frame buffers with the batch queues, so reading
+// frame N + 1 and writing frame N - 1 overlap the compute of frame N. Compute stays on the main thread with one
+// context, so the OpenMP pool and every stage buffer stay warm from frame to frame.
+// Everything but the frames goes to stderr, stdout may be the output.
+#define VIDEO_FRAMES 3
+static_assert(VIDEO_FRAMES <= BATCH_SLOTS, "the batch queues hold at most BATCH_SLOTS frames");
+
+typedef struct {
+    uint8_t *pixels;
+    uint8_t *edges;
+    struct timespec read; // when the whole frame was read
+} video_frame;
 
-    free(image);
-    return new_image;
+typedef struct {
+    FILE *input;
+    FILE *output;
+    size_t frame_size;
+    size_t edges_size;
+    bool stopped;  // set when a stage failed, the reader stops early
+    bool failed;
+    pthread_mutex_t mutex;
+    batch_queue free_frames;
+    batch_queue read;
+    batch_queue computed;
+    double *latencies; // read to written, in seconds, owned by the writer
+    size_t latency_count;
+    size_t latency_capacity;
+} video_pipeline;
+
+static void video_stop(video_pipeline *pipeline, bool failed) {
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->stopped = true;
+    pipeline->failed |= failed;
+    pthread_mutex_unlock(&pipeline->mutex);
 }
 
-float *apply_double_threshold(float *image, uint32_t width, uint32_t height) {
-    float *new_image = malloc(width * height * sizeof(float));
+static bool video_stopped(video_pipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    bool stopped = pipeline->stopped;
+    pthread_mutex_unlock(&pipeline->mutex);
+    return stopped;
+}
 
-    float high = FLT_MIN;
-#pragma omp parallel for default(none) reduction(max:high) shared(image, width, height)
-    for (uint32_t i = 0; i < width * height; i++) {
-        if (image[i] > high) high = image[i];
+static void record_seconds(double **values, size_t *count, size_t *capacity, double seconds) {
+    if (*count == *capacity) {
+        *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+        *values = realloc(*values, *capacity * sizeof(double));
     }
+    (*values)[(*count)++] = seconds;
+}
 
-    float high_threshold = high * HIGH_THRESHOLD_RATIO;
-    float low_threshold = high_threshold * LOW_THRESHOLD_RATIO;
+static void *video_reader(void *argument) {
+    video_pipeline *pipeline = argument;
 
-#pragma omp parallel for default(none) shared(image, new_image, width, height, high_threshold, low_threshold)
-    for (uint32_t i = 0; i < width * height; i++) {
-        if (image[i] > high_threshold) {
-            new_image[i] = STRONG_EDGE_PIXEL;
-        } else if (image[i] > low_threshold) {
-            new_image[i] = WEAK_EDGE_PIXEL;
-        } else {
-            new_image[i] = 0.0f;
+    while (!video_stopped(pipeline)) {
+        video_frame *frame = batch_queue_pop(&pipeline->free_frames);
+        size_t size = fread(frame->pixels, 1, pipeline->frame_size, pipeline->input);
+        if (size != pipeline->frame_size) {
+            // a partial frame at the end of the input is dropped
+            if (size != 0) fprintf(stderr, "Dropped a partial frame of %zu bytes at the end of the input\n", size);
+            if (ferror(pipeline->input)) video_stop(pipeline, true);
+            batch_queue_push(&pipeline->free_frames, frame);
+            break;
         }
+        clock_gettime(CLOCK_MONOTONIC, &frame->read);
+        batch_queue_push(&pipeline->read, frame);
     }
 
-#ifdef WRITE_INTERMEDIATE_IMAGES
-    write_intermediate_image("/tmp/test_after_double_threshold.png", new_image, width, height);
-#endif
+    batch_queue_close(&pipeline->read);
+    return nullptr;
+}
+
+static void *video_writer(void *argument) {
+    video_pipeline *pipeline = argument;
 
-    free(image);
-    return new_image;
+    video_frame *frame;
+    while ((frame = batch_queue_pop(&pipeline->computed)) != nullptr) {
+        if (!video_stopped(pipeline)) {
+            if (fwrite(frame->edges, 1, pipeline->edges_size, pipeline->output) != pipeline->edges_size ||
+                fflush(pipeline->output) != 0) {
+                fprintf(stderr, "Cannot write the output\n");
+                video_stop(pipeline, true);
+            } else {
+                struct timespec written;
+                clock_gettime(CLOCK_MONOTONIC, &written);
+                record_seconds(&pipeline->latencies, &pipeline->latency_count, &pipeline->latency_capacity,
+                               TIME_IN_SECONDS(frame->read, written));
+            }
+        }
+        batch_queue_push(&pipeline->free_frames, frame);
+    }
+    return nullptr;
 }
 
-float *apply_edge_histeresis(float *image, uint32_t width, uint32_t height) {
-    float *new_image = malloc(width * height * sizeof(float));
-
-#pragma omp parallel for default(none) shared(image, new_image, width, height) collapse(2)
-    for (int y = 0; y < (int) height; y++) {
-        for (int x = 0; x < (int) width; x++) {
-            if (image[y * width + x] == WEAK_EDGE_PIXEL) {
-                if (image[calculate_index_with_wrap_around(x + 1, y, width, height)] == STRONG_EDGE_PIXEL ||
-                    image[calculate_index_with_wrap_around(x - 1, y, width, height)] == STRONG_EDGE_PIXEL ||
-                    image[calculate_index_with_wrap_around(x, y + 1, width, height)] == STRONG_EDGE_PIXEL ||
-                    image[calculate_index_with_wrap_around(x, y - 1, width, height)] == STRONG_EDGE_PIXEL ||
-                    image[calculate_index_with_wrap_around(x + 1, y + 1, width, height)] == STRONG_EDGE_PIXEL ||
-                    image[calculate_index_with_wrap_around(x - 1, y - 1, width, height)] == STRONG_EDGE_PIXEL ||
-                    image[calculate_index_with_wrap_around(x - 1, y + 1, width, height)] == STRONG_EDGE_PIXEL ||
-                    image[calculate_index_with_wrap_around(x + 1, y - 1, width, height)] == STRONG_EDGE_PIXEL) {
-                    new_image[y * width + x] = STRONG_EDGE_PIXEL;
-                } else {
-                    new_image[y * width + x] = 0.0f;
-                }
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank percentiles of values, which get sorted
+static void print_latencies(const char *name, double *values, size_t count) {
+    if (count == 0) return;
+    qsort(values, count, sizeof(double), compare_doubles);
+    const double percentiles[] = {50.0, 90.0, 95.0, 99.0};
+    fprintf(stderr, "%s latency (ms):", name);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        size_t rank = (size_t) (percentiles[i] / 100.0 * (double) count + 0.999999);
+        fprintf(stderr, " p%.0f %.3f", percentiles[i], 1000.0 * values[rank > 0 ? rank - 1 : 0]);
+    }
+    fprintf(stderr, " max %.3f\n", 1000.0 * values[count - 1]);
+}
+
+int run_video(const char *input_path, const char *output_path, const canny_params *params, const raw_geometry *frame,
+              const char *profile_path, bool incremental) {
+    canny_params video_params = *params;
+    video_params.channels = frame->channels;
+    canny_context *context = canny_context_create(frame->width, frame->height, &video_params);
+    if (context == nullptr) {
+        fprintf(stderr, "Cannot create a context for %u x %u frames\n", frame->width, frame->height);
+        return 1;
+    }
+
+    video_pipeline pipeline = {
+            .input = strcmp(input_path, "-") == 0 ? stdin : fopen(input_path, "rb"),
+            .output = strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "wb"),
+            .frame_size = (size_t) frame->width * frame->height * frame->channels,
+            .edges_size = (size_t) frame->width * frame->height,
+    };
+    if (pipeline.input == nullptr || pipeline.output == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", pipeline.input == nullptr ? input_path : output_path);
+        if (pipeline.input != nullptr && pipeline.input != stdin) fclose(pipeline.input);
+        if (pipeline.output != nullptr && pipeline.output != stdout) fclose(pipeline.output);
+        canny_context_destroy(context);
+        return 1;
+    }
+
+    pthread_mutex_init(&pipeline.mutex, nullptr);
+    batch_queue_init(&pipeline.free_frames);
+    batch_queue_init(&pipeline.read);
+    batch_queue_init(&pipeline.computed);
+
+    video_frame frames[VIDEO_FRAMES];
+    for (int i = 0; i < VIDEO_FRAMES; i++) {
+        frames[i].pixels = malloc(pipeline.frame_size);
+        frames[i].edges = malloc(pipeline.edges_size);
+        batch_queue_push(&pipeline.free_frames, &frames[i]);
+    }
+
+    fprintf(stderr, "Video of %u x %u frames with %u channels, %d compute threads\n", frame->width, frame->height,
+            frame->channels, omp_get_max_threads());
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t reader, writer;
+    pthread_create(&reader, nullptr, video_reader, &pipeline);
+    pthread_create(&writer, nullptr, video_writer, &pipeline);
+
+    double *compute_times = nullptr;
+    size_t frame_count = 0;
+    size_t compute_capacity = 0;
+    double recomputed_sum = 0.0;
+    video_frame *current;
+    while ((current = batch_queue_pop(&pipeline.read)) != nullptr) {
+        // after a failure the remaining frames are only handed back until the reader has stopped
+        if (!video_stopped(&pipeline)) {
+            struct timespec compute_start;
+            clock_gettime(CLOCK_MONOTONIC, &compute_start);
+            size_t stride = (size_t) frame->width * frame->channels;
+            float recomputed = 1.0f;
+            canny_status status = incremental
+                                  ? canny_run_incremental(context, current->pixels, frame->width, frame->height,
+                                                          stride, current->edges, frame->width, &recomputed)
+                                  : canny_run(context, current->pixels, frame->width, frame->height, stride,
+                                              current->edges, frame->width);
+            recomputed_sum += recomputed;
+            struct timespec compute_end;
+            clock_gettime(CLOCK_MONOTONIC, &compute_end);
+
+            if (status == CANNY_OK) {
+                record_seconds(&compute_times, &frame_count, &compute_capacity,
+                               TIME_IN_SECONDS(compute_start, compute_end));
             } else {
-                new_image[y * width + x] = image[y * width + x];
+                fprintf(stderr, "error: %s\n", canny_status_text(status));
+                video_stop(&pipeline, true);
             }
         }
+        batch_queue_push(&pipeline.computed, current);
+    }
+    batch_queue_close(&pipeline.computed);
+
+    pthread_join(reader, nullptr);
+    pthread_join(writer, nullptr);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = TIME_IN_SECONDS(start, end);
+
+    fprintf(stderr, "Processed %zu frames in %.3f seconds, %.2f fps\n", frame_count, seconds,
+            (double) frame_count / seconds);
+    if (incremental && frame_count > 0) {
+        fprintf(stderr, "Recomputed %.1f%% of every frame on average\n", 100.0 * recomputed_sum / (double) frame_count);
     }
+    print_latencies("Compute", compute_times, frame_count);
+    print_latencies("End to end", pipeline.latencies, pipeline.latency_count);
+    fprintf(stderr, "Peak workspace size: %zu bytes\n", canny_context_peak_bytes(context));
+    if (profile_path != nullptr && !write_profile(context, profile_path, stderr)) pipeline.failed = true;
 
-#ifdef WRITE_INTERMEDIATE_IMAGES
-    write_intermediate_image("/tmp/test_after_edge_histeresis.png", new_image, width, height);
-#endif
+    if (pipeline.output != stdout && fclose(pipeline.output) != 0) pipeline.failed = true;
+    if (pipeline.input != stdin) fclose(pipeline.input);
+    for (int i = 0; i < VIDEO_FRAMES; i++) {
+        free(frames[i].pixels);
+        free(frames[i].edges);
+    }
+    free(compute_times);
+    free(pipeline.latencies);
+    canny_context_destroy(context);
+    batch_queue_destroy(&pipeline.free_frames);
+    batch_queue_destroy(&pipeline.read);
+    batch_queue_destroy(&pipeline.computed);
+    pthread_mutex_destroy(&pipeline.mutex);
+    return pipeline.failed ? 1 : 0;
+}
 
-    free(image);
-    return new_image;
+// the sizes --tune measures, whose buckets cover everything from thumbnails to 4K and beyond
+static const struct {
+    uint32_t width;
+    uint32_t height;
+} tune_sizes[] = {{640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+
+int run_tune(const char *input_path, const raw_geometry *raw, const canny_params *params, const char *tuning_path) {
+    image_file input;
+    if (!image_file_open(&input, input_path, raw)) return 1;
+    canny_tuning *tuning = canny_tuning_load(tuning_path);
+    if (tuning == nullptr) tuning = canny_tuning_create();
+    printf("Tuning on %s with up to %d threads\n", input_path, omp_get_max_threads());
+
+    uint32_t channels = input.channels;
+    canny_status status = CANNY_OK;
+    for (size_t i = 0; i < sizeof(tune_sizes) / sizeof(tune_sizes[0]) && status == CANNY_OK; i++) {
+        // the input scaled to the size by its nearest pixel, so the edges are about as dense as in the input
+        uint32_t width = tune_sizes[i].width;
+        uint32_t height = tune_sizes[i].height;
+        uint8_t *pixels = malloc((size_t) width * height * channels);
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = input.pixels + (size_t) y * input.height / height * input.stride;
+            for (uint32_t x = 0; x < width; x++) {
+                memcpy(pixels + ((size_t) y * width + x) * channels, row + (size_t) x * input.width / width * channels,
+                       channels);
+            }
+        }
+
+        canny_pipeline pipelines[] = {CANNY_PIPELINE_FLOAT, CANNY_PIPELINE_FUSED, CANNY_PIPELINE_INTEGER};
+        for (size_t p = 0; p < sizeof(pipelines) / sizeof(pipelines[0]) && status == CANNY_OK; p++) {
+            canny_params tune_params = *params;
+            tune_params.pipeline = pipelines[p];
+            tune_params.channels = channels;
+            tune_params.profile = false;
+            status = canny_tune(tuning, &tune_params, pixels, width, height, (size_t) width * channels, stdout);
+            fflush(stdout);
+        }
+        free(pixels);
+    }
+    image_file_close(&input);
+
+    bool saved = status == CANNY_OK && canny_tuning_save(tuning, tuning_path);
+    if (status != CANNY_OK) {
+        printf("error: %s\n", canny_status_text(status));
+    } else if (saved) {
+        printf("Saved the tuning profile to %s\n", tuning_path);
+    } else {
+        printf("Cannot write %s\n", tuning_path);
+    }
+    canny_tuning_destroy(tuning);
+    return saved ? 0 : 1;
 }
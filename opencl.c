@@ -1,11 +1,32 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <CL/opencl.h>
 #include <assert.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "lodepng.h"
+#include "png_codec.h"
+#include "canny.h"
 
 #define GET_IMAGE_SIZE(width, height) (4 * width * height)
+#define TIME_IN_SECONDS(start, end) ((double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1000000000)
+#define PROGRAM_BUILD_OPTIONS ""
+#define DEFAULT_LOCAL_SIZE 16
+// FUSED_HALO in compute.cl
+#define FUSED_HALO 4
+// MAX_REDUCTION_LOCAL_SIZE in compute.cl
+#define MAX_REDUCTION_LOCAL_SIZE 256
+#define MAX_REDUCTION_GROUPS 256
+#define DEFAULT_IN_FLIGHT_IMAGES 2
+#define MAX_IN_FLIGHT_IMAGES 8
+#define TUNE_REPETITIONS 5
+// a work-group size has to be this much faster than the one before it to be kept
+#define TUNE_MARGIN 0.03
 
 float *convertToFloatArray(const uint8_t *array, size_t size) {
     float *result = (float *) malloc(size * sizeof(float));
@@ -26,33 +47,40 @@ uint8_t *convertToByteArray(const float *array, size_t size) {
     return result;
 }
 
+// Prefers a GPU and falls back to any other device, e.g. the CPU of a PoCL runtime
 cl_device_id getOpenCLDevice() {
     cl_platform_id platform[64];
     uint32_t platformCount;
     cl_int platformResult = clGetPlatformIDs(64, platform, &platformCount);
     assert(platformResult == CL_SUCCESS);
 
+    const cl_device_type deviceTypes[] = {CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL};
     cl_device_id device = nullptr;
-    for (int i = 0; i < platformCount && device == nullptr; i++) {
-        cl_device_id devices[64];
-        uint32_t deviceCount;
-        cl_int deviceResult = clGetDeviceIDs(platform[i], CL_DEVICE_TYPE_GPU, 64, devices, &deviceCount);
+    for (int type = 0; type < 2 && device == nullptr; type++) {
+        for (int i = 0; i < platformCount && device == nullptr; i++) {
+            cl_device_id devices[64];
+            uint32_t deviceCount;
+            cl_int deviceResult = clGetDeviceIDs(platform[i], deviceTypes[type], 64, devices, &deviceCount);
 
-        if (deviceResult != CL_SUCCESS) {
-            continue;
-        }
+            if (deviceResult != CL_SUCCESS) {
+                continue;
+            }
 
-        for (int j = 0; j < deviceCount; j++) {
-            char vendorName[256];
-            size_t vendorNameLength;
-            cl_int deviceInfoResult = clGetDeviceInfo(devices[j], CL_DEVICE_VENDOR, 256, vendorName, &vendorNameLength);
-            if (deviceInfoResult == CL_SUCCESS) {
-                device = devices[j];
+            for (int j = 0; j < deviceCount; j++) {
+                char vendorName[256];
+                size_t vendorNameLength;
+                cl_int deviceInfoResult = clGetDeviceInfo(devices[j], CL_DEVICE_VENDOR, 256, vendorName, &vendorNameLength);
+                if (deviceInfoResult == CL_SUCCESS) {
+                    device = devices[j];
+                }
             }
         }
     }
+    assert(device != nullptr);
 
-    printf("Device: %p\n", device);
+    char deviceName[256] = {0};
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, nullptr);
+    printf("Device: %s\n", deviceName);
     return device;
 }
 
@@ -64,21 +92,148 @@ cl_context createOpenCLContext(cl_device_id device) {
     return context;
 }
 
+void printBuildLog(cl_program program, cl_device_id device) {
+    size_t logSize;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+    char *log = (char *) malloc(logSize + 1);
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, log, nullptr);
+    log[logSize] = '\0';
+    printf("Build log: %s\n", log);
+    free(log);
+}
+
+// FNV-1a
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+uint64_t hashDeviceInfo(uint64_t hash, cl_device_id device, cl_device_info info) {
+    char value[1024] = {0};
+    clGetDeviceInfo(device, info, sizeof(value) - 1, value, nullptr);
+    return hashBytes(hash, value, strlen(value) + 1);
+}
+
+// Compiled programs are cached in $CANNY_CL_CACHE_DIR, $XDG_CACHE_HOME/canny-edge-detection or
+// ~/.cache/canny-edge-detection, one file per device, driver version, build options and source.
+// Returns false if there is nowhere to put the cache.
+bool getProgramCachePath(cl_device_id device, const char *source, char *path, size_t pathSize) {
+    char directory[1024];
+    const char *cacheDir = getenv("CANNY_CL_CACHE_DIR");
+    const char *xdgCacheHome = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cacheDir != nullptr && cacheDir[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s", cacheDir);
+    } else if (xdgCacheHome != nullptr && xdgCacheHome[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s/canny-edge-detection", xdgCacheHome);
+    } else if (home != nullptr && home[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s/.cache", home);
+        mkdir(directory, 0755);
+        snprintf(directory, sizeof(directory), "%s/.cache/canny-edge-detection", home);
+    } else {
+        return false;
+    }
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) return false;
+
+    cl_platform_id platform;
+    char platformVersion[256] = {0};
+    clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, nullptr);
+    clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(platformVersion) - 1, platformVersion, nullptr);
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hashBytes(hash, platformVersion, strlen(platformVersion) + 1);
+    hash = hashDeviceInfo(hash, device, CL_DEVICE_NAME);
+    hash = hashDeviceInfo(hash, device, CL_DEVICE_VENDOR);
+    hash = hashDeviceInfo(hash, device, CL_DEVICE_VERSION);
+    hash = hashDeviceInfo(hash, device, CL_DRIVER_VERSION);
+    hash = hashBytes(hash, PROGRAM_BUILD_OPTIONS, sizeof(PROGRAM_BUILD_OPTIONS));
+    hash = hashBytes(hash, source, strlen(source));
+    snprintf(path, pathSize, "%s/%016llx.bin", directory, (unsigned long long) hash);
+    return true;
+}
+
+// nullptr if there is no cached binary or the runtime rejects it
+cl_program loadCachedProgram(cl_context context, cl_device_id device, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) return nullptr;
+    fseek(file, 0, SEEK_END);
+    size_t binarySize = ftell(file);
+    rewind(file);
+    unsigned char *binary = (unsigned char *) malloc(binarySize);
+    size_t n = fread(binary, 1, binarySize, file);
+    fclose(file);
+    if (n != binarySize || binarySize == 0) {
+        free(binary);
+        return nullptr;
+    }
+
+    cl_int binaryStatus;
+    cl_int programResult;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binarySize,
+                                                   (const unsigned char **) &binary, &binaryStatus, &programResult);
+    free(binary);
+    if (programResult != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+        if (program != nullptr) clReleaseProgram(program);
+        return nullptr;
+    }
+
+    // a binary still has to be built, which only links it
+    if (clBuildProgram(program, 1, &device, PROGRAM_BUILD_OPTIONS, nullptr, nullptr) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return nullptr;
+    }
+    return program;
+}
+
+// written to a temporary file first, so a concurrent run never loads a partial binary
+void storeProgramBinary(cl_program program, const char *path) {
+    size_t binarySize;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, nullptr) != CL_SUCCESS ||
+        binarySize == 0) {
+        return;
+    }
+    unsigned char *binary = (unsigned char *) malloc(binarySize);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, nullptr) != CL_SUCCESS) {
+        free(binary);
+        return;
+    }
+
+    char temporaryPath[1100];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d", path, (int) getpid());
+    FILE *file = fopen(temporaryPath, "wb");
+    if (file != nullptr) {
+        bool written = fwrite(binary, 1, binarySize, file) == binarySize;
+        written &= fclose(file) == 0;
+        if (!written || rename(temporaryPath, path) != 0) unlink(temporaryPath);
+    }
+    free(binary);
+}
+
 cl_program createOpenCLProgram(cl_context context, cl_device_id device, const char *source) {
+    char cachePath[1024];
+    bool cacheable = getProgramCachePath(device, source, cachePath, sizeof(cachePath));
+    if (cacheable) {
+        cl_program cachedProgram = loadCachedProgram(context, device, cachePath);
+        if (cachedProgram != nullptr) {
+            printf("Program: loaded from %s\n", cachePath);
+            return cachedProgram;
+        }
+    }
+
     size_t length = strlen(source);
     cl_int programResult;
     cl_program program = clCreateProgramWithSource(context, 1, (const char **) &source, &length, &programResult);
     assert(programResult == CL_SUCCESS);
 
-    cl_int programBuildResult = clBuildProgram(program, 1, &device, "", nullptr, nullptr);
+    cl_int programBuildResult = clBuildProgram(program, 1, &device, PROGRAM_BUILD_OPTIONS, nullptr, nullptr);
     if (programBuildResult != CL_SUCCESS) {
-        size_t logSize;
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
-        char *log = (char *) malloc(logSize + 1);
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, log, nullptr);
-        log[logSize] = '\0';
-        printf("Build log: %s\n", log);
-        free(log);
+        printBuildLog(program, device);
+    } else if (cacheable) {
+        storeProgramBinary(program, cachePath);
+        printf("Program: built from source and cached in %s\n", cachePath);
     }
 
     return program;
@@ -101,247 +256,865 @@ const char *loadProgramSource(const char *filename) {
     bzero(programSource, fileSize + 1);
     int n = fread(programSource, 1, fileSize, file);
     assert(n > 0);
+    fclose(file);
     return programSource;
 }
 
-int main(int argc, char **argv) {
-    printf("We are running OpenCL code\n");
+// The kernels whose work-group size is tuned, by their names in the program and in the tuning profile.
+typedef enum {
+    TUNED_GRAYSCALE,
+    TUNED_GAUSSIAN,
+    TUNED_SOBEL,
+    TUNED_EDGE_THINNING,
+    TUNED_FUSED,
+    TUNED_DOUBLE_THRESHOLDING,
+    TUNED_EDGE_HISTERESIS,
+    TUNED_KERNEL_COUNT
+} TunedKernel;
 
-    char inputImagePath[1024] = {0};
-    char outputImagePath[1024] = {0};
-    char kernelPath[1024] = {0};
+const char *tunedKernelNames[TUNED_KERNEL_COUNT] = {
+        "grayscale_image", "gaussian_blur", "sobel_filter", "edge_thinning", "fused_blur_sobel_thinning",
+        "double_thresholding", "edge_histeresis",
+};
 
-    for (int i = 0; i < argc; i++) {
-        printf("Argument %d: %s\n", i, argv[i]);
+// the work-group sizes tried by -T besides the driver's choice, or the default tile of the fused kernel
+const size_t tuningCandidates[][2] = {
+        {8, 8}, {16, 8}, {16, 16}, {32, 4}, {32, 8}, {32, 16}, {32, 32}, {64, 1}, {64, 4}, {128, 1}, {256, 1},
+};
+
+// The work-group sizes measured fastest on images of a number of pixels, {0, 0} leaves them to the driver or, for
+// the fused kernel, to -l.
+typedef struct {
+    uint64_t pixels;
+    size_t localSizes[TUNED_KERNEL_COUNT][2];
+} OpenCLTuningBucket;
+
+// Everything one image in flight needs: its own in-order queue, kernels bound to its own buffers, and the host
+// buffers the asynchronous transfers read from and write to. The buffers are sized for one image and only
+// recreated when the next image in the slot has a different size.
+typedef struct {
+    cl_command_queue queue;
+    cl_kernel grayscale;
+    cl_kernel gaussian;
+    cl_kernel sobel;
+    cl_kernel edgeThinning;
+    cl_kernel maxIntensity;
+    cl_kernel combineMaxIntensity;
+    cl_kernel doubleThresholding;
+    cl_kernel edgeHisteresis;
+    cl_kernel fusedBlurSobelThinning;
+
+    uint32_t width;
+    uint32_t height;
+    cl_mem colorImageBuffer;
+    cl_mem auxiliaryImageBuffer;
+    cl_mem auxiliaryGrayscaleBuffer;
+    cl_mem sobelIntensityCLBuffer;
+    cl_mem sobelOrientationCLBuffer;
+    cl_mem edgeThinningCLBuffer;
+    cl_mem maxIntensityPartialsCLBuffer;
+    cl_mem maxIntensityValueCLBuffer;
+
+    // the image in flight, nothing is in flight while busy is false
+    bool busy;
+    char outputImagePath[1024];
+    float *imageFloatBuffer;
+    float *outputImageBuffer;
+    cl_event uploaded;
+    cl_event computed;
+    cl_event downloaded;
+    struct timespec start;
+} OpenCLImageSlot;
+
+// Device, context, program and slots live as long as the pipeline, so only the first image pays for the setup.
+// Every slot has a queue of its own, so while one image is computed the next one is already uploaded.
+typedef struct {
+    cl_device_id device;
+    cl_context context;
+    cl_program program;
+    // blur, sobel and thinning in one work-group tiled kernel instead of three launches
+    bool fused;
+    size_t localSize[2];
+    // -l was given, so the fused kernel keeps localSize whatever the tuning profile says
+    bool fixedLocalSize;
+    size_t fusedMaxWorkGroupSize;
+    cl_ulong localMemorySize;
+    size_t reductionLocalSize;
+    png_compression compression;
+
+    // the lines of the tuning profile for this device, nothing is tuned while tuningPath is empty
+    char tuningPath[1024];
+    uint64_t deviceKey;
+    OpenCLTuningBucket *tuningBuckets;
+    size_t tuningBucketCount;
+
+    size_t slotCount;
+    OpenCLImageSlot slots[MAX_IN_FLIGHT_IMAGES];
+} OpenCLPipeline;
+
+// the gray, blur, magnitude and orientation tiles of fused_blur_sobel_thinning
+size_t fusedTileSize(const size_t localSize[2], int halo) {
+    return (localSize[0] + 2 * halo) * (localSize[1] + 2 * halo) * sizeof(float);
+}
+
+size_t fusedLocalMemorySize(const size_t localSize[2]) {
+    return fusedTileSize(localSize, FUSED_HALO) + fusedTileSize(localSize, 2) + 2 * fusedTileSize(localSize, 1);
+}
+
+bool fusedTileFits(const OpenCLPipeline *pipeline, const size_t localSize[2]) {
+    return localSize[0] > 0 && localSize[1] > 0 &&
+           localSize[0] * localSize[1] <= pipeline->fusedMaxWorkGroupSize &&
+           fusedLocalMemorySize(localSize) <= pipeline->localMemorySize;
+}
+
+// the bucket of exactly this many pixels, a new one without any sizes if there is none yet
+OpenCLTuningBucket *openCLTuningBucketOf(OpenCLPipeline *pipeline, uint64_t pixels) {
+    for (size_t i = 0; i < pipeline->tuningBucketCount; i++) {
+        if (pipeline->tuningBuckets[i].pixels == pixels) return &pipeline->tuningBuckets[i];
     }
+    pipeline->tuningBuckets = realloc(pipeline->tuningBuckets,
+                                      (pipeline->tuningBucketCount + 1) * sizeof(OpenCLTuningBucket));
+    OpenCLTuningBucket *bucket = &pipeline->tuningBuckets[pipeline->tuningBucketCount++];
+    memset(bucket, 0, sizeof(OpenCLTuningBucket));
+    bucket->pixels = pixels;
+    return bucket;
+}
 
-    switch (argc) {
-        case 2:
-            strcpy(inputImagePath, "lenna.png");
-            strcpy(outputImagePath, "/tmp/lena_out.png");
-            break;
-        case 3:
-            assert(strstr(argv[2], ".png") != nullptr);
-            strcpy(inputImagePath, argv[2]);
-            strcpy(outputImagePath, "/tmp/lena_out.png");
-            break;
-        case 4:
-            assert(strstr(argv[3], ".png") != nullptr);
-            assert(strstr(argv[4], ".png") != nullptr);
-            strcpy(inputImagePath, argv[2]);
-            strcpy(outputImagePath, argv[3]);
-            break;
-        default:
-            printf("Usage: %s [input_image_path] [output_image_path]\n", argv[0]);
-            return 1;
+// the bucket closest in pixels by ratio, nullptr if nothing was tuned on this device
+const OpenCLTuningBucket *findOpenCLTuningBucket(const OpenCLPipeline *pipeline, uint64_t pixels) {
+    const OpenCLTuningBucket *nearest = nullptr;
+    double nearestRatio = HUGE_VAL;
+    for (size_t i = 0; i < pipeline->tuningBucketCount; i++) {
+        double bucketPixels = (double) pipeline->tuningBuckets[i].pixels;
+        double ratio = bucketPixels > pixels ? bucketPixels / pixels : pixels / bucketPixels;
+        if (ratio < nearestRatio) {
+            nearest = &pipeline->tuningBuckets[i];
+            nearestRatio = ratio;
+        }
     }
-    strcpy(kernelPath, argv[1]);
+    return nearest;
+}
 
-    const char *programSource = loadProgramSource(kernelPath);
-    printf("Input image path: %s\n", inputImagePath);
-    printf("Output image path: %s\n", outputImagePath);
+// Every device has lines of its own in the profile,
+//     opencl <device> <pixels> local <kernel> <width> <height>
+// with the device a hash of its name, vendor, version and driver version. Other lines are left alone.
+int openCLTuningPrefix(const OpenCLPipeline *pipeline, char *prefix, size_t prefixSize) {
+    return snprintf(prefix, prefixSize, "opencl %016llx ", (unsigned long long) pipeline->deviceKey);
+}
 
-    uint8_t *imageBuffer;
-    uint32_t width, height;
+// reads the lines of this device from the profile at pipeline->tuningPath, lines it cannot make sense of are skipped
+void loadOpenCLTuning(OpenCLPipeline *pipeline) {
+    canny_tuning *profile = canny_tuning_load(pipeline->tuningPath);
+    if (profile == nullptr) return;
 
-    uint32_t error = lodepng_decode32_file(&imageBuffer, &width, &height, inputImagePath);
-    assert(error == 0);
+    char prefix[64];
+    int prefixLength = openCLTuningPrefix(pipeline, prefix, sizeof(prefix));
+    const char *line;
+    for (size_t i = 0; (line = canny_tuning_other_line(profile, i)) != nullptr; i++) {
+        if (strncmp(line, prefix, prefixLength) != 0) continue;
+        unsigned long long pixels;
+        char kernelName[64];
+        size_t localSize[2];
+        if (sscanf(line + prefixLength, "%llu local %63s %zu %zu", &pixels, kernelName, &localSize[0],
+                   &localSize[1]) != 4 || pixels == 0 || (localSize[0] == 0) != (localSize[1] == 0)) {
+            continue;
+        }
+        for (int k = 0; k < TUNED_KERNEL_COUNT; k++) {
+            if (strcmp(tunedKernelNames[k], kernelName) != 0) continue;
+            OpenCLTuningBucket *bucket = openCLTuningBucketOf(pipeline, pixels);
+            bucket->localSizes[k][0] = localSize[0];
+            bucket->localSizes[k][1] = localSize[1];
+        }
+    }
+    canny_tuning_destroy(profile);
+    if (pipeline->tuningBucketCount > 0) {
+        printf("Work-group sizes of %zu image sizes from %s\n", pipeline->tuningBucketCount, pipeline->tuningPath);
+    }
+}
 
-    printf("Image width: %d height: %d\n", width, height);
-    float *imageFloatBuffer = convertToFloatArray(imageBuffer, GET_IMAGE_SIZE(width, height));
+// Replaces the lines of this device in the profile at pipeline->tuningPath and keeps everything else in it.
+// Returns false if it cannot be written.
+bool saveOpenCLTuning(const OpenCLPipeline *pipeline) {
+    canny_tuning *profile = canny_tuning_load(pipeline->tuningPath);
+    if (profile == nullptr) profile = canny_tuning_create();
 
-    struct timespec start;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    cl_device_id device = getOpenCLDevice();
-    cl_context context = createOpenCLContext(device);
+    char prefix[64];
+    openCLTuningPrefix(pipeline, prefix, sizeof(prefix));
+    canny_tuning_remove_other_lines(profile, prefix);
+    for (size_t i = 0; i < pipeline->tuningBucketCount; i++) {
+        const OpenCLTuningBucket *bucket = &pipeline->tuningBuckets[i];
+        for (int k = 0; k < TUNED_KERNEL_COUNT; k++) {
+            char line[256];
+            snprintf(line, sizeof(line), "%s%llu local %s %zu %zu", prefix, (unsigned long long) bucket->pixels,
+                     tunedKernelNames[k], bucket->localSizes[k][0], bucket->localSizes[k][1]);
+            canny_tuning_add_other_line(profile, line);
+        }
+    }
+
+    bool saved = canny_tuning_save(profile, pipeline->tuningPath);
+    canny_tuning_destroy(profile);
+    return saved;
+}
 
+void createOpenCLImageSlot(OpenCLPipeline *pipeline, OpenCLImageSlot *slot) {
+    cl_queue_properties properties[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
     cl_int commandQueueResult;
-    cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, nullptr, &commandQueueResult);
-    cl_program program = createOpenCLProgram(context, device, programSource);
+    slot->queue = clCreateCommandQueueWithProperties(pipeline->context, pipeline->device, properties,
+                                                     &commandQueueResult);
     assert(commandQueueResult == CL_SUCCESS);
 
-    struct timespec deviceSetupEnd;
-    clock_gettime(CLOCK_MONOTONIC, &deviceSetupEnd);
+    slot->grayscale = createOpenCLKernel(pipeline->program, "grayscale_image");
+    slot->gaussian = createOpenCLKernel(pipeline->program, "gaussian_blur");
+    slot->sobel = createOpenCLKernel(pipeline->program, "sobel_filter");
+    slot->edgeThinning = createOpenCLKernel(pipeline->program, "edge_thinning");
+    slot->maxIntensity = createOpenCLKernel(pipeline->program, "find_max_intensity");
+    slot->combineMaxIntensity = createOpenCLKernel(pipeline->program, "find_max_intensity");
+    slot->doubleThresholding = createOpenCLKernel(pipeline->program, "double_thresholding");
+    slot->edgeHisteresis = createOpenCLKernel(pipeline->program, "edge_histeresis");
+    slot->fusedBlurSobelThinning = createOpenCLKernel(pipeline->program, "fused_blur_sobel_thinning");
+}
+
+// Local sizes larger than the device allows for the fused kernel are halved until they fit. The work-group sizes
+// tuned for this device are loaded from the tuning profile, with fixedLocalSize the fused kernel keeps localSize.
+void createOpenCLPipeline(OpenCLPipeline *pipeline, const char *programSource, bool fused, const size_t localSize[2],
+                          bool fixedLocalSize, size_t slotCount, png_compression compression) {
+    memset(pipeline, 0, sizeof(OpenCLPipeline));
+    pipeline->fused = fused;
+    pipeline->compression = compression;
+    pipeline->localSize[0] = localSize[0];
+    pipeline->localSize[1] = localSize[1];
+    pipeline->fixedLocalSize = fixedLocalSize;
+    pipeline->slotCount = slotCount;
+    pipeline->device = getOpenCLDevice();
+    pipeline->context = createOpenCLContext(pipeline->device);
+    pipeline->program = createOpenCLProgram(pipeline->context, pipeline->device, programSource);
+    for (size_t i = 0; i < slotCount; i++) {
+        createOpenCLImageSlot(pipeline, &pipeline->slots[i]);
+    }
+
+    size_t maxWorkGroupSize;
+    clGetKernelWorkGroupInfo(pipeline->slots[0].maxIntensity, pipeline->device, CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(size_t), &maxWorkGroupSize, nullptr);
+    pipeline->reductionLocalSize = MAX_REDUCTION_LOCAL_SIZE;
+    while (pipeline->reductionLocalSize > maxWorkGroupSize) {
+        pipeline->reductionLocalSize /= 2;
+    }
+
+    clGetKernelWorkGroupInfo(pipeline->slots[0].fusedBlurSobelThinning, pipeline->device, CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(size_t), &pipeline->fusedMaxWorkGroupSize, nullptr);
+    clGetDeviceInfo(pipeline->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &pipeline->localMemorySize,
+                    nullptr);
+    if (fused) {
+        while (!fusedTileFits(pipeline, pipeline->localSize)) {
+            int larger = pipeline->localSize[0] >= pipeline->localSize[1] ? 0 : 1;
+            assert(pipeline->localSize[larger] > 1);
+            pipeline->localSize[larger] /= 2;
+        }
+        printf("Fused kernel with %zu x %zu work-groups\n", pipeline->localSize[0], pipeline->localSize[1]);
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hashDeviceInfo(hash, pipeline->device, CL_DEVICE_NAME);
+    hash = hashDeviceInfo(hash, pipeline->device, CL_DEVICE_VENDOR);
+    hash = hashDeviceInfo(hash, pipeline->device, CL_DEVICE_VERSION);
+    hash = hashDeviceInfo(hash, pipeline->device, CL_DRIVER_VERSION);
+    pipeline->deviceKey = hash;
+    if (canny_tuning_default_path(pipeline->tuningPath, sizeof(pipeline->tuningPath))) {
+        loadOpenCLTuning(pipeline);
+    } else {
+        pipeline->tuningPath[0] = '\0';
+    }
+}
+
+void releaseOpenCLImageSlotBuffers(OpenCLImageSlot *slot) {
+    if (slot->colorImageBuffer == nullptr) return;
+    cl_int err = clReleaseMemObject(slot->colorImageBuffer);
+    err |= clReleaseMemObject(slot->auxiliaryImageBuffer);
+    err |= clReleaseMemObject(slot->auxiliaryGrayscaleBuffer);
+    err |= clReleaseMemObject(slot->sobelIntensityCLBuffer);
+    err |= clReleaseMemObject(slot->sobelOrientationCLBuffer);
+    err |= clReleaseMemObject(slot->edgeThinningCLBuffer);
+    err |= clReleaseMemObject(slot->maxIntensityPartialsCLBuffer);
+    err |= clReleaseMemObject(slot->maxIntensityValueCLBuffer);
+    assert(err == CL_SUCCESS);
+    slot->colorImageBuffer = nullptr;
+}
+
+// the number of groups of the first find_max_intensity launch, each of them writes one partial maximum
+size_t maxIntensityGroupCount(const OpenCLPipeline *pipeline, uint32_t width, uint32_t height) {
+    size_t groups = ((size_t) width * height + pipeline->reductionLocalSize - 1) / pipeline->reductionLocalSize;
+    return groups < MAX_REDUCTION_GROUPS ? groups : MAX_REDUCTION_GROUPS;
+}
 
+// creates the buffers for width x height and binds them to the kernels, nothing happens if the size did not change
+void resizeOpenCLImageSlot(const OpenCLPipeline *pipeline, OpenCLImageSlot *slot, uint32_t width, uint32_t height) {
+    if (slot->colorImageBuffer != nullptr && slot->width == width && slot->height == height) return;
+    releaseOpenCLImageSlotBuffers(slot);
+    slot->width = width;
+    slot->height = height;
+
+    cl_context context = pipeline->context;
     cl_image_format imageFormat = {.image_channel_data_type = CL_FLOAT, .image_channel_order = CL_RGBA};
     cl_image_format grayscaleImageFormat = {.image_channel_data_type = CL_FLOAT, .image_channel_order = CL_INTENSITY};
     cl_image_desc imageDesc = {.image_type = CL_MEM_OBJECT_IMAGE2D, .image_width = width, .image_height = height};
 
     cl_int imageResult;
-    cl_mem colorImageBuffer = clCreateImage(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, &imageFormat, &imageDesc,
-                                            imageFloatBuffer, &imageResult);
-    printf("image result: %d\n", imageResult);
+    slot->colorImageBuffer = clCreateImage(context, CL_MEM_READ_ONLY, &imageFormat, &imageDesc, nullptr,
+                                           &imageResult);
     assert(imageResult == CL_SUCCESS);
-
-    float *grayscaleImageBuffer = (float *) malloc(width * height * sizeof(float));
-    cl_mem auxiliaryImageBuffer = clCreateImage(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, &grayscaleImageFormat,
-                                                &imageDesc, grayscaleImageBuffer, &imageResult);
+    slot->auxiliaryImageBuffer = clCreateImage(context, CL_MEM_READ_WRITE, &grayscaleImageFormat, &imageDesc,
+                                               nullptr, &imageResult);
     assert(imageResult == CL_SUCCESS);
-
-    float *grayscaleAuxiliaryBuffer = (float *) malloc(width * height * sizeof(float));
-    cl_mem auxiliaryGrayscaleBuffer = clCreateImage(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-                                                    &grayscaleImageFormat,
-                                                    &imageDesc, grayscaleAuxiliaryBuffer, &imageResult);
+    slot->auxiliaryGrayscaleBuffer = clCreateImage(context, CL_MEM_READ_WRITE, &grayscaleImageFormat, &imageDesc,
+                                                   nullptr, &imageResult);
     assert(imageResult == CL_SUCCESS);
-
-    float *sobelIntensityBuffer = (float *) malloc(width * height * sizeof(float));
-    cl_mem sobelIntensityCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-                                                   width * height * sizeof(float), sobelIntensityBuffer, &imageResult);
+    slot->sobelIntensityCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float),
+                                                  nullptr, &imageResult);
     assert(imageResult == CL_SUCCESS);
-
-    float *sobelOrientationBuffer = (float *) malloc(width * height * sizeof(float));
-    cl_mem sobelOrientationCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-                                                     width * height * sizeof(float), sobelOrientationBuffer,
-                                                     &imageResult);
+    slot->sobelOrientationCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float),
+                                                    nullptr, &imageResult);
     assert(imageResult == CL_SUCCESS);
-
-    float *edgeThinningBuffer = (float *) malloc(width * height * sizeof(float));
-    cl_mem edgeThinningCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-                                                 width * height * sizeof(float), edgeThinningBuffer, &imageResult);
+    slot->edgeThinningCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, width * height * sizeof(float),
+                                                nullptr, &imageResult);
+    assert(imageResult == CL_SUCCESS);
+    slot->maxIntensityPartialsCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                                        MAX_REDUCTION_GROUPS * sizeof(float), nullptr, &imageResult);
+    assert(imageResult == CL_SUCCESS);
+    slot->maxIntensityValueCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float), nullptr,
+                                                     &imageResult);
     assert(imageResult == CL_SUCCESS);
 
-    float *maxIntensityValueBuffer = (float *) malloc(sizeof(float));
-    cl_mem maxIntensityValueCLBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-                                                      sizeof(float), maxIntensityValueBuffer, &imageResult);
+    cl_int err;
+    err = clSetKernelArg(slot->grayscale, 0, sizeof(cl_mem), &slot->colorImageBuffer);
+    err |= clSetKernelArg(slot->grayscale, 1, sizeof(cl_mem), &slot->auxiliaryImageBuffer);
+    assert(err == CL_SUCCESS);
 
-    struct timespec memoryBuffersEnd;
-    clock_gettime(CLOCK_MONOTONIC, &memoryBuffersEnd);
+    err = clSetKernelArg(slot->gaussian, 0, sizeof(cl_mem), &slot->auxiliaryImageBuffer);
+    err |= clSetKernelArg(slot->gaussian, 1, sizeof(cl_mem), &slot->auxiliaryGrayscaleBuffer);
+    assert(err == CL_SUCCESS);
 
-    size_t origin[3] = {0, 0, 0};
-    size_t region[3] = {imageDesc.image_width, imageDesc.image_height, 1};
+    err = clSetKernelArg(slot->sobel, 0, sizeof(cl_mem), &slot->auxiliaryGrayscaleBuffer);
+    err |= clSetKernelArg(slot->sobel, 1, sizeof(cl_mem), &slot->sobelIntensityCLBuffer);
+    err |= clSetKernelArg(slot->sobel, 2, sizeof(cl_mem), &slot->sobelOrientationCLBuffer);
+    assert(err == CL_SUCCESS);
 
-    cl_int err;
-    cl_kernel grayscaleKernel = createOpenCLKernel(program, "grayscale_image");
-    err = clSetKernelArg(grayscaleKernel, 0, sizeof(cl_mem), &colorImageBuffer);
-    err |= clSetKernelArg(grayscaleKernel, 1, sizeof(cl_mem), &auxiliaryImageBuffer);
+    err = clSetKernelArg(slot->edgeThinning, 0, sizeof(cl_mem), &slot->sobelIntensityCLBuffer);
+    err |= clSetKernelArg(slot->edgeThinning, 1, sizeof(cl_mem), &slot->sobelOrientationCLBuffer);
+    err |= clSetKernelArg(slot->edgeThinning, 2, sizeof(cl_mem), &slot->edgeThinningCLBuffer);
     assert(err == CL_SUCCESS);
 
-    cl_kernel gaussian = createOpenCLKernel(program, "gaussian_blur");
-    err = clSetKernelArg(gaussian, 0, sizeof(cl_mem), &auxiliaryImageBuffer);
-    err |= clSetKernelArg(gaussian, 1, sizeof(cl_mem), &auxiliaryGrayscaleBuffer);
+    // thinning keeps the largest magnitude, so in the fused path the thinned image has the same maximum
+    cl_mem maxIntensityInput = pipeline->fused ? slot->edgeThinningCLBuffer : slot->sobelIntensityCLBuffer;
+    err = clSetKernelArg(slot->maxIntensity, 0, sizeof(cl_mem), &maxIntensityInput);
+    err |= clSetKernelArg(slot->maxIntensity, 1, sizeof(cl_mem), &slot->maxIntensityPartialsCLBuffer);
+    cl_int bufferSize = width * height;
+    err |= clSetKernelArg(slot->maxIntensity, 2, sizeof(cl_int), &bufferSize);
     assert(err == CL_SUCCESS);
 
-    cl_kernel sobel = createOpenCLKernel(program, "sobel_filter");
-    err = clSetKernelArg(sobel, 0, sizeof(cl_mem), &auxiliaryGrayscaleBuffer);
-    err |= clSetKernelArg(sobel, 1, sizeof(cl_mem), &sobelIntensityCLBuffer);
-    err |= clSetKernelArg(sobel, 2, sizeof(cl_mem), &sobelOrientationCLBuffer);
+    err = clSetKernelArg(slot->combineMaxIntensity, 0, sizeof(cl_mem), &slot->maxIntensityPartialsCLBuffer);
+    err |= clSetKernelArg(slot->combineMaxIntensity, 1, sizeof(cl_mem), &slot->maxIntensityValueCLBuffer);
+    cl_int partialCount = (cl_int) maxIntensityGroupCount(pipeline, width, height);
+    err |= clSetKernelArg(slot->combineMaxIntensity, 2, sizeof(cl_int), &partialCount);
     assert(err == CL_SUCCESS);
 
-    cl_kernel edge_thinning = createOpenCLKernel(program, "edge_thinning");
-    err | clSetKernelArg(edge_thinning, 0, sizeof(cl_mem), &sobelIntensityCLBuffer);
-    err |= clSetKernelArg(edge_thinning, 1, sizeof(cl_mem), &sobelOrientationCLBuffer);
-    err |= clSetKernelArg(edge_thinning, 2, sizeof(cl_mem), &edgeThinningCLBuffer);
+    // the tiles in local memory follow the work-group size of every launch, see enqueueTunedKernel()
+    err = clSetKernelArg(slot->fusedBlurSobelThinning, 0, sizeof(cl_mem), &slot->auxiliaryImageBuffer);
+    err |= clSetKernelArg(slot->fusedBlurSobelThinning, 1, sizeof(cl_mem), &slot->edgeThinningCLBuffer);
     assert(err == CL_SUCCESS);
 
-    cl_kernel max_intensity = createOpenCLKernel(program, "find_max_intensity");
-    err = clSetKernelArg(max_intensity, 0, sizeof(cl_mem), &sobelIntensityCLBuffer);
-    err |= clSetKernelArg(max_intensity, 1, sizeof(cl_mem), &maxIntensityValueCLBuffer);
-    cl_int bufferSize = width * height;
-    err |= clSetKernelArg(max_intensity, 2, sizeof(cl_int), &bufferSize);
+    err = clSetKernelArg(slot->doubleThresholding, 0, sizeof(cl_mem), &slot->edgeThinningCLBuffer);
+    err |= clSetKernelArg(slot->doubleThresholding, 1, sizeof(cl_mem), &slot->auxiliaryGrayscaleBuffer);
+    err |= clSetKernelArg(slot->doubleThresholding, 2, sizeof(cl_mem), &slot->maxIntensityValueCLBuffer);
     assert(err == CL_SUCCESS);
 
-    cl_kernel double_thresholding = createOpenCLKernel(program, "double_thresholding");
-    err = clSetKernelArg(double_thresholding, 0, sizeof(cl_mem), &edgeThinningCLBuffer);
-    err |= clSetKernelArg(double_thresholding, 1, sizeof(cl_mem), &auxiliaryGrayscaleBuffer);
+    err = clSetKernelArg(slot->edgeHisteresis, 0, sizeof(cl_mem), &slot->auxiliaryGrayscaleBuffer);
+    err |= clSetKernelArg(slot->edgeHisteresis, 1, sizeof(cl_mem), &slot->auxiliaryImageBuffer);
     assert(err == CL_SUCCESS);
+}
 
-    cl_kernel edge_histeresis = createOpenCLKernel(program, "edge_histeresis");
-    err = clSetKernelArg(edge_histeresis, 0, sizeof(cl_mem), &auxiliaryGrayscaleBuffer);
-    err |= clSetKernelArg(edge_histeresis, 1, sizeof(cl_mem), &auxiliaryImageBuffer);
+void releaseOpenCLPipeline(OpenCLPipeline *pipeline) {
+    cl_int err = CL_SUCCESS;
+    for (size_t i = 0; i < pipeline->slotCount; i++) {
+        OpenCLImageSlot *slot = &pipeline->slots[i];
+        releaseOpenCLImageSlotBuffers(slot);
+        err |= clReleaseCommandQueue(slot->queue);
+        err |= clReleaseKernel(slot->grayscale);
+        err |= clReleaseKernel(slot->gaussian);
+        err |= clReleaseKernel(slot->sobel);
+        err |= clReleaseKernel(slot->edgeThinning);
+        err |= clReleaseKernel(slot->maxIntensity);
+        err |= clReleaseKernel(slot->combineMaxIntensity);
+        err |= clReleaseKernel(slot->doubleThresholding);
+        err |= clReleaseKernel(slot->edgeHisteresis);
+        err |= clReleaseKernel(slot->fusedBlurSobelThinning);
+    }
+    err |= clReleaseProgram(pipeline->program);
+    err |= clReleaseContext(pipeline->context);
     assert(err == CL_SUCCESS);
+    free(pipeline->tuningBuckets);
+}
+
+cl_kernel tunedKernel(const OpenCLImageSlot *slot, TunedKernel kernel) {
+    switch (kernel) {
+        case TUNED_GRAYSCALE:
+            return slot->grayscale;
+        case TUNED_GAUSSIAN:
+            return slot->gaussian;
+        case TUNED_SOBEL:
+            return slot->sobel;
+        case TUNED_EDGE_THINNING:
+            return slot->edgeThinning;
+        case TUNED_FUSED:
+            return slot->fusedBlurSobelThinning;
+        case TUNED_DOUBLE_THRESHOLDING:
+            return slot->doubleThresholding;
+        case TUNED_EDGE_HISTERESIS:
+        default:
+            return slot->edgeHisteresis;
+    }
+}
+
+// the kernels the pipeline runs over the whole image in their order, find_max_intensity comes before
+// double_thresholding
+size_t pipelineKernels(const OpenCLPipeline *pipeline, TunedKernel kernels[TUNED_KERNEL_COUNT]) {
+    size_t count = 0;
+    kernels[count++] = TUNED_GRAYSCALE;
+    if (pipeline->fused) {
+        kernels[count++] = TUNED_FUSED;
+    } else {
+        kernels[count++] = TUNED_GAUSSIAN;
+        kernels[count++] = TUNED_SOBEL;
+        kernels[count++] = TUNED_EDGE_THINNING;
+    }
+    kernels[count++] = TUNED_DOUBLE_THRESHOLDING;
+    kernels[count++] = TUNED_EDGE_HISTERESIS;
+    return count;
+}
+
+// The work-group sizes for a width x height image, from the closest size in the tuning profile. The kernels but the
+// fused one read their neighbours by get_global_size(), so their range cannot be padded to whole work-groups and a
+// tuned size that does not divide the image is left to the driver.
+void chooseLocalSizes(const OpenCLPipeline *pipeline, uint32_t width, uint32_t height,
+                      size_t localSizes[TUNED_KERNEL_COUNT][2]) {
+    memset(localSizes, 0, TUNED_KERNEL_COUNT * sizeof(localSizes[0]));
+    localSizes[TUNED_FUSED][0] = pipeline->localSize[0];
+    localSizes[TUNED_FUSED][1] = pipeline->localSize[1];
+    const OpenCLTuningBucket *bucket = findOpenCLTuningBucket(pipeline, (uint64_t) width * height);
+    if (bucket == nullptr) return;
+
+    for (int k = 0; k < TUNED_KERNEL_COUNT; k++) {
+        const size_t *tuned = bucket->localSizes[k];
+        bool usable = k == TUNED_FUSED ? !pipeline->fixedLocalSize && fusedTileFits(pipeline, tuned)
+                                       : tuned[0] > 0 && width % tuned[0] == 0 && height % tuned[1] == 0;
+        if (usable) {
+            localSizes[k][0] = tuned[0];
+            localSizes[k][1] = tuned[1];
+        }
+    }
+}
 
-    size_t globalWorkSize[2] = {width, height};
-    size_t maxIntensityKernelWorkSize = width * height;
-//    size_t localWorkSize[2] = {0, 0};
-    void *localWorkSize = nullptr;
-    cl_int kernelEnqueueResult = clEnqueueNDRangeKernel(queue, grayscaleKernel, 2, nullptr, globalWorkSize,
-                                                        localWorkSize, 0,
-                                                        nullptr, nullptr);
-    kernelEnqueueResult |= clEnqueueNDRangeKernel(queue, gaussian, 2, nullptr, globalWorkSize, localWorkSize, 0,
-                                                  nullptr, nullptr);
-    kernelEnqueueResult |= clEnqueueNDRangeKernel(queue, sobel, 2, nullptr, globalWorkSize, localWorkSize, 0,
-                                                  nullptr, nullptr);
-    kernelEnqueueResult |= clEnqueueNDRangeKernel(queue, edge_thinning, 2, nullptr, globalWorkSize, localWorkSize, 0,
-                                                  nullptr, nullptr);
-    kernelEnqueueResult |= clEnqueueNDRangeKernel(queue, max_intensity, 1, nullptr, &maxIntensityKernelWorkSize,
-                                                  nullptr, 0, nullptr,
-                                                  nullptr);
-
-    cl_float maxIntensityValue;
-    err = clEnqueueReadBuffer(queue, maxIntensityValueCLBuffer, CL_TRUE, 0, sizeof(cl_float), &maxIntensityValue, 0,
-                              nullptr, nullptr);
+// Enqueues one of the tuned kernels over the image in the slot, {0, 0} leaves the work-groups to the driver.
+cl_int enqueueTunedKernel(const OpenCLImageSlot *slot, TunedKernel kernel, const size_t localSize[2],
+                          cl_event *event) {
+    size_t globalWorkSize[2] = {slot->width, slot->height};
+    cl_int err = CL_SUCCESS;
+    if (kernel == TUNED_FUSED) {
+        // every work-group is a full tile, the ones past the edge of the image only fill in the halo
+        globalWorkSize[0] = (slot->width + localSize[0] - 1) / localSize[0] * localSize[0];
+        globalWorkSize[1] = (slot->height + localSize[1] - 1) / localSize[1] * localSize[1];
+        err |= clSetKernelArg(slot->fusedBlurSobelThinning, 2, fusedTileSize(localSize, FUSED_HALO), nullptr);
+        err |= clSetKernelArg(slot->fusedBlurSobelThinning, 3, fusedTileSize(localSize, 2), nullptr);
+        err |= clSetKernelArg(slot->fusedBlurSobelThinning, 4, fusedTileSize(localSize, 1), nullptr);
+        err |= clSetKernelArg(slot->fusedBlurSobelThinning, 5, fusedTileSize(localSize, 1), nullptr);
+    }
+    const size_t *localWorkSize = localSize[0] > 0 ? localSize : nullptr;
+    return err | clEnqueueNDRangeKernel(slot->queue, tunedKernel(slot, kernel), 2, nullptr, globalWorkSize,
+                                        localWorkSize, 0, nullptr, event);
+}
+
+// partial maxima of up to MAX_REDUCTION_GROUPS groups, then a single group combines them into the value
+// double_thresholding reads, so the host never waits for it
+cl_int enqueueMaxIntensity(const OpenCLPipeline *pipeline, const OpenCLImageSlot *slot) {
+    size_t reductionLocalSize = pipeline->reductionLocalSize;
+    size_t maxIntensityKernelWorkSize = maxIntensityGroupCount(pipeline, slot->width, slot->height) *
+                                        reductionLocalSize;
+    cl_int err = clEnqueueNDRangeKernel(slot->queue, slot->maxIntensity, 1, nullptr, &maxIntensityKernelWorkSize,
+                                        &reductionLocalSize, 0, nullptr, nullptr);
+    err |= clEnqueueNDRangeKernel(slot->queue, slot->combineMaxIntensity, 1, nullptr, &reductionLocalSize,
+                                  &reductionLocalSize, 0, nullptr, nullptr);
+    return err;
+}
+
+// Decodes inputImagePath and enqueues the upload, every kernel and the download without waiting for any of them,
+// finishImage() collects the result. Returns false if the input cannot be decoded.
+bool enqueueImage(const OpenCLPipeline *pipeline, OpenCLImageSlot *slot, const char *inputImagePath,
+                  const char *outputImagePath) {
+    assert(!slot->busy);
+    uint8_t *imageBuffer;
+    uint32_t width, height;
+
+    uint32_t error = lodepng_decode32_file(&imageBuffer, &width, &height, inputImagePath);
+    if (error) {
+        printf("%s: error %u: %s\n", inputImagePath, error, lodepng_error_text(error));
+        return false;
+    }
+
+    printf("Image width: %d height: %d\n", width, height);
+    clock_gettime(CLOCK_MONOTONIC, &slot->start);
+    slot->imageFloatBuffer = convertToFloatArray(imageBuffer, GET_IMAGE_SIZE(width, height));
+    slot->outputImageBuffer = (float *) malloc(width * height * sizeof(float));
+    free(imageBuffer);
+    strcpy(slot->outputImagePath, outputImagePath);
+    resizeOpenCLImageSlot(pipeline, slot, width, height);
+    cl_command_queue queue = slot->queue;
+
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {width, height, 1};
+    cl_int err = clEnqueueWriteImage(queue, slot->colorImageBuffer, CL_FALSE, origin, region, 0, 0,
+                                     slot->imageFloatBuffer, 0, nullptr, &slot->uploaded);
     assert(err == CL_SUCCESS);
 
-    clSetKernelArg(double_thresholding, 2, sizeof(cl_float), &maxIntensityValue);
-    kernelEnqueueResult |= clEnqueueNDRangeKernel(queue, double_thresholding, 2, nullptr, globalWorkSize, localWorkSize,
-                                                  0,
-                                                  nullptr, nullptr);
-    kernelEnqueueResult |= clEnqueueNDRangeKernel(queue, edge_histeresis, 2, nullptr, globalWorkSize, localWorkSize, 0,
-                                                  nullptr, nullptr);
+    size_t localSizes[TUNED_KERNEL_COUNT][2];
+    chooseLocalSizes(pipeline, width, height, localSizes);
+    TunedKernel kernels[TUNED_KERNEL_COUNT];
+    size_t kernelCount = pipelineKernels(pipeline, kernels);
+    cl_int kernelEnqueueResult = CL_SUCCESS;
+    for (size_t i = 0; i < kernelCount; i++) {
+        if (kernels[i] == TUNED_DOUBLE_THRESHOLDING) kernelEnqueueResult |= enqueueMaxIntensity(pipeline, slot);
+        cl_event *event = i + 1 == kernelCount ? &slot->computed : nullptr;
+        kernelEnqueueResult |= enqueueTunedKernel(slot, kernels[i], localSizes[kernels[i]], event);
+    }
     if (kernelEnqueueResult != CL_SUCCESS) {
         printf("Error: %d\n", kernelEnqueueResult);
     }
     assert(kernelEnqueueResult == CL_SUCCESS);
 
-    clFinish(queue);
-    struct timespec kernelComputeEnd;
-    clock_gettime(CLOCK_MONOTONIC, &kernelComputeEnd);
-
-    float *outputImageBuffer = (float *) malloc(width * height * sizeof(float));
-    err = clEnqueueReadImage(queue, auxiliaryImageBuffer, CL_TRUE, origin, region, 0, 0, outputImageBuffer, 0,
-                             nullptr,
-                             nullptr);
-//    err = clEnqueueReadBuffer(queue, edgeThinningCLBuffer, CL_TRUE, 0, width * height * sizeof(float),
-//                              outputImageBuffer, 0, nullptr, nullptr);
+    err = clEnqueueReadImage(queue, slot->auxiliaryImageBuffer, CL_FALSE, origin, region, 0, 0,
+                             slot->outputImageBuffer, 0, nullptr, &slot->downloaded);
     assert(err == CL_SUCCESS);
-    struct timespec imageCopyEnd;
-    clock_gettime(CLOCK_MONOTONIC, &imageCopyEnd);
+    clFlush(queue);
+    slot->busy = true;
+    return true;
+}
 
-#define TIME_IN_SECONDS(start, end) ((double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1000000000)
+// the device clock of a profiled command in seconds, info is CL_PROFILING_COMMAND_START or _END
+double eventTime(cl_event event, cl_profiling_info info) {
+    cl_ulong time = 0;
+    clGetEventProfilingInfo(event, info, sizeof(cl_ulong), &time, nullptr);
+    return (double) time / 1000000000;
+}
 
-    putc('\n', stdout);
-    printf("Device setup: %.5f seconds\n", TIME_IN_SECONDS(start, deviceSetupEnd));
-    printf("Memory buffers: %.5f seconds\n", TIME_IN_SECONDS(deviceSetupEnd, memoryBuffersEnd));
-    printf("Kernel compute: %.5f seconds\n", TIME_IN_SECONDS(memoryBuffersEnd, kernelComputeEnd));
-    printf("Image copy: %.5f seconds\n", TIME_IN_SECONDS(kernelComputeEnd, imageCopyEnd));
-    printf("Total time: %.5f seconds\n", TIME_IN_SECONDS(start, imageCopyEnd));
-    printf("Total time excluding device setup: %.5f seconds\n", TIME_IN_SECONDS(deviceSetupEnd, imageCopyEnd));
-
-    uint8_t *outputImageByteArray = convertToByteArray(outputImageBuffer, width * height);
-    error = lodepng_encode_file(outputImagePath, outputImageByteArray, width, height, LCT_GREY, 8);
-    assert(error == 0);
-
-    err = clReleaseMemObject(auxiliaryImageBuffer);
-    err |= clReleaseMemObject(colorImageBuffer);
-    err |= clReleaseMemObject(sobelIntensityCLBuffer);
-    err |= clReleaseMemObject(sobelOrientationCLBuffer);
-    err |= clReleaseMemObject(edgeThinningCLBuffer);
-    err |= clReleaseMemObject(auxiliaryGrayscaleBuffer);
-    err |= clReleaseMemObject(auxiliaryImageBuffer);
-    err |= clReleaseCommandQueue(queue);
-    err |= clReleaseKernel(grayscaleKernel);
-    err |= clReleaseKernel(gaussian);
-    err |= clReleaseKernel(sobel);
-    err |= clReleaseKernel(edge_thinning);
-    err |= clReleaseKernel(max_intensity);
-    err |= clReleaseKernel(double_thresholding);
-    err |= clReleaseKernel(edge_histeresis);
-    err |= clReleaseProgram(program);
-    err |= clReleaseContext(context);
+// Waits for the image in flight in the slot and encodes it.
+// Returns false if the output cannot be written.
+bool finishImage(const OpenCLPipeline *pipeline, OpenCLImageSlot *slot) {
+    assert(slot->busy);
+    cl_int err = clWaitForEvents(1, &slot->downloaded);
     assert(err == CL_SUCCESS);
+    slot->busy = false;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    free(sobelOrientationBuffer);
-    free(sobelIntensityBuffer);
-    free(edgeThinningBuffer);
-    free(grayscaleImageBuffer);
-    free(grayscaleAuxiliaryBuffer);
+    // the transfers and kernels of other slots may run in between, so these are not meant to add up
+    printf("\nFinished %s\n", slot->outputImagePath);
+    printf("Memory buffers: %.5f seconds\n",
+           eventTime(slot->uploaded, CL_PROFILING_COMMAND_END) - eventTime(slot->uploaded, CL_PROFILING_COMMAND_START));
+    printf("Kernel compute: %.5f seconds\n",
+           eventTime(slot->computed, CL_PROFILING_COMMAND_END) - eventTime(slot->uploaded, CL_PROFILING_COMMAND_END));
+    printf("Image copy: %.5f seconds\n", eventTime(slot->downloaded, CL_PROFILING_COMMAND_END) -
+                                         eventTime(slot->downloaded, CL_PROFILING_COMMAND_START));
+    printf("Total time excluding device setup: %.5f seconds\n", TIME_IN_SECONDS(slot->start, end));
+    clReleaseEvent(slot->uploaded);
+    clReleaseEvent(slot->computed);
+    clReleaseEvent(slot->downloaded);
+
+    uint8_t *outputImageByteArray = convertToByteArray(slot->outputImageBuffer, slot->width * slot->height);
+    uint32_t error = png_encode_grey_file(slot->outputImagePath, outputImageByteArray, slot->width, slot->height,
+                                          pipeline->compression);
+    if (error) {
+        printf("%s: error %u: %s\n", slot->outputImagePath, error, lodepng_error_text(error));
+    }
 
-    free(maxIntensityValueBuffer);
     free(outputImageByteArray);
-    free(outputImageBuffer);
+    free(slot->outputImageBuffer);
+    free(slot->imageFloatBuffer);
+    return error == 0;
+}
+
+// Decodes inputImagePath, runs every kernel and encodes the edges to outputImagePath.
+// Returns false if the input cannot be decoded or the output cannot be written.
+bool processImage(OpenCLPipeline *pipeline, const char *inputImagePath, const char *outputImagePath) {
+    return enqueueImage(pipeline, &pipeline->slots[0], inputImagePath, outputImagePath) &&
+           finishImage(pipeline, &pipeline->slots[0]);
+}
+
+// the fastest of TUNE_REPETITIONS launches by the device clock in seconds, HUGE_VAL if the device refuses localSize
+double kernelSeconds(const OpenCLImageSlot *slot, TunedKernel kernel, const size_t localSize[2]) {
+    double fastest = HUGE_VAL;
+    for (int repetition = 0; repetition < TUNE_REPETITIONS; repetition++) {
+        cl_event event;
+        if (enqueueTunedKernel(slot, kernel, localSize, &event) != CL_SUCCESS) {
+            clFinish(slot->queue);
+            return HUGE_VAL;
+        }
+        clWaitForEvents(1, &event);
+        double seconds = eventTime(event, CL_PROFILING_COMMAND_END) - eventTime(event, CL_PROFILING_COMMAND_START);
+        clReleaseEvent(event);
+        if (seconds < fastest) fastest = seconds;
+    }
+    return fastest;
+}
+
+// Measures every kernel of the pipeline on the image in inputImagePath, in their order and each on the output of
+// the one before, with the driver's choice or the fused kernel's tile and then every one of tuningCandidates that
+// fits. The fastest go into the tuning for images of its size, replacing what it held for them.
+// Returns false if the input cannot be decoded.
+bool tuneImage(OpenCLPipeline *pipeline, const char *inputImagePath) {
+    uint8_t *imageBuffer;
+    uint32_t width, height;
+    uint32_t error = lodepng_decode32_file(&imageBuffer, &width, &height, inputImagePath);
+    if (error) {
+        printf("%s: error %u: %s\n", inputImagePath, error, lodepng_error_text(error));
+        return false;
+    }
+
+    OpenCLImageSlot *slot = &pipeline->slots[0];
+    float *imageFloatBuffer = convertToFloatArray(imageBuffer, GET_IMAGE_SIZE(width, height));
     free(imageBuffer);
+    resizeOpenCLImageSlot(pipeline, slot, width, height);
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {width, height, 1};
+    cl_int err = clEnqueueWriteImage(slot->queue, slot->colorImageBuffer, CL_TRUE, origin, region, 0, 0,
+                                     imageFloatBuffer, 0, nullptr, nullptr);
+    assert(err == CL_SUCCESS);
     free(imageFloatBuffer);
-    free((void *) programSource);
 
-    return 0;
-}
\ No newline at end of file
+    printf("Tuning work-group sizes on %u x %u\n", width, height);
+    OpenCLTuningBucket *bucket = openCLTuningBucketOf(pipeline, (uint64_t) width * height);
+    TunedKernel kernels[TUNED_KERNEL_COUNT];
+    size_t kernelCount = pipelineKernels(pipeline, kernels);
+    for (size_t i = 0; i < kernelCount; i++) {
+        TunedKernel kernel = kernels[i];
+        if (kernel == TUNED_DOUBLE_THRESHOLDING) {
+            err = enqueueMaxIntensity(pipeline, slot);
+            assert(err == CL_SUCCESS);
+        }
+
+        size_t chosen[2] = {0, 0};
+        if (kernel == TUNED_FUSED) {
+            chosen[0] = pipeline->localSize[0];
+            chosen[1] = pipeline->localSize[1];
+        }
+        double fastest = kernelSeconds(slot, kernel, chosen);
+        printf("%s %zux%zu: %.3f ms\n", tunedKernelNames[kernel], chosen[0], chosen[1], fastest * 1000);
+        for (size_t c = 0; c < sizeof(tuningCandidates) / sizeof(tuningCandidates[0]); c++) {
+            const size_t *candidate = tuningCandidates[c];
+            bool usable = kernel == TUNED_FUSED ? fusedTileFits(pipeline, candidate)
+                                                : width % candidate[0] == 0 && height % candidate[1] == 0;
+            if (!usable) continue;
+            double seconds = kernelSeconds(slot, kernel, candidate);
+            if (seconds == HUGE_VAL) continue;
+            printf("%s %zux%zu: %.3f ms\n", tunedKernelNames[kernel], candidate[0], candidate[1], seconds * 1000);
+            if (seconds < fastest * (1 - TUNE_MARGIN)) {
+                fastest = seconds;
+                chosen[0] = candidate[0];
+                chosen[1] = candidate[1];
+            }
+        }
+        bucket->localSizes[kernel][0] = chosen[0];
+        bucket->localSizes[kernel][1] = chosen[1];
+        printf("%s: %zux%zu\n", tunedKernelNames[kernel], chosen[0], chosen[1]);
+
+        // the next kernel reads what this one wrote
+        err = enqueueTunedKernel(slot, kernel, chosen, nullptr);
+        assert(err == CL_SUCCESS);
+    }
+    clFinish(slot->queue);
+    return true;
+}
+
+// Every line of the list is "<input.png> <output.png>", - reads the list from stdin as the lines come in,
+// so a long running process can be fed images without paying for the setup again.
+// The images take turns in the slots: the next one is decoded and uploaded while the ones before it compute, and a
+// slot is only waited for when its turn comes again.
+int processImageList(OpenCLPipeline *pipeline, const char *listPath) {
+    FILE *list = strcmp(listPath, "-") == 0 ? stdin : fopen(listPath, "r");
+    if (list == nullptr) {
+        printf("Cannot open %s\n", listPath);
+        return 1;
+    }
+
+    size_t images = 0;
+    size_t failures = 0;
+    size_t next = 0;
+    char line[2200];
+    while (fgets(line, sizeof(line), list) != nullptr) {
+        char inputImagePath[1024];
+        char outputImagePath[1024];
+        if (line[0] == '#' || sscanf(line, "%1023s %1023s", inputImagePath, outputImagePath) != 2) continue;
+
+        OpenCLImageSlot *slot = &pipeline->slots[next];
+        if (slot->busy && !finishImage(pipeline, slot)) failures++;
+
+        printf("\n%s -> %s\n", inputImagePath, outputImagePath);
+        if (enqueueImage(pipeline, slot, inputImagePath, outputImagePath)) {
+            next = (next + 1) % pipeline->slotCount;
+        } else {
+            failures++;
+        }
+        images++;
+        fflush(stdout);
+    }
+    if (list != stdin) fclose(list);
+
+    // the oldest image first
+    for (size_t i = 0; i < pipeline->slotCount; i++) {
+        OpenCLImageSlot *slot = &pipeline->slots[(next + i) % pipeline->slotCount];
+        if (slot->busy && !finishImage(pipeline, slot)) failures++;
+    }
+
+    printf("\nProcessed %zu images, %zu failed\n", images, failures);
+    return failures == 0 ? 0 : 1;
+}
+
+void printUsage(const char *program) {
+    printf("Usage: %s [-u] [-T] [-l WxH] [-q images] [-z level] kernel.cl [input_image_path] [output_image_path]\n",
+           program);
+    printf("       %s [-u] [-l WxH] [-q images] [-z level] kernel.cl -p <list|->\n", program);
+    printf("-p keeps the device set up and processes every \"<input.png> <output.png>\" line of the list\n");
+    printf("-q sets how many images of the list are in flight at once, %d by default\n", DEFAULT_IN_FLIGHT_IMAGES);
+    printf("-u runs blur, sobel and thinning as separate kernels instead of the fused one\n");
+    printf("-l sets the work-group size of the fused kernel, %dx%d by default\n", DEFAULT_LOCAL_SIZE,
+           DEFAULT_LOCAL_SIZE);
+    printf("-z best|fast|stored picks how the output PNGs are compressed, best by default, see png_codec.h\n");
+    printf("-T measures the work-group size of every kernel on the input image before processing it and keeps the\n"
+           "   fastest in the tuning profile, later runs on this device use them, see canny_tuning_create in canny.h\n");
+}
+
+int main(int argc, char **argv) {
+    printf("We are running OpenCL code\n");
+
+    char inputImagePath[1024] = {0};
+    char outputImagePath[1024] = {0};
+    char kernelPath[1024] = {0};
+    const char *listPath = nullptr;
+    bool fused = true;
+    size_t localSize[2] = {DEFAULT_LOCAL_SIZE, DEFAULT_LOCAL_SIZE};
+    bool fixedLocalSize = false;
+    bool tune = false;
+    size_t slotCount = DEFAULT_IN_FLIGHT_IMAGES;
+    png_compression compression = PNG_COMPRESSION_BEST;
+
+    for (int i = 0; i < argc; i++) {
+        printf("Argument %d: %s\n", i, argv[i]);
+    }
+
+    const char *program = argv[0];
+    int option;
+    while ((option = getopt(argc, argv, "+ul:q:z:T")) != -1) {
+        switch (option) {
+            case 'u':
+                fused = false;
+                break;
+            case 'l':
+                if (sscanf(optarg, "%zux%zu", &localSize[0], &localSize[1]) != 2 || localSize[0] == 0 ||
+                    localSize[1] == 0) {
+                    printf("Work-group size has to be <width>x<height>\n");
+                    return 1;
+                }
+                fixedLocalSize = true;
+                break;
+            case 'T':
+                tune = true;
+                break;
+            case 'q':
+                slotCount = strtoul(optarg, nullptr, 10);
+                if (slotCount == 0 || slotCount > MAX_IN_FLIGHT_IMAGES) {
+                    printf("Between 1 and %d images can be in flight\n", MAX_IN_FLIGHT_IMAGES);
+                    return 1;
+                }
+                break;
+            case 'z':
+                if (strcmp(optarg, "best") == 0) {
+                    compression = PNG_COMPRESSION_BEST;
+                } else if (strcmp(optarg, "fast") == 0) {
+                    compression = PNG_COMPRESSION_FAST;
+                } else if (strcmp(optarg, "stored") == 0) {
+                    compression = PNG_COMPRESSION_STORED;
+                } else {
+                    printf("PNG compression has to be best, fast or stored\n");
+                    return 1;
+                }
+                break;
+            default:
+                printUsage(program);
+                return 1;
+        }
+    }
+    // the rest keeps its positions, with argv[1] the kernel
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    switch (argc) {
+        case 2:
+            strcpy(inputImagePath, "lenna.png");
+            strcpy(outputImagePath, "/tmp/lena_out.png");
+            break;
+        case 3:
+            assert(strstr(argv[2], ".png") != nullptr);
+            strcpy(inputImagePath, argv[2]);
+            strcpy(outputImagePath, "/tmp/lena_out.png");
+            break;
+        case 4:
+            if (strcmp(argv[2], "-p") == 0) {
+                listPath = argv[3];
+                break;
+            }
+            assert(strstr(argv[2], ".png") != nullptr);
+            assert(strstr(argv[3], ".png") != nullptr);
+            strcpy(inputImagePath, argv[2]);
+            strcpy(outputImagePath, argv[3]);
+            break;
+        default:
+            printUsage(program);
+            return 1;
+    }
+    if (tune && listPath != nullptr) {
+        printf("-T tunes on a single image, not on a list\n");
+        return 1;
+    }
+    strcpy(kernelPath, argv[1]);
+
+    const char *programSource = loadProgramSource(kernelPath);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    OpenCLPipeline pipeline;
+    createOpenCLPipeline(&pipeline, programSource, fused, localSize, fixedLocalSize, slotCount, compression);
+    struct timespec deviceSetupEnd;
+    clock_gettime(CLOCK_MONOTONIC, &deviceSetupEnd);
+    printf("Device setup: %.5f seconds\n", TIME_IN_SECONDS(start, deviceSetupEnd));
+
+    int result;
+    if (listPath != nullptr) {
+        result = processImageList(&pipeline, listPath);
+    } else {
+        printf("Input image path: %s\n", inputImagePath);
+        printf("Output image path: %s\n", outputImagePath);
+        if (tune && tuneImage(&pipeline, inputImagePath)) {
+            if (pipeline.tuningPath[0] != '\0' && saveOpenCLTuning(&pipeline)) {
+                printf("Work-group sizes saved to %s\n", pipeline.tuningPath);
+            } else {
+                printf("Cannot save the work-group sizes, see CANNY_TUNING\n");
+            }
+        }
+        result = processImage(&pipeline, inputImagePath, outputImagePath) ? 0 : 1;
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Total time: %.5f seconds\n", TIME_IN_SECONDS(start, end));
+    }
+
+    releaseOpenCLPipeline(&pipeline);
+    free((void *) programSource);
+    return result;
+}
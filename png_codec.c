@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "vendor/lodepng/lodepng.h"
+#include "png_codec.h"
+
+// a segment holds at least one row and about this many filtered bytes, but there are at least as many as threads
+#define PNG_SEGMENT_BYTES (256 * 1024)
+#define PNG_HASH_BITS 14
+#define PNG_WINDOW 32768
+#define PNG_MIN_MATCH 4
+#define PNG_MAX_MATCH 258
+#define PNG_STORED_BLOCK 65535
+#define ADLER_BASE 65521
+// the most bytes adler32 can sum before its 32 bit sums have to be reduced
+#define ADLER_RUN 5552
+// lodepng's "failed to open file for writing"
+#define PNG_ERROR_WRITE 79
+
+static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+static void write_u32(uint8_t *out, uint32_t value) {
+    out[0] = (uint8_t) (value >> 24);
+    out[1] = (uint8_t) (value >> 16);
+    out[2] = (uint8_t) (value >> 8);
+    out[3] = (uint8_t) value;
+}
+
+static uint32_t read_u32(const uint8_t *in) {
+    return (uint32_t) in[0] << 24 | (uint32_t) in[1] << 16 | (uint32_t) in[2] << 8 | in[3];
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        size_t run = size < ADLER_RUN ? size : ADLER_RUN;
+        for (size_t i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+        data += run;
+        size -= run;
+    }
+    return b << 16 | a;
+}
+
+// the adler32 of two pieces back to back from their own, as zlib's adler32_combine does it
+static uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+    uint32_t remainder = (uint32_t) (second_size % ADLER_BASE);
+    uint32_t a = first & 0xffff;
+    uint32_t b = (uint32_t) (((uint64_t) remainder * a) % ADLER_BASE);
+    a += (second & 0xffff) + ADLER_BASE - 1;
+    b += (first >> 16) + (second >> 16) + ADLER_BASE - remainder;
+    if (a >= ADLER_BASE) a -= ADLER_BASE;
+    if (a >= ADLER_BASE) a -= ADLER_BASE;
+    if (b >= 2 * ADLER_BASE) b -= 2 * ADLER_BASE;
+    if (b >= ADLER_BASE) b -= ADLER_BASE;
+    return b << 16 | a;
+}
+
+// deflate writes its bits least significant first
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    uint64_t bits;
+    int bit_count;
+} bit_writer;
+
+static inline void put_bits(bit_writer *writer, uint32_t value, int count) {
+    writer->bits |= (uint64_t) value << writer->bit_count;
+    writer->bit_count += count;
+    while (writer->bit_count >= 8) {
+        writer->data[writer->size++] = (uint8_t) writer->bits;
+        writer->bits >>= 8;
+        writer->bit_count -= 8;
+    }
+}
+
+static void align_bits(bit_writer *writer) {
+    if (writer->bit_count > 0) put_bits(writer, 0, 8 - writer->bit_count);
+}
+
+// The fixed Huffman code of RFC 1951 3.2.6, with the codes already reversed for the bit writer.
+typedef struct {
+    uint16_t symbols[288];
+    uint8_t symbol_lengths[288];
+    uint8_t distances[30];
+} fixed_code;
+
+static uint16_t reverse_bits(uint16_t code, int length) {
+    uint16_t reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = (uint16_t) (reversed << 1 | (code >> i & 1));
+    }
+    return reversed;
+}
+
+static void fixed_code_init(fixed_code *code) {
+    for (int symbol = 0; symbol < 288; symbol++) {
+        int length = symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
+        int value = symbol < 144 ? 0x30 + symbol : symbol < 256 ? 0x190 + symbol - 144
+                                                 : symbol < 280 ? symbol - 256 : 0xc0 + symbol - 280;
+        code->symbols[symbol] = reverse_bits((uint16_t) value, length);
+        code->symbol_lengths[symbol] = (uint8_t) length;
+    }
+    for (int distance = 0; distance < 30; distance++) {
+        code->distances[distance] = (uint8_t) reverse_bits((uint16_t) distance, 5);
+    }
+}
+
+static inline void put_symbol(bit_writer *writer, const fixed_code *code, int symbol) {
+    put_bits(writer, code->symbols[symbol], code->symbol_lengths[symbol]);
+}
+
+static inline int floor_log2(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+// length codes 257 to 284 cover 4 lengths per extra bit, 285 is 258 alone
+static inline void put_length(bit_writer *writer, const fixed_code *code, uint32_t length) {
+    uint32_t value = length - 3;
+    if (value < 8) {
+        put_symbol(writer, code, 257 + (int) value);
+    } else if (length == PNG_MAX_MATCH) {
+        put_symbol(writer, code, 285);
+    } else {
+        int extra = floor_log2(value) - 2;
+        put_symbol(writer, code, 257 + 4 * (extra + 1) + (int) (value >> extra & 3));
+        put_bits(writer, value & ((1u << extra) - 1), extra);
+    }
+}
+
+// distance codes 0 to 3 have no extra bits, after that two codes per extra bit
+static inline void put_distance(bit_writer *writer, const fixed_code *code, uint32_t distance) {
+    uint32_t value = distance - 1;
+    if (value < 4) {
+        put_bits(writer, code->distances[value], 5);
+    } else {
+        int extra = floor_log2(value) - 1;
+        put_bits(writer, code->distances[2 * (extra + 1) + (value >> extra & 1)], 5);
+        put_bits(writer, value & ((1u << extra) - 1), extra);
+    }
+}
+
+static inline uint32_t hash4(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value * 2654435761u >> (32 - PNG_HASH_BITS);
+}
+
+// One fixed Huffman block, greedy matching against the latest position with the same hash. Long runs of zeros,
+// which is most of an edge map, become a chain of 258 byte matches.
+static void deflate_fixed(bit_writer *writer, const fixed_code *code, const uint8_t *data, size_t size, bool final,
+                          int32_t *head) {
+    memset(head, 0xff, sizeof(int32_t) << PNG_HASH_BITS);
+    put_bits(writer, final, 1);
+    put_bits(writer, 1, 2);
+    size_t i = 0;
+    while (i + PNG_MIN_MATCH <= size) {
+        uint32_t hash = hash4(data + i);
+        int32_t candidate = head[hash];
+        head[hash] = (int32_t) i;
+        if (candidate >= 0 && i - (size_t) candidate <= PNG_WINDOW &&
+            memcmp(data + candidate, data + i, PNG_MIN_MATCH) == 0) {
+            size_t limit = size - i < PNG_MAX_MATCH ? size - i : PNG_MAX_MATCH;
+            size_t length = PNG_MIN_MATCH;
+            while (length < limit && data[candidate + length] == data[i + length]) length++;
+            put_length(writer, code, (uint32_t) length);
+            put_distance(writer, code, (uint32_t) (i - (size_t) candidate));
+            i += length;
+        } else {
+            put_symbol(writer, code, data[i++]);
+        }
+    }
+    while (i < size) put_symbol(writer, code, data[i++]);
+    put_symbol(writer, code, 256);
+}
+
+static void deflate_stored(bit_writer *writer, const uint8_t *data, size_t size, bool final) {
+    for (size_t offset = 0; offset < size; offset += PNG_STORED_BLOCK) {
+        size_t length = size - offset < PNG_STORED_BLOCK ? size - offset : PNG_STORED_BLOCK;
+        put_bits(writer, final && offset + length == size, 1);
+        put_bits(writer, 0, 2);
+        align_bits(writer);
+        put_bits(writer, (uint32_t) length, 16);
+        put_bits(writer, (uint32_t) length ^ 0xffff, 16);
+        memcpy(writer->data + writer->size, data + offset, length);
+        writer->size += length;
+    }
+}
+
+// one IDAT chunk: length, type, data and CRC
+typedef struct {
+    uint8_t *chunk;
+    size_t size;
+    size_t rows;
+    size_t raw_size;
+    uint32_t adler;
+} png_segment;
+
+static bool is_binary(const uint8_t *pixels, size_t size) {
+    bool binary = true;
+#pragma omp parallel for default(none) shared(pixels, size) reduction(&&: binary)
+    for (size_t i = 0; i < size; i++) {
+        binary = binary && (pixels[i] == 0 || pixels[i] == 255);
+    }
+    return binary;
+}
+
+// filters rows first_row onwards into raw, every row with filter type 0
+static void filter_rows(const uint8_t *pixels, uint32_t width, size_t first_row, size_t rows, int bit_depth,
+                        uint8_t *raw) {
+    size_t row_bytes = bit_depth == 1 ? (width + 7) / 8 : width;
+    for (size_t y = 0; y < rows; y++) {
+        const uint8_t *row = pixels + (first_row + y) * width;
+        uint8_t *out = raw + y * (row_bytes + 1);
+        out[0] = 0;
+        if (bit_depth == 8) {
+            memcpy(out + 1, row, width);
+            continue;
+        }
+        memset(out + 1, 0, row_bytes);
+        for (uint32_t x = 0; x < width; x++) {
+            out[1 + x / 8] |= (uint8_t) ((row[x] != 0) << (7 - x % 8));
+        }
+    }
+}
+
+static void chunk_finish(uint8_t *chunk, size_t data_size) {
+    write_u32(chunk, (uint32_t) data_size);
+    write_u32(chunk + 8 + data_size, lodepng_crc32(chunk + 4, data_size + 4));
+}
+
+static bool write_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t size) {
+    uint8_t header[8];
+    write_u32(header, size);
+    memcpy(header + 4, type, 4);
+    uint8_t *chunk = malloc(size + 12);
+    memcpy(chunk, header, 8);
+    if (size > 0) memcpy(chunk + 8, data, size);
+    chunk_finish(chunk, size);
+    bool written = fwrite(chunk, 1, size + 12, file) == size + 12;
+    free(chunk);
+    return written;
+}
+
+unsigned png_encode_grey_file(const char *path, const uint8_t *pixels, uint32_t width, uint32_t height,
+                              png_compression compression) {
+    if (compression == PNG_COMPRESSION_BEST) return lodepng_encode_file(path, pixels, width, height, LCT_GREY, 8);
+
+    int bit_depth = is_binary(pixels, (size_t) width * height) ? 1 : 8;
+    size_t row_bytes = bit_depth == 1 ? (width + 7) / 8 : width;
+    size_t segment_rows = PNG_SEGMENT_BYTES / (row_bytes + 1);
+    size_t rows_per_thread = (height + omp_get_max_threads() - 1) / omp_get_max_threads();
+    if (segment_rows > rows_per_thread) segment_rows = rows_per_thread;
+    if (segment_rows == 0) segment_rows = 1;
+    size_t segment_count = (height + segment_rows - 1) / segment_rows;
+    png_segment *segments = calloc(segment_count, sizeof(png_segment));
+
+    fixed_code code;
+    fixed_code_init(&code);
+#pragma omp parallel for schedule(dynamic) default(none) \
+        shared(pixels, width, height, compression, bit_depth, row_bytes, segment_rows, segment_count, segments, code)
+    for (size_t s = 0; s < segment_count; s++) {
+        png_segment *segment = &segments[s];
+        size_t first_row = s * segment_rows;
+        segment->rows = height - first_row < segment_rows ? height - first_row : segment_rows;
+        segment->raw_size = segment->rows * (row_bytes + 1);
+        uint8_t *raw = malloc(segment->raw_size);
+        filter_rows(pixels, width, first_row, segment->rows, bit_depth, raw);
+        segment->adler = adler32(raw, segment->raw_size);
+
+        // 9 bits for every literal at worst, or 5 bytes of header for every stored block, plus the block ends,
+        // the zlib header, the adler32 and the chunk framing
+        size_t bound = segment->raw_size + segment->raw_size / 8 + 5 * (segment->raw_size / PNG_STORED_BLOCK + 1) + 32;
+        segment->chunk = malloc(bound);
+        memcpy(segment->chunk + 4, "IDAT", 4);
+        bit_writer writer = {.data = segment->chunk + 8};
+        if (s == 0) {
+            put_bits(&writer, 0x78, 8);
+            put_bits(&writer, 0x01, 8);
+        }
+        bool final = s + 1 == segment_count;
+        if (compression == PNG_COMPRESSION_STORED) {
+            deflate_stored(&writer, raw, segment->raw_size, final);
+        } else {
+            int32_t *head = malloc(sizeof(int32_t) << PNG_HASH_BITS);
+            deflate_fixed(&writer, &code, raw, segment->raw_size, final, head);
+            free(head);
+        }
+        // an empty stored block ends every other segment on a byte boundary, like zlib's Z_SYNC_FLUSH
+        if (!final) {
+            put_bits(&writer, 0, 3);
+            align_bits(&writer);
+            put_bits(&writer, 0xffff0000u, 32);
+        }
+        align_bits(&writer);
+        segment->size = writer.size;
+        if (!final) chunk_finish(segment->chunk, segment->size);
+        free(raw);
+    }
+
+    // the last segment ends with the adler32 of all of them
+    png_segment *last = &segments[segment_count - 1];
+    uint32_t adler = segments[0].adler;
+    for (size_t s = 1; s < segment_count; s++) {
+        adler = adler32_combine(adler, segments[s].adler, segments[s].raw_size);
+    }
+    write_u32(last->chunk + 8 + last->size, adler);
+    last->size += 4;
+    chunk_finish(last->chunk, last->size);
+
+    uint8_t header[13];
+    write_u32(header, width);
+    write_u32(header + 4, height);
+    header[8] = (uint8_t) bit_depth;
+    header[9] = LCT_GREY;
+    header[10] = header[11] = header[12] = 0;
+    uint8_t *segment_table = malloc(segment_count * 4);
+    for (size_t s = 0; s < segment_count; s++) {
+        write_u32(segment_table + 4 * s, (uint32_t) segments[s].rows);
+    }
+
+    FILE *file = fopen(path, "wb");
+    bool written = file != nullptr && fwrite(png_signature, 1, sizeof(png_signature), file) == sizeof(png_signature) &&
+                   write_chunk(file, "IHDR", header, sizeof(header)) &&
+                   write_chunk(file, "cnSG", segment_table, (uint32_t) (segment_count * 4));
+    for (size_t s = 0; s < segment_count; s++) {
+        written = written && fwrite(segments[s].chunk, 1, segments[s].size + 12, file) == segments[s].size + 12;
+        free(segments[s].chunk);
+    }
+    written = written && write_chunk(file, "IEND", nullptr, 0);
+    if (file != nullptr) written = fclose(file) == 0 && written;
+    free(segment_table);
+    free(segments);
+    return written ? 0 : PNG_ERROR_WRITE;
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// undoes the filters of the rows in place, with one byte per pixel for filtering as both bit depths have
+static bool unfilter_rows(uint8_t *raw, size_t row_bytes, uint32_t height) {
+    const uint8_t *previous = nullptr;
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = raw + y * (row_bytes + 1) + 1;
+        uint8_t filter = row[-1];
+        for (size_t x = 0; x < row_bytes; x++) {
+            uint8_t left = x > 0 ? row[x - 1] : 0;
+            uint8_t up = previous != nullptr ? previous[x] : 0;
+            uint8_t up_left = previous != nullptr && x > 0 ? previous[x - 1] : 0;
+            switch (filter) {
+                case 0:
+                    break;
+                case 1:
+                    row[x] += left;
+                    break;
+                case 2:
+                    row[x] += up;
+                    break;
+                case 3:
+                    row[x] += (uint8_t) ((left + up) / 2);
+                    break;
+                case 4:
+                    row[x] += paeth(left, up, up_left);
+                    break;
+                default:
+                    return false;
+            }
+        }
+        previous = row;
+    }
+    return true;
+}
+
+// the PNG parts png_decode_segmented needs
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    int bit_depth;
+    const uint8_t *segment_table;
+    size_t segment_count;
+    const uint8_t **idat;
+    size_t *idat_size;
+    size_t idat_count;
+} png_layout;
+
+static bool parse_layout(const uint8_t *data, size_t size, png_layout *layout) {
+    if (size < sizeof(png_signature) || memcmp(data, png_signature, sizeof(png_signature)) != 0) return false;
+    bool header = false;
+    for (size_t offset = sizeof(png_signature); offset + 12 <= size;) {
+        uint32_t length = read_u32(data + offset);
+        if (length > size - offset - 12) return false;
+        const uint8_t *type = data + offset + 4;
+        const uint8_t *chunk = data + offset + 8;
+        offset += (size_t) length + 12;
+        if (memcmp(type, "IHDR", 4) == 0 && length == 13) {
+            layout->width = read_u32(chunk);
+            layout->height = read_u32(chunk + 4);
+            layout->bit_depth = chunk[8];
+            // grey, deflate, adaptive filtering, not interlaced
+            header = chunk[9] == LCT_GREY && chunk[10] == 0 && chunk[11] == 0 && chunk[12] == 0 &&
+                     (layout->bit_depth == 1 || layout->bit_depth == 8) && layout->width > 0 && layout->height > 0;
+            if (!header) return false;
+        } else if (memcmp(type, "cnSG", 4) == 0 && layout->segment_table == nullptr && length > 0 && length % 4 == 0) {
+            layout->segment_table = chunk;
+            layout->segment_count = length / 4;
+            layout->idat = malloc(layout->segment_count * sizeof(uint8_t *));
+            layout->idat_size = malloc(layout->segment_count * sizeof(size_t));
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (layout->idat_count == layout->segment_count) return false;
+            layout->idat[layout->idat_count] = chunk;
+            layout->idat_size[layout->idat_count++] = length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+    }
+    if (!header || layout->segment_count == 0 || layout->idat_count != layout->segment_count) return false;
+
+    uint64_t rows = 0;
+    for (size_t s = 0; s < layout->segment_count; s++) {
+        rows += read_u32(layout->segment_table + 4 * s);
+    }
+    return rows == layout->height;
+}
+
+bool png_decode_segmented(const uint8_t *data, size_t size, uint8_t **pixels, uint32_t *width, uint32_t *height) {
+    png_layout layout = {0};
+    bool valid = parse_layout(data, size, &layout);
+    size_t row_bytes = layout.bit_depth == 1 ? (layout.width + 7) / 8 : layout.width;
+    uint8_t *raw = valid ? malloc(layout.height * (row_bytes + 1)) : nullptr;
+    size_t *row_offsets = valid ? malloc(layout.segment_count * sizeof(size_t)) : nullptr;
+    uint32_t *adlers = valid ? malloc(layout.segment_count * sizeof(uint32_t)) : nullptr;
+    for (size_t s = 0, row = 0; valid && s < layout.segment_count; s++) {
+        row_offsets[s] = row;
+        row += read_u32(layout.segment_table + 4 * s);
+    }
+
+    // every segment but the last ends on a byte boundary after a non-final block, so appending an empty final
+    // block makes it a complete deflate stream of its own
+    static const uint8_t final_block[2] = {0x03, 0x00};
+    size_t segment_count = valid ? layout.segment_count : 0;
+#pragma omp parallel for schedule(dynamic) default(none) \
+        shared(layout, row_bytes, raw, row_offsets, adlers, segment_count, final_block, lodepng_default_decompress_settings) \
+        reduction(&&: valid)
+    for (size_t s = 0; s < segment_count; s++) {
+        bool first = s == 0;
+        bool last = s + 1 == segment_count;
+        const uint8_t *in = layout.idat[s];
+        size_t in_size = layout.idat_size[s];
+        if ((first && (in_size < 2 || (in[0] & 0x0f) != 8 || (in[0] << 8 | in[1]) % 31 != 0 || (in[1] & 0x20))) ||
+            (last && in_size < (first ? 6 : 4))) {
+            valid = false;
+            continue;
+        }
+        if (first) {
+            in += 2;
+            in_size -= 2;
+        }
+        if (last) in_size -= 4;
+        uint8_t *stream = malloc(in_size + sizeof(final_block));
+        memcpy(stream, in, in_size);
+        if (!last) {
+            memcpy(stream + in_size, final_block, sizeof(final_block));
+            in_size += sizeof(final_block);
+        }
+
+        unsigned char *out = nullptr;
+        size_t out_size = 0;
+        unsigned error = lodepng_inflate(&out, &out_size, stream, in_size, &lodepng_default_decompress_settings);
+        size_t expected = read_u32(layout.segment_table + 4 * s) * (row_bytes + 1);
+        if (error == 0 && out_size == expected) {
+            memcpy(raw + row_offsets[s] * (row_bytes + 1), out, out_size);
+            adlers[s] = adler32(out, out_size);
+        } else {
+            valid = false;
+        }
+        free(out);
+        free(stream);
+    }
+
+    if (valid) {
+        uint32_t adler = adlers[0];
+        for (size_t s = 1; s < layout.segment_count; s++) {
+            adler = adler32_combine(adler, adlers[s], read_u32(layout.segment_table + 4 * s) * (row_bytes + 1));
+        }
+        const uint8_t *last = layout.idat[layout.segment_count - 1];
+        valid = adler == read_u32(last + layout.idat_size[layout.segment_count - 1] - 4) &&
+                unfilter_rows(raw, row_bytes, layout.height);
+    }
+    if (valid) {
+        uint32_t image_width = layout.width;
+        uint32_t image_height = layout.height;
+        int bit_depth = layout.bit_depth;
+        uint8_t *grey = malloc((size_t) image_width * image_height);
+#pragma omp parallel for default(none) shared(raw, grey, row_bytes, image_width, image_height, bit_depth)
+        for (uint32_t y = 0; y < image_height; y++) {
+            const uint8_t *row = raw + y * (row_bytes + 1) + 1;
+            uint8_t *out = grey + (size_t) y * image_width;
+            if (bit_depth == 8) {
+                memcpy(out, row, image_width);
+                continue;
+            }
+            for (uint32_t x = 0; x < image_width; x++) {
+                out[x] = row[x / 8] >> (7 - x % 8) & 1 ? 255 : 0;
+            }
+        }
+        *pixels = grey;
+        *width = image_width;
+        *height = image_height;
+    }
+
+    free(adlers);
+    free(row_offsets);
+    free(raw);
+    free(layout.idat);
+    free(layout.idat_size);
+    return valid;
+}
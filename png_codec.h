@@ -0,0 +1,27 @@
+#ifndef EDGE_DETECTION_PNG_CODEC_H
+#define EDGE_DETECTION_PNG_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    PNG_COMPRESSION_BEST,   // lodepng with its default settings, the smallest files and by far the slowest
+    PNG_COMPRESSION_FAST,   // greedy LZ77 with the fixed Huffman code, in parallel segments
+    PNG_COMPRESSION_STORED, // no compression, in parallel segments
+} png_compression;
+
+// Writes a width x height grey image without row padding to path, returns a lodepng error code.
+// FAST and STORED write an image that only holds 0 and 255, like every edge map, with 1 bit per pixel and otherwise
+// 8, with unfiltered rows either way. The rows are split into segments that the OpenMP threads compress on their own,
+// each ending byte aligned, and every segment goes into an IDAT chunk of its own. A private cnSG chunk in front of
+// them holds the row count of every segment as a big endian uint32, which is what lets png_decode_segmented inflate
+// them in parallel; any other decoder just sees a valid PNG.
+unsigned png_encode_grey_file(const char *path, const uint8_t *pixels, uint32_t width, uint32_t height,
+                              png_compression compression);
+
+// Decodes a PNG written by png_encode_grey_file with FAST or STORED into width * height grey bytes, inflating the
+// segments in parallel. Returns false for every other PNG, or a damaged one, which is left to lodepng.
+bool png_decode_segmented(const uint8_t *data, size_t size, uint8_t **pixels, uint32_t *width, uint32_t *height);
+
+#endif //EDGE_DETECTION_PNG_CODEC_H
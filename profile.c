@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+#include <omp.h>
+#include "profile.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define PROFILE_MAX_STAGES 32
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT,
+} profile_counter;
+
+static const char *counter_names[COUNTER_COUNT] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+
+typedef struct {
+    const char *name;
+    size_t calls;
+    double wall;
+    double *busy; // per thread
+    size_t traffic;
+    size_t allocated;
+    uint64_t counters[COUNTER_COUNT];
+    bool counted[COUNTER_COUNT]; // false once any thread could not count it
+} profile_stage;
+
+// one per OpenMP thread, only ever touched by that thread
+typedef struct {
+    double busy_start;
+    int counters[COUNTER_COUNT]; // perf event fds, -1 if not permitted
+    uint64_t counter_start[COUNTER_COUNT];
+    bool opened;
+} profile_thread;
+
+struct canny_profiler {
+    int thread_count;
+    profile_thread *threads;
+    profile_stage stages[PROFILE_MAX_STAGES];
+    int stage_count;
+    profile_stage *current;
+    struct timespec wall_start;
+    size_t runs;
+};
+
+static double seconds(struct timespec time) {
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static double thread_cpu_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return seconds(time);
+}
+
+#ifdef __linux__
+// counts the calling thread only, in user space, which is what perf_event_paranoid <= 2 permits
+static int open_counter(profile_counter counter) {
+    static const uint64_t configs[COUNTER_COUNT] = {
+            [COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+            [COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+            [COUNTER_LLC_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+            [COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = configs[counter];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd) {
+    uint64_t value = 0;
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) return 0;
+    return value;
+}
+#endif
+
+static void thread_open(profile_thread *thread) {
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+#ifdef __linux__
+        thread->counters[c] = open_counter(c);
+#else
+        thread->counters[c] = -1;
+#endif
+    }
+    thread->opened = true;
+}
+
+canny_profiler *profiler_create(void) {
+    canny_profiler *profiler = calloc(1, sizeof(canny_profiler));
+    profiler->thread_count = omp_get_max_threads();
+    profiler->threads = calloc(profiler->thread_count, sizeof(profile_thread));
+    return profiler;
+}
+
+void profiler_destroy(canny_profiler *profiler) {
+    if (profiler == nullptr) return;
+    for (int t = 0; t < profiler->thread_count; t++) {
+        for (int c = 0; c < COUNTER_COUNT && profiler->threads[t].opened; c++) {
+#ifdef __linux__
+            if (profiler->threads[t].counters[c] >= 0) close(profiler->threads[t].counters[c]);
+#endif
+        }
+    }
+    for (int s = 0; s < profiler->stage_count; s++) {
+        free(profiler->stages[s].busy);
+    }
+    free(profiler->threads);
+    free(profiler);
+}
+
+static profile_stage *find_stage(canny_profiler *profiler, const char *name) {
+    for (int s = 0; s < profiler->stage_count; s++) {
+        if (strcmp(profiler->stages[s].name, name) == 0) return &profiler->stages[s];
+    }
+    if (profiler->stage_count == PROFILE_MAX_STAGES) return nullptr;
+
+    profile_stage *stage = &profiler->stages[profiler->stage_count++];
+    stage->name = name;
+    stage->busy = calloc(profiler->thread_count, sizeof(double));
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        stage->counted[c] = true;
+    }
+    return stage;
+}
+
+// The sampling runs in a parallel region of its own, which the OpenMP runtime hands to the same pool threads
+// as the stage regions in between.
+void profiler_begin(canny_profiler *profiler, const char *name) {
+    profiler->current = find_stage(profiler, name);
+    if (profiler->current == nullptr) return;
+
+#pragma omp parallel default(none) shared(profiler)
+    {
+        int t = omp_get_thread_num();
+        if (t < profiler->thread_count) {
+            profile_thread *thread = &profiler->threads[t];
+            if (!thread->opened) thread_open(thread);
+            for (int c = 0; c < COUNTER_COUNT; c++) {
+#ifdef __linux__
+                if (thread->counters[c] >= 0) thread->counter_start[c] = read_counter(thread->counters[c]);
+#endif
+            }
+            thread->busy_start = thread_cpu_seconds();
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &profiler->wall_start);
+}
+
+void profiler_end(canny_profiler *profiler, size_t traffic, size_t allocated) {
+    profile_stage *stage = profiler->current;
+    if (stage == nullptr) return;
+
+    struct timespec wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    stage->wall += seconds(wall_end) - seconds(profiler->wall_start);
+    stage->calls++;
+    stage->traffic += traffic;
+    stage->allocated += allocated;
+
+#pragma omp parallel default(none) shared(profiler, stage)
+    {
+        int t = omp_get_thread_num();
+        if (t < profiler->thread_count && profiler->threads[t].opened) {
+            profile_thread *thread = &profiler->threads[t];
+            double busy = thread_cpu_seconds() - thread->busy_start;
+            uint64_t counts[COUNTER_COUNT] = {0};
+            for (int c = 0; c < COUNTER_COUNT; c++) {
+#ifdef __linux__
+                if (thread->counters[c] >= 0) counts[c] = read_counter(thread->counters[c]) - thread->counter_start[c];
+#endif
+            }
+
+#pragma omp critical(profiler)
+            {
+                stage->busy[t] += busy;
+                for (int c = 0; c < COUNTER_COUNT; c++) {
+                    if (thread->counters[c] < 0) stage->counted[c] = false;
+                    stage->counters[c] += counts[c];
+                }
+            }
+        }
+    }
+    profiler->current = nullptr;
+}
+
+void profiler_count_run(canny_profiler *profiler) {
+    profiler->runs++;
+}
+
+double profiler_stage_seconds(const canny_profiler *profiler, const char *name) {
+    for (int s = 0; s < profiler->stage_count; s++) {
+        const profile_stage *stage = &profiler->stages[s];
+        if (strcmp(stage->name, name) == 0) return stage->calls > 0 ? stage->wall / (double) stage->calls : 0.0;
+    }
+    return 0.0;
+}
+
+void profiler_write_json(const canny_profiler *profiler, FILE *file) {
+    fprintf(file, "{\n  \"runs\": %zu,\n  \"threads\": %d,\n  \"stages\": [\n", profiler->runs, profiler->thread_count);
+    for (int s = 0; s < profiler->stage_count; s++) {
+        const profile_stage *stage = &profiler->stages[s];
+        double calls = (double) stage->calls;
+        double wall = stage->wall / calls;
+
+        double busy_total = 0.0;
+        double busy_max = 0.0;
+        for (int t = 0; t < profiler->thread_count; t++) {
+            busy_total += stage->busy[t];
+            if (stage->busy[t] > busy_max) busy_max = stage->busy[t];
+        }
+        double busy_mean = busy_total / profiler->thread_count;
+
+        fprintf(file, "    {\n      \"name\": \"%s\",\n      \"calls\": %zu,\n      \"wall_ms\": %.4f,\n",
+                stage->name, stage->calls, 1000.0 * wall);
+        fprintf(file, "      \"busy_ms\": [");
+        for (int t = 0; t < profiler->thread_count; t++) {
+            fprintf(file, "%s%.4f", t > 0 ? ", " : "", 1000.0 * stage->busy[t] / calls);
+        }
+        fprintf(file, "],\n      \"idle_ms\": [");
+        for (int t = 0; t < profiler->thread_count; t++) {
+            double idle = wall - stage->busy[t] / calls;
+            fprintf(file, "%s%.4f", t > 0 ? ", " : "", 1000.0 * (idle > 0.0 ? idle : 0.0));
+        }
+        // the busiest thread over the mean, 1.0 is perfectly balanced
+        fprintf(file, "],\n      \"imbalance\": %.3f,\n", busy_mean > 0.0 ? busy_max / busy_mean : 1.0);
+        fprintf(file, "      \"allocated_bytes\": %zu,\n      \"traffic_bytes\": %.0f,\n      \"bandwidth_gb_s\": %.3f",
+                stage->allocated, (double) stage->traffic / calls,
+                wall > 0.0 ? (double) stage->traffic / calls / wall / 1e9 : 0.0);
+        for (int c = 0; c < COUNTER_COUNT; c++) {
+            if (stage->counted[c]) {
+                fprintf(file, ",\n      \"%s\": %.0f", counter_names[c], (double) stage->counters[c] / calls);
+            } else {
+                fprintf(file, ",\n      \"%s\": null", counter_names[c]);
+            }
+        }
+        if (stage->counted[COUNTER_CYCLES] && stage->counted[COUNTER_INSTRUCTIONS] && stage->counters[COUNTER_CYCLES] > 0) {
+            fprintf(file, ",\n      \"ipc\": %.3f",
+                    (double) stage->counters[COUNTER_INSTRUCTIONS] / (double) stage->counters[COUNTER_CYCLES]);
+        }
+        fprintf(file, "\n    }%s\n", s + 1 < profiler->stage_count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
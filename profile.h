@@ -0,0 +1,34 @@
+#ifndef EDGE_DETECTION_PROFILE_H
+#define EDGE_DETECTION_PROFILE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Per stage instrumentation for canny_params.profile.
+// Every stage records its wall time, the CPU time every OpenMP thread spent in it, the workspace bytes it allocated,
+// a rough estimate of the bytes it read and wrote, and on Linux the cycles, instructions, LLC misses and branch
+// misses of all threads through perf_event_open. Counters the kernel does not permit are reported as null.
+// Stages are accumulated by name over all runs.
+//
+// Busy time is the thread CPU clock, so threads spinning at a barrier count as busy. libgomp spins for a while
+// before it sleeps; run with OMP_WAIT_POLICY=passive to see the load imbalance of short stages.
+typedef struct canny_profiler canny_profiler;
+
+canny_profiler *profiler_create(void);
+
+void profiler_destroy(canny_profiler *profiler);
+
+// stages do not nest, name has to outlive the profiler
+void profiler_begin(canny_profiler *profiler, const char *name);
+
+// traffic is the estimated bytes read and written, allocated the bytes the stage added to the workspace
+void profiler_end(canny_profiler *profiler, size_t traffic, size_t allocated);
+
+void profiler_count_run(canny_profiler *profiler);
+
+// the mean wall time of a call of the stage in seconds, 0 if it never ran
+double profiler_stage_seconds(const canny_profiler *profiler, const char *name);
+
+void profiler_write_json(const canny_profiler *profiler, FILE *file);
+
+#endif //EDGE_DETECTION_PROFILE_H
@@ -0,0 +1,538 @@
+#define _GNU_SOURCE // F_GET_SEALS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <omp.h>
+#include "server.h"
+
+// A long running process that keeps a context for every image size it has seen and the OpenMP threads warm, so a
+// request costs about as much as canny_run itself.
+// Every connection has a thread that reads its requests into buffers of its own and writes the responses. The
+// compute thread takes all pending requests at once: small images run side by side, one per thread, which is where
+// concurrent clients gain the most, and large ones run one after another on the whole pool.
+
+// contexts kept warm, also the most requests in one batch, which never need more contexts than that
+#define SERVER_CONTEXTS 16
+// images up to this many pixels run on a single thread when others are pending with them
+#define SERVER_SMALL_PIXELS (512 * 512)
+// a bound on what a single request can make the server allocate
+#define SERVER_MAX_PIXELS (1ull << 26)
+
+typedef struct server_state server_state;
+typedef struct server_connection server_connection;
+
+struct server_connection {
+    server_state *server;
+    int fd;
+    pthread_t thread;
+    bool finished; // the thread has returned and can be joined
+    server_connection *next;
+    server_connection *next_pending;
+    pthread_cond_t done_changed;
+    bool done;
+    server_request request;
+    server_response response;
+    struct timespec received;
+    // inline requests, never shrunk
+    uint8_t *pixels;
+    size_t pixels_capacity;
+    uint8_t *edges;
+    size_t edges_capacity;
+    // the attached shared memory
+    uint8_t *shared;
+    size_t shared_size;
+    // the request's pixels and edges, in one of the above
+    const uint8_t *in;
+    uint8_t *out;
+};
+
+typedef struct {
+    canny_context *context; // nullptr if the size or channels are invalid
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint64_t last_used;
+    bool busy;
+} server_context;
+
+struct server_state {
+    canny_params params;
+    int listener;
+    int wake;     // the read end of the pipe the signal handler writes to
+    pthread_mutex_t mutex;
+    pthread_cond_t pending_changed;
+    server_connection *pending_head;
+    server_connection *pending_tail;
+    server_connection *connections;
+    bool stopping;
+    // only touched by the compute thread
+    server_context contexts[SERVER_CONTEXTS];
+    int context_count;
+    uint64_t clock;
+    size_t requests;
+    size_t batches;
+};
+
+// the write end of the wake pipe
+static int server_wake = -1;
+
+static void server_signal(int signal) {
+    char byte = (char) signal;
+    ssize_t written = write(server_wake, &byte, 1);
+    (void) written;
+}
+
+static uint64_t nanoseconds_between(struct timespec start, struct timespec end) {
+    return (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000u + (uint64_t) end.tv_nsec - (uint64_t) start.tv_nsec;
+}
+
+static bool read_fully(int fd, void *data, size_t size) {
+    uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t count = recv(fd, bytes, size, 0);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+// Reads the next request header, and the file descriptor sent along with it into attached, -1 if there is none.
+// The descriptor comes with the first byte of the header, which is why that is read with recvmsg.
+static bool read_request(int fd, server_request *request, int *attached) {
+    *attached = -1;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec vector = {.iov_base = request, .iov_len = sizeof(server_request)};
+    struct msghdr message = {
+            .msg_iov = &vector, .msg_iovlen = 1, .msg_control = control.space, .msg_controllen = sizeof(control.space)
+    };
+    ssize_t count;
+    do {
+        count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) return false;
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+        int received;
+        memcpy(&received, CMSG_DATA(header), sizeof(int));
+        if (*attached < 0) {
+            *attached = received;
+        } else {
+            close(received);
+        }
+    }
+    return read_fully(fd, (uint8_t *) request + count, sizeof(server_request) - (size_t) count);
+}
+
+// Maps fd as the connection's shared memory, replacing the previous one. The client keeps the fd, so it has to be
+// sealed against shrinking, otherwise a later ftruncate would turn the server's accesses past the new end into
+// SIGBUS for the whole process.
+static bool attach_shared(server_connection *connection, int fd) {
+    if (connection->shared != nullptr) munmap(connection->shared, connection->shared_size);
+    connection->shared = nullptr;
+    connection->shared_size = 0;
+
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) return false;
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size <= 0) return false;
+    void *shared = mmap(nullptr, (size_t) status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED) return false;
+    connection->shared = shared;
+    connection->shared_size = (size_t) status.st_size;
+    return true;
+}
+
+static bool grow_buffer(uint8_t **buffer, size_t *capacity, size_t size) {
+    if (size <= *capacity) return true;
+    free(*buffer);
+    *buffer = malloc(size);
+    *capacity = *buffer != nullptr ? size : 0;
+    return *buffer != nullptr;
+}
+
+// Checks the request and points in and out at its pixels and edges, reading inline pixels from the socket.
+// Returns false for a bad request.
+static bool receive_pixels(server_connection *connection) {
+    const server_request *request = &connection->request;
+    if (request->magic != SERVER_MAGIC) return false;
+    if (request->channels != 1 && request->channels != 3 && request->channels != 4) return false;
+    uint64_t pixels = (uint64_t) request->width * request->height;
+    if (pixels == 0 || pixels > SERVER_MAX_PIXELS) return false;
+    size_t in_size = (size_t) pixels * request->channels;
+
+    if (request->flags & SERVER_REQUEST_SHARED) {
+        if (connection->shared == nullptr) return false;
+        if (request->output_offset < in_size || request->output_offset > connection->shared_size ||
+            connection->shared_size - request->output_offset < pixels) return false;
+        connection->in = connection->shared;
+        connection->out = connection->shared + request->output_offset;
+        return true;
+    }
+
+    if (!grow_buffer(&connection->pixels, &connection->pixels_capacity, in_size) ||
+        !grow_buffer(&connection->edges, &connection->edges_capacity, pixels)) return false;
+    connection->in = connection->pixels;
+    connection->out = connection->edges;
+    return read_fully(connection->fd, connection->pixels, in_size);
+}
+
+// hands the request to the compute thread, false once the server is stopping
+static bool submit(server_connection *connection) {
+    server_state *server = connection->server;
+    pthread_mutex_lock(&server->mutex);
+    bool submitted = !server->stopping;
+    if (submitted) {
+        connection->done = false;
+        connection->next_pending = nullptr;
+        if (server->pending_tail != nullptr) {
+            server->pending_tail->next_pending = connection;
+        } else {
+            server->pending_head = connection;
+        }
+        server->pending_tail = connection;
+        pthread_cond_signal(&server->pending_changed);
+        while (!connection->done) pthread_cond_wait(&connection->done_changed, &server->mutex);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return submitted;
+}
+
+static void *serve_connection(void *argument) {
+    server_connection *connection = argument;
+    server_state *server = connection->server;
+
+    int attached;
+    while (read_request(connection->fd, &connection->request, &attached)) {
+        const server_request *request = &connection->request;
+        bool valid = true;
+        if (attached >= 0) {
+            valid = (request->flags & SERVER_REQUEST_ATTACH) && attach_shared(connection, attached);
+            close(attached);
+        } else if (request->flags & SERVER_REQUEST_ATTACH) {
+            valid = false;
+        }
+        valid = valid && receive_pixels(connection);
+        clock_gettime(CLOCK_MONOTONIC, &connection->received);
+
+        if (!valid) {
+            connection->response = (server_response) {
+                    .magic = SERVER_MAGIC, .status = SERVER_STATUS_BAD_REQUEST, .width = request->width,
+                    .height = request->height
+            };
+            write_fully(connection->fd, &connection->response, sizeof(server_response));
+            break;
+        }
+        if (!submit(connection)) break;
+
+        const server_response *response = &connection->response;
+        bool inline_edges = response->status == CANNY_OK && !(request->flags & SERVER_REQUEST_SHARED);
+        if (!write_fully(connection->fd, response, sizeof(server_response)) ||
+            (inline_edges && !write_fully(connection->fd, connection->edges, (size_t) request->width * request->height))) {
+            break;
+        }
+    }
+
+    // the descriptor is closed once the thread is joined, the client sees the end of the connection now
+    shutdown(connection->fd, SHUT_RDWR);
+    pthread_mutex_lock(&server->mutex);
+    connection->finished = true;
+    pthread_mutex_unlock(&server->mutex);
+    return nullptr;
+}
+
+static void free_connection(server_connection *connection) {
+    pthread_join(connection->thread, nullptr);
+    close(connection->fd);
+    if (connection->shared != nullptr) munmap(connection->shared, connection->shared_size);
+    free(connection->pixels);
+    free(connection->edges);
+    pthread_cond_destroy(&connection->done_changed);
+    free(connection);
+}
+
+// joins the threads of closed connections, or of all of them
+static void reap_connections(server_state *server, bool all) {
+    pthread_mutex_lock(&server->mutex);
+    server_connection **link = &server->connections;
+    server_connection *finished = nullptr;
+    while (*link != nullptr) {
+        server_connection *connection = *link;
+        if (all || connection->finished) {
+            *link = connection->next;
+            connection->next = finished;
+            finished = connection;
+        } else {
+            link = &connection->next;
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    while (finished != nullptr) {
+        server_connection *next = finished->next;
+        free_connection(finished);
+        finished = next;
+    }
+}
+
+// accepts connections until the wake pipe is written to, then stops the server and ends every connection
+static void *accept_connections(void *argument) {
+    server_state *server = argument;
+    struct pollfd fds[2] = {{.fd = server->listener, .events = POLLIN}, {.fd = server->wake, .events = POLLIN}};
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents != 0) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int fd = accept(server->listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        reap_connections(server, false);
+
+        server_connection *connection = calloc(1, sizeof(server_connection));
+        connection->server = server;
+        connection->fd = fd;
+        pthread_cond_init(&connection->done_changed, nullptr);
+        if (pthread_create(&connection->thread, nullptr, serve_connection, connection) != 0) {
+            fprintf(stderr, "Cannot start a thread for a connection\n");
+            close(fd);
+            pthread_cond_destroy(&connection->done_changed);
+            free(connection);
+            continue;
+        }
+        pthread_mutex_lock(&server->mutex);
+        connection->next = server->connections;
+        server->connections = connection;
+        pthread_mutex_unlock(&server->mutex);
+    }
+
+    // requests that are already pending still get their response
+    pthread_mutex_lock(&server->mutex);
+    server->stopping = true;
+    pthread_cond_broadcast(&server->pending_changed);
+    for (server_connection *connection = server->connections; connection != nullptr; connection = connection->next) {
+        shutdown(connection->fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    reap_connections(server, true);
+    return nullptr;
+}
+
+// A context for width x height images with channels, which is busy until release_context. There are never more than
+// SERVER_CONTEXTS busy ones, so if none of the right size is idle, the least recently used idle one makes room.
+static server_context *acquire_context(server_state *server, uint32_t width, uint32_t height, uint32_t channels) {
+    server_context *oldest = nullptr;
+    for (int i = 0; i < server->context_count; i++) {
+        server_context *entry = &server->contexts[i];
+        if (entry->busy) continue;
+        if (entry->width == width && entry->height == height && entry->channels == channels) {
+            entry->busy = true;
+            return entry;
+        }
+        if (oldest == nullptr || entry->last_used < oldest->last_used) oldest = entry;
+    }
+
+    server_context *entry = server->context_count < SERVER_CONTEXTS ? &server->contexts[server->context_count++] : oldest;
+    canny_context_destroy(entry->context);
+    canny_params params = server->params;
+    params.channels = channels;
+    *entry = (server_context) {
+            .context = canny_context_create(width, height, &params), .width = width, .height = height,
+            .channels = channels, .busy = true
+    };
+    return entry;
+}
+
+static void release_context(server_state *server, server_context *entry) {
+    entry->busy = false;
+    entry->last_used = ++server->clock;
+}
+
+// runs a request with the current thread count and hands the response to its connection
+static void run_request(server_state *server, server_connection *connection, server_context *entry) {
+    const server_request *request = &connection->request;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    canny_status status = canny_run(entry->context, connection->in, request->width, request->height,
+                                    (size_t) request->width * request->channels, connection->out, request->width);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&server->mutex);
+    connection->response = (server_response) {
+            .magic = SERVER_MAGIC, .status = status, .width = request->width, .height = request->height,
+            .queued_ns = nanoseconds_between(connection->received, start), .compute_ns = nanoseconds_between(start, end)
+    };
+    connection->done = true;
+    pthread_cond_signal(&connection->done_changed);
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static void run_requests(server_state *server, server_connection **batch, int count) {
+    int small_count = 0;
+    for (int i = 0; i < count; i++) {
+        if ((uint64_t) batch[i]->request.width * batch[i]->request.height <= SERVER_SMALL_PIXELS) small_count++;
+    }
+    // a single small request is better off on the whole pool
+    bool side_by_side = small_count > 1;
+    int threads = small_count < omp_get_max_threads() ? small_count : omp_get_max_threads();
+
+    // Small requests run side by side go to thread small % threads in order, everything else runs after them on
+    // the calling thread, lane -1. Requests of the same size in the same lane run one after another, so they share
+    // a context.
+    int lanes[SERVER_CONTEXTS];
+    int small[SERVER_CONTEXTS];
+    server_context *entries[SERVER_CONTEXTS];
+    bool owner[SERVER_CONTEXTS];
+    for (int i = 0, next_small = 0; i < count; i++) {
+        const server_request *request = &batch[i]->request;
+        bool is_small = (uint64_t) request->width * request->height <= SERVER_SMALL_PIXELS;
+        lanes[i] = side_by_side && is_small ? next_small % threads : -1;
+        if (side_by_side && is_small) small[next_small++] = i;
+
+        owner[i] = true;
+        for (int j = 0; j < i && owner[i]; j++) {
+            const server_request *other = &batch[j]->request;
+            if (owner[j] && lanes[j] == lanes[i] && other->width == request->width &&
+                other->height == request->height && other->channels == request->channels) {
+                entries[i] = entries[j];
+                owner[i] = false;
+            }
+        }
+        if (owner[i]) entries[i] = acquire_context(server, request->width, request->height, request->channels);
+    }
+
+    if (side_by_side) {
+#pragma omp parallel for schedule(static, 1) num_threads(threads) default(none) shared(server, batch, entries, small, small_count)
+        for (int i = 0; i < small_count; i++) {
+            omp_set_num_threads(1);
+            run_request(server, batch[small[i]], entries[small[i]]);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (lanes[i] < 0) run_request(server, batch[i], entries[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (owner[i]) release_context(server, entries[i]);
+    }
+    server->requests += count;
+    server->batches++;
+}
+
+// the compute thread, until the server stops and the last pending request is done
+static void serve_requests(server_state *server) {
+    server_connection *batch[SERVER_CONTEXTS];
+    for (;;) {
+        pthread_mutex_lock(&server->mutex);
+        while (server->pending_head == nullptr && !server->stopping) {
+            pthread_cond_wait(&server->pending_changed, &server->mutex);
+        }
+        int count = 0;
+        while (server->pending_head != nullptr && count < SERVER_CONTEXTS) {
+            batch[count++] = server->pending_head;
+            server->pending_head = server->pending_head->next_pending;
+        }
+        if (server->pending_head == nullptr) server->pending_tail = nullptr;
+        pthread_mutex_unlock(&server->mutex);
+
+        if (count == 0) break;
+        run_requests(server, batch, count);
+    }
+}
+
+int run_server(const char *socket_path, const canny_params *params) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+    // left behind by a server that did not stop cleanly, anything else at that path is not ours to remove
+    struct stat status;
+    if (lstat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (const struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+    int wake[2];
+    if (pipe(wake) != 0) {
+        perror("pipe");
+        close(listener);
+        unlink(socket_path);
+        return 1;
+    }
+
+    server_state *server = calloc(1, sizeof(server_state));
+    server->params = *params;
+    server->listener = listener;
+    server->wake = wake[0];
+    pthread_mutex_init(&server->mutex, nullptr);
+    pthread_cond_init(&server->pending_changed, nullptr);
+
+    server_wake = wake[1];
+    struct sigaction action = {.sa_handler = server_signal, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    fprintf(stderr, "Listening on %s with %d compute threads\n", socket_path, omp_get_max_threads());
+    pthread_t acceptor;
+    pthread_create(&acceptor, nullptr, accept_connections, server);
+    serve_requests(server);
+    pthread_join(acceptor, nullptr);
+
+    size_t peak_bytes = 0;
+    for (int i = 0; i < server->context_count; i++) {
+        if (server->contexts[i].context != nullptr) peak_bytes += canny_context_peak_bytes(server->contexts[i].context);
+        canny_context_destroy(server->contexts[i].context);
+    }
+    fprintf(stderr, "Served %zu requests in %zu batches, %d contexts of %zu bytes\n", server->requests,
+            server->batches, server->context_count, peak_bytes);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    server_wake = -1;
+    close(wake[0]);
+    close(wake[1]);
+    close(listener);
+    unlink(socket_path);
+    pthread_mutex_destroy(&server->mutex);
+    pthread_cond_destroy(&server->pending_changed);
+    free(server);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef EDGE_DETECTION_SERVER_H
+#define EDGE_DETECTION_SERVER_H
+
+#include <stdint.h>
+#include "canny.h"
+
+// The protocol of run_server over a Unix stream socket. Both ends are on the same machine, so every field is in its
+// byte order. A client sends one server_request and waits for its server_response before it sends the next one,
+// concurrent requests come over concurrent connections.
+#define SERVER_MAGIC 0x43414e59u
+
+typedef enum {
+    // the pixels are at the start of the connection's shared memory and the edges go to output_offset in it,
+    // instead of following the request and the response on the socket
+    SERVER_REQUEST_SHARED = 1 << 0,
+    // the request carries a file descriptor (SCM_RIGHTS) of memfd_create(MFD_ALLOW_SEALING) sealed with
+    // F_SEAL_SHRINK, which the server maps as the connection's shared memory until the next one or the end of the
+    // connection, unsealed ones are a bad request
+    SERVER_REQUEST_ATTACH = 1 << 1,
+} server_request_flags;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;    // server_request_flags
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels; // 1, 3 or 4 bytes per pixel, rows are width * channels bytes
+    uint32_t reserved;
+    uint64_t output_offset; // only SERVER_REQUEST_SHARED, past the pixels
+} server_request;
+
+// a request the server cannot make sense of, it closes the connection after the response
+#define SERVER_STATUS_BAD_REQUEST 0x100u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t status; // a canny_status or SERVER_STATUS_BAD_REQUEST, the edges only follow on CANNY_OK
+    uint32_t width;
+    uint32_t height;
+    uint64_t queued_ns;  // from the request being read until its run started
+    uint64_t compute_ns; // the run itself
+} server_response;
+
+// Serves edge maps of width * height grey bytes on a Unix socket at socket_path until SIGINT or SIGTERM.
+// Every request runs with params, except for its channels.
+int run_server(const char *socket_path, const canny_params *params);
+
+#endif //EDGE_DETECTION_SERVER_H
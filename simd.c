@@ -0,0 +1,376 @@
+#include "simd.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// The vector kernels add the taps in the same order as the scalar code below (which in turn matches
+// the 3x3 loop of apply_sobel_filter), so every implementation produces the same bits.
+
+static inline void sobel_row_scalar_range(const float *above, const float *row, const float *below,
+                                          float *magnitude, float *orientation, uint32_t begin, uint32_t count) {
+    for (ptrdiff_t x = begin; x < count; x++) {
+        float sobel_x = 0.0f - above[x - 1];
+        sobel_x += above[x + 1];
+        sobel_x -= 2.0f * row[x - 1];
+        sobel_x += 2.0f * row[x + 1];
+        sobel_x -= below[x - 1];
+        sobel_x += below[x + 1];
+
+        float sobel_y = 0.0f + above[x - 1];
+        sobel_y += 2.0f * above[x];
+        sobel_y += above[x + 1];
+        sobel_y -= below[x - 1];
+        sobel_y -= 2.0f * below[x];
+        sobel_y -= below[x + 1];
+
+        magnitude[x] = sqrtf(sobel_x * sobel_x + sobel_y * sobel_y);
+        orientation[x] = quantize_orientation(sobel_x, sobel_y);
+    }
+}
+
+static inline void thinning_row_scalar_range(const float *above, const float *row, const float *below,
+                                             const float *orientation, float *out, uint32_t begin, uint32_t count) {
+    for (ptrdiff_t x = begin; x < count; x++) {
+        float q = 255.0f;
+        float r = 255.0f;
+        float angle = orientation[x];
+
+        if (angle >= 0 && angle < 22.5) {
+            q = row[x + 1];
+            r = row[x - 1];
+        } else if (angle >= 22.5 && angle < 67.5) {
+            q = below[x - 1];
+            r = above[x + 1];
+        } else if (angle >= 67.5 && angle < 112.5) {
+            q = below[x];
+            r = above[x];
+        } else if (angle >= 112.5 && angle < 157.5) {
+            q = above[x - 1];
+            r = below[x + 1];
+        }
+
+        float intensity = row[x];
+        out[x] = intensity >= q && intensity >= r ? intensity : 0.0f;
+    }
+}
+
+static void sobel_row_scalar(const float *above, const float *row, const float *below,
+                             float *magnitude, float *orientation, uint32_t count) {
+    sobel_row_scalar_range(above, row, below, magnitude, orientation, 0, count);
+}
+
+static void thinning_row_scalar(const float *above, const float *row, const float *below,
+                                const float *orientation, float *out, uint32_t count) {
+    thinning_row_scalar_range(above, row, below, orientation, out, 0, count);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// SSE2 is part of x86-64, so this is the baseline; blends are done with and/andnot/or
+static inline __m128 blend_sse2(__m128 a, __m128 b, __m128 mask) {
+    return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+}
+
+static void sobel_row_sse2(const float *above, const float *row, const float *below,
+                           float *magnitude, float *orientation, uint32_t count) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 tan_22_5 = _mm_set1_ps(TAN_22_5);
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+
+    uint32_t x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128 above_left = _mm_loadu_ps(above + x - 1);
+        __m128 above_center = _mm_loadu_ps(above + x);
+        __m128 above_right = _mm_loadu_ps(above + x + 1);
+        __m128 left = _mm_loadu_ps(row + x - 1);
+        __m128 right = _mm_loadu_ps(row + x + 1);
+        __m128 below_left = _mm_loadu_ps(below + x - 1);
+        __m128 below_center = _mm_loadu_ps(below + x);
+        __m128 below_right = _mm_loadu_ps(below + x + 1);
+
+        __m128 sobel_x = _mm_sub_ps(zero, above_left);
+        sobel_x = _mm_add_ps(sobel_x, above_right);
+        sobel_x = _mm_sub_ps(sobel_x, _mm_mul_ps(two, left));
+        sobel_x = _mm_add_ps(sobel_x, _mm_mul_ps(two, right));
+        sobel_x = _mm_sub_ps(sobel_x, below_left);
+        sobel_x = _mm_add_ps(sobel_x, below_right);
+
+        __m128 sobel_y = _mm_add_ps(zero, above_left);
+        sobel_y = _mm_add_ps(sobel_y, _mm_mul_ps(two, above_center));
+        sobel_y = _mm_add_ps(sobel_y, above_right);
+        sobel_y = _mm_sub_ps(sobel_y, below_left);
+        sobel_y = _mm_sub_ps(sobel_y, _mm_mul_ps(two, below_center));
+        sobel_y = _mm_sub_ps(sobel_y, below_right);
+
+        __m128 result = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(sobel_x, sobel_x), _mm_mul_ps(sobel_y, sobel_y)));
+        _mm_storeu_ps(magnitude + x, result);
+
+        __m128 abs_x = _mm_andnot_ps(sign_mask, sobel_x);
+        __m128 abs_y = _mm_andnot_ps(sign_mask, sobel_y);
+        __m128 horizontal = _mm_cmple_ps(abs_y, _mm_mul_ps(tan_22_5, abs_x));
+        __m128 vertical = _mm_cmplt_ps(abs_x, _mm_mul_ps(tan_22_5, abs_y));
+        __m128 opposite_signs = _mm_xor_ps(_mm_cmpgt_ps(sobel_x, zero), _mm_cmpgt_ps(sobel_y, zero));
+
+        __m128 angle = blend_sse2(_mm_set1_ps(45.0f), _mm_set1_ps(135.0f), opposite_signs);
+        angle = blend_sse2(angle, _mm_set1_ps(90.0f), vertical);
+        angle = blend_sse2(angle, zero, horizontal);
+        _mm_storeu_ps(orientation + x, angle);
+    }
+
+    sobel_row_scalar_range(above, row, below, magnitude, orientation, x, count);
+}
+
+static void thinning_row_sse2(const float *above, const float *row, const float *below,
+                              const float *orientation, float *out, uint32_t count) {
+#define SECTOR_MASK(angle, low, high) _mm_and_ps(_mm_cmpge_ps(angle, _mm_set1_ps(low)), _mm_cmplt_ps(angle, _mm_set1_ps(high)))
+    uint32_t x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128 angle = _mm_loadu_ps(orientation + x);
+        __m128 q = _mm_set1_ps(255.0f);
+        __m128 r = _mm_set1_ps(255.0f);
+
+        __m128 sector = SECTOR_MASK(angle, 0.0f, 22.5f);
+        q = blend_sse2(q, _mm_loadu_ps(row + x + 1), sector);
+        r = blend_sse2(r, _mm_loadu_ps(row + x - 1), sector);
+        sector = SECTOR_MASK(angle, 22.5f, 67.5f);
+        q = blend_sse2(q, _mm_loadu_ps(below + x - 1), sector);
+        r = blend_sse2(r, _mm_loadu_ps(above + x + 1), sector);
+        sector = SECTOR_MASK(angle, 67.5f, 112.5f);
+        q = blend_sse2(q, _mm_loadu_ps(below + x), sector);
+        r = blend_sse2(r, _mm_loadu_ps(above + x), sector);
+        sector = SECTOR_MASK(angle, 112.5f, 157.5f);
+        q = blend_sse2(q, _mm_loadu_ps(above + x - 1), sector);
+        r = blend_sse2(r, _mm_loadu_ps(below + x + 1), sector);
+
+        __m128 intensity = _mm_loadu_ps(row + x);
+        __m128 keep = _mm_and_ps(_mm_cmpge_ps(intensity, q), _mm_cmpge_ps(intensity, r));
+        _mm_storeu_ps(out + x, _mm_and_ps(keep, intensity));
+    }
+#undef SECTOR_MASK
+
+    thinning_row_scalar_range(above, row, below, orientation, out, x, count);
+}
+
+__attribute__((target("avx2")))
+static void sobel_row_avx2(const float *above, const float *row, const float *below,
+                           float *magnitude, float *orientation, uint32_t count) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 tan_22_5 = _mm256_set1_ps(TAN_22_5);
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+
+    uint32_t x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256 above_left = _mm256_loadu_ps(above + x - 1);
+        __m256 above_center = _mm256_loadu_ps(above + x);
+        __m256 above_right = _mm256_loadu_ps(above + x + 1);
+        __m256 left = _mm256_loadu_ps(row + x - 1);
+        __m256 right = _mm256_loadu_ps(row + x + 1);
+        __m256 below_left = _mm256_loadu_ps(below + x - 1);
+        __m256 below_center = _mm256_loadu_ps(below + x);
+        __m256 below_right = _mm256_loadu_ps(below + x + 1);
+
+        __m256 sobel_x = _mm256_sub_ps(zero, above_left);
+        sobel_x = _mm256_add_ps(sobel_x, above_right);
+        sobel_x = _mm256_sub_ps(sobel_x, _mm256_mul_ps(two, left));
+        sobel_x = _mm256_add_ps(sobel_x, _mm256_mul_ps(two, right));
+        sobel_x = _mm256_sub_ps(sobel_x, below_left);
+        sobel_x = _mm256_add_ps(sobel_x, below_right);
+
+        __m256 sobel_y = _mm256_add_ps(zero, above_left);
+        sobel_y = _mm256_add_ps(sobel_y, _mm256_mul_ps(two, above_center));
+        sobel_y = _mm256_add_ps(sobel_y, above_right);
+        sobel_y = _mm256_sub_ps(sobel_y, below_left);
+        sobel_y = _mm256_sub_ps(sobel_y, _mm256_mul_ps(two, below_center));
+        sobel_y = _mm256_sub_ps(sobel_y, below_right);
+
+        __m256 result = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(sobel_x, sobel_x),
+                                                     _mm256_mul_ps(sobel_y, sobel_y)));
+        _mm256_storeu_ps(magnitude + x, result);
+
+        __m256 abs_x = _mm256_andnot_ps(sign_mask, sobel_x);
+        __m256 abs_y = _mm256_andnot_ps(sign_mask, sobel_y);
+        __m256 horizontal = _mm256_cmp_ps(abs_y, _mm256_mul_ps(tan_22_5, abs_x), _CMP_LE_OQ);
+        __m256 vertical = _mm256_cmp_ps(abs_x, _mm256_mul_ps(tan_22_5, abs_y), _CMP_LT_OQ);
+        __m256 opposite_signs = _mm256_xor_ps(_mm256_cmp_ps(sobel_x, zero, _CMP_GT_OQ),
+                                              _mm256_cmp_ps(sobel_y, zero, _CMP_GT_OQ));
+
+        __m256 angle = _mm256_blendv_ps(_mm256_set1_ps(45.0f), _mm256_set1_ps(135.0f), opposite_signs);
+        angle = _mm256_blendv_ps(angle, _mm256_set1_ps(90.0f), vertical);
+        angle = _mm256_blendv_ps(angle, zero, horizontal);
+        _mm256_storeu_ps(orientation + x, angle);
+    }
+
+    sobel_row_scalar_range(above, row, below, magnitude, orientation, x, count);
+}
+
+__attribute__((target("avx2")))
+static void thinning_row_avx2(const float *above, const float *row, const float *below,
+                              const float *orientation, float *out, uint32_t count) {
+#define SECTOR_MASK(angle, low, high) _mm256_and_ps(_mm256_cmp_ps(angle, _mm256_set1_ps(low), _CMP_GE_OQ), \
+                                                    _mm256_cmp_ps(angle, _mm256_set1_ps(high), _CMP_LT_OQ))
+    uint32_t x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256 angle = _mm256_loadu_ps(orientation + x);
+        __m256 q = _mm256_set1_ps(255.0f);
+        __m256 r = _mm256_set1_ps(255.0f);
+
+        __m256 sector = SECTOR_MASK(angle, 0.0f, 22.5f);
+        q = _mm256_blendv_ps(q, _mm256_loadu_ps(row + x + 1), sector);
+        r = _mm256_blendv_ps(r, _mm256_loadu_ps(row + x - 1), sector);
+        sector = SECTOR_MASK(angle, 22.5f, 67.5f);
+        q = _mm256_blendv_ps(q, _mm256_loadu_ps(below + x - 1), sector);
+        r = _mm256_blendv_ps(r, _mm256_loadu_ps(above + x + 1), sector);
+        sector = SECTOR_MASK(angle, 67.5f, 112.5f);
+        q = _mm256_blendv_ps(q, _mm256_loadu_ps(below + x), sector);
+        r = _mm256_blendv_ps(r, _mm256_loadu_ps(above + x), sector);
+        sector = SECTOR_MASK(angle, 112.5f, 157.5f);
+        q = _mm256_blendv_ps(q, _mm256_loadu_ps(above + x - 1), sector);
+        r = _mm256_blendv_ps(r, _mm256_loadu_ps(below + x + 1), sector);
+
+        __m256 intensity = _mm256_loadu_ps(row + x);
+        __m256 keep = _mm256_and_ps(_mm256_cmp_ps(intensity, q, _CMP_GE_OQ), _mm256_cmp_ps(intensity, r, _CMP_GE_OQ));
+        _mm256_storeu_ps(out + x, _mm256_and_ps(keep, intensity));
+    }
+#undef SECTOR_MASK
+
+    thinning_row_scalar_range(above, row, below, orientation, out, x, count);
+}
+
+__attribute__((target("avx512f")))
+static void sobel_row_avx512(const float *above, const float *row, const float *below,
+                             float *magnitude, float *orientation, uint32_t count) {
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 tan_22_5 = _mm512_set1_ps(TAN_22_5);
+
+    uint32_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+        __m512 above_left = _mm512_loadu_ps(above + x - 1);
+        __m512 above_center = _mm512_loadu_ps(above + x);
+        __m512 above_right = _mm512_loadu_ps(above + x + 1);
+        __m512 left = _mm512_loadu_ps(row + x - 1);
+        __m512 right = _mm512_loadu_ps(row + x + 1);
+        __m512 below_left = _mm512_loadu_ps(below + x - 1);
+        __m512 below_center = _mm512_loadu_ps(below + x);
+        __m512 below_right = _mm512_loadu_ps(below + x + 1);
+
+        __m512 sobel_x = _mm512_sub_ps(zero, above_left);
+        sobel_x = _mm512_add_ps(sobel_x, above_right);
+        sobel_x = _mm512_sub_ps(sobel_x, _mm512_mul_ps(two, left));
+        sobel_x = _mm512_add_ps(sobel_x, _mm512_mul_ps(two, right));
+        sobel_x = _mm512_sub_ps(sobel_x, below_left);
+        sobel_x = _mm512_add_ps(sobel_x, below_right);
+
+        __m512 sobel_y = _mm512_add_ps(zero, above_left);
+        sobel_y = _mm512_add_ps(sobel_y, _mm512_mul_ps(two, above_center));
+        sobel_y = _mm512_add_ps(sobel_y, above_right);
+        sobel_y = _mm512_sub_ps(sobel_y, below_left);
+        sobel_y = _mm512_sub_ps(sobel_y, _mm512_mul_ps(two, below_center));
+        sobel_y = _mm512_sub_ps(sobel_y, below_right);
+
+        __m512 result = _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(sobel_x, sobel_x),
+                                                     _mm512_mul_ps(sobel_y, sobel_y)));
+        _mm512_storeu_ps(magnitude + x, result);
+
+        __m512 abs_x = _mm512_abs_ps(sobel_x);
+        __m512 abs_y = _mm512_abs_ps(sobel_y);
+        __mmask16 horizontal = _mm512_cmp_ps_mask(abs_y, _mm512_mul_ps(tan_22_5, abs_x), _CMP_LE_OQ);
+        __mmask16 vertical = _mm512_cmp_ps_mask(abs_x, _mm512_mul_ps(tan_22_5, abs_y), _CMP_LT_OQ);
+        __mmask16 opposite_signs = _mm512_cmp_ps_mask(sobel_x, zero, _CMP_GT_OQ) ^
+                                   _mm512_cmp_ps_mask(sobel_y, zero, _CMP_GT_OQ);
+
+        __m512 angle = _mm512_mask_blend_ps(opposite_signs, _mm512_set1_ps(45.0f), _mm512_set1_ps(135.0f));
+        angle = _mm512_mask_blend_ps(vertical, angle, _mm512_set1_ps(90.0f));
+        angle = _mm512_mask_blend_ps(horizontal, angle, zero);
+        _mm512_storeu_ps(orientation + x, angle);
+    }
+
+    sobel_row_scalar_range(above, row, below, magnitude, orientation, x, count);
+}
+
+__attribute__((target("avx512f")))
+static void thinning_row_avx512(const float *above, const float *row, const float *below,
+                                const float *orientation, float *out, uint32_t count) {
+#define SECTOR_MASK(angle, low, high) (_mm512_cmp_ps_mask(angle, _mm512_set1_ps(low), _CMP_GE_OQ) & \
+                                       _mm512_cmp_ps_mask(angle, _mm512_set1_ps(high), _CMP_LT_OQ))
+    uint32_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+        __m512 angle = _mm512_loadu_ps(orientation + x);
+        __m512 q = _mm512_set1_ps(255.0f);
+        __m512 r = _mm512_set1_ps(255.0f);
+
+        __mmask16 sector = SECTOR_MASK(angle, 0.0f, 22.5f);
+        q = _mm512_mask_loadu_ps(q, sector, row + x + 1);
+        r = _mm512_mask_loadu_ps(r, sector, row + x - 1);
+        sector = SECTOR_MASK(angle, 22.5f, 67.5f);
+        q = _mm512_mask_loadu_ps(q, sector, below + x - 1);
+        r = _mm512_mask_loadu_ps(r, sector, above + x + 1);
+        sector = SECTOR_MASK(angle, 67.5f, 112.5f);
+        q = _mm512_mask_loadu_ps(q, sector, below + x);
+        r = _mm512_mask_loadu_ps(r, sector, above + x);
+        sector = SECTOR_MASK(angle, 112.5f, 157.5f);
+        q = _mm512_mask_loadu_ps(q, sector, above + x - 1);
+        r = _mm512_mask_loadu_ps(r, sector, below + x + 1);
+
+        __m512 intensity = _mm512_loadu_ps(row + x);
+        __mmask16 keep = _mm512_cmp_ps_mask(intensity, q, _CMP_GE_OQ) & _mm512_cmp_ps_mask(intensity, r, _CMP_GE_OQ);
+        _mm512_storeu_ps(out + x, _mm512_maskz_mov_ps(keep, intensity));
+    }
+#undef SECTOR_MASK
+
+    thinning_row_scalar_range(above, row, below, orientation, out, x, count);
+}
+
+#endif
+
+static const simd_kernels kernel_table[] = {
+#ifdef HAVE_X86_KERNELS
+        {"avx512", sobel_row_avx512, thinning_row_avx512},
+        {"avx2",   sobel_row_avx2,   thinning_row_avx2},
+        {"sse2",   sobel_row_sse2,   thinning_row_sse2},
+#endif
+        {"scalar", sobel_row_scalar, thinning_row_scalar},
+};
+
+static bool kernels_supported(const simd_kernels *kernels) {
+#ifdef HAVE_X86_KERNELS
+    if (strcmp(kernels->name, "avx512") == 0) return __builtin_cpu_supports("avx512f");
+    if (strcmp(kernels->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+static const simd_kernels *select_simd_kernels(void) {
+    const simd_kernels *choice = nullptr;
+    const char *requested = getenv("CANNY_SIMD");
+    for (size_t i = 0; i < sizeof(kernel_table) / sizeof(kernel_table[0]) && choice == nullptr; i++) {
+        if (!kernels_supported(&kernel_table[i])) continue;
+        if (requested == nullptr || strcmp(requested, kernel_table[i].name) == 0) choice = &kernel_table[i];
+    }
+    // an unknown or unsupported request falls back to the best supported kernels
+    if (choice == nullptr) {
+        for (size_t i = 0; choice == nullptr; i++) {
+            if (kernels_supported(&kernel_table[i])) choice = &kernel_table[i];
+        }
+    }
+    return choice;
+}
+
+// Threads asking for the first time at once may each select, they all come to the same entry of the table.
+const simd_kernels *get_simd_kernels(void) {
+    static const simd_kernels *selected = nullptr;
+    const simd_kernels *kernels = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (kernels != nullptr) return kernels;
+
+    kernels = select_simd_kernels();
+    __atomic_store_n(&selected, kernels, __ATOMIC_RELEASE);
+    return kernels;
+}
@@ -0,0 +1,39 @@
+#ifndef EDGE_DETECTION_SIMD_H
+#define EDGE_DETECTION_SIMD_H
+
+#include <stdint.h>
+#include <math.h>
+
+// tan(22.5 deg), the boundary between the horizontal/vertical and the diagonal sectors
+#define TAN_22_5 0.41421356f
+
+// Quantizes the gradient direction to 0, 45, 90 or 135 degrees without any trigonometry.
+// Equivalent to rounding atan2f(sobel_y, sobel_x) to the nearest 45 degrees and folding it into [0, 180).
+static inline float quantize_orientation(float sobel_x, float sobel_y) {
+    float abs_x = fabsf(sobel_x);
+    float abs_y = fabsf(sobel_y);
+    if (abs_y <= TAN_22_5 * abs_x) return 0.0f;
+    if (abs_x < TAN_22_5 * abs_y) return 90.0f;
+    return (sobel_x > 0.0f) == (sobel_y > 0.0f) ? 45.0f : 135.0f;
+}
+
+// Sobel over [0, count) of one row, above/row/below are read at [-1, count].
+// Writes the magnitude and the quantized orientation.
+typedef void (*sobel_row_kernel)(const float *above, const float *row, const float *below,
+                                 float *magnitude, float *orientation, uint32_t count);
+
+// Non-maximum suppression over [0, count) of one row of magnitudes, above/row/below are read at [-1, count].
+typedef void (*thinning_row_kernel)(const float *above, const float *row, const float *below,
+                                    const float *orientation, float *out, uint32_t count);
+
+typedef struct {
+    const char *name;
+    sobel_row_kernel sobel_row;
+    thinning_row_kernel thinning_row;
+} simd_kernels;
+
+// The widest kernels the CPU supports, picked once from CPUID, from any thread.
+// CANNY_SIMD=avx512|avx2|sse2|scalar overrides the choice, e.g. to compare implementations.
+const simd_kernels *get_simd_kernels(void);
+
+#endif //EDGE_DETECTION_SIMD_H
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include <sys/stat.h>
+#include "canny.h"
+#include "canny_internal.h"
+
+// canny_tune and the tuning profiles, see canny.h. The settings are applied by run_pipeline and stage_begin.
+
+#define TUNING_LINE_SIZE 512
+// every candidate runs until it took about this long, within TUNE_MIN_REPETITIONS and TUNE_MAX_REPETITIONS
+#define TUNE_SECONDS_PER_CANDIDATE 0.25
+#define TUNE_MIN_REPETITIONS 3
+#define TUNE_MAX_REPETITIONS 15
+// a candidate has to beat the best one so far by this share, so noise does not pick among equals
+#define TUNE_MARGIN 0.03
+
+static const char *const pipeline_names[] = {
+        [CANNY_PIPELINE_FLOAT] = "float", [CANNY_PIPELINE_FUSED] = "fused", [CANNY_PIPELINE_INTEGER] = "integer",
+};
+
+static const struct {
+    const char *name;
+    omp_sched_t kind;
+} schedule_kinds[] = {
+        {"static", omp_sched_static}, {"dynamic", omp_sched_dynamic}, {"guided", omp_sched_guided},
+};
+
+// in rows, chunk 0 is the kind's default: even blocks for static, 1 for dynamic
+static const struct {
+    omp_sched_t kind;
+    int chunk;
+} schedule_candidates[] = {
+        {omp_sched_static, 0}, {omp_sched_static, 4}, {omp_sched_static, 16}, {omp_sched_dynamic, 1},
+        {omp_sched_dynamic, 4}, {omp_sched_dynamic, 16}, {omp_sched_guided, 0},
+};
+#define SCHEDULE_CANDIDATES (sizeof(schedule_candidates) / sizeof(schedule_candidates[0]))
+
+static const uint32_t tile_candidates[] = {16, 32, 48, 64, 96, 128, 192, 256};
+#define TILE_CANDIDATES (sizeof(tile_candidates) / sizeof(tile_candidates[0]))
+
+// the stages whose loops run with schedule(runtime), the fused tiles are tasks
+static const char *const scheduled_stages[] = {
+        "ingest_gaussian", "grayscale", "gaussian", "sobel", "thinning", "double_threshold",
+};
+#define SCHEDULED_STAGES (sizeof(scheduled_stages) / sizeof(scheduled_stages[0]))
+
+static const char *schedule_name(int kind) {
+    for (size_t k = 0; k < sizeof(schedule_kinds) / sizeof(schedule_kinds[0]); k++) {
+        if ((int) schedule_kinds[k].kind == kind) return schedule_kinds[k].name;
+    }
+    return "static";
+}
+
+const tuning_bucket *tuning_find(const canny_tuning *tuning, canny_pipeline pipeline, uint64_t pixels) {
+    if (tuning == nullptr) return nullptr;
+    const tuning_bucket *closest = nullptr;
+    double closest_distance = INFINITY;
+    for (size_t b = 0; b < tuning->count; b++) {
+        if (tuning->buckets[b].pipeline != pipeline) continue;
+        // sizes are compared by their ratio, so 4K is as far from 1080p as 1080p is from 540p
+        double distance = fabs(log((double) pixels / (double) tuning->buckets[b].pixels));
+        if (distance < closest_distance) {
+            closest = &tuning->buckets[b];
+            closest_distance = distance;
+        }
+    }
+    return closest;
+}
+
+// the bucket of pipeline measured at exactly pixels, added if there is none
+static tuning_bucket *tuning_bucket_of(canny_tuning *tuning, canny_pipeline pipeline, uint64_t pixels) {
+    for (size_t b = 0; b < tuning->count; b++) {
+        if (tuning->buckets[b].pipeline == pipeline && tuning->buckets[b].pixels == pixels) return &tuning->buckets[b];
+    }
+    tuning->buckets = realloc(tuning->buckets, (tuning->count + 1) * sizeof(tuning_bucket));
+    tuning_bucket *bucket = &tuning->buckets[tuning->count++];
+    memset(bucket, 0, sizeof(tuning_bucket));
+    bucket->pipeline = pipeline;
+    bucket->pixels = pixels;
+    return bucket;
+}
+
+canny_tuning *canny_tuning_create(void) {
+    return calloc(1, sizeof(canny_tuning));
+}
+
+void canny_tuning_destroy(canny_tuning *tuning) {
+    if (tuning == nullptr) return;
+    for (size_t i = 0; i < tuning->other_count; i++) {
+        free(tuning->other_lines[i]);
+    }
+    free(tuning->other_lines);
+    free(tuning->buckets);
+    free(tuning);
+}
+
+// a cpu line without its "cpu", false and nothing taken from it if it is malformed
+static bool parse_cpu_line(canny_tuning *tuning, const char *line) {
+    char pipeline_name[TUNING_NAME_SIZE];
+    char setting[TUNING_NAME_SIZE];
+    unsigned long long pixels;
+    int length = 0;
+    if (sscanf(line, "%23s %llu %23s %n", pipeline_name, &pixels, setting, &length) != 3 || pixels == 0) return false;
+    const char *values = line + length;
+
+    int pipeline = -1;
+    for (int p = 0; p < (int) (sizeof(pipeline_names) / sizeof(pipeline_names[0])); p++) {
+        if (strcmp(pipeline_names[p], pipeline_name) == 0) pipeline = p;
+    }
+    if (pipeline < 0) return false;
+
+    if (strcmp(setting, "threads") == 0) {
+        int threads;
+        if (sscanf(values, "%d", &threads) != 1 || threads <= 0) return false;
+        tuning_bucket_of(tuning, (canny_pipeline) pipeline, pixels)->threads = threads;
+        return true;
+    }
+    if (strcmp(setting, "tile") == 0) {
+        unsigned tile_size;
+        if (sscanf(values, "%u", &tile_size) != 1 || tile_size == 0) return false;
+        tuning_bucket_of(tuning, (canny_pipeline) pipeline, pixels)->tile_size = tile_size;
+        return true;
+    }
+    if (strcmp(setting, "schedule") != 0) return false;
+
+    tuning_schedule schedule;
+    char kind[TUNING_NAME_SIZE];
+    if (sscanf(values, "%23s %23s %d", schedule.stage, kind, &schedule.chunk) != 3 || schedule.chunk < 0) {
+        return false;
+    }
+    for (size_t k = 0; k < sizeof(schedule_kinds) / sizeof(schedule_kinds[0]); k++) {
+        if (strcmp(schedule_kinds[k].name, kind) != 0) continue;
+        schedule.kind = schedule_kinds[k].kind;
+        tuning_bucket *bucket = tuning_bucket_of(tuning, (canny_pipeline) pipeline, pixels);
+        if (bucket->schedule_count == TUNING_MAX_SCHEDULES) return false;
+        bucket->schedules[bucket->schedule_count++] = schedule;
+        return true;
+    }
+    return false;
+}
+
+canny_tuning *canny_tuning_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) return nullptr;
+
+    canny_tuning *tuning = canny_tuning_create();
+    char line[TUNING_LINE_SIZE];
+    for (int number = 1; fgets(line, sizeof(line), file) != nullptr; number++) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "cpu ", 4) == 0) {
+            // the rest of the profile still counts, a line written by a later version is no reason to run untuned
+            if (!parse_cpu_line(tuning, line + 4)) fprintf(stderr, "%s:%d: skipped malformed line\n", path, number);
+        } else if (line[0] != '\0' && line[0] != '#') {
+            canny_tuning_add_other_line(tuning, line);
+        }
+    }
+    fclose(file);
+    return tuning;
+}
+
+const char *canny_tuning_other_line(const canny_tuning *tuning, size_t index) {
+    return index < tuning->other_count ? tuning->other_lines[index] : nullptr;
+}
+
+void canny_tuning_remove_other_lines(canny_tuning *tuning, const char *prefix) {
+    size_t kept = 0;
+    size_t prefix_length = strlen(prefix);
+    for (size_t i = 0; i < tuning->other_count; i++) {
+        if (strncmp(tuning->other_lines[i], prefix, prefix_length) == 0) {
+            free(tuning->other_lines[i]);
+        } else {
+            tuning->other_lines[kept++] = tuning->other_lines[i];
+        }
+    }
+    tuning->other_count = kept;
+}
+
+void canny_tuning_add_other_line(canny_tuning *tuning, const char *line) {
+    tuning->other_lines = realloc(tuning->other_lines, (tuning->other_count + 1) * sizeof(char *));
+    tuning->other_lines[tuning->other_count++] = strdup(line);
+}
+
+// mkdir -p of the directories path is in
+static void create_parent_directories(const char *path) {
+    char directory[TUNING_LINE_SIZE];
+    snprintf(directory, sizeof(directory), "%s", path);
+    for (char *slash = strchr(directory + 1, '/'); slash != nullptr; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(directory, 0755);
+        *slash = '/';
+    }
+}
+
+bool canny_tuning_save(const canny_tuning *tuning, const char *path) {
+    char temporary[TUNING_LINE_SIZE];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int) sizeof(temporary)) return false;
+    FILE *file = fopen(temporary, "w");
+    if (file == nullptr && errno == ENOENT) {
+        create_parent_directories(path);
+        file = fopen(temporary, "w");
+    }
+    if (file == nullptr) return false;
+
+    fprintf(file, "# canny tuning profile, see canny_tuning_create in canny.h\n");
+    for (size_t i = 0; i < tuning->other_count; i++) {
+        fprintf(file, "%s\n", tuning->other_lines[i]);
+    }
+    for (size_t b = 0; b < tuning->count; b++) {
+        const tuning_bucket *bucket = &tuning->buckets[b];
+        const char *pipeline = pipeline_names[bucket->pipeline];
+        unsigned long long pixels = bucket->pixels;
+        if (bucket->threads > 0) fprintf(file, "cpu %s %llu threads %d\n", pipeline, pixels, bucket->threads);
+        if (bucket->tile_size > 0) fprintf(file, "cpu %s %llu tile %u\n", pipeline, pixels, bucket->tile_size);
+        for (int s = 0; s < bucket->schedule_count; s++) {
+            const tuning_schedule *schedule = &bucket->schedules[s];
+            fprintf(file, "cpu %s %llu schedule %s %s %d\n", pipeline, pixels, schedule->stage,
+                    schedule_name(schedule->kind), schedule->chunk);
+        }
+    }
+
+    bool written = fclose(file) == 0;
+    if (!written || rename(temporary, path) != 0) {
+        remove(temporary);
+        return false;
+    }
+    return true;
+}
+
+bool canny_tuning_default_path(char *path, size_t size) {
+    const char *override = getenv("CANNY_TUNING");
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int length;
+    if (override != nullptr) {
+        if (override[0] == '\0') return false;
+        length = snprintf(path, size, "%s", override);
+    } else if (xdg_cache_home != nullptr && xdg_cache_home[0] != '\0') {
+        length = snprintf(path, size, "%s/canny-edge-detection/tuning", xdg_cache_home);
+    } else if (home != nullptr && home[0] != '\0') {
+        length = snprintf(path, size, "%s/.cache/canny-edge-detection/tuning", home);
+    } else {
+        return false;
+    }
+    return length > 0 && (size_t) length < size;
+}
+
+// one image and the buffers canny_tune measures the candidates with
+typedef struct {
+    const canny_params *params;
+    canny_workspace *workspace;
+    const uint8_t *in;
+    uint32_t width;
+    uint32_t height;
+    size_t in_stride;
+    uint8_t *map;
+} tune_run;
+
+static double seconds_since(struct timespec start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static double run_once(tune_run *run, const tuning_bucket *candidate) {
+    const canny_params *params = run->params;
+    canny_output output = {.map = run->map, .stride = run->width};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    switch (params->pipeline) {
+        case CANNY_PIPELINE_FLOAT:
+            canny_workspace_run(run->workspace, run->in, run->in_stride, params->channels, run->width, run->height,
+                                params->sigma, &output);
+            break;
+        case CANNY_PIPELINE_FUSED:
+            canny_workspace_run_fused(run->workspace, run->in, run->in_stride, params->channels, run->width,
+                                      run->height, params->sigma, candidate->tile_size, &output);
+            break;
+        case CANNY_PIPELINE_INTEGER:
+            canny_workspace_run_integer(run->workspace, run->in, run->in_stride, params->channels, run->width,
+                                        run->height, params->sigma, &output);
+            break;
+    }
+    return seconds_since(start);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// The median of the candidate's runs after a warm-up run, which also sizes the workspace for it and tells how many
+// runs fit into TUNE_SECONDS_PER_CANDIDATE.
+// per_stage leaves the stage times in the workspace's profiler, which the caller destroys.
+static double measure(tune_run *run, const tuning_bucket *candidate, bool per_stage) {
+    omp_set_num_threads(candidate->threads);
+    run->workspace->tuning = candidate;
+    double warm_up = run_once(run, candidate);
+    int repetitions = (int) (TUNE_SECONDS_PER_CANDIDATE / (warm_up > 1e-6 ? warm_up : 1e-6));
+    if (repetitions < TUNE_MIN_REPETITIONS) repetitions = TUNE_MIN_REPETITIONS;
+    if (repetitions > TUNE_MAX_REPETITIONS) repetitions = TUNE_MAX_REPETITIONS;
+
+    if (per_stage) run->workspace->profiler = profiler_create();
+    double times[TUNE_MAX_REPETITIONS];
+    for (int r = 0; r < repetitions; r++) {
+        times[r] = run_once(run, candidate);
+    }
+    run->workspace->tuning = nullptr;
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    return times[repetitions / 2];
+}
+
+canny_status canny_tune(canny_tuning *tuning, const canny_params *params, const uint8_t *in, uint32_t width,
+                        uint32_t height, size_t in_stride, FILE *log) {
+    if (tuning == nullptr || params == nullptr || in == nullptr) return CANNY_ERROR_INVALID_ARGUMENT;
+    // a context of a single pixel is the cheapest way to have the parameters checked
+    canny_params checked = *params;
+    checked.tuning = nullptr;
+    checked.profile = false;
+    canny_context *context = canny_context_create(1, 1, &checked);
+    if (context == nullptr) return CANNY_ERROR_INVALID_ARGUMENT;
+    canny_context_destroy(context);
+    int kernel_radius;
+    free(create_gaussian_kernel(params->sigma, &kernel_radius));
+    if (width <= (uint32_t) kernel_radius || height <= (uint32_t) kernel_radius ||
+        in_stride < (size_t) width * params->channels) return CANNY_ERROR_INVALID_ARGUMENT;
+
+    canny_workspace *workspace = canny_workspace_create(width, height);
+    workspace->threshold = params->threshold;
+    workspace->percentile = params->percentile;
+    workspace->border = params->border;
+    tune_run run = {
+            .params = params, .workspace = workspace, .in = in, .width = width, .height = height,
+            .in_stride = in_stride, .map = malloc((size_t) width * height),
+    };
+    const char *pipeline = pipeline_names[params->pipeline];
+    int max_threads = omp_get_max_threads();
+    omp_sched_t caller_kind;
+    int caller_chunk;
+    omp_get_schedule(&caller_kind, &caller_chunk);
+
+    // the thread count on static schedules, then every stage's schedule, then the tile size on the best of both
+    tuning_bucket best = {.pipeline = params->pipeline, .pixels = (uint64_t) width * height, .threads = max_threads,
+                          .tile_size = params->tile_size};
+    double best_time = INFINITY;
+    // powers of two and all of them
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        tuning_bucket candidate = best;
+        candidate.threads = threads;
+        double time = measure(&run, &candidate, false);
+        if (log != nullptr) fprintf(log, "%s %ux%u: %d threads %.3f ms\n", pipeline, width, height, threads, 1e3 * time);
+        // fewer threads come first and leave the others free when more do not help
+        if (time < best_time * (1.0 - TUNE_MARGIN)) {
+            best_time = time;
+            best.threads = threads;
+        }
+        if (threads == max_threads) break;
+    }
+
+    double stage_times[SCHEDULED_STAGES];
+    for (size_t s = 0; s < SCHEDULED_STAGES; s++) {
+        stage_times[s] = INFINITY;
+    }
+    best.schedule_count = 0;
+    for (size_t c = 0; c < SCHEDULE_CANDIDATES; c++) {
+        // every stage runs the candidate schedule at once, they are measured apart
+        tuning_bucket candidate = best;
+        for (size_t s = 0; s < SCHEDULED_STAGES; s++) {
+            tuning_schedule *schedule = &candidate.schedules[s];
+            snprintf(schedule->stage, sizeof(schedule->stage), "%s", scheduled_stages[s]);
+            schedule->kind = schedule_candidates[c].kind;
+            schedule->chunk = schedule_candidates[c].chunk;
+        }
+        candidate.schedule_count = SCHEDULED_STAGES;
+        double time = measure(&run, &candidate, true);
+        if (log != nullptr) {
+            fprintf(log, "%s %ux%u: schedule(%s, %d) %.3f ms\n", pipeline, width, height,
+                    schedule_name(schedule_candidates[c].kind), schedule_candidates[c].chunk, 1e3 * time);
+        }
+
+        for (size_t s = 0; s < SCHEDULED_STAGES; s++) {
+            double stage_time = profiler_stage_seconds(workspace->profiler, scheduled_stages[s]);
+            // a stage the pipeline does not have never ran, the static schedule comes first
+            if (stage_time <= 0.0 || stage_time >= stage_times[s] * (1.0 - TUNE_MARGIN)) continue;
+            stage_times[s] = stage_time;
+            int index = 0;
+            while (index < best.schedule_count && strcmp(best.schedules[index].stage, scheduled_stages[s]) != 0) {
+                index++;
+            }
+            best.schedules[index] = candidate.schedules[s];
+            if (index == best.schedule_count) best.schedule_count++;
+        }
+        profiler_destroy(workspace->profiler);
+        workspace->profiler = nullptr;
+    }
+
+    if (params->pipeline == CANNY_PIPELINE_FUSED) {
+        best_time = measure(&run, &best, false);
+        uint32_t largest = width > height ? width : height;
+        for (size_t t = 0; t < TILE_CANDIDATES && (t == 0 || tile_candidates[t] <= largest); t++) {
+            if (tile_candidates[t] == best.tile_size) continue;
+            tuning_bucket candidate = best;
+            candidate.tile_size = tile_candidates[t];
+            double time = measure(&run, &candidate, false);
+            if (log != nullptr) {
+                fprintf(log, "%s %ux%u: %ux%u tiles %.3f ms\n", pipeline, width, height, candidate.tile_size,
+                        candidate.tile_size, 1e3 * time);
+            }
+            if (time < best_time * (1.0 - TUNE_MARGIN)) {
+                best_time = time;
+                best.tile_size = candidate.tile_size;
+            }
+        }
+    } else {
+        best.tile_size = 0;
+    }
+
+    *tuning_bucket_of(tuning, best.pipeline, best.pixels) = best;
+    if (log != nullptr) {
+        fprintf(log, "%s %ux%u: %d threads", pipeline, width, height, best.threads);
+        if (best.tile_size > 0) fprintf(log, ", %ux%u tiles", best.tile_size, best.tile_size);
+        for (int s = 0; s < best.schedule_count; s++) {
+            fprintf(log, ", %s schedule(%s, %d)", best.schedules[s].stage, schedule_name(best.schedules[s].kind),
+                    best.schedules[s].chunk);
+        }
+        fprintf(log, "\n");
+    }
+
+    omp_set_num_threads(max_threads);
+    omp_set_schedule(caller_kind, caller_chunk);
+    free(run.map);
+    canny_workspace_destroy(workspace);
+    return CANNY_OK;
+}